@@ -2,17 +2,180 @@
 #define FUZZER_API
 
 #include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <fstream>
+#include <functional>
 #include <string>
+#include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "FuzzerBatch.h"
+#include "FuzzerCheckpoint.h"
 #include "FuzzerCoverage.h"
+#include "FuzzerExecLog.h"
+#include "FuzzerHash.h"
+#include "FuzzerInputStore.h"
+
+/// Enables receiving test cases via shared memory instead of the '@@' file.
+/// Has to be placed once at file scope in the target (like `__AFL_FUZZ_INIT`).
+/// Targets without it keep reading their inputs from disk.
+#define FUZZER_API_INIT()                                                      \
+    extern "C" {                                                               \
+    int __afl_sharedmem_fuzzing = 1;                                           \
+    }
+
+extern "C" {
+// Set up by the AFL++ runtime when the fuzzer delivers test cases via shared
+// memory. Weak so that targets without the runtime can still be linked.
+__attribute__((weak)) extern unsigned char *__afl_fuzz_ptr;
+__attribute__((weak)) extern unsigned int *__afl_fuzz_len;
+}
+
+/// A read-only view on the bytes of the current fuzzing input.
+struct FuzzingInput {
+    /// The input bytes or nullptr if the input could not be read.
+    const std::uint8_t *data = nullptr;
+    /// The number of bytes in the input.
+    std::size_t size = 0;
+};
+
+/// Returns true if the fuzzer delivered the current input via shared memory.
+inline bool hasSharedMemoryInput() {
+    return &__afl_fuzz_ptr && __afl_fuzz_ptr && &__afl_fuzz_len && __afl_fuzz_len;
+}
+
+/// The input of the current execution. Loaded once and then shared by all
+/// API calls until `fuzzInputCallback` announces the next input.
+struct CachedFuzzingInput {
+    bool loaded = false;
+    std::string path;
+    FuzzingInput view;
+    /// The mapping of the test case file (if it was read from disk).
+    void *mapping = nullptr;
+    std::size_t mappingSize = 0;
+    bool hashed = false;
+    std::uint64_t hash = 0;
+    /// The index of the current program in a batched input.
+    std::uint32_t program = 0;
+    /// The issues recorded for the current program so far.
+    std::vector<std::string> issues;
+
+    __attribute__((no_sanitize("memory", "dataflow")))
+    void reset() {
+        if (mapping)
+            munmap(mapping, mappingSize);
+        *this = CachedFuzzingInput();
+    }
+
+    __attribute__((no_sanitize("memory", "dataflow")))
+    void load(const std::string &pathToTestCase) {
+        reset();
+        loaded = true;
+        path = pathToTestCase;
+        if (hasSharedMemoryInput()) {
+            view = FuzzingInput{__afl_fuzz_ptr, *__afl_fuzz_len};
+            return;
+        }
+
+        int fd = open(pathToTestCase.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat fileInfo;
+        if (fstat(fd, &fileInfo) == 0) {
+            std::size_t size = static_cast<std::size_t>(fileInfo.st_size);
+            // Empty files can't be mapped, but they are still valid inputs.
+            static const std::uint8_t emptyInput = 0;
+            view = FuzzingInput{&emptyInput, 0};
+            if (size != 0) {
+                void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (ptr != MAP_FAILED) {
+                    mapping = ptr;
+                    mappingSize = size;
+                    view = FuzzingInput{static_cast<const std::uint8_t *>(ptr), size};
+                } else {
+                    view = FuzzingInput{};
+                }
+            }
+        }
+        close(fd);
+    }
+};
+
+inline CachedFuzzingInput &getCachedFuzzingInput() {
+    static CachedFuzzingInput input;
+    return input;
+}
+
+/// Returns a view on the current fuzzing input.
+/// The input is taken from shared memory if the fuzzer provided it that way.
+/// Otherwise the file at the given path is mapped once, which allows running
+/// a reproducer by hand. The view stays valid until the next input.
+/// @param pathToTestCase Path to the test case on disk.
+__attribute__((no_sanitize("memory", "dataflow")))
+inline FuzzingInput getFuzzingInput(const std::string &pathToTestCase) {
+    CachedFuzzingInput &input = getCachedFuzzingInput();
+    if (!input.loaded || input.path != pathToTestCase)
+        input.load(pathToTestCase);
+    return input.view;
+}
+
+/// Returns the stable hash of the current fuzzing input.
+/// The hash is only computed once per input.
+/// @param pathToTestCase Path to the test case on disk.
+__attribute__((no_sanitize("memory", "dataflow")))
+inline std::uint64_t getFuzzingInputHash(const std::string &pathToTestCase) {
+    FuzzingInput view = getFuzzingInput(pathToTestCase);
+    CachedFuzzingInput &input = getCachedFuzzingInput();
+    if (!input.hashed) {
+        input.hash = hashFuzzingBytes(view.data, view.size);
+        input.hashed = true;
+    }
+    return input.hash;
+}
+
+/// Writes the given input to a new file at the given path.
+/// @param input The input to store.
+/// @param path The path of the new file. Existing files are not overwritten.
+__attribute__((no_sanitize("memory", "dataflow")))
+inline void writeFuzzingInput(const FuzzingInput &input, const std::string &path) {
+    if (std::filesystem::exists(path))
+        return;
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(input.data), input.size);
+}
+
+/// Returns the directory that found issues are saved in, or nullptr if the
+/// fuzzer didn't set one. While the fuzzer minimizes a cause it switches the
+/// target to a scratch directory, so the smaller reproducers it tries don't
+/// show up as new causes.
+__attribute__((no_sanitize("memory", "dataflow")))
+inline const char *getFuzzingCauseDir() {
+    static const std::uint32_t *redirect = []() -> const std::uint32_t * {
+        const char *id = std::getenv("SIM_CAUSE_REDIRECT_SHM_ID");
+        if (!id)
+            return nullptr;
+        void *ptr = shmat(std::atoi(id), nullptr, SHM_RDONLY);
+        if (ptr == reinterpret_cast<void *>(-1)) {
+            std::cerr << "Failed to attach cause redirect " << id << "\n";
+            return nullptr;
+        }
+        return static_cast<const std::uint32_t *>(ptr);
+    }();
+    const char *scratchDir = std::getenv("FUZZING_SCRATCH_DIR");
+    if (redirect && scratchDir && __atomic_load_n(redirect, __ATOMIC_ACQUIRE))
+        return scratchDir;
+    return std::getenv("FUZZING_CAUSE_DIR");
+}
 
 /// Returns the path that `reportFuzzingIssue` will save the input to.
 /// @param reason A string that will be displayed in the fuzzing interface.
@@ -21,28 +184,21 @@ __attribute__((no_sanitize("memory", "dataflow")))
 inline std::string getFuzzingSavePath(std::string reason, std::string pathToTestCase) {
     // Read the env var set by the fuzzer to figure out where to store the
     // failure reason.
-    const char *causeDirVar = "FUZZING_CAUSE_DIR";
-    const char *causeDir = std::getenv(causeDirVar);
+    const char *causeDir = getFuzzingCauseDir();
     if (!causeDir)
         return "";
 
-    // Hash the test case file to always give the output an unique name.
+    // Hash the test case to always give the output an unique name.
     // The unique name is only necessary to record duplicates.
-    std::ifstream testCase(pathToTestCase);
-    if (testCase.bad()) {
+    if (!getFuzzingInput(pathToTestCase).data) {
         std::cerr << "Failed to read test case: " << pathToTestCase << "\n";
         abort();
     }
-    // Read the test case.
-    std::stringstream buffer;
-    buffer << testCase.rdbuf();
 
-    // Now hash the test case contents.
-    std::uint64_t testCaseHashVal = std::hash<std::string>()(buffer.str());
-
-    // Create a he string of the contents.
+    // Create a hex string of the stable hash of the contents.
     std::stringstream testCaseHash;
-    testCaseHash << std::hex << testCaseHashVal;
+    testCaseHash << std::hex << std::setw(16) << std::setfill('0')
+                 << getFuzzingInputHash(pathToTestCase);
 
     // Replace all spaces with underscores to make the file names less annoying
     // to work with in bash scripts.
@@ -62,40 +218,58 @@ inline std::string getFuzzingSavePath(std::string reason, std::string pathToTest
 
 /// Saves the given test case and annotates it with the given reason string
 /// that will be displayed in the fuzzing interface.
+/// Unlike `reportFuzzingIssue` this returns to the caller, so targets that
+/// can recover from the issue (e.g., by resetting the simulator) can keep
+/// running further inputs in persistent mode.
 /// @param reason A string that will be displayed in the fuzzing interface.
 /// @param pathToTestCase Path to the test case on disk.
-[[noreturn]]
+/// @return True if the test case was saved in the cause directory.
 __attribute__((no_sanitize("memory", "dataflow")))
-inline void reportFuzzingIssue(std::string reason, std::string pathToTestCase) {
-    completedSimCallback();
-
+inline bool recordFuzzingIssue(std::string reason, std::string pathToTestCase) {
     std::cerr << "Found issue: " << reason << "\n";
+    getCachedFuzzingInput().issues.push_back(reason);
     const char *causeDirVar = "FUZZING_CAUSE_DIR";
-    const char *causeDir = std::getenv(causeDirVar);
+    const char *causeDir = getFuzzingCauseDir();
     if (!causeDir) {
         std::cerr << "  Note: " << causeDirVar << " env var not set.\n";
         std::cerr << "  This is fine if you're running the target manually.\n";
-        abort();
+        return false;
     }
 
     std::string savedFileName = getFuzzingSavePath(reason, pathToTestCase);
 
-    // Copy the original test case to the cause dir.
-    // This should probably move the file instead, but there is little
-    // contention and it's not clear how AFL reacts to the input file being
-    // moved.
-    std::filesystem::copy(pathToTestCase, savedFileName);
+    // Store the test case in the cause dir. The input might only exist in
+    // shared memory, so this writes out the bytes instead of copying the file.
+    // Duplicates have the same name, so just keep the first one.
+    writeFuzzingInput(getFuzzingInput(pathToTestCase), savedFileName);
+    return true;
+}
+
+/// Saves the given test case and annotates it with the given reason string
+/// that will be displayed in the fuzzing interface.
+/// Aborts the target afterwards.
+/// @param reason A string that will be displayed in the fuzzing interface.
+/// @param pathToTestCase Path to the test case on disk.
+[[noreturn]]
+__attribute__((no_sanitize("memory", "dataflow")))
+inline void reportFuzzingIssue(std::string reason, std::string pathToTestCase) {
+    completedSimCallback();
+    recordFuzzingIssue(reason, pathToTestCase);
     abort();
 }
 
-/// Should be called on every executed fuzz input.
-/// Takes care of storing all inputs if requested by the fuzzer.
+/// Stores the current fuzzing input if requested by the fuzzer.
 /// @param path Path to the file containing the fuzzer input.
 __attribute__((no_sanitize("memory")))
-inline void fuzzInputCallback(std::string path) {
+inline void storeFuzzingInput(const std::string &path) {
     // INPUT_STORAGE is set by the fuzzer if we should save all inputs. The
     // value of the variable is the directory we should save the inputs in.
-    if (const char *outPathC = std::getenv("INPUT_STORAGE")) {
+    // Packed storage deduplicates inputs, see FuzzerInputStore.h.
+    if (InputStore *store = getInputStore()) {
+        FuzzingInput input = getFuzzingInput(path);
+        store->add(getFuzzingInputHash(path), input.data,
+                   static_cast<std::uint32_t>(input.size));
+    } else if (const char *outPathC = std::getenv("INPUT_STORAGE")) {
         const auto now = std::chrono::system_clock::now();
 
         // Generate a unique output name.
@@ -109,42 +283,408 @@ inline void fuzzInputCallback(std::string path) {
         outPath << "-" << getpid();
         outPath << "-" << getppid();
 
-        std::filesystem::copy(path, outPath.str());
+        writeFuzzingInput(getFuzzingInput(path), outPath.str());
+    }
+
+    // COUNTER_FOLDER is set if we should log every executed input. See
+    // FuzzerExecLog.h for the format.
+    if (std::getenv("COUNTER_FOLDER")) {
+        FuzzingInput input = getFuzzingInput(path);
+        logFuzzingExecution(getFuzzingInputHash(path),
+                            static_cast<std::uint32_t>(input.size));
+    }
+}
+
+/// Should be called on every executed fuzz input.
+/// Takes care of storing all inputs if requested by the fuzzer.
+/// Also marks the start of a new input, so it has to be called before the
+/// other API functions in persistent mode.
+/// @param path Path to the file containing the fuzzer input.
+__attribute__((no_sanitize("memory")))
+inline void fuzzInputCallback(std::string path) {
+    getCachedFuzzingInput().load(path);
+    resetCoverageDelta();
+
+    // The programs of a batch are stored one by one by `FuzzingProgramIterator`.
+    FuzzingInput input = getFuzzingInput(path);
+    if (!isFuzzingBatch(input.data, input.size))
+        storeFuzzingInput(path);
+}
+
+/// Returns the reset hook that `runPersistentFuzzingLoop` calls between two
+/// inputs.
+inline std::function<void()> &getFuzzingResetHook() {
+    static std::function<void()> hook;
+    return hook;
+}
+
+/// Sets the function that restores the simulator to its initial state.
+/// It is called after every input in persistent mode so that the next input
+/// starts from the same state as a fresh process would.
+/// @param hook The reset function provided by the simulator.
+inline void setFuzzingResetHook(std::function<void()> hook) {
+    getFuzzingResetHook() = std::move(hook);
+}
+
+/// Returns the reset hook that `FuzzingProgramIterator` calls between two
+/// programs of a batch.
+inline std::function<void()> &getFuzzingBatchResetHook() {
+    static std::function<void()> hook;
+    return hook;
+}
+
+/// Sets the function that restores the architectural state (registers,
+/// memory of the program) between two programs of a batch. This can be much
+/// cheaper than the full reset of `setFuzzingResetHook`, which is used if no
+/// batch reset hook is set.
+/// @param hook The reset function provided by the simulator.
+inline void setFuzzingBatchResetHook(std::function<void()> hook) {
+    getFuzzingBatchResetHook() = std::move(hook);
+}
+
+/// Iterates over the programs of the current input. A regular input is a
+/// single program, a batched input from `sim-fuzzer --batch` contains
+/// several (see FuzzerBatch.h). While a program is selected it is the
+/// current fuzzing input for all other API calls, so causes are saved and
+/// hashed per program. The coverage of every program is handed to the
+/// fuzzer separately.
+///
+///   fuzzInputCallback(path);
+///   FuzzingProgramIterator programs(path);
+///   while (programs.next())
+///     simulate(getFuzzingInput(path));
+class FuzzingProgramIterator {
+public:
+    /// @param pathToTestCase Path to the test case on disk.
+    __attribute__((no_sanitize("memory", "dataflow")))
+    explicit FuzzingProgramIterator(std::string pathToTestCase)
+        : path(std::move(pathToTestCase)) {
+        whole = getFuzzingInput(path);
+        for (const FuzzingProgram &program : splitFuzzingBatch(whole.data, whole.size))
+            programs.push_back(FuzzingInput{program.data, program.size});
+        batched = !programs.empty();
+        if (!batched)
+            programs.push_back(whole);
+        channel = batched ? getBatchChannel() : nullptr;
+    }
+
+    /// Restores the whole input, e.g. for a reproducer that runs the batch
+    /// again.
+    __attribute__((no_sanitize("memory", "dataflow")))
+    ~FuzzingProgramIterator() {
+        if (batched)
+            select(whole);
     }
 
-    if (const char *counterFolderC = std::getenv("COUNTER_FOLDER")) {
-        // Create a unique file path in the folder.
-        // We use the parent pid to reduce the number of files (which all
-        // take up inodes). Each forkserver just has one files, so this is
-        // still save.
-        std::string counterFile = counterFolderC;
-        counterFile += "/inputs_" + std::to_string(getppid());
-
-        // Read and hash the file contents.
-        std::ifstream infile(path);
-        std::string inputContents;
-        while (infile) {
-            char c;
-            infile.get(c);
-            inputContents.push_back(c);
+    FuzzingProgramIterator(const FuzzingProgramIterator &) = delete;
+    FuzzingProgramIterator &operator=(const FuzzingProgramIterator &) = delete;
+
+    /// Finishes the previous program and selects the next one.
+    /// @return False once all programs ran.
+    __attribute__((no_sanitize("memory", "dataflow")))
+    bool next() {
+        if (current > 0 && batched) {
+            if (channel)
+                channel->snapshot(current - 1, getCoverageMapPtr(), __afl_map_size);
+            if (current < programs.size()) {
+                const auto &batchReset = getFuzzingBatchResetHook();
+                const auto &reset = batchReset ? batchReset : getFuzzingResetHook();
+                if (reset)
+                    reset();
+            }
         }
+        if (current == programs.size())
+            return false;
+        if (batched) {
+            select(programs[current]);
+            if (channel)
+                channel->start(current);
+            storeFuzzingInput(path);
+        }
+        ++current;
+        return true;
+    }
 
-        const std::size_t hashSum = std::hash<std::string>()(inputContents);
+    /// Returns the number of programs in the input.
+    std::size_t size() const { return programs.size(); }
 
-        // 1.1.2024 as a custom epoch. Saves a few megabyte when printing
-        // many relative time stamps.
-        const std::int64_t customEpoch = 1704063600;
+private:
+    __attribute__((no_sanitize("memory", "dataflow")))
+    void select(FuzzingInput input) {
+        CachedFuzzingInput &cached = getCachedFuzzingInput();
+        cached.view = input;
+        cached.hashed = false;
+        cached.program = current;
+        cached.issues.clear();
+        resetCoverageDelta();
+    }
 
-        const auto now = std::chrono::system_clock::now();
-        const auto timeStamp = std::chrono::duration_cast<std::chrono::seconds>(
-                        now.time_since_epoch()).count();
-
-        std::ofstream stream(counterFile, std::ios_base::app);
-        stream << std::hex << hashSum;
-        stream << std::hex << " " << inputContents.size();
-        stream << std::hex << " " << (timeStamp - customEpoch);
-        stream << "\n";
+    std::string path;
+    FuzzingInput whole;
+    std::vector<FuzzingInput> programs;
+    std::uint32_t current = 0;
+    bool batched = false;
+    BatchChannel *channel = nullptr;
+};
+
+extern "C" {
+// Provided by the AFL++ runtime. Weak so that targets linked without the
+// runtime still fall back to running a single input.
+__attribute__((weak)) int __afl_persistent_loop(unsigned int maxCnt);
+__attribute__((weak)) void __afl_manual_init();
+}
+
+/// The functions that save and restore the simulator state for prefix
+/// checkpoints.
+struct FuzzingCheckpointHooks {
+    std::function<FuzzingCheckpoint()> save;
+    std::function<void(const FuzzingCheckpoint &)> restore;
+};
+
+inline FuzzingCheckpointHooks &getFuzzingCheckpointHooks() {
+    static FuzzingCheckpointHooks hooks;
+    return hooks;
+}
+
+/// Enables prefix checkpoints (see FuzzerCheckpoint.h). The fuzzer decides
+/// how much memory they may use (sim-fuzzer --checkpoint-memory).
+/// @param save Returns the complete simulator state at an instruction
+///             boundary (or an empty state if it can't be saved right now).
+/// @param restore Puts a state returned by `save` back into the simulator.
+inline void setFuzzingCheckpointHooks(std::function<FuzzingCheckpoint()> save,
+                                      std::function<void(const FuzzingCheckpoint &)> restore) {
+    getFuzzingCheckpointHooks() = FuzzingCheckpointHooks{std::move(save), std::move(restore)};
+}
+
+/// Restores the checkpoint of the longest cached prefix of the current
+/// program, including the coverage and issues of that prefix. Should be
+/// called after the reset and before simulating the program.
+/// @param pathToTestCase Path to the test case on disk.
+/// @return The number of program bytes that were already simulated, or 0 if
+///         the simulation has to start from the beginning.
+__attribute__((no_sanitize("memory", "dataflow")))
+inline std::size_t resumeFuzzingCheckpoint(const std::string &pathToTestCase) {
+    CheckpointCache *cache = getCheckpointCache();
+    const FuzzingCheckpointHooks &hooks = getFuzzingCheckpointHooks();
+    if (!cache || !hooks.save || !hooks.restore)
+        return 0;
+    FuzzingInput input = getFuzzingInput(pathToTestCase);
+    const CheckpointEntry *entry = cache->find(input.data, input.size);
+    if (!entry)
+        return 0;
+    hooks.restore(entry->checkpoint);
+    char *map_ptr = getCoverageMapPtr();
+    for (std::uint32_t covered : entry->coverage) {
+        // Saturates like the hitcounts of a long run instead of wrapping
+        // around to a low count.
+        unsigned hits = std::uint8_t(map_ptr[covered >> 8]) + (covered & 0xff);
+        map_ptr[covered >> 8] = static_cast<char>(hits > 0xff ? 0xff : hits);
     }
+    for (const std::string &reason : entry->issues)
+        recordFuzzingIssue(reason, pathToTestCase);
+    return entry->prefix.size();
+}
+
+/// Should be called at instruction boundaries with the number of program
+/// bytes that the simulator state depends on so far, i.e., nothing after
+/// them was fetched yet. Saves a checkpoint if one is due at this position
+/// and the prefix will likely be seen again. Cheap otherwise.
+/// @param pathToTestCase Path to the test case on disk.
+/// @param executedBytes The size of the simulated prefix of the program.
+__attribute__((no_sanitize("memory", "dataflow")))
+inline void instructionBoundaryCallback(const std::string &pathToTestCase,
+                                        std::size_t executedBytes) {
+    if (executedBytes % 4 != 0 || !isFuzzingCheckpointPosition(executedBytes / 4))
+        return;
+    CheckpointCache *cache = getCheckpointCache();
+    const FuzzingCheckpointHooks &hooks = getFuzzingCheckpointHooks();
+    // The cached coverage can only hold map indices of 24 bits.
+    if (!cache || !hooks.save || !hooks.restore || __afl_map_size > (1u << 24))
+        return;
+    FuzzingInput input = getFuzzingInput(pathToTestCase);
+    const CachedFuzzingInput &cached = getCachedFuzzingInput();
+    if (executedBytes > input.size || executedBytes > getCheckpointHint(cached.program) ||
+        cache->contains(input.data, executedBytes))
+        return;
+
+    CheckpointEntry entry;
+    entry.checkpoint = hooks.save();
+    if (!entry.checkpoint.state)
+        return;
+    entry.prefix.assign(input.data, input.data + executedBytes);
+    entry.coverage = collectCoverage(getCoverageMapPtr(), __afl_map_size);
+    entry.issues = cached.issues;
+    cache->insert(std::move(entry));
+}
+
+/// Returns true when there is another input to run. Wraps AFL's
+/// `__AFL_LOOP` so that the forkserver child is reused for up to
+/// `maxIterations` inputs before it is restarted.
+/// Without the AFL++ runtime (e.g., when running a reproducer manually) this
+/// returns true exactly once.
+/// @param maxIterations Number of inputs to run before restarting the child.
+__attribute__((no_sanitize("memory", "dataflow")))
+inline bool nextFuzzingInput(unsigned maxIterations) {
+    // Signature that afl-fuzz looks for to enable persistent mode.
+    static volatile const char *persistentSignature
+        __attribute__((used)) = "##SIG_AFL_PERSISTENT##";
+    (void)persistentSignature;
+
+    if (__afl_persistent_loop)
+        return __afl_persistent_loop(maxIterations);
+
+    static bool ranOnce = false;
+    if (ranOnce)
+        return false;
+    ranOnce = true;
+    return true;
+}
+
+/// Runs the given simulation function on every input that the fuzzer sends
+/// to this process. Should be called once the simulator is fully constructed,
+/// which is also where the (deferred) forkserver is started.
+/// Between two inputs the hook set via `setFuzzingResetHook` is called.
+/// Batched inputs are split into their programs, which `runInput` sees as
+/// separate inputs as long as it reads them with `getFuzzingInput`.
+/// @param pathToTestCase Path to the test case on disk (the '@@' argument).
+/// @param runInput Simulates the program in the given test case file.
+/// @param maxIterations Number of inputs to run before restarting the child.
+__attribute__((no_sanitize("memory", "dataflow")))
+inline void runPersistentFuzzingLoop(std::string pathToTestCase,
+                                     std::function<void(const std::string &)> runInput,
+                                     unsigned maxIterations = 1000) {
+    // Make sure the children share the log/storage mappings of the forkserver.
+    getExecLog();
+    getInputStore();
+
+    if (__afl_manual_init)
+        __afl_manual_init();
+
+    while (nextFuzzingInput(maxIterations)) {
+        fuzzInputCallback(pathToTestCase);
+        FuzzingProgramIterator programs(pathToTestCase);
+        while (programs.next())
+            runInput(pathToTestCase);
+        completedSimCallback();
+
+        if (const auto &reset = getFuzzingResetHook())
+            reset();
+    }
+}
+
+// In-process targets
+//
+// Simulators that can be instantiated several times in one process can also
+// be built as a shared library and loaded with `sim-fuzzer --in-process`.
+// Every worker thread of the fuzzer then owns a `SimContext` with its own
+// simulator instance and runs inputs by calling `SimFuzzerTestOneInput`.
+// There is no forkserver, no '@@' file and no env var involved: the input is
+// passed in memory, coverage goes into the map of the context and issues are
+// reported through it. As all instances share one process, such targets must
+// not use the global helpers above (the AFL++ map, the cause dir, abort()).
+
+/// Bumped whenever the layout of `SimContext` changes.
+#define SIM_FUZZER_ABI_VERSION 1
+
+/// The input ran to completion (issues may still have been recorded).
+#define SIM_FUZZER_OK 0
+/// The input triggered an issue the simulator can't continue after. Treated
+/// like a crash of a forkserver target.
+#define SIM_FUZZER_ISSUE 1
+/// The simulation was stopped because `simFuzzerShouldStop` returned true.
+#define SIM_FUZZER_TIMEOUT 2
+// Negative results mean the target couldn't run the input at all, which
+// stops the fuzzer.
+
+extern "C" {
+
+/// The state of one simulator instance, shared between the fuzzer and the
+/// target. Set up by the fuzzer, the target only writes `coverage` and
+/// `target`.
+struct SimContext {
+    /// SIM_FUZZER_ABI_VERSION of the fuzzer.
+    std::uint32_t abiVersion;
+    /// The index of the worker thread that owns this context.
+    std::uint32_t worker;
+    /// The coverage map of this instance (AFL++ hitcounts). All entries are
+    /// 0 when an input starts.
+    std::uint8_t *coverage;
+    std::uint32_t coverageSize;
+    /// Set to non-zero by the fuzzer (from another thread) once the current
+    /// input ran out of time. Read it with `simFuzzerShouldStop`.
+    const std::uint32_t *stop;
+    /// Saves the current input in the cause dir under the given reason. Use
+    /// `simFuzzerRecordIssue`.
+    void (*recordIssue)(SimContext *ctx, const char *reason);
+    /// Owned by the fuzzer.
+    void *fuzzer;
+    /// Owned by the target, e.g., the simulator instance.
+    void *target;
+};
+
+/// Runs one program. Always called on the worker thread that owns `ctx`, so
+/// an instance is never used by two threads at the same time. The fuzzer
+/// splits batches itself, so `data` is always a single program.
+/// @return One of the SIM_FUZZER_* results.
+int SimFuzzerTestOneInput(const std::uint8_t *data, std::size_t size, SimContext *ctx);
+
+// Optional, looked up by name when the library is loaded:
+//
+//   int SimFuzzerInitContext(SimContext *ctx, int argc, char **argv);
+//     Creates the simulator instance of a context (stored in ctx->target)
+//     on its worker thread. argv are the positional arguments of sim-fuzzer.
+//     Returns 0 on success.
+//
+//   void SimFuzzerDestroyContext(SimContext *ctx);
+//     Frees the instance before the worker thread exits.
+//
+//   std::uint32_t SimFuzzerMapSize(void);
+//     The number of coverage map entries the target uses (the counterpart of
+//     AFL_DUMP_MAP_SIZE). Without it the map has the default size.
+}
+
+/// Records an issue of the current input of an in-process target. The
+/// counterpart of `recordFuzzingIssue`.
+/// @param ctx The context passed to `SimFuzzerTestOneInput`.
+/// @param reason A string that will be displayed in the fuzzing interface.
+inline void simFuzzerRecordIssue(SimContext *ctx, const std::string &reason) {
+    if (ctx->recordIssue)
+        ctx->recordIssue(ctx, reason.c_str());
+}
+
+/// The counterpart of `reportFuzzingIssue`. Instead of aborting, the target
+/// returns the result to the fuzzer:
+///
+///   if (trapped)
+///     return simFuzzerReportIssue(ctx, "illegal trap");
+///
+/// @param ctx The context passed to `SimFuzzerTestOneInput`.
+/// @param reason A string that will be displayed in the fuzzing interface.
+/// @return SIM_FUZZER_ISSUE.
+inline int simFuzzerReportIssue(SimContext *ctx, const std::string &reason) {
+    simFuzzerRecordIssue(ctx, reason);
+    return SIM_FUZZER_ISSUE;
+}
+
+/// Returns true once the current input ran out of time. The fuzzer can't
+/// kill a thread, so in-process targets have to check this regularly (e.g.,
+/// every few thousand cycles) and return SIM_FUZZER_TIMEOUT. A worker that
+/// doesn't return within a second after that is replaced by a new one with
+/// a fresh context, and the old context is only destroyed once it returns.
+/// @param ctx The context passed to `SimFuzzerTestOneInput`.
+inline bool simFuzzerShouldStop(const SimContext *ctx) {
+    return ctx->stop && __atomic_load_n(ctx->stop, __ATOMIC_RELAXED) != 0;
+}
+
+/// Counts a hit of the given entry in the coverage map of the context.
+/// @param ctx The context passed to `SimFuzzerTestOneInput`.
+/// @param index The map entry, entries beyond the map are ignored.
+inline void simFuzzerCoverage(SimContext *ctx, std::uint32_t index) {
+    if (index >= ctx->coverageSize)
+        return;
+    std::uint8_t &hits = ctx->coverage[index];
+    if (hits != 0xff)
+        ++hits;
 }
 
 #endif // FUZZER_API
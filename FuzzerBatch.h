@@ -0,0 +1,165 @@
+#ifndef FUZZER_BATCH
+#define FUZZER_BATCH
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <sys/shm.h>
+
+// Batched execution runs several programs in one simulator run (see
+// `sim-fuzzer --batch`). The fuzzer then sends a framed input instead of a
+// single program and the harness records the coverage of every program in a
+// separate shared memory region. See `src/batch.rs` for the fuzzer side.
+//
+// Framed input (all values little endian):
+//   0: magic "RVB1"   4: u32 number of programs
+//   8: for each program a u32 size followed by the program bytes
+// The magic is not a valid 32-bit RISC-V instruction (its lowest bits are
+// not 0b11), so a regular program is never mistaken for a batch.
+//
+// Coverage channel, attached via the shared memory id in SIM_BATCH_SHM_ID:
+//   0: u32 entries per slot   4: u32 number of slots
+//   8: u32 number of programs the harness started
+//  12: slots of a u32 entry count followed by the entries. Every entry is
+//      (map index << 8) | hitcount. A count above the capacity means the
+//      program covered too much and the fuzzer has to run it on its own.
+
+#define COMMON_FUZZ_BATCH_ATTRS __attribute__((no_sanitize("memory", "dataflow")))
+
+/// A read-only view on one program of the current input.
+struct FuzzingProgram {
+  const std::uint8_t *data = nullptr;
+  std::size_t size = 0;
+};
+
+COMMON_FUZZ_BATCH_ATTRS
+inline std::uint32_t readBatchLE32(const std::uint8_t *ptr) {
+  return std::uint32_t(ptr[0]) | std::uint32_t(ptr[1]) << 8 |
+         std::uint32_t(ptr[2]) << 16 | std::uint32_t(ptr[3]) << 24;
+}
+
+/// Returns true if the input looks like a framed batch of programs.
+COMMON_FUZZ_BATCH_ATTRS
+inline bool isFuzzingBatch(const std::uint8_t *data, std::size_t size) {
+  return data && size >= 8 && std::memcmp(data, "RVB1", 4) == 0;
+}
+
+/// Splits a framed input into its programs. Returns an empty vector if the
+/// input isn't a batch or the frame is broken.
+COMMON_FUZZ_BATCH_ATTRS
+inline std::vector<FuzzingProgram> splitFuzzingBatch(const std::uint8_t *data,
+                                                     std::size_t size) {
+  std::vector<FuzzingProgram> programs;
+  if (!isFuzzingBatch(data, size))
+    return programs;
+  std::uint32_t count = readBatchLE32(data + 4);
+  std::size_t offset = 8;
+  for (std::uint32_t i = 0; i < count; ++i) {
+    if (size - offset < 4)
+      break;
+    std::uint32_t programSize = readBatchLE32(data + offset);
+    offset += 4;
+    if (size - offset < programSize)
+      break;
+    programs.push_back(FuzzingProgram{data + offset, programSize});
+    offset += programSize;
+  }
+  if (programs.size() != count || offset != size) {
+    std::cerr << "Broken batch frame, running the input as one program\n";
+    programs.clear();
+  }
+  return programs;
+}
+
+struct BatchChannelHeader {
+  std::uint32_t slotCapacity;
+  std::uint32_t numSlots;
+  std::uint32_t started;
+};
+
+static_assert(sizeof(BatchChannelHeader) == 12, "Unexpected batch header size");
+
+/// The per-program coverage channel shared with the fuzzer.
+struct BatchChannel {
+  BatchChannelHeader *header = nullptr;
+
+  COMMON_FUZZ_BATCH_ATTRS
+  std::uint32_t *slot(std::uint32_t idx) const {
+    auto *slots = reinterpret_cast<std::uint32_t *>(header + 1);
+    return slots + std::size_t(idx) * (header->slotCapacity + 1);
+  }
+
+  /// Marks the program with the given index as running, so the fuzzer
+  /// knows which program a crash or timeout belongs to.
+  COMMON_FUZZ_BATCH_ATTRS
+  void start(std::uint32_t idx) const {
+    __atomic_store_n(&header->started, idx + 1, __ATOMIC_RELEASE);
+  }
+
+  /// Moves the coverage of the program with the given index from the map
+  /// into its slot and clears the map for the next program. Only the touched
+  /// words of the map are written, which is much cheaper than a memset.
+  COMMON_FUZZ_BATCH_ATTRS
+  void snapshot(std::uint32_t idx, char *map_ptr, uint32_t size) const {
+    if (idx >= header->numSlots) {
+      std::memset(map_ptr, 0, size);
+      return;
+    }
+    std::uint32_t *out = slot(idx);
+    std::uint32_t capacity = header->slotCapacity;
+    std::uint32_t count = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      std::uint64_t word;
+      std::memcpy(&word, map_ptr + i, 8);
+      if (!word)
+        continue;
+      for (uint32_t j = i; j < i + 8; ++j) {
+        if (std::uint8_t hits = std::uint8_t(map_ptr[j])) {
+          if (count < capacity)
+            out[1 + count] = j << 8 | hits;
+          ++count;
+        }
+      }
+      std::memset(map_ptr + i, 0, 8);
+    }
+    for (; i < size; ++i) {
+      if (std::uint8_t hits = std::uint8_t(map_ptr[i])) {
+        if (count < capacity)
+          out[1 + count] = i << 8 | hits;
+        ++count;
+        map_ptr[i] = 0;
+      }
+    }
+    // Map indices have to fit into 24 bits.
+    if (size > (1u << 24))
+      count = capacity + 1;
+    out[0] = count;
+  }
+};
+
+/// Returns the coverage channel or nullptr if the fuzzer doesn't run batches.
+COMMON_FUZZ_BATCH_ATTRS
+inline BatchChannel *getBatchChannel() {
+  static BatchChannel *channel = []() -> BatchChannel * {
+    const char *id = std::getenv("SIM_BATCH_SHM_ID");
+    if (!id)
+      return nullptr;
+    void *ptr = shmat(std::atoi(id), nullptr, 0);
+    if (ptr == reinterpret_cast<void *>(-1)) {
+      std::cerr << "Failed to attach batch coverage channel " << id << "\n";
+      return nullptr;
+    }
+    static BatchChannel attached;
+    attached.header = static_cast<BatchChannelHeader *>(ptr);
+    return &attached;
+  }();
+  return channel;
+}
+
+#undef COMMON_FUZZ_BATCH_ATTRS
+
+#endif // FUZZER_BATCH
@@ -0,0 +1,205 @@
+#ifndef FUZZER_CHECKPOINT
+#define FUZZER_CHECKPOINT
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/shm.h>
+
+#include "FuzzerHash.h"
+
+// Prefix checkpoints let the harness skip simulating the part of a program
+// that it already simulated for another input. Most mutations keep a long
+// prefix of the program, so the state of the simulator after that prefix can
+// be saved once and restored for every input that starts with it.
+//
+// Checkpoints are taken at fixed instruction positions (16, 24, 32, 48, 64,
+// ...) so that only a few prefixes have to be looked up per input. Every
+// checkpoint stores the simulator state from the save hook, the coverage
+// and the issues recorded while simulating the prefix. The cache lives in
+// the forkserver child, so it only helps in persistent mode.
+//
+// The fuzzer tells the harness how much of every program is shared with the
+// corpus entry it was mutated from (see `src/checkpoint.rs`). Only prefixes
+// within that part are saved, as only they will be seen again.
+//
+// Hint channel, attached via the shared memory id in SIM_CHECKPOINT_SHM_ID
+// (all values little endian):
+//   0: u32 number of hints
+//   4: u32 shared prefix in bytes for every program of the input
+
+#define COMMON_FUZZ_CHECKPOINT_ATTRS __attribute__((no_sanitize("memory", "dataflow")))
+
+/// Simulator state returned by the save hook. The harness decides what the
+/// state contains, the cache only keeps it alive.
+struct FuzzingCheckpoint {
+  std::shared_ptr<const void> state;
+  /// Approximate memory used by the state, counted against the budget.
+  std::size_t size = 0;
+};
+
+/// Returns true if checkpoints are taken after the given number of
+/// instructions: 16, 24, 32, 48, 64, 96, ...
+inline bool isFuzzingCheckpointPosition(std::size_t instructions) {
+  if (instructions < 16)
+    return false;
+  std::size_t odd = instructions >> __builtin_ctzl(instructions);
+  return odd == 1 || odd == 3;
+}
+
+/// Returns the checkpoint position after the given one.
+inline std::size_t nextFuzzingCheckpointPosition(std::size_t instructions) {
+  std::size_t odd = instructions >> __builtin_ctzl(instructions);
+  return odd == 1 ? instructions / 2 * 3 : instructions / 3 * 4;
+}
+
+struct CheckpointEntry {
+  std::vector<std::uint8_t> prefix;
+  FuzzingCheckpoint checkpoint;
+  /// (map index << 8) | hitcount of the covered map entries.
+  std::vector<std::uint32_t> coverage;
+  std::vector<std::string> issues;
+
+  std::size_t bytes() const {
+    return prefix.size() + checkpoint.size + coverage.size() * 4 +
+           issues.size() * sizeof(std::string) + sizeof(CheckpointEntry);
+  }
+};
+
+/// Returns the covered entries of the map as (map index << 8) | hitcount.
+/// The map can have at most 1 << 24 entries.
+COMMON_FUZZ_CHECKPOINT_ATTRS
+inline std::vector<std::uint32_t> collectCoverage(const char *map_ptr, std::uint32_t size) {
+  std::vector<std::uint32_t> covered;
+  std::uint32_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, map_ptr + i, 8);
+    if (!word)
+      continue;
+    for (std::uint32_t j = i; j < i + 8; ++j)
+      if (std::uint8_t hits = std::uint8_t(map_ptr[j]))
+        covered.push_back(j << 8 | hits);
+  }
+  for (; i < size; ++i)
+    if (std::uint8_t hits = std::uint8_t(map_ptr[i]))
+      covered.push_back(i << 8 | hits);
+  return covered;
+}
+
+/// Memory-bounded cache of prefix checkpoints, evicting the least recently
+/// used ones.
+class CheckpointCache {
+public:
+  explicit CheckpointCache(std::size_t budget) : budget(budget) {}
+
+  /// Returns the checkpoint of the longest cached prefix of the program.
+  COMMON_FUZZ_CHECKPOINT_ATTRS
+  const CheckpointEntry *find(const std::uint8_t *program, std::size_t size) {
+    std::vector<std::size_t> positions;
+    for (std::size_t insts = 16; insts * 4 <= size;
+         insts = nextFuzzingCheckpointPosition(insts))
+      positions.push_back(insts * 4);
+    for (auto it = positions.rbegin(); it != positions.rend(); ++it) {
+      auto found = entries.find(key(program, *it));
+      if (found == entries.end())
+        continue;
+      Slot &slot = found->second;
+      const std::vector<std::uint8_t> &prefix = slot.entry.prefix;
+      if (prefix.size() != *it || std::memcmp(prefix.data(), program, *it) != 0)
+        continue;
+      lru.splice(lru.begin(), lru, slot.lruPos);
+      return &slot.entry;
+    }
+    return nullptr;
+  }
+
+  COMMON_FUZZ_CHECKPOINT_ATTRS
+  bool contains(const std::uint8_t *program, std::size_t prefixSize) const {
+    return entries.count(key(program, prefixSize)) != 0;
+  }
+
+  /// Adds the entry if it fits into the budget, evicting old entries.
+  COMMON_FUZZ_CHECKPOINT_ATTRS
+  void insert(CheckpointEntry entry) {
+    std::size_t bytes = entry.bytes();
+    std::uint64_t k = key(entry.prefix.data(), entry.prefix.size());
+    if (bytes > budget || entries.count(k))
+      return;
+    while (used + bytes > budget && !lru.empty()) {
+      auto oldest = entries.find(lru.back());
+      used -= oldest->second.entry.bytes();
+      entries.erase(oldest);
+      lru.pop_back();
+    }
+    lru.push_front(k);
+    used += bytes;
+    entries.emplace(k, Slot{std::move(entry), lru.begin()});
+  }
+
+  std::size_t size() const { return entries.size(); }
+  std::size_t usedBytes() const { return used; }
+
+private:
+  struct Slot {
+    CheckpointEntry entry;
+    std::list<std::uint64_t>::iterator lruPos;
+  };
+
+  COMMON_FUZZ_CHECKPOINT_ATTRS
+  static std::uint64_t key(const std::uint8_t *program, std::size_t prefixSize) {
+    return hashFuzzingBytes(program, prefixSize, prefixSize);
+  }
+
+  std::size_t budget;
+  std::size_t used = 0;
+  std::list<std::uint64_t> lru;
+  std::unordered_map<std::uint64_t, Slot> entries;
+};
+
+/// Returns the checkpoint cache or nullptr if the fuzzer didn't give it any
+/// memory (SIM_CHECKPOINT_MEMORY in bytes).
+inline CheckpointCache *getCheckpointCache() {
+  static CheckpointCache *cache = []() -> CheckpointCache * {
+    const char *memory = std::getenv("SIM_CHECKPOINT_MEMORY");
+    if (!memory || std::strtoull(memory, nullptr, 10) == 0)
+      return nullptr;
+    static CheckpointCache instance(std::strtoull(memory, nullptr, 10));
+    return &instance;
+  }();
+  return cache;
+}
+
+/// Returns how many bytes of the given program of the input are shared with
+/// the corpus entry it was derived from. Without hints from the fuzzer (e.g.
+/// when running a reproducer) all of it.
+COMMON_FUZZ_CHECKPOINT_ATTRS
+inline std::size_t getCheckpointHint(std::uint32_t program) {
+  static const std::uint32_t *hints = []() -> const std::uint32_t * {
+    const char *id = std::getenv("SIM_CHECKPOINT_SHM_ID");
+    if (!id)
+      return nullptr;
+    void *ptr = shmat(std::atoi(id), nullptr, SHM_RDONLY);
+    if (ptr == reinterpret_cast<void *>(-1)) {
+      std::cerr << "Failed to attach checkpoint hints " << id << "\n";
+      return nullptr;
+    }
+    return static_cast<const std::uint32_t *>(ptr);
+  }();
+  if (!hints)
+    return SIZE_MAX;
+  if (program >= __atomic_load_n(&hints[0], __ATOMIC_ACQUIRE))
+    return 0;
+  return hints[1 + program];
+}
+
+#undef COMMON_FUZZ_CHECKPOINT_ATTRS
+
+#endif // FUZZER_CHECKPOINT
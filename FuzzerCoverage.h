@@ -1,14 +1,28 @@
 #ifndef FUZZER_COVERAGE
 #define FUZZER_COVERAGE
 
+#include <algorithm>
 #include <bitset>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <vector>
 
 #include <dlfcn.h>
 
+#ifdef FUZZER_COVERAGE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 extern "C" {
 extern uint32_t __afl_map_size;
 }
@@ -16,7 +30,7 @@ extern uint32_t __afl_map_size;
 #define COMMON_FUZZ_COVERAGE_ATTRS __attribute__((no_sanitize("memory")))
 
 COMMON_FUZZ_COVERAGE_ATTRS
-inline char * getCoverageMapPtr() {
+inline char ** lookupCoverageMapPtr() {
   // Find the coverage map via dlsym.
   void *f = dlopen(nullptr, RTLD_NOW);
   if (f == nullptr) {
@@ -32,7 +46,14 @@ inline char * getCoverageMapPtr() {
 
   // We got a pointer (because dlsym returns pointers) to the coverage map
   // pointer.
-  char **ptr = (char **) obj;
+  return (char **) obj;
+}
+
+COMMON_FUZZ_COVERAGE_ATTRS
+inline char * getCoverageMapPtr() {
+  // Only the location of the pointer is cached. The AFL runtime points it to
+  // the shared memory map once the forkserver starts.
+  static char **ptr = lookupCoverageMapPtr();
   char *map_ptr = *ptr;
   if (map_ptr == nullptr) {
     std::cerr << "coverage map ptr is null?\n";
@@ -41,34 +62,353 @@ inline char * getCoverageMapPtr() {
   return map_ptr;
 }
 
+/// Counts the non-zero bytes in the given buffer.
 COMMON_FUZZ_COVERAGE_ATTRS
-inline uint32_t getCurrentCoverage() {
-  char *map_ptr = getCoverageMapPtr();
-
+inline uint32_t countNonZeroScalar(const char *map_ptr, uint32_t size) {
   uint32_t result = 0;
-  for (uint32_t i = 0; i < __afl_map_size; ++i) {
+  for (uint32_t i = 0; i < size; ++i) {
       if (map_ptr[i])
         ++result;
   }
   return result;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+COMMON_FUZZ_COVERAGE_ATTRS __attribute__((target("avx2,popcnt")))
+inline uint32_t countNonZeroAVX2(const char *map_ptr, uint32_t size) {
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t result = 0;
+  uint32_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(map_ptr + i));
+    uint32_t zeroes = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+    result += 32 - (uint32_t)_mm_popcnt_u32(zeroes);
+  }
+  return result + countNonZeroScalar(map_ptr + i, size - i);
+}
+
+COMMON_FUZZ_COVERAGE_ATTRS __attribute__((target("avx512f,avx512bw,popcnt")))
+inline uint32_t countNonZeroAVX512(const char *map_ptr, uint32_t size) {
+  uint32_t result = 0;
+  uint32_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    __m512i v = _mm512_loadu_si512((const void *)(map_ptr + i));
+    __mmask64 nonZero = _mm512_test_epi8_mask(v, v);
+    result += (uint32_t)_mm_popcnt_u64(nonZero);
+  }
+  return result + countNonZeroScalar(map_ptr + i, size - i);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+COMMON_FUZZ_COVERAGE_ATTRS
+inline uint32_t countNonZeroNEON(const char *map_ptr, uint32_t size) {
+  uint32_t result = 0;
+  uint32_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)(map_ptr + i));
+    // 0xff for every non-zero byte, shifted down to 1 and summed up.
+    uint8x16_t nonZero = vshrq_n_u8(vtstq_u8(v, v), 7);
+    result += vaddvq_u8(nonZero);
+  }
+  return result + countNonZeroScalar(map_ptr + i, size - i);
+}
+#endif
+
+using CountNonZeroFn = uint32_t (*)(const char *, uint32_t);
+
+/// Picks the fastest non-zero byte counter supported by the current CPU.
+COMMON_FUZZ_COVERAGE_ATTRS
+inline CountNonZeroFn selectCountNonZero() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt"))
+    return countNonZeroAVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    return countNonZeroAVX2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  return countNonZeroNEON;
+#endif
+  return countNonZeroScalar;
+}
+
+/// Counts the non-zero bytes in the given buffer with the fastest available
+/// implementation.
+COMMON_FUZZ_COVERAGE_ATTRS
+inline uint32_t countNonZero(const char *map_ptr, uint32_t size) {
+  static const CountNonZeroFn impl = selectCountNonZero();
+  return impl(map_ptr, size);
+}
+
+COMMON_FUZZ_COVERAGE_ATTRS
+inline uint32_t getCurrentCoverage() {
+  return countNonZero(getCoverageMapPtr(), __afl_map_size);
+}
+
+/// Returns a mask with one bit for every non-zero byte in the given 64 bytes.
+COMMON_FUZZ_COVERAGE_ATTRS
+inline uint64_t nonZeroMaskScalar(const char *chunk, uint32_t size = 64) {
+  uint64_t mask = 0;
+  for (uint32_t i = 0; i < size; ++i) {
+    if (chunk[i])
+      mask |= 1ULL << i;
+  }
+  return mask;
+}
+
+/// Marks all non-zero map bytes in `seen` (one bit per map byte) and returns
+/// how many of them were not marked before.
+COMMON_FUZZ_COVERAGE_ATTRS
+inline uint32_t markNewCoverageScalar(const char *map_ptr, uint64_t *seen, uint32_t size) {
+  uint32_t added = 0;
+  uint32_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    // Most of the map is never touched, so skip empty chunks quickly.
+    uint64_t words[8];
+    std::memcpy(words, map_ptr + i, sizeof(words));
+    if (!(words[0] | words[1] | words[2] | words[3] | words[4] | words[5] |
+          words[6] | words[7]))
+      continue;
+    uint64_t mask = nonZeroMaskScalar(map_ptr + i);
+    added += __builtin_popcountll(mask & ~seen[i / 64]);
+    seen[i / 64] |= mask;
+  }
+  if (i < size) {
+    uint64_t mask = nonZeroMaskScalar(map_ptr + i, size - i);
+    added += __builtin_popcountll(mask & ~seen[i / 64]);
+    seen[i / 64] |= mask;
+  }
+  return added;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+COMMON_FUZZ_COVERAGE_ATTRS __attribute__((target("avx2,popcnt")))
+inline uint32_t markNewCoverageAVX2(const char *map_ptr, uint64_t *seen, uint32_t size) {
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t added = 0;
+  uint32_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)(map_ptr + i));
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(map_ptr + i + 32));
+    if (_mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi)))
+      continue;
+    uint64_t zeroes = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero)) |
+        ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, zero)) << 32);
+    uint64_t mask = ~zeroes;
+    added += (uint32_t)_mm_popcnt_u64(mask & ~seen[i / 64]);
+    seen[i / 64] |= mask;
+  }
+  return added + markNewCoverageScalar(map_ptr + i, seen + i / 64, size - i);
+}
+
+COMMON_FUZZ_COVERAGE_ATTRS __attribute__((target("avx512f,avx512bw,popcnt")))
+inline uint32_t markNewCoverageAVX512(const char *map_ptr, uint64_t *seen, uint32_t size) {
+  uint32_t added = 0;
+  uint32_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    __m512i v = _mm512_loadu_si512((const void *)(map_ptr + i));
+    uint64_t mask = _mm512_test_epi8_mask(v, v);
+    added += (uint32_t)_mm_popcnt_u64(mask & ~seen[i / 64]);
+    seen[i / 64] |= mask;
+  }
+  return added + markNewCoverageScalar(map_ptr + i, seen + i / 64, size - i);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+COMMON_FUZZ_COVERAGE_ATTRS
+inline uint32_t markNewCoverageNEON(const char *map_ptr, uint64_t *seen, uint32_t size) {
+  uint32_t added = 0;
+  uint32_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    const uint8_t *chunk = (const uint8_t *)(map_ptr + i);
+    uint8x16_t any = vorrq_u8(vorrq_u8(vld1q_u8(chunk), vld1q_u8(chunk + 16)),
+                              vorrq_u8(vld1q_u8(chunk + 32), vld1q_u8(chunk + 48)));
+    if (vmaxvq_u8(any) == 0)
+      continue;
+    uint64_t mask = nonZeroMaskScalar(map_ptr + i);
+    added += __builtin_popcountll(mask & ~seen[i / 64]);
+    seen[i / 64] |= mask;
+  }
+  return added + markNewCoverageScalar(map_ptr + i, seen + i / 64, size - i);
+}
+#endif
+
+using MarkNewCoverageFn = uint32_t (*)(const char *, uint64_t *, uint32_t);
+
+/// Picks the fastest coverage diffing function supported by the current CPU.
+COMMON_FUZZ_COVERAGE_ATTRS
+inline MarkNewCoverageFn selectMarkNewCoverage() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt"))
+    return markNewCoverageAVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    return markNewCoverageAVX2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  return markNewCoverageNEON;
+#endif
+  return markNewCoverageScalar;
+}
+
+/// The coverage seen so far during the current simulation.
+struct CoverageDelta {
+  /// Number of map entries that were non-zero at any point so far.
+  uint32_t total = 0;
+  /// Number of map entries that became non-zero since the last update.
+  uint32_t added = 0;
+  /// One bit per map entry that was already counted in `total`.
+  std::vector<uint64_t> seen;
+  /// Whether a cycle was reported while there was no coverage yet.
+  bool reportedEmpty = false;
+};
+
+inline CoverageDelta &getCoverageDeltaState() {
+  static CoverageDelta state;
+  return state;
+}
+
+/// Forgets the coverage seen so far. Has to be called when the coverage map
+/// is cleared, e.g., before the next input in persistent mode.
+inline void resetCoverageDelta() {
+  CoverageDelta &state = getCoverageDeltaState();
+  state.total = 0;
+  state.added = 0;
+  state.reportedEmpty = false;
+  std::fill(state.seen.begin(), state.seen.end(), 0);
+}
+
+/// Updates and returns the coverage that was found since the last call.
+///
+/// This reads the whole map. The AFL++ instrumentation bumps the counters
+/// inline and keeps no record of which ones it touched, so there's nothing
+/// smaller to scan. It's cheap enough for what it's used for: it only runs
+/// with PRINT_COVERAGE set (i.e., not while fuzzing), at most every
+/// PRINT_COVERAGE_INTERVAL cycles, and the mostly empty map is skipped one
+/// 64-byte chunk at a time.
+COMMON_FUZZ_COVERAGE_ATTRS
+inline const CoverageDelta &updateCoverageDelta() {
+  static const MarkNewCoverageFn impl = selectMarkNewCoverage();
+  CoverageDelta &state = getCoverageDeltaState();
+  state.seen.resize((__afl_map_size + 63) / 64);
+  state.added = impl(getCoverageMapPtr(), state.seen.data(), __afl_map_size);
+  state.total += state.added;
+  return state;
+}
+
+/// Should be called after every simulated cycle.
+/// If PRINT_COVERAGE is set, prints the cycle, the coverage so far and the
+/// coverage added since the last printed cycle. Cycles without new coverage
+/// are not printed as they don't change the coverage curve (except for the
+/// first one, so the curve has a start). PRINT_COVERAGE_INTERVAL can be set
+/// to only check the coverage every N cycles.
 COMMON_FUZZ_COVERAGE_ATTRS
 inline void completedCycleCallback(uint32_t cycle) {
-  if (std::getenv("PRINT_COVERAGE")) {
-    std::cout << "COVERAGE: " << cycle << " " << getCurrentCoverage() << "\n";
+  // Called every simulated cycle, so only look up the env vars once.
+  static const bool printCoverage = std::getenv("PRINT_COVERAGE") != nullptr;
+  static const uint32_t interval = [] {
+    const char *value = std::getenv("PRINT_COVERAGE_INTERVAL");
+    long parsed = value ? std::strtol(value, nullptr, 10) : 1;
+    return parsed > 0 ? (uint32_t)parsed : 1u;
+  }();
+  if (!printCoverage || cycle % interval != 0)
+    return;
+
+  CoverageDelta &delta = getCoverageDeltaState();
+  updateCoverageDelta();
+  if (delta.added != 0 || (delta.total == 0 && !delta.reportedEmpty)) {
+    delta.reportedEmpty = true;
+    std::cout << "COVERAGE: " << cycle << " " << delta.total << " "
+              << delta.added << "\n";
   }
 }
 
+// Binary coverage map dump format (all values little endian):
+//   magic "RVCM", u8 version, u8 kind, u8 flags, u8 reserved,
+//   u32 map size, u32 number of entries, payload.
+// The payload is the raw map for dense dumps and a list of (u32 index,
+// u8 hitcount) pairs of non-zero entries for sparse dumps. With the zstd flag
+// the payload is a single zstd frame. See `src/coverage_map.rs` for a reader.
+enum CoverageMapKind : uint8_t { CoverageMapDense = 0, CoverageMapSparse = 1 };
+const uint8_t coverageMapVersion = 1;
+const uint8_t coverageMapZstdFlag = 1;
+
+inline void appendLE32(std::vector<uint8_t> &out, uint32_t value) {
+  for (unsigned i = 0; i < 4; ++i)
+    out.push_back((uint8_t)(value >> (8 * i)));
+}
+
+/// Serializes the given coverage map in the binary dump format.
+COMMON_FUZZ_COVERAGE_ATTRS
+inline std::vector<uint8_t> serializeCoverageMap(const char *map_ptr, uint32_t size,
+                                                 CoverageMapKind kind) {
+  std::vector<uint8_t> payload;
+  uint32_t entries = size;
+  if (kind == CoverageMapSparse) {
+    entries = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      // Skip empty 8-byte blocks, most of the map is never touched.
+      if (i % 8 == 0 && i + 8 <= size) {
+        uint64_t word;
+        std::memcpy(&word, map_ptr + i, sizeof(word));
+        if (word == 0) {
+          i += 7;
+          continue;
+        }
+      }
+      if (!map_ptr[i])
+        continue;
+      appendLE32(payload, i);
+      payload.push_back((uint8_t)map_ptr[i]);
+      ++entries;
+    }
+  } else {
+    payload.assign((const uint8_t *)map_ptr, (const uint8_t *)map_ptr + size);
+  }
+
+  uint8_t flags = 0;
+#ifdef FUZZER_COVERAGE_ZSTD
+  std::vector<uint8_t> compressed(ZSTD_compressBound(payload.size()));
+  size_t compressedSize = ZSTD_compress(compressed.data(), compressed.size(),
+                                        payload.data(), payload.size(), 3);
+  if (!ZSTD_isError(compressedSize)) {
+    compressed.resize(compressedSize);
+    payload.swap(compressed);
+    flags |= coverageMapZstdFlag;
+  }
+#endif
+
+  std::vector<uint8_t> result = {'R', 'V', 'C', 'M', coverageMapVersion,
+                                 (uint8_t)kind, flags, 0};
+  appendLE32(result, size);
+  appendLE32(result, entries);
+  result.insert(result.end(), payload.begin(), payload.end());
+  return result;
+}
+
+/// Should be called once the simulation finished.
+/// If PRINT_COVERAGE_MAP is set, writes the coverage map to the given path.
+/// PRINT_COVERAGE_MAP_FORMAT selects the format: 'text' (default, one
+/// '0'/'1' bit string per entry), 'dense' (raw binary map) or 'sparse'
+/// (binary list of non-zero entries). Binary dumps are zstd compressed when
+/// compiled with FUZZER_COVERAGE_ZSTD.
 COMMON_FUZZ_COVERAGE_ATTRS
 inline void completedSimCallback() {
   if (const char *outpath = std::getenv("PRINT_COVERAGE_MAP")) {
-    std::ofstream output(outpath);
+    std::ofstream output(outpath, std::ios::binary);
     char *map_ptr = getCoverageMapPtr();
 
+    const char *format = std::getenv("PRINT_COVERAGE_MAP_FORMAT");
+    std::string formatStr = format ? format : "text";
+    if (formatStr == "dense" || formatStr == "sparse") {
+      CoverageMapKind kind = formatStr == "dense" ? CoverageMapDense : CoverageMapSparse;
+      std::vector<uint8_t> data = serializeCoverageMap(map_ptr, __afl_map_size, kind);
+      output.write((const char *)data.data(), data.size());
+      return;
+    }
+
+    std::string text;
+    text.reserve((size_t)__afl_map_size * 8);
     for (uint32_t i = 0; i < __afl_map_size; ++i) {
-      output << std::bitset<8>(map_ptr[i]);
+      text += std::bitset<8>(map_ptr[i]).to_string();
     }
+    output << text;
   }
 }
 
@@ -0,0 +1,182 @@
+#ifndef FUZZER_EXEC_LOG
+#define FUZZER_EXEC_LOG
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Binary log of all executed inputs that replaces the old text format in
+// COUNTER_FOLDER. There is one file per forkserver ('inputs_<pid>.bin') that
+// is mapped shared into the forkserver before it forks. The children then
+// append records by writing to memory, which needs no syscalls and survives
+// the child calling abort(). See `src/exec_log.rs` for a reader.
+//
+// File layout (all values little endian):
+//   0: magic "RVEL"   4: u32 version   8: u64 epoch (unix seconds)
+//  16: u64 capacity (records that fit in the file)
+//  24: u64 number of records
+//  32: records of u64 input hash, u32 input size, u32 seconds since epoch
+
+extern "C" {
+// Set by the AFL++ runtime once the forkserver is running.
+__attribute__((weak)) extern std::uint8_t __afl_connected;
+}
+
+#define COMMON_FUZZ_EXEC_LOG_ATTRS __attribute__((no_sanitize("memory", "dataflow")))
+
+/// Returns the pid of the forkserver that this process belongs to. When
+/// called from a forked child this is the parent, otherwise the process itself.
+inline pid_t getForkserverPid() {
+  bool isForkedChild = &__afl_connected && __afl_connected;
+  return isForkedChild ? getppid() : getpid();
+}
+
+struct ExecLogHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint64_t epoch;
+  std::uint64_t capacity;
+  std::uint64_t numRecords;
+};
+
+struct ExecLogRecord {
+  std::uint64_t hash;
+  std::uint32_t size;
+  std::uint32_t time;
+};
+
+static_assert(sizeof(ExecLogHeader) == 32, "Unexpected exec log header size");
+static_assert(sizeof(ExecLogRecord) == 16, "Unexpected exec log record size");
+
+struct ExecLog {
+  int fd = -1;
+  ExecLogHeader *header = nullptr;
+  bool warnedFull = false;
+
+  /// 1.1.2024 as a custom epoch. Keeps the relative time stamps small.
+  static constexpr std::uint64_t customEpoch = 1704063600;
+  /// How much address space is reserved for the file mapping.
+  static constexpr std::uint64_t reservedBytes = 1ULL << 34;
+  /// By how many records the file grows once it is full.
+  static constexpr std::uint64_t growRecords = 1ULL << 16;
+
+  ExecLogRecord *records() const {
+    return reinterpret_cast<ExecLogRecord *>(header + 1);
+  }
+
+  static constexpr std::uint64_t maxRecords() {
+    return (reservedBytes - sizeof(ExecLogHeader)) / sizeof(ExecLogRecord);
+  }
+
+  /// Opens or creates the log file at the given path.
+  COMMON_FUZZ_EXEC_LOG_ATTRS
+  bool open(const std::string &path) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      return false;
+
+    void *ptr = mmap(nullptr, reservedBytes, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (ptr == MAP_FAILED) {
+      ::close(fd);
+      fd = -1;
+      return false;
+    }
+    header = static_cast<ExecLogHeader *>(ptr);
+
+    // A previous forkserver with the same pid might have left a log behind,
+    // in which case we just keep appending.
+    if (lseek(fd, 0, SEEK_END) >= (off_t)sizeof(ExecLogHeader) &&
+        std::memcmp(header->magic, "RVEL", 4) == 0)
+      return true;
+
+    if (!grow(growRecords))
+      return false;
+    std::memcpy(header->magic, "RVEL", 4);
+    header->version = 1;
+    header->epoch = customEpoch;
+    header->numRecords = 0;
+    return true;
+  }
+
+  /// Grows the file so that it fits at least the given number of records.
+  COMMON_FUZZ_EXEC_LOG_ATTRS
+  bool grow(std::uint64_t minRecords) {
+    std::uint64_t capacity = (minRecords + growRecords - 1) / growRecords * growRecords;
+    if (capacity > maxRecords())
+      capacity = maxRecords();
+    if (capacity < minRecords)
+      return false;
+    if (ftruncate(fd, sizeof(ExecLogHeader) + capacity * sizeof(ExecLogRecord)) != 0)
+      return false;
+    header->capacity = capacity;
+    return true;
+  }
+
+  /// Appends a record for an input with the given hash and size.
+  COMMON_FUZZ_EXEC_LOG_ATTRS
+  void append(std::uint64_t hash, std::uint32_t size) {
+    const auto now = std::chrono::system_clock::now();
+    const std::uint64_t timeStamp = std::chrono::duration_cast<std::chrono::seconds>(
+                        now.time_since_epoch()).count();
+
+    std::uint64_t idx = __atomic_fetch_add(&header->numRecords, 1, __ATOMIC_RELAXED);
+    if (idx >= __atomic_load_n(&header->capacity, __ATOMIC_ACQUIRE) && !grow(idx + 1)) {
+      __atomic_fetch_sub(&header->numRecords, 1, __ATOMIC_RELAXED);
+      if (!warnedFull)
+        std::cerr << "Execution log is full, dropping records.\n";
+      warnedFull = true;
+      return;
+    }
+    records()[idx] = ExecLogRecord{hash, size,
+                                   static_cast<std::uint32_t>(timeStamp - header->epoch)};
+  }
+};
+
+/// Returns the execution log of this forkserver or nullptr if COUNTER_FOLDER
+/// is not set. The first call should happen before the forkserver forks, so
+/// that all children share the mapping (see `runPersistentFuzzingLoop`).
+COMMON_FUZZ_EXEC_LOG_ATTRS
+inline ExecLog *getExecLog() {
+  static ExecLog *log = []() -> ExecLog * {
+    const char *counterFolder = std::getenv("COUNTER_FOLDER");
+    if (!counterFolder)
+      return nullptr;
+    // Each forkserver has just one file to reduce the number of files (which
+    // all take up inodes). If this is called from a forked child, the file
+    // belongs to the parent forkserver.
+    std::string path = std::string(counterFolder) + "/inputs_" +
+                       std::to_string(getForkserverPid()) + ".bin";
+    static ExecLog instance;
+    if (!instance.open(path)) {
+      std::cerr << "Failed to open execution log " << path << "\n";
+      return nullptr;
+    }
+    return &instance;
+  }();
+  return log;
+}
+
+/// Records the execution of an input in the execution log (if enabled).
+/// @param hash The stable hash of the input.
+/// @param size The size of the input in bytes.
+COMMON_FUZZ_EXEC_LOG_ATTRS
+inline void logFuzzingExecution(std::uint64_t hash, std::uint32_t size) {
+  if (ExecLog *log = getExecLog())
+    log->append(hash, size);
+}
+
+/// Opens the log during static initialization, i.e., usually before the
+/// (deferred) forkserver starts forking children.
+inline ExecLog *const execLogAtStartup = getExecLog();
+
+#undef COMMON_FUZZ_EXEC_LOG_ATTRS
+
+#endif // FUZZER_EXEC_LOG
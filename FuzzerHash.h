@@ -0,0 +1,112 @@
+#ifndef FUZZER_HASH
+#define FUZZER_HASH
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// XXH64 as specified by https://github.com/Cyan4973/xxHash. Unlike std::hash
+// the result is the same across standard libraries, builds and machines, so
+// it can be used for file names and logs that are compared between nodes.
+
+#define COMMON_FUZZ_HASH_ATTRS __attribute__((no_sanitize("memory", "dataflow")))
+
+namespace fuzzer_hash_detail {
+constexpr std::uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+constexpr std::uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr std::uint64_t prime3 = 0x165667B19E3779F9ULL;
+constexpr std::uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+constexpr std::uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+inline std::uint64_t rotl(std::uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+COMMON_FUZZ_HASH_ATTRS
+inline std::uint64_t read64(const std::uint8_t *p) {
+  std::uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+COMMON_FUZZ_HASH_ATTRS
+inline std::uint32_t read32(const std::uint8_t *p) {
+  std::uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline std::uint64_t round(std::uint64_t acc, std::uint64_t input) {
+  acc += input * prime2;
+  acc = rotl(acc, 31);
+  return acc * prime1;
+}
+
+inline std::uint64_t mergeRound(std::uint64_t acc, std::uint64_t val) {
+  acc ^= round(0, val);
+  return acc * prime1 + prime4;
+}
+} // namespace fuzzer_hash_detail
+
+/// Returns the stable 64-bit hash (XXH64) of the given bytes.
+/// Assumes a little-endian host like the rest of the fuzzer.
+/// @param data The bytes to hash.
+/// @param size Number of bytes to hash.
+/// @param seed Seed value, 0 matches the reference implementation's default.
+COMMON_FUZZ_HASH_ATTRS
+inline std::uint64_t hashFuzzingBytes(const std::uint8_t *data, std::size_t size,
+                                      std::uint64_t seed = 0) {
+  using namespace fuzzer_hash_detail;
+  const std::uint8_t *p = data;
+  const std::uint8_t *const end = data + size;
+  std::uint64_t h;
+
+  if (size >= 32) {
+    std::uint64_t v1 = seed + prime1 + prime2;
+    std::uint64_t v2 = seed + prime2;
+    std::uint64_t v3 = seed;
+    std::uint64_t v4 = seed - prime1;
+    do {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = mergeRound(h, v1);
+    h = mergeRound(h, v2);
+    h = mergeRound(h, v3);
+    h = mergeRound(h, v4);
+  } else {
+    h = seed + prime5;
+  }
+
+  h += static_cast<std::uint64_t>(size);
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= round(0, read64(p));
+    h = rotl(h, 27) * prime1 + prime4;
+  }
+  if (p + 4 <= end) {
+    h ^= static_cast<std::uint64_t>(read32(p)) * prime1;
+    h = rotl(h, 23) * prime2 + prime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= static_cast<std::uint64_t>(*p) * prime5;
+    h = rotl(h, 11) * prime1;
+  }
+
+  h ^= h >> 33;
+  h *= prime2;
+  h ^= h >> 29;
+  h *= prime3;
+  h ^= h >> 32;
+  return h;
+}
+
+#undef COMMON_FUZZ_HASH_ATTRS
+
+#endif // FUZZER_HASH
@@ -0,0 +1,208 @@
+#ifndef FUZZER_INPUT_STORE
+#define FUZZER_INPUT_STORE
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "FuzzerExecLog.h"
+
+// Content-addressed storage for all executed inputs, used when the fuzzer
+// sets INPUT_STORAGE_FORMAT=pack. Instead of one file per executed input,
+// every forkserver packs its inputs into 'inputs_<pid>.dat' and keeps an index
+// of them in 'inputs_<pid>.idx'. Inputs with the same hash are stored only
+// once, later executions just bump their counter.
+// Both files are mapped shared into the forkserver before it forks, so the
+// children store inputs with plain memory writes that the kernel flushes in
+// the background. See `src/input_store.rs` for a reader.
+//
+// Index layout (all values little endian):
+//   0: magic "RVIS"   4: u32 version   8: u64 epoch (unix seconds)
+//  16: u64 number of slots   24: u64 number of entries
+//  32: u64 bytes used in the data file   40: u64 data file size
+//  64: hash table of slots:
+//      u64 hash, u64 offset in the data file, u32 size,
+//      u32 first seen (seconds since epoch), u32 execution count, u32 ready
+
+#define COMMON_FUZZ_INPUT_STORE_ATTRS __attribute__((no_sanitize("memory", "dataflow")))
+
+struct InputStoreHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint64_t epoch;
+  std::uint64_t numSlots;
+  std::uint64_t numEntries;
+  std::uint64_t dataSize;
+  std::uint64_t dataCapacity;
+  std::uint64_t reserved[2];
+};
+
+struct InputStoreSlot {
+  std::uint64_t hash;
+  std::uint64_t offset;
+  std::uint32_t size;
+  std::uint32_t firstSeen;
+  std::uint32_t count;
+  std::uint32_t ready;
+};
+
+static_assert(sizeof(InputStoreHeader) == 64, "Unexpected input store header size");
+static_assert(sizeof(InputStoreSlot) == 32, "Unexpected input store slot size");
+
+struct InputStore {
+  int indexFd = -1;
+  int dataFd = -1;
+  InputStoreHeader *header = nullptr;
+  std::uint8_t *data = nullptr;
+  bool warnedFull = false;
+
+  /// 1.1.2024 as a custom epoch, same as the execution log.
+  static constexpr std::uint64_t customEpoch = 1704063600;
+  /// Number of unique inputs that one forkserver can store. The index file
+  /// is sparse, so unused slots don't take up disk space.
+  static constexpr std::uint64_t numSlots = 1ULL << 22;
+  /// How much address space is reserved for the data file mapping.
+  static constexpr std::uint64_t reservedDataBytes = 1ULL << 36;
+  /// By how many bytes the data file grows once it is full.
+  static constexpr std::uint64_t growDataBytes = 64ULL << 20;
+
+  InputStoreSlot *slots() const {
+    return reinterpret_cast<InputStoreSlot *>(header + 1);
+  }
+
+  /// Opens or creates the store with the given path prefix.
+  COMMON_FUZZ_INPUT_STORE_ATTRS
+  bool open(const std::string &pathPrefix) {
+    const std::uint64_t indexSize = sizeof(InputStoreHeader) + numSlots * sizeof(InputStoreSlot);
+    indexFd = ::open((pathPrefix + ".idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    dataFd = ::open((pathPrefix + ".dat").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (indexFd < 0 || dataFd < 0)
+      return false;
+
+    bool existing = lseek(indexFd, 0, SEEK_END) == (off_t)indexSize;
+    if (!existing && ftruncate(indexFd, indexSize) != 0)
+      return false;
+
+    void *indexPtr = mmap(nullptr, indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+    void *dataPtr = mmap(nullptr, reservedDataBytes, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_NORESERVE, dataFd, 0);
+    if (indexPtr == MAP_FAILED || dataPtr == MAP_FAILED)
+      return false;
+    header = static_cast<InputStoreHeader *>(indexPtr);
+    data = static_cast<std::uint8_t *>(dataPtr);
+
+    // A previous forkserver with the same pid might have left a store behind,
+    // in which case we just keep adding to it.
+    if (existing && std::memcmp(header->magic, "RVIS", 4) == 0)
+      return true;
+
+    std::memcpy(header->magic, "RVIS", 4);
+    header->version = 1;
+    header->epoch = customEpoch;
+    header->numSlots = numSlots;
+    header->numEntries = 0;
+    header->dataSize = 0;
+    header->dataCapacity = 0;
+    return true;
+  }
+
+  /// Grows the data file so that it is at least the given size.
+  COMMON_FUZZ_INPUT_STORE_ATTRS
+  bool growData(std::uint64_t minSize) {
+    std::uint64_t capacity = (minSize + growDataBytes - 1) / growDataBytes * growDataBytes;
+    if (capacity > reservedDataBytes)
+      return false;
+    if (ftruncate(dataFd, capacity) != 0)
+      return false;
+    __atomic_store_n(&header->dataCapacity, capacity, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  COMMON_FUZZ_INPUT_STORE_ATTRS
+  void warnFull() {
+    if (!warnedFull)
+      std::cerr << "Input storage is full, dropping inputs.\n";
+    warnedFull = true;
+  }
+
+  /// Stores the given input unless an input with the same hash is already
+  /// stored, in which case only its execution count is increased.
+  COMMON_FUZZ_INPUT_STORE_ATTRS
+  void add(std::uint64_t hash, const std::uint8_t *bytes, std::uint32_t size) {
+    // Hash 0 marks unused slots.
+    if (hash == 0)
+      hash = 1;
+
+    const std::uint64_t mask = header->numSlots - 1;
+    for (std::uint64_t probe = 0; probe < header->numSlots; ++probe) {
+      InputStoreSlot &slot = slots()[(hash + probe) & mask];
+      std::uint64_t expected = 0;
+      if (!__atomic_compare_exchange_n(&slot.hash, &expected, hash, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (expected == hash) {
+          __atomic_fetch_add(&slot.count, 1, __ATOMIC_RELAXED);
+          return;
+        }
+        continue;
+      }
+
+      // We claimed a new slot, copy the input into the data file.
+      __atomic_fetch_add(&slot.count, 1, __ATOMIC_RELAXED);
+      std::uint64_t offset = __atomic_fetch_add(&header->dataSize, size, __ATOMIC_RELAXED);
+      if (offset + size > __atomic_load_n(&header->dataCapacity, __ATOMIC_ACQUIRE) &&
+          !growData(offset + size)) {
+        warnFull();
+        return;
+      }
+      std::memcpy(data + offset, bytes, size);
+
+      const auto now = std::chrono::system_clock::now();
+      const std::uint64_t timeStamp = std::chrono::duration_cast<std::chrono::seconds>(
+                          now.time_since_epoch()).count();
+      slot.offset = offset;
+      slot.size = size;
+      slot.firstSeen = static_cast<std::uint32_t>(timeStamp - header->epoch);
+      __atomic_store_n(&slot.ready, 1, __ATOMIC_RELEASE);
+      __atomic_fetch_add(&header->numEntries, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    warnFull();
+  }
+};
+
+/// Returns the input store of this forkserver or nullptr if the fuzzer didn't
+/// request packed input storage. As with the execution log, the first call
+/// should happen before the forkserver forks.
+COMMON_FUZZ_INPUT_STORE_ATTRS
+inline InputStore *getInputStore() {
+  static InputStore *store = []() -> InputStore * {
+    const char *storageDir = std::getenv("INPUT_STORAGE");
+    const char *format = std::getenv("INPUT_STORAGE_FORMAT");
+    if (!storageDir || !format || std::string(format) != "pack")
+      return nullptr;
+    std::string prefix = std::string(storageDir) + "/inputs_" +
+                         std::to_string(getForkserverPid());
+    static InputStore instance;
+    if (!instance.open(prefix)) {
+      std::cerr << "Failed to open input storage " << prefix << "\n";
+      return nullptr;
+    }
+    return &instance;
+  }();
+  return store;
+}
+
+/// Opens the store during static initialization, i.e., usually before the
+/// (deferred) forkserver starts forking children.
+inline InputStore *const inputStoreAtStartup = getInputStore();
+
+#undef COMMON_FUZZ_INPUT_STORE_ATTRS
+
+#endif // FUZZER_INPUT_STORE
@@ -0,0 +1,145 @@
+// Microbenchmarks for the callbacks that simulators call from FuzzerAPI.h
+// and FuzzerCoverage.h. Prints one JSON object per line like the Rust
+// benchmarks (see benches/throughput.rs), so the output can be compared with
+// bench/compare.py.
+//
+// Build and run (see bench/run.sh):
+//   g++ -std=c++17 -O2 -rdynamic bench/api_bench.cpp -o api_bench -ldl
+//   ./api_bench [filter]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../FuzzerAPI.h"
+
+// Normally provided by the AFL++ runtime. The map is as large as the one
+// the fuzzer uses.
+extern "C" {
+char *__afl_area_ptr = nullptr;
+uint32_t __afl_map_size = 2621440;
+}
+
+namespace {
+
+/// How long each sample should take at least.
+const std::chrono::milliseconds sampleTime(20);
+/// Number of samples per benchmark. The median is reported.
+const int samples = 11;
+
+std::string filter;
+
+template <typename T> void doNotOptimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+void bench(const std::string &name, const std::function<void()> &routine) {
+  if (!filter.empty() && name.find(filter) == std::string::npos)
+    return;
+  using Clock = std::chrono::steady_clock;
+
+  // Find out how many iterations fill a sample.
+  std::size_t iters = 1;
+  while (iters < (1u << 24)) {
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < iters; ++i)
+      routine();
+    if (Clock::now() - start >= sampleTime)
+      break;
+    iters *= 2;
+  }
+
+  std::vector<double> results;
+  for (int s = 0; s < samples; ++s) {
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < iters; ++i)
+      routine();
+    std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+    results.push_back(elapsed.count() / iters);
+  }
+  std::sort(results.begin(), results.end());
+  double median = results[results.size() / 2];
+  std::fprintf(stderr, "%-40s %14.1f ns/iter\n", name.c_str(), median);
+  std::printf("{\"name\": \"%s\", \"unit\": \"ns/iter\", \"value\": %.1f, "
+              "\"min\": %.1f, \"max\": %.1f}\n",
+              name.c_str(), median, results.front(), results.back());
+  std::fflush(stdout);
+}
+
+/// Sets `hits` random entries of the map to non-zero values.
+void fillMap(std::vector<char> &map, std::size_t hits) {
+  std::fill(map.begin(), map.end(), 0);
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<std::size_t> index(0, map.size() - 1);
+  for (std::size_t i = 0; i < hits; ++i)
+    map[index(rng)] = 1;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    filter = argv[1];
+
+  std::vector<char> map(__afl_map_size);
+  __afl_area_ptr = map.data();
+
+  // A typical simulation touches only a tiny part of the map.
+  for (std::size_t hits : {100, 10000}) {
+    fillMap(map, hits);
+    std::string suffix = "/" + std::to_string(hits);
+    bench("coverage/count_scalar" + suffix, [&] {
+      doNotOptimize(countNonZeroScalar(map.data(), __afl_map_size));
+    });
+    bench("coverage/count" + suffix, [&] {
+      doNotOptimize(countNonZero(map.data(), __afl_map_size));
+    });
+    std::vector<uint64_t> seen((__afl_map_size + 63) / 64);
+    bench("coverage/mark_new_scalar" + suffix, [&] {
+      doNotOptimize(markNewCoverageScalar(map.data(), seen.data(), __afl_map_size));
+    });
+    bench("coverage/update_delta" + suffix, [&] {
+      doNotOptimize(updateCoverageDelta().total);
+    });
+  }
+
+  // Without PRINT_COVERAGE this is what every simulated cycle pays.
+  uint32_t cycle = 0;
+  bench("coverage/completed_cycle", [&] { completedCycleCallback(cycle++); });
+
+  std::vector<uint8_t> program(4 * 1000);
+  std::mt19937 rng(1);
+  for (uint8_t &byte : program)
+    byte = static_cast<uint8_t>(rng());
+  bench("hash/4000", [&] {
+    doNotOptimize(hashFuzzingBytes(program.data(), program.size()));
+  });
+
+  // The per-input work in persistent mode without input storage or logging.
+  char path[] = "/tmp/api_bench_input_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, program.data(), program.size()) !=
+                    static_cast<ssize_t>(program.size())) {
+    std::perror("Failed to create benchmark input");
+    return 1;
+  }
+  close(fd);
+  unsetenv("INPUT_STORAGE");
+  unsetenv("COUNTER_FOLDER");
+  bench("api/fuzz_input_callback", [&] {
+    fuzzInputCallback(path);
+    doNotOptimize(getFuzzingInput(path).size);
+  });
+  bench("api/save_path", [&] {
+    doNotOptimize(getFuzzingSavePath("some cause", path).size());
+  });
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""Compares two benchmark result files (one JSON object per line).
+
+Exits with status 1 if any benchmark got slower than the allowed threshold,
+so this can block regressions in CI:
+    bench/compare.py baseline.jsonl new.jsonl --threshold 10
+
+Results with the unit 'ns/iter' are better when lower, all other units
+(e.g. 'execs/s') are better when higher.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    results = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith("{"):
+                continue
+            result = json.loads(line)
+            results[result["name"]] = result
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("new")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="allowed slowdown in percent (default: 10)")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    new = load(args.new)
+    regressions = 0
+    for name, result in sorted(new.items()):
+        old = baseline.get(name)
+        if old is None or old["unit"] != result["unit"] or old["value"] == 0:
+            print(f"{name:<40} {result['value']:>14.1f} {result['unit']} (new)")
+            continue
+        change = (result["value"] - old["value"]) / old["value"] * 100
+        slowdown = change if result["unit"] == "ns/iter" else -change
+        marker = ""
+        if slowdown > args.threshold:
+            marker = "  REGRESSION"
+            regressions += 1
+        print(f"{name:<40} {result['value']:>14.1f} {result['unit']} "
+              f"({change:+.1f}%){marker}")
+
+    if regressions:
+        print(f"{regressions} benchmark(s) regressed by more than "
+              f"{args.threshold}%", file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,51 @@
+#!/bin/bash
+# End-to-end throughput of the fuzzer on the dummy target with a fixed seed.
+# Prints the result as JSON lines like the other benchmarks.
+#
+# Usage: bench/e2e.sh [SECONDS] [extra sim-fuzzer args...]
+# The target is built with afl-clang-fast++ from $AFL_CXX (defaults to the
+# AFL checkout next to this repository, see dummy-target/run.sh).
+
+set -e
+
+cd "$(dirname "$0")/.."
+DURATION=${1:-60}
+shift || true
+AFL_CXX=${AFL_CXX:-../AFL/afl-clang-fast++}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$AFL_CXX -std=c++17 -fsanitize=dataflow -O1 -g dummy-target/target.cpp -o "$WORK/target" >&2
+cargo build --release --bin sim-fuzzer >&2
+
+mkdir -p "$WORK/in"
+# Four nops (addi x0, x0, 0), so every run starts from the same corpus.
+printf '\x13\x00\x00\x00\x13\x00\x00\x00\x13\x00\x00\x00\x13\x00\x00\x00' > "$WORK/in/seed.insts"
+# A cause that is never found, so the fuzzer doesn't stop early.
+echo "never found" > "$WORK/expected"
+
+(
+    cd "$WORK"
+    FUZZING_EXPECTED_LIST="$WORK/expected" timeout -s INT "$DURATION" \
+        "$OLDPWD/target/release/sim-fuzzer" --simple-ui --cores 0 -i in -o out "$@" \
+        ./target @@ > fuzzer.log 2>&1 || true
+)
+
+METRICS="$WORK/out/metrics.prom"
+if [ ! -f "$METRICS" ]; then
+    echo "No metrics written, see the fuzzer output:" >&2
+    cat "$WORK/fuzzer.log" >&2
+    exit 1
+fi
+
+metric() {
+    awk -v name="sim_fuzzer_$1" '$1 == name { print $2 }' "$METRICS"
+}
+EXECS=$(metric execs_total)
+RUN_TIME=$(metric run_time_seconds)
+CORPUS=$(metric corpus_size)
+awk -v execs="$EXECS" -v time="$RUN_TIME" -v corpus="$CORPUS" 'BEGIN {
+    printf "{\"name\": \"e2e/dummy-target\", \"unit\": \"execs/s\", \"value\": %.1f}\n", execs / time
+    printf "{\"name\": \"e2e/dummy-target/corpus\", \"unit\": \"entries\", \"value\": %d}\n", corpus
+}'
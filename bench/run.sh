@@ -0,0 +1,23 @@
+#!/bin/bash
+# Runs all benchmarks and writes their results as JSON lines to the given
+# file (default: bench_output.txt). Compare two runs with bench/compare.py.
+#
+# Usage: bench/run.sh [OUTPUT] [E2E_SECONDS]
+# Set E2E_SECONDS to 0 to skip the end-to-end benchmark.
+
+set -e
+
+cd "$(dirname "$0")/.."
+OUTPUT=${1:-bench_output.txt}
+E2E_SECONDS=${2:-60}
+
+cargo bench --bench throughput > "$OUTPUT"
+
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+${CXX:-g++} -std=c++17 -O2 -rdynamic -w bench/api_bench.cpp -o "$BUILD/api_bench" -ldl
+FUZZING_CAUSE_DIR="$BUILD" "$BUILD/api_bench" >> "$OUTPUT"
+
+if [ "$E2E_SECONDS" != "0" ]; then
+    bench/e2e.sh "$E2E_SECONDS" >> "$OUTPUT"
+fi
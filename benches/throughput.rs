@@ -0,0 +1,162 @@
+//! Throughput benchmarks for the hot paths of the fuzzer.
+//!
+//! Every result is printed as one JSON object per line on stdout (progress
+//! goes to stderr), so runs can be compared with 'bench/compare.py':
+//!   cargo bench --bench throughput > new.jsonl
+//!   bench/compare.py baseline.jsonl new.jsonl
+//! Pass a substring to only run matching benchmarks, e.g.
+//!   cargo bench --bench throughput -- mutation/add
+use std::{
+    hint::black_box,
+    time::{Duration, Instant},
+};
+
+use libafl::prelude::*;
+use riscv_mutator::{
+    assembler::assemble_instructions,
+    generator::{InstGenerator, InstructionSet},
+    instructions::{self, Instruction},
+    mutator::{Mutation, RiscVInstructionMutator},
+    parser::{parse_instructions, parse_instructions_with, Decoder},
+    program_input::ProgramInput,
+};
+
+/// How long each sample should take at least.
+const SAMPLE_TIME: Duration = Duration::from_millis(20);
+/// Number of samples per benchmark. The median is reported.
+const SAMPLES: usize = 11;
+const PROGRAM_SIZES: [usize; 4] = [10, 100, 1_000, 10_000];
+
+/// The minimal state the mutators need.
+struct BenchState {
+    rand: StdRand,
+}
+
+impl HasRand for BenchState {
+    type Rand = StdRand;
+
+    fn rand(&self) -> &StdRand {
+        &self.rand
+    }
+
+    fn rand_mut(&mut self) -> &mut StdRand {
+        &mut self.rand
+    }
+}
+
+struct Bencher {
+    filter: Option<String>,
+}
+
+impl Bencher {
+    fn from_args() -> Self {
+        // Cargo passes '--bench', everything that isn't a flag is a filter.
+        let filter = std::env::args().skip(1).find(|arg| !arg.starts_with("--"));
+        Self { filter }
+    }
+
+    fn enabled(&self, name: &str) -> bool {
+        self.filter
+            .as_ref()
+            .map_or(true, |f| name.contains(f.as_str()))
+    }
+
+    fn report(&self, name: &str, mut samples: Vec<f64>) {
+        samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        let median = samples[samples.len() / 2];
+        eprintln!("{:<40} {:>14.1} ns/iter", name, median);
+        println!(
+            "{{\"name\": \"{}\", \"unit\": \"ns/iter\", \"value\": {:.1}, \"min\": {:.1}, \"max\": {:.1}}}",
+            name,
+            median,
+            samples[0],
+            samples[samples.len() - 1]
+        );
+    }
+
+    /// Measures `routine` on fresh inputs from `setup`. Creating the inputs
+    /// is not part of the measurement.
+    fn bench_batched<T, S, R>(&self, name: &str, mut setup: S, mut routine: R)
+    where
+        S: FnMut() -> T,
+        R: FnMut(&mut T),
+    {
+        if !self.enabled(name) {
+            return;
+        }
+        // Find out how many iterations fill a sample.
+        let mut iters = 1usize;
+        loop {
+            let mut inputs: Vec<T> = (0..iters).map(|_| setup()).collect();
+            let start = Instant::now();
+            inputs.iter_mut().for_each(&mut routine);
+            if start.elapsed() >= SAMPLE_TIME || iters >= 1 << 20 {
+                break;
+            }
+            iters *= 2;
+        }
+
+        let samples = (0..SAMPLES)
+            .map(|_| {
+                let mut inputs: Vec<T> = (0..iters).map(|_| setup()).collect();
+                let start = Instant::now();
+                inputs.iter_mut().for_each(&mut routine);
+                start.elapsed().as_nanos() as f64 / iters as f64
+            })
+            .collect();
+        self.report(name, samples);
+    }
+
+    fn bench<R: FnMut()>(&self, name: &str, mut routine: R) {
+        self.bench_batched(name, || (), |_| routine());
+    }
+}
+
+fn random_program(rand: &mut StdRand, len: usize) -> Vec<Instruction> {
+    InstGenerator::new().generate_instructions(rand, &instructions::sets::riscv_g(), len as u32)
+}
+
+fn main() {
+    let bencher = Bencher::from_args();
+    let mut rand = StdRand::with_seed(0);
+    let all = instructions::riscv::all();
+
+    let program = random_program(&mut rand, 1_000);
+    let bytes = assemble_instructions(&program);
+    bencher.bench("assemble/1000", || {
+        black_box(assemble_instructions(black_box(&program)));
+    });
+    bencher.bench("parse/decoder/1000", || {
+        black_box(parse_instructions_with(black_box(&bytes), Decoder::all()).unwrap());
+    });
+    bencher.bench("parse/linear/1000", || {
+        black_box(parse_instructions(black_box(&bytes), &all).unwrap());
+    });
+
+    let generator = InstGenerator::new();
+    let riscv_g = instructions::sets::riscv_g();
+    let set = InstructionSet::riscv_base();
+    bencher.bench("generate/riscv_g", || {
+        black_box(generator.generate_instruction(&mut rand, &riscv_g));
+    });
+    bencher.bench("generate/weighted_set", || {
+        black_box(generator.generate_instruction_from(&mut rand, &set));
+    });
+
+    let mut state = BenchState {
+        rand: StdRand::with_seed(1),
+    };
+    for size in PROGRAM_SIZES {
+        let base = ProgramInput::new(random_program(&mut rand, size));
+        for mutation in Mutation::ALL {
+            let mut mutator = RiscVInstructionMutator::new(mutation);
+            bencher.bench_batched(
+                &format!("mutation/{}/{}", mutation.name(), size),
+                || base.clone(),
+                |input| {
+                    black_box(mutator.mutate(&mut state, input, 0).unwrap());
+                },
+            );
+        }
+    }
+}
@@ -4,6 +4,10 @@
 #include <unistd.h>
 #include <time.h>
 
+#include "../FuzzerAPI.h"
+
+FUZZER_API_INIT()
+
 char store[10000];
 
 int main(int argc, char **argv) {
@@ -12,16 +16,18 @@ int main(int argc, char **argv) {
 
     dfsan_label label = 1;
 
-    FILE *file = fopen(argv[1], "r");
+    // Reads from shared memory when fuzzing and from argv[1] otherwise.
+    FuzzingInput input = getFuzzingInput(argv[1]);
 
-    if (file == NULL)
+    if (input.data == NULL)
         return 1;
 
     dfsan_set_label(label, store, 1);
 
     int c = 0;
     size_t n = 0;
-    while ((c = fgetc(file)) != EOF) {
+    while (n < input.size) {
+        c = input.data[n];
         ++n;
         switch (__LINE__ + (int)c) {
 #define BLOCK case __LINE__ : \
@@ -3,14 +3,22 @@ use crate::instructions::Instruction;
 /// Returns a list of instructions to their encoded machine code (in bytes).
 pub fn assemble_instructions(input: &Vec<Instruction>) -> Vec<u8> {
     let mut result = Vec::<u8>::new();
+    assemble_instructions_into(input, &mut result);
+    result
+}
 
-    for inst in input {
-        for byte in inst.encode().to_le_bytes() {
-            result.push(byte);
-        }
+/// Appends the encoded machine code of the given instructions to `output`.
+/// Allows reusing the same buffer for several encodings.
+pub fn assemble_instructions_into(input: &[Instruction], output: &mut Vec<u8>) {
+    const INST_SIZE: usize = std::mem::size_of::<u32>();
+    let start = output.len();
+    output.resize(start + input.len() * INST_SIZE, 0);
+    for (inst, bytes) in input
+        .iter()
+        .zip(output[start..].chunks_exact_mut(INST_SIZE))
+    {
+        bytes.copy_from_slice(&inst.encode().to_le_bytes());
     }
-
-    result
 }
 
 #[cfg(test)]
@@ -23,7 +31,7 @@ mod tests {
     use crate::instructions::riscv::args;
     use crate::instructions::riscv::rv_i::*;
     use crate::instructions::*;
-    use crate::parser::parse_instructions;
+    use crate::parser::{parse_instructions_with, Decoder};
 
     use super::assemble_instructions;
 
@@ -52,7 +60,7 @@ mod tests {
         assert_eq!(assembled.len(), 8);
 
         // Parse the output and check that we get the same result.
-        let parsed = parse_instructions(&assembled, &instructions::sets::riscv_g()).unwrap();
+        let parsed = parse_instructions_with(&assembled, Decoder::riscv_g()).unwrap();
         assert_eq!(insts, parsed);
     }
 
@@ -77,7 +85,7 @@ mod tests {
             let assembled = assemble_instructions(&insts);
 
             // Parse the output and check that we get the same result.
-            let parsed = parse_instructions(&assembled, &instructions::sets::riscv_g())
+            let parsed = parse_instructions_with(&assembled, Decoder::riscv_g())
                 .expect(format!("{}: Failed to parse instructions: {:?}", i, insts).as_str());
             assert_eq!(insts, parsed, "Instructions: {:?}", insts);
         }
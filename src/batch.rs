@@ -0,0 +1,478 @@
+//! Batched execution: several mutated programs are sent to the target as one
+//! framed input and run back to back in the same simulator run, which saves
+//! the start-up and reset cost of the simulator for all but one of them. The
+//! harness side is in FuzzerBatch.h and `FuzzingProgramIterator` in
+//! FuzzerAPI.h.
+//!
+//! The harness moves the coverage of every program into its own slot of a
+//! shared memory region, so every program is judged by the feedbacks as if
+//! it had been executed on its own.
+extern crate alloc;
+use alloc::string::{String, ToString};
+use core::marker::PhantomData;
+
+#[cfg(feature = "introspection")]
+use libafl::monitors::PerfFeature;
+use libafl::{
+    bolts::{
+        shmem::ShMem,
+        tuples::{MatchName, Named},
+        AsMutSlice, AsSlice,
+    },
+    corpus::{Corpus, CorpusId},
+    events::EventFirer,
+    executors::{Executor, ExitKind, HasObservers},
+    feedbacks::HasObserverName,
+    fuzzer::{Evaluator, ExecutionProcessor},
+    inputs::UsesInput,
+    mark_feature_time,
+    mutators::{MutationResult, Mutator},
+    observers::{MapObserver, ObserversTuple, UsesObserver},
+    stages::{MutationalStage, Stage},
+    start_timer,
+    state::{HasClientPerfMonitor, HasCorpus, HasExecutions, HasRand, UsesState},
+    Error,
+};
+
+use crate::program_input::ProgramInput;
+
+/// Marks a framed input. Not a valid 32-bit RISC-V instruction (the lowest
+/// two bits are not 0b11), so a regular program never starts with it.
+const BATCH_MAGIC: &[u8; 4] = b"RVB1";
+/// The env var with the id of the shared memory for the per-program coverage.
+pub const BATCH_SHM_ENV: &str = "SIM_BATCH_SHM_ID";
+/// How many map entries a single program of a batch may cover. Programs that
+/// cover more are executed again on their own.
+pub const BATCH_SLOT_ENTRIES: usize = 16384;
+/// The input shared memory of the forkserver is 1 MiB, stay well below it.
+const MAX_BATCH_BYTES: usize = 512 * 1024;
+const HEADER_SIZE: usize = 12;
+
+/// Frames the given programs into a single input:
+/// "RVB1", u32 count, then a u32 size and the bytes of every program.
+pub fn frame_programs<'a, I>(programs: I) -> Vec<u8>
+where
+    I: IntoIterator<Item = &'a [u8]>,
+{
+    let mut out = Vec::with_capacity(MAX_BATCH_BYTES);
+    out.extend_from_slice(BATCH_MAGIC);
+    out.extend_from_slice(&0u32.to_le_bytes());
+    let mut count = 0u32;
+    for program in programs {
+        out.extend_from_slice(&(program.len() as u32).to_le_bytes());
+        out.extend_from_slice(program);
+        count += 1;
+    }
+    out[4..8].copy_from_slice(&count.to_le_bytes());
+    out
+}
+
+/// Splits a framed input into its programs. Returns `None` for inputs that
+/// are not a (valid) batch.
+pub fn split_programs(bytes: &[u8]) -> Option<Vec<&[u8]>> {
+    if bytes.len() < 8 || &bytes[..4] != BATCH_MAGIC {
+        return None;
+    }
+    let count = read_u32(bytes, 4) as usize;
+    let mut programs = Vec::with_capacity(count);
+    let mut offset = 8;
+    for _ in 0..count {
+        if bytes.len() - offset < 4 {
+            return None;
+        }
+        let size = read_u32(bytes, offset) as usize;
+        offset += 4;
+        if bytes.len() - offset < size {
+            return None;
+        }
+        programs.push(&bytes[offset..offset + size]);
+        offset += size;
+    }
+    (offset == bytes.len()).then_some(programs)
+}
+
+fn read_u32(bytes: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(bytes[offset..offset + 4].try_into().unwrap())
+}
+
+fn write_u32(bytes: &mut [u8], offset: usize, value: u32) {
+    bytes[offset..offset + 4].copy_from_slice(&value.to_le_bytes());
+}
+
+fn slot_offset(slot: usize) -> usize {
+    HEADER_SIZE + slot * (BATCH_SLOT_ENTRIES + 1) * 4
+}
+
+/// Returns the bytes of a channel with the given number of slots.
+pub fn channel_size(slots: usize) -> usize {
+    slot_offset(slots)
+}
+
+/// Returns the (map index, hitcount) pairs the harness recorded for the
+/// given slot or `None` if the program covered more than fits into it.
+fn slot_entries(channel: &[u8], slot: usize) -> Option<Vec<(usize, u8)>> {
+    let offset = slot_offset(slot);
+    let count = read_u32(channel, offset) as usize;
+    if count > BATCH_SLOT_ENTRIES {
+        return None;
+    }
+    let entries = (0..count)
+        .map(|idx| read_u32(channel, offset + 4 * (idx + 1)))
+        .map(|entry| ((entry >> 8) as usize, entry as u8))
+        .collect();
+    Some(entries)
+}
+
+/// The number of slots of a channel set up by `BatchChannel::new`.
+pub fn channel_slots(channel: &[u8]) -> usize {
+    read_u32(channel, 4) as usize
+}
+
+/// Writes the coverage of a finished program into its slot like the harness
+/// does. For executors that run the programs of a batch themselves.
+pub fn write_slot(channel: &mut [u8], slot: usize, entries: &[(usize, u8)]) {
+    if slot >= channel_slots(channel) {
+        return;
+    }
+    let offset = slot_offset(slot);
+    // Like the harness, a full slot still records the total count so that
+    // the program is executed again on its own.
+    write_u32(channel, offset, entries.len() as u32);
+    for (idx, (map_idx, hits)) in entries.iter().take(BATCH_SLOT_ENTRIES).enumerate() {
+        write_u32(
+            channel,
+            offset + 4 * (idx + 1),
+            (*map_idx as u32) << 8 | *hits as u32,
+        );
+    }
+}
+
+/// Sets the number of programs of the batch that were started.
+pub fn write_started(channel: &mut [u8], started: usize) {
+    write_u32(channel, 8, started as u32);
+}
+
+/// The shared memory in which the harness stores the coverage of every
+/// program of a batch. See FuzzerBatch.h for the layout.
+pub struct BatchChannel<SHM> {
+    shmem: SHM,
+    slots: usize,
+}
+
+impl<SHM: ShMem> BatchChannel<SHM> {
+    /// Wraps the given shared memory, which should be `channel_size` bytes
+    /// large for the number of programs in a batch.
+    pub fn new(mut shmem: SHM) -> Result<Self, String> {
+        let len = shmem.as_slice().len();
+        if len < channel_size(1) {
+            return Err(format!("Batch channel of {} bytes is too small", len));
+        }
+        let slots = (len - HEADER_SIZE) / ((BATCH_SLOT_ENTRIES + 1) * 4);
+        let buf = shmem.as_mut_slice();
+        write_u32(buf, 0, BATCH_SLOT_ENTRIES as u32);
+        write_u32(buf, 4, slots as u32);
+        Ok(Self { shmem, slots })
+    }
+
+    /// The number of programs that fit into a batch.
+    pub fn slots(&self) -> usize {
+        self.slots
+    }
+
+    /// Prepares the channel for the next batch.
+    fn reset(&mut self, programs: usize) {
+        let buf = self.shmem.as_mut_slice();
+        write_u32(buf, 8, 0);
+        for slot in 0..programs {
+            write_u32(buf, slot_offset(slot), 0);
+        }
+    }
+
+    /// The number of programs the harness started. The last one is the one
+    /// that was running when the target crashed or timed out.
+    fn started(&self) -> usize {
+        read_u32(self.shmem.as_slice(), 8) as usize
+    }
+
+    fn entries(&self, slot: usize) -> Option<Vec<(usize, u8)>> {
+        slot_entries(self.shmem.as_slice(), slot)
+    }
+}
+
+/// Runs the mutations of the wrapped mutational stage in batches of up to
+/// `batch_size` programs. The stage still decides how often an entry is
+/// mutated (e.g. by the power schedule) and with which mutator. Without a
+/// channel (or with a batch size of 1) the wrapped stage runs as usual, which
+/// keeps the type of the stages tuple the same for both cases.
+pub struct BatchedMutationalStage<M, O, SHM, ST> {
+    inner: ST,
+    channel: Option<BatchChannel<SHM>>,
+    batch_size: usize,
+    map_observer_name: String,
+    /// Set once the harness didn't report any program of a batch.
+    unsupported: bool,
+    phantom: PhantomData<(M, O)>,
+}
+
+impl<M, O, SHM, ST> UsesState for BatchedMutationalStage<M, O, SHM, ST>
+where
+    ST: UsesState,
+{
+    type State = ST::State;
+}
+
+impl<E, EM, M, O, OT, SHM, ST, Z> Stage<E, EM, Z> for BatchedMutationalStage<M, O, SHM, ST>
+where
+    E: Executor<EM, Z> + HasObservers<Observers = OT>,
+    EM: EventFirer<State = E::State>,
+    M: Mutator<ProgramInput, E::State>,
+    O: MapObserver<Entry = u8>,
+    OT: ObserversTuple<E::State>,
+    SHM: ShMem,
+    ST: MutationalStage<E, EM, ProgramInput, M, Z> + UsesState<State = E::State>,
+    E::State: HasCorpus
+        + HasRand
+        + HasExecutions
+        + HasClientPerfMonitor
+        + UsesInput<Input = ProgramInput>,
+    Z: Evaluator<E, EM, State = E::State> + ExecutionProcessor<OT, State = E::State>,
+{
+    fn perform(
+        &mut self,
+        fuzzer: &mut Z,
+        executor: &mut E,
+        state: &mut E::State,
+        mgr: &mut EM,
+        corpus_idx: CorpusId,
+    ) -> Result<(), Error> {
+        let batch_size = self
+            .batch_size
+            .min(self.channel.as_ref().map_or(1, |c| c.slots()));
+        if batch_size <= 1 || self.unsupported {
+            return self.inner.perform(fuzzer, executor, state, mgr, corpus_idx);
+        }
+
+        let iterations = self.inner.iterations(state, corpus_idx)?;
+
+        start_timer!(state);
+        let base = state
+            .corpus()
+            .get(corpus_idx)?
+            .borrow_mut()
+            .load_input(state.corpus())?
+            .clone();
+        mark_feature_time!(state, PerfFeature::GetInputFromCorpus);
+
+        let mut stage_idx = 0u64;
+        while stage_idx < iterations {
+            let mut batch = Vec::with_capacity(batch_size);
+            let mut bytes = 0;
+            while stage_idx < iterations && batch.len() < batch_size && bytes < MAX_BATCH_BYTES {
+                let mut input = base.clone();
+                start_timer!(state);
+                let mutated =
+                    self.inner
+                        .mutator_mut()
+                        .mutate(state, &mut input, stage_idx as i32)?;
+                mark_feature_time!(state, PerfFeature::Mutate);
+                if mutated == MutationResult::Mutated {
+                    bytes += input.encoded().len() + 4;
+                    batch.push((stage_idx as i32, input));
+                }
+                stage_idx += 1;
+            }
+            if !batch.is_empty() {
+                self.run_batch(fuzzer, executor, state, mgr, batch)?;
+            }
+        }
+        Ok(())
+    }
+}
+
+impl<M, O, SHM, ST> BatchedMutationalStage<M, O, SHM, ST>
+where
+    O: MapObserver<Entry = u8>,
+    SHM: ShMem,
+{
+    /// Creates the stage. `channel` has to be shared with the target via
+    /// `BATCH_SHM_ENV` and the target must use `FuzzingProgramIterator`.
+    #[must_use]
+    pub fn new<F, S>(
+        inner: ST,
+        map_feedback: &F,
+        channel: Option<BatchChannel<SHM>>,
+        batch_size: usize,
+    ) -> Self
+    where
+        F: HasObserverName + Named + UsesObserver<S, Observer = O>,
+        S: UsesInput,
+    {
+        Self {
+            inner,
+            channel,
+            batch_size,
+            map_observer_name: map_feedback.observer_name().to_string(),
+            unsupported: false,
+            phantom: PhantomData,
+        }
+    }
+
+    /// Copies the coverage of one program into the map observer.
+    fn restore_map<OT>(&self, observers: &mut OT, entries: &[(usize, u8)]) -> Result<(), Error>
+    where
+        OT: MatchName,
+    {
+        let map = observers
+            .match_name_mut::<O>(&self.map_observer_name)
+            .ok_or_else(|| Error::key_not_found("MapObserver not found".to_string()))?;
+        map.reset_map()?;
+        let len = map.usable_count();
+        for &(idx, hits) in entries.iter().filter(|(idx, _)| *idx < len) {
+            *map.get_mut(idx) = hits;
+        }
+        Ok(())
+    }
+
+    fn run_batch<E, EM, OT, Z>(
+        &mut self,
+        fuzzer: &mut Z,
+        executor: &mut E,
+        state: &mut E::State,
+        mgr: &mut EM,
+        batch: Vec<(i32, ProgramInput)>,
+    ) -> Result<(), Error>
+    where
+        E: Executor<EM, Z> + HasObservers<Observers = OT>,
+        EM: EventFirer<State = E::State>,
+        M: Mutator<ProgramInput, E::State>,
+        OT: ObserversTuple<E::State>,
+        ST: MutationalStage<E, EM, ProgramInput, M, Z> + UsesState<State = E::State>,
+        E::State: HasCorpus
+            + HasRand
+            + HasExecutions
+            + HasClientPerfMonitor
+            + UsesInput<Input = ProgramInput>,
+        Z: Evaluator<E, EM, State = E::State> + ExecutionProcessor<OT, State = E::State>,
+    {
+        let framed = ProgramInput::from_target_bytes(frame_programs(
+            batch.iter().map(|(_, input)| input.encoded()),
+        ));
+        let channel = self.channel.as_mut().unwrap();
+        channel.reset(batch.len());
+
+        start_timer!(state);
+        executor.observers_mut().pre_exec_all(state, &framed)?;
+        mark_feature_time!(state, PerfFeature::PreExecObservers);
+
+        start_timer!(state);
+        let exit_kind = executor.run_target(fuzzer, state, mgr, &framed)?;
+        mark_feature_time!(state, PerfFeature::TargetExecution);
+
+        let started = channel.started().min(batch.len());
+        if started == 0 && exit_kind == ExitKind::Ok {
+            log::error!("The target didn't run the batch, is it using FuzzingProgramIterator?");
+            self.unsupported = true;
+        }
+        // The program that was running when the target stopped. Its coverage
+        // is still in the map, as the harness moves the coverage of every
+        // finished program into its slot.
+        let failed = (exit_kind != ExitKind::Ok && started > 0).then(|| started - 1);
+        let failed_entries: Vec<(usize, u8)> = match failed {
+            Some(_) => {
+                let map = executor
+                    .observers()
+                    .match_name::<O>(&self.map_observer_name)
+                    .ok_or_else(|| Error::key_not_found("MapObserver not found".to_string()))?;
+                let initial = map.initial();
+                (0..map.usable_count())
+                    .filter(|idx| *map.get(*idx) != initial)
+                    .map(|idx| (idx, *map.get(idx)))
+                    .collect()
+            }
+            None => Vec::new(),
+        };
+
+        for (slot, (stage_idx, input)) in batch.into_iter().enumerate() {
+            let finished = slot + 1 < started || (slot + 1 == started && failed.is_none());
+            let (entries, slot_exit) = if finished {
+                (self.channel.as_ref().unwrap().entries(slot), ExitKind::Ok)
+            } else if failed == Some(slot) {
+                (Some(failed_entries.clone()), exit_kind)
+            } else {
+                (None, ExitKind::Ok)
+            };
+
+            let corpus_id = match entries {
+                Some(entries) => {
+                    start_timer!(state);
+                    self.restore_map(executor.observers_mut(), &entries)?;
+                    executor
+                        .observers_mut()
+                        .post_exec_all(state, &input, &slot_exit)?;
+                    mark_feature_time!(state, PerfFeature::PostExecObservers);
+                    *state.executions_mut() += 1;
+                    let (_, corpus_id) = fuzzer.process_execution(
+                        state,
+                        mgr,
+                        input,
+                        executor.observers(),
+                        &slot_exit,
+                        true,
+                    )?;
+                    corpus_id
+                }
+                // Programs that didn't run or covered too much for their
+                // slot are executed on their own.
+                None => fuzzer.evaluate_input(state, executor, mgr, input)?.1,
+            };
+            // All programs were mutated before the first one ran, the stage
+            // index tells the mutator which of its inputs this was.
+            self.inner
+                .mutator_mut()
+                .post_exec(state, stage_idx, corpus_id)?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        channel_size, frame_programs, slot_entries, slot_offset, split_programs, write_slot,
+        write_u32,
+    };
+
+    #[test]
+    fn frame_round_trip() {
+        let programs: Vec<&[u8]> = vec![&[1, 2, 3, 4], &[], &[5, 6, 7, 8, 9, 10, 11, 12]];
+        let framed = frame_programs(programs.iter().copied());
+        assert_eq!(&framed[..8], b"RVB1\x03\x00\x00\x00");
+        assert_eq!(split_programs(&framed), Some(programs));
+
+        // Regular programs and broken frames aren't batches.
+        assert_eq!(split_programs(&[0x13, 0, 0, 0, 0x13, 0, 0, 0]), None);
+        assert_eq!(split_programs(&framed[..framed.len() - 1]), None);
+    }
+
+    #[test]
+    fn read_slot_entries() {
+        let mut channel = vec![0u8; channel_size(2)];
+        // What the harness writes for a program that covered two entries.
+        let offset = slot_offset(1);
+        channel[offset..offset + 4].copy_from_slice(&2u32.to_le_bytes());
+        channel[offset + 4..offset + 8].copy_from_slice(&(7u32 << 8 | 3).to_le_bytes());
+        channel[offset + 8..offset + 12].copy_from_slice(&(2_000_000u32 << 8 | 1).to_le_bytes());
+        assert_eq!(slot_entries(&channel, 0), Some(vec![]));
+        assert_eq!(
+            slot_entries(&channel, 1),
+            Some(vec![(7, 3), (2_000_000, 1)])
+        );
+        write_u32(&mut channel, 4, 2);
+        write_slot(&mut channel, 0, &[(7, 3), (2_000_000, 1)]);
+        assert_eq!(slot_entries(&channel, 0), slot_entries(&channel, 1));
+
+        // Too many entries for the slot.
+        channel[offset..offset + 4].copy_from_slice(&u32::MAX.to_le_bytes());
+        assert_eq!(slot_entries(&channel, 1), None);
+    }
+}
@@ -0,0 +1,85 @@
+use clap::Parser;
+use riscv_mutator::exec_log::open_exec_log;
+use std::{
+    collections::HashSet,
+    io::{self, BufWriter, Write},
+    process::ExitCode,
+};
+
+/// Prints the execution logs that the harness writes into COUNTER_FOLDER.
+#[derive(Parser, Debug)]
+#[command(author, version, about, long_about = None)]
+struct Args {
+    input: Vec<String>,
+    /// Only print a summary of each log instead of every record.
+    #[arg(long, default_value_t = false)]
+    summary: bool,
+}
+
+fn main() -> ExitCode {
+    let args = Args::parse();
+
+    let stdout = io::stdout();
+    let mut out = BufWriter::new(stdout.lock());
+
+    for filename in args.input {
+        let reader = match open_exec_log(&filename) {
+            Ok(reader) => reader,
+            Err(err) => {
+                eprintln!("error: {}", err);
+                return ExitCode::FAILURE;
+            }
+        };
+        let epoch = reader.epoch();
+
+        if !args.summary {
+            // Same columns as the old text format, but with absolute and
+            // decimal time stamps.
+            for record in reader {
+                writeln!(
+                    out,
+                    "{:016x} {} {}",
+                    record.hash,
+                    record.size,
+                    epoch + record.time as u64
+                )
+                .expect("Failed to write output");
+            }
+            continue;
+        }
+
+        let mut execs: u64 = 0;
+        let mut total_size: u64 = 0;
+        let mut unique = HashSet::<u64>::new();
+        let mut first_time = u32::MAX;
+        let mut last_time = 0u32;
+        for record in reader {
+            execs += 1;
+            total_size += record.size as u64;
+            unique.insert(record.hash);
+            first_time = first_time.min(record.time);
+            last_time = last_time.max(record.time);
+        }
+        let duration = if execs == 0 {
+            0
+        } else {
+            last_time - first_time
+        };
+        let execs_per_sec = execs as f64 / (duration.max(1) as f64);
+        let avg_size = total_size as f64 / (execs.max(1) as f64);
+        writeln!(
+            out,
+            "{}: execs: {}, unique: {}, avg size: {:.1}, duration: {}s, exec/sec: {:.2}",
+            filename,
+            execs,
+            unique.len(),
+            avg_size,
+            duration,
+            execs_per_sec
+        )
+        .expect("Failed to write output");
+    }
+
+    out.flush().expect("Failed to write output");
+    ExitCode::SUCCESS
+}
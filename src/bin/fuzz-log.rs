@@ -0,0 +1,55 @@
+use clap::Parser;
+use riscv_mutator::logger::open_fuzz_log;
+use std::{
+    io::{self, BufWriter, Write},
+    process::ExitCode,
+};
+
+/// Prints the binary logs that sim-fuzzer writes with --log-format binary.
+#[derive(Parser, Debug)]
+#[command(author, version, about, long_about = None)]
+struct Args {
+    input: Vec<String>,
+    /// Only print records with this level or a more severe one.
+    #[arg(long, default_value = "trace")]
+    level: String,
+}
+
+fn main() -> ExitCode {
+    let args = Args::parse();
+    let level = match args.level.parse::<log::Level>() {
+        Ok(level) => level,
+        Err(_) => {
+            eprintln!("error: unknown log level {:?}", args.level);
+            return ExitCode::FAILURE;
+        }
+    };
+
+    let stdout = io::stdout();
+    let mut out = BufWriter::new(stdout.lock());
+
+    for filename in args.input {
+        let reader = match open_fuzz_log(&filename) {
+            Ok(reader) => reader,
+            Err(err) => {
+                eprintln!("error: {}", err);
+                return ExitCode::FAILURE;
+            }
+        };
+        for record in reader.filter(|record| record.level <= level) {
+            writeln!(
+                out,
+                "{}.{:06} {} {}: {}",
+                record.time / 1_000_000,
+                record.time % 1_000_000,
+                record.level,
+                record.target,
+                record.message
+            )
+            .expect("Failed to write output");
+        }
+    }
+
+    out.flush().expect("Failed to write output");
+    ExitCode::SUCCESS
+}
@@ -1,9 +1,10 @@
 use clap::Parser;
 use colored::Colorize;
 use crossterm::style::Stylize;
+use riscv_mutator::input_store::{is_input_store_index, InputStore};
 use riscv_mutator::instructions::Instruction;
+use riscv_mutator::parser::{self, Decoder};
 use riscv_mutator::program_input::ProgramInput;
-use riscv_mutator::{instructions, parser};
 use std::fs;
 
 #[derive(Parser, Debug)]
@@ -14,6 +15,36 @@ struct Args {
     raw: bool,
 }
 
+fn print_program(program: Vec<Instruction>) {
+    for inst in program {
+        print!(" {}", Colorize::bold(inst.template().name()));
+        for op in inst.arguments() {
+            print!(
+                " {}={}",
+                Colorize::cyan(op.spec().name()),
+                format!("{:#x}", op.value()).red()
+            );
+        }
+        println!("");
+    }
+}
+
+/// Disassembles every input in the given packed input store.
+fn print_store(filename: String) {
+    let store = InputStore::open(filename).expect("Failed to open input store");
+    for entry in store.entries() {
+        println!(
+            "{}:",
+            format!("{:016x} (executed {}x)", entry.hash, entry.count).yellow()
+        );
+        let bytes = store.read(entry).expect("Failed to read input store");
+        match parser::parse_instructions_with(&bytes, Decoder::riscv_g()) {
+            Ok(program) => print_program(program),
+            Err(_) => eprintln!("Failed to decode raw instructions."),
+        }
+    }
+}
+
 fn main() {
     let args = Args::parse();
 
@@ -24,13 +55,17 @@ fn main() {
             println!("{}:", filename.clone().bold().blue());
         }
 
-        let buffer = fs::read(filename).expect("Failed to read file");
+        let buffer = fs::read(filename.clone()).expect("Failed to read file");
+
+        if is_input_store_index(&buffer) {
+            print_store(filename);
+            continue;
+        }
 
         let program: Vec<Instruction>;
 
         if args.raw {
-            let program_or_err =
-                parser::parse_instructions(&buffer, &instructions::sets::riscv_g());
+            let program_or_err = parser::parse_instructions_with(&buffer, Decoder::riscv_g());
             if program_or_err.is_err() {
                 eprintln!("Failed to decode raw instructions.");
                 continue;
@@ -41,16 +76,6 @@ fn main() {
             program = input.unwrap().insts().to_vec();
         }
 
-        for inst in program {
-            print!(" {}", Colorize::bold(inst.template().name()));
-            for op in inst.arguments() {
-                print!(
-                    " {}={}",
-                    Colorize::cyan(op.spec().name()),
-                    format!("{:#x}", op.value()).red()
-                );
-            }
-            println!("");
-        }
+        print_program(program);
     }
 }
@@ -1,6 +1,7 @@
 use clap::Parser;
 use crossterm::style::Stylize;
 use riscv_mutator::assembler::assemble_instructions;
+use riscv_mutator::input_store::{is_input_store_index, InputStore};
 use riscv_mutator::program_input::ProgramInput;
 use std::fs;
 
@@ -10,11 +11,31 @@ struct Args {
     input: Vec<String>,
 }
 
+/// Writes every input in the given packed input store next to the index.
+fn unpack_store(filename: &String) {
+    let store = InputStore::open(filename).expect("Failed to open input store");
+    for entry in store.entries() {
+        let bytes = store.read(entry).expect("Failed to read input store");
+        let output = format!("{}-{:016x}.insts", filename, entry.hash);
+        fs::write(output.clone(), bytes).expect("Unable to write output file");
+    }
+    println!(
+        "Written {} inputs from {}",
+        store.entries().len(),
+        filename.clone().bold().blue()
+    );
+}
+
 fn main() {
     let args = Args::parse();
 
     for filename in args.input {
         let buffer = fs::read(filename.clone()).expect("Failed to read file");
+        if is_input_store_index(&buffer) {
+            unpack_store(&filename);
+            continue;
+        }
+
         let input = postcard::from_bytes::<ProgramInput>(buffer.as_slice());
 
         if input.is_err() {
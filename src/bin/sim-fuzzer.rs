@@ -1,11 +1,12 @@
-use core::time::Duration;
+use core::{marker::PhantomData, time::Duration};
 use std::{
     collections::HashMap,
-    fs::{self, OpenOptions},
-    io::Write,
-    path::PathBuf,
+    fs,
+    net::SocketAddr,
+    panic,
+    path::{Path, PathBuf},
     process,
-    sync::{Arc, Mutex},
+    sync::Arc,
 };
 
 use clap::Parser;
@@ -17,33 +18,39 @@ use libafl::{
         tuples::tuple_list,
         AsMutSlice,
     },
-    corpus::{OnDiskCorpus},
+    corpus::{Corpus, CorpusId, OnDiskCorpus},
     executors::forkserver::{ForkserverExecutor, TimeoutForkserverExecutor},
     feedback_or,
-    feedbacks::{CrashFeedback, MaxMapFeedback, TimeFeedback},
+    feedbacks::{CrashFeedback, TimeFeedback},
     fuzzer::{Fuzzer, StdFuzzer},
-    mutators::StdScheduledMutator,
+    monitors::UserStats,
     observers::{HitcountsMapObserver, StdMapObserver, TimeObserver},
     prelude::current_time,
     schedulers::{
         powersched::PowerSchedule, IndexesLenTimeMinimizerScheduler, StdWeightedScheduler,
     },
     stages::power::StdPowerMutationalStage,
-    state::StdState,
+    state::{HasMetadata, HasSolutions, StdState},
     Error, Evaluator,
 };
 use libafl::{
-    events::ProgressReporter,
+    events::{Event, EventFirer, ProgressReporter},
     prelude::{Cores, EventConfig, Launcher, LlmpRestartingEventManager},
 };
-use libafl::{
-    prelude::{ondisk::OnDiskMetadataFormat, CoreId},
-};
+use libafl::prelude::CoreId;
 use nix::sys::signal::Signal;
 use riscv_mutator::{
-    calibration::DummyCalibration,
-    causes::{list_causes, FUZZING_CAUSE_DIR_VAR},
+    batch::{channel_size, BatchChannel, BatchedMutationalStage, BATCH_SHM_ENV},
+    calibration::{CalibrationMode, ProgramCalibration},
+    checkpoint::{
+        hint_channel_size, CheckpointHintObserver, CHECKPOINT_MEMORY_ENV, CHECKPOINT_SHM_ENV,
+    },
+    causes::{FUZZER_PID_VAR, FUZZING_CAUSE_DIR_VAR},
     fuzz_ui::FuzzUI,
+    generator::InstructionSet,
+    hybrid_corpus::{flush_corpus_writes, HybridCorpus},
+    in_process::{InProcessSimExecutor, SimExecutor, SimLibrary},
+    input_store::INPUT_STORAGE_FORMAT_PACK,
     instructions::{
         riscv::{
             args,
@@ -51,37 +58,25 @@ use riscv_mutator::{
         },
         Argument, Instruction,
     },
+    isa::resolve_instruction_set,
+    logger::{flush_log, flush_log_on_exit, FuzzLogger, FUZZING_LOG_DIR_VAR},
+    map_size::{align_map_size, probe_map_size, DEFAULT_MAP_SIZE},
+    minimizer::{minimize_cause, CauseRedirect, MinimizationStage},
     monitor::HWFuzzMonitor,
-    mutator::{all_riscv_mutations},
+    mutation_scheduler::{
+        AdaptiveScheduledMutator, MutationSchedule, MutationStatsMetadata, MUTATION_STATS_NAME,
+    },
+    mutator::{parse_mutations, Mutation},
+    prefilter::{Prefilter, PrefilterMutator},
     program_input::ProgramInput,
+    seeds::{load_seeds, seed_shard, SeedCuller},
+    sparse_feedback::SparseMaxMapFeedback,
+    sync::{default_node_name, NodeSync},
 };
 
-use log::{LevelFilter, Metadata, Record};
-
-struct FuzzLogger;
-
-pub const FUZZING_LOG_DIR_VAR: &'static str = "FUZZING_LOG_DIR";
-
-impl log::Log for FuzzLogger {
-    fn enabled(&self, _metadata: &Metadata) -> bool {
-        true
-    }
-
-    fn log(&self, record: &Record) {
-        let log_dir = std::env::var(FUZZING_LOG_DIR_VAR).unwrap_or(".".to_owned());
-        let logfile = format!("{}/fuzzer-pid_{}.log", log_dir, process::id());
-        let mut dd = OpenOptions::new()
-            .append(true)
-            .create(true)
-            .open(logfile)
-            .expect("Failed to open log");
-        dd.write_all(format!("{:?}\n", record).as_bytes())
-            .expect("Failed to write log");
-    }
+use log::LevelFilter;
 
-    fn flush(&self) {}
-}
-static LOGGER: FuzzLogger = FuzzLogger;
+static LOGGER: FuzzLogger = FuzzLogger::new();
 
 #[derive(Parser, Debug)]
 #[command(author, version, about, long_about = None)]
@@ -97,16 +92,96 @@ struct Args {
     cores: String,
     #[arg(long, default_value_t = false)]
     log: bool,
+    /// Format of the logs in 'logs': 'text' or 'binary' (compact, read them
+    /// with fuzz-log).
+    #[arg(long, default_value = "text")]
+    log_format: String,
     #[arg(long, default_value_t = false)]
     save_inputs: bool,
+    /// How --save-inputs stores inputs: 'files' (one file per execution) or
+    /// 'pack' (deduplicated and packed into a few large files).
+    #[arg(long, default_value = "files")]
+    save_inputs_format: String,
     #[arg(short, long, default_value_t = false)]
     simple_ui: bool,
     #[arg(long, default_value = "explore")]
     scheduler: String,
+    /// Comma separated list of mutations to use (e.g. 'add,replace,remove')
+    /// or 'default' for the default mix.
     #[arg(long, default_value = "default")]
     mutations: String,
+    /// How mutations are picked: 'adaptive' (favor mutations that find new
+    /// coverage) or 'uniform' (fixed by --mutations).
+    #[arg(long, default_value = "adaptive")]
+    mutation_schedule: String,
+    /// The extensions that mutations generate instructions from, e.g. 'i',
+    /// 'imafd' or 'rv_i,rv64_m'.
+    #[arg(long, default_value = "i")]
+    isa: String,
+    /// File with per-instruction weights for the generator. Each line is
+    /// '<instruction|class:NAME|ext:NAME> <weight>'.
+    #[arg(long)]
+    isa_weights: Option<PathBuf>,
+    /// How often new corpus entries are executed to measure their run time
+    /// and find unstable coverage. 0 estimates the run time from the program
+    /// length and only runs each entry once.
+    #[arg(long, default_value_t = 0)]
+    calibration_runs: usize,
+    /// Memory (in MiB) each client may use for keeping its corpus in memory.
+    /// Entries beyond that are evicted and loaded from 'queue' when needed.
+    #[arg(long, default_value_t = 1024)]
+    corpus_memory: usize,
+    /// Shrink new corpus entries while they keep their coverage. Inputs
+    /// that trigger a cause are shrunk as well and stored in 'minimized'.
+    #[arg(long, default_value_t = false)]
+    minimize: bool,
     #[arg(long, default_value_t = 0)]
     port: u16,
+    /// Address (ip:port) of the broker on another machine. Connecting the
+    /// brokers shares all new corpus entries between the machines.
+    #[arg(long)]
+    remote_broker: Option<SocketAddr>,
+    /// Directory shared between the machines of a campaign (e.g. over NFS).
+    /// Corpus entries and causes are exchanged through it, which also makes
+    /// the found-all check see the causes of all machines.
+    #[arg(long)]
+    sync_dir: Option<PathBuf>,
+    /// Name of this machine in the --sync-dir. Defaults to the hostname.
+    #[arg(long)]
+    node_name: Option<String>,
+    /// Reuse the forkserver child for several inputs. The target has to use
+    /// the persistent loop from FuzzerAPI.h.
+    #[arg(long, default_value_t = false)]
+    persistent: bool,
+    /// Run up to this many mutated programs in one execution of the target.
+    /// The target has to iterate over them with FuzzingProgramIterator from
+    /// FuzzerAPI.h. --timeout applies to the whole batch.
+    #[arg(long, default_value_t = 1)]
+    batch: usize,
+    /// Memory (in MiB) the target may use for checkpoints of program
+    /// prefixes, 0 disables them. The target has to set the checkpoint hooks
+    /// from FuzzerAPI.h and run in --persistent mode.
+    #[arg(long, default_value_t = 0)]
+    checkpoint_memory: usize,
+    /// Size of the coverage map in bytes. 0 asks the target for the size its
+    /// instrumentation needs.
+    #[arg(long, default_value_t = 0)]
+    map_size: usize,
+    /// Run mutated programs in a fast RISC-V interpreter first and drop the
+    /// ones that jump out of the program, loop forever or repeat the trace
+    /// of a recent program. Programs running longer than this many
+    /// instructions count as looping. 0 disables the filter.
+    #[arg(long, default_value_t = 0)]
+    prefilter: usize,
+    /// Load the target as a shared library with the in-process interface
+    /// from FuzzerAPI.h instead of starting it with a forkserver. All
+    /// positional arguments are passed to SimFuzzerInitContext.
+    #[arg(long)]
+    in_process: Option<PathBuf>,
+    /// The number of simulator instances (one per thread) that every client
+    /// runs with --in-process. The programs of a batch run in parallel.
+    #[arg(long, default_value_t = 1)]
+    workers: usize,
 }
 
 pub fn main() {
@@ -123,9 +198,29 @@ pub fn main() {
     } else {
         LevelFilter::Warn
     };
+    match args.log_format.as_str() {
+        "text" => (),
+        "binary" => LOGGER.set_binary(true),
+        _ => {
+            println!(
+                "Unknown log format {:?}. Supported formats: text, binary",
+                args.log_format
+            );
+            return;
+        }
+    }
     log::set_logger(&LOGGER)
         .map(|()| log::set_max_level(fuzzing_level))
         .expect("Failed to setup logger.");
+    flush_log_on_exit();
+    // Keep the records (and corpus entries) that lead up to a panic.
+    let default_hook = panic::take_hook();
+    panic::set_hook(Box::new(move |info| {
+        log::error!("{}", info);
+        flush_log();
+        flush_corpus_writes();
+        default_hook(info);
+    }));
 
     if fs::create_dir(&out_dir).is_err() {
         if !out_dir.is_dir() {
@@ -145,6 +240,8 @@ pub fn main() {
     std::fs::File::create(start_time_marker).expect("Failed to create start time marker");
 
     std::env::set_var(FUZZING_CAUSE_DIR_VAR, cause_dir.as_os_str());
+    // The monitor interrupts us once all expected causes are found.
+    std::env::set_var(FUZZER_PID_VAR, process::id().to_string());
 
     // If asked to save inputs, set the environment variable so the driver can
     // save the inputs for us. Also see the FuzzerAPI.h header.
@@ -154,24 +251,102 @@ pub fn main() {
         std::fs::create_dir_all(inputs_dir.clone())
             .expect("Failed to create 'inputs' subdirectory directory.");
         std::env::set_var("INPUT_STORAGE", inputs_dir.as_os_str());
+        match args.save_inputs_format.as_str() {
+            "files" => (),
+            INPUT_STORAGE_FORMAT_PACK => {
+                std::env::set_var("INPUT_STORAGE_FORMAT", INPUT_STORAGE_FORMAT_PACK)
+            }
+            _ => {
+                println!(
+                    "Unknown input storage format {:?}. Supported formats: files, pack",
+                    args.save_inputs_format
+                );
+                return;
+            }
+        }
+    }
+
+    // See FuzzerCheckpoint.h.
+    if args.checkpoint_memory > 0 {
+        std::env::set_var(
+            CHECKPOINT_MEMORY_ENV,
+            (args.checkpoint_memory * 1024 * 1024).to_string(),
+        );
     }
 
     let mut queue_dir = out_dir.clone();
     queue_dir.push("queue");
 
+    let minimized_dir = if args.minimize {
+        let mut minimized_dir = out_dir.clone();
+        minimized_dir.push("minimized");
+        std::fs::create_dir_all(minimized_dir.clone())
+            .expect("Failed to create 'minimized' subdirectory.");
+        Some(minimized_dir)
+    } else {
+        None
+    };
+
     let in_dir = PathBuf::from(args.input);
     if !in_dir.is_dir() {
         println!("In dir at {:?} is not a valid directory!", &in_dir);
         return;
     }
+    let seeds = match load_seeds(&in_dir) {
+        Ok(seeds) => seeds,
+        Err(err) => {
+            println!("Failed to load seeds: {}", err);
+            return;
+        }
+    };
 
     let timeout = Duration::from_millis(args.timeout);
-    let executable = args.arguments.first().unwrap();
+    // In-process targets get all positional arguments, there is no
+    // executable to start.
+    let (executable, arguments) = match &args.in_process {
+        Some(library) => (library.to_string_lossy().into_owned(), &args.arguments[..]),
+        None => match args.arguments.split_first() {
+            Some((executable, arguments)) => (executable.clone(), arguments),
+            None => {
+                println!("No target given!");
+                return;
+            }
+        },
+    };
+    let in_process = match &args.in_process {
+        Some(library) => match SimLibrary::open(library) {
+            Ok(library) => Some(Arc::new(library)),
+            Err(err) => {
+                println!("{}", err);
+                return;
+            }
+        },
+        None => None,
+    };
     let debug_child = false;
     let simple_ui = args.simple_ui;
     let cores = Cores::from_cmdline(&args.cores.to_string()).expect("Failed to parse --cores arg");
     let signal = str::parse::<Signal>("SIGKILL").unwrap();
-    let arguments = &args.arguments[1..];
+
+    let map_size = if args.map_size != 0 {
+        align_map_size(args.map_size)
+    } else if let Some(library) = &in_process {
+        library
+            .map_size()
+            .map_or(DEFAULT_MAP_SIZE, align_map_size)
+    } else {
+        match probe_map_size(Path::new(&executable), arguments) {
+            Ok(size) => size,
+            Err(err) => {
+                println!(
+                    "{}, using a map of {} bytes. Set the size with --map-size.",
+                    err, DEFAULT_MAP_SIZE
+                );
+                DEFAULT_MAP_SIZE
+            }
+        }
+    };
+    log::info!("Coverage map size: {} bytes", map_size);
 
     let scheduler_map: HashMap<String, PowerSchedule> = HashMap::from([
         ("explore".to_owned(), PowerSchedule::EXPLORE),
@@ -188,6 +363,40 @@ pub fn main() {
         return;
     }
 
+    let mutations = match parse_mutations(&args.mutations) {
+        Ok(mutations) => mutations,
+        Err(err) => {
+            println!("{}", err);
+            return;
+        }
+    };
+    let mutation_schedule = match MutationSchedule::from_name(&args.mutation_schedule) {
+        Some(schedule) => schedule,
+        None => {
+            println!(
+                "Unknown mutation schedule {:?}. Supported schedules: adaptive, uniform",
+                args.mutation_schedule
+            );
+            return;
+        }
+    };
+    let insts = match resolve_instruction_set(&args.isa, args.isa_weights.as_deref()) {
+        Ok(insts) => Arc::new(insts),
+        Err(err) => {
+            println!("{}", err);
+            return;
+        }
+    };
+
+    let calibration = match args.calibration_runs {
+        0 => CalibrationMode::Estimate,
+        runs => CalibrationMode::Measure { runs },
+    };
+
+    let sync = args
+        .sync_dir
+        .map(|dir| (dir, args.node_name.unwrap_or_else(default_node_name)));
+
     let port = if args.port == 0 {
         None
     } else {
@@ -198,9 +407,9 @@ pub fn main() {
         out_dir,
         queue_dir,
         crashes,
-        &in_dir,
+        &seeds,
         timeout,
-        executable,
+        &executable,
         debug_child,
         signal,
         &arguments,
@@ -208,8 +417,24 @@ pub fn main() {
         simple_ui,
         scheduler.copied(),
         port,
+        args.persistent,
+        args.batch,
+        map_size,
+        args.prefilter,
+        args.checkpoint_memory > 0,
+        in_process,
+        args.workers,
+        &mutations,
+        mutation_schedule,
+        insts,
+        calibration,
+        args.corpus_memory * 1024 * 1024,
+        minimized_dir,
+        args.remote_broker,
+        sync,
     )
     .expect("An error occurred while fuzzing");
+    flush_log();
 }
 
 /// The actual fuzzer
@@ -217,7 +442,7 @@ fn fuzz(
     out_dir: PathBuf,
     base_corpus_dir: PathBuf,
     base_objective_dir: PathBuf,
-    _seed_dir: &PathBuf, // Currently unused because seed parsing not implemented.
+    seeds: &[ProgramInput],
     timeout: Duration,
     executable: &String,
     debug_child: bool,
@@ -227,10 +452,23 @@ fn fuzz(
     simple_ui: bool,
     schedule: Option<PowerSchedule>,
     port: Option<u16>,
+    persistent: bool,
+    batch_size: usize,
+    map_size: usize,
+    prefilter_steps: usize,
+    checkpoints: bool,
+    in_process: Option<Arc<SimLibrary>>,
+    workers: usize,
+    mutations: &[Mutation],
+    mutation_schedule: MutationSchedule,
+    insts: Arc<InstructionSet>,
+    calibration_mode: CalibrationMode,
+    corpus_memory: usize,
+    minimized_dir: Option<PathBuf>,
+    remote_broker: Option<SocketAddr>,
+    sync: Option<(PathBuf, String)>,
 ) -> Result<(), Error> {
-    let ui: Arc<Mutex<FuzzUI>> = Arc::new(Mutex::new(FuzzUI::new(simple_ui)));
-    const MAP_SIZE: usize = 2_621_440;
-    let start_time = current_time();
+    let ui = FuzzUI::new(simple_ui);
 
     let monitor = HWFuzzMonitor::new(
         ui,
@@ -240,20 +478,34 @@ fn fuzz(
             .to_owned(),
     );
 
+    // Only the first client of every machine talks to the other machines.
+    let sync_core = *cores.ids.first().unwrap();
+    let cause_dir = PathBuf::from(
+        std::env::var(FUZZING_CAUSE_DIR_VAR).expect("Cause dir env var not set?"),
+    );
+
     let shmem_provider = UnixShMemProvider::new().expect("Failed to init shared memory");
     let mut shmem_provider_client = shmem_provider.clone();
 
     let mut run_client =
         |_state: Option<_>, mut mgr: LlmpRestartingEventManager<_, _>, core_id: CoreId| {
             // The coverage map shared between observer and executor
-            let mut shmem = shmem_provider_client.new_shmem(MAP_SIZE).unwrap();
+            let mut shmem = shmem_provider_client.new_shmem(map_size).unwrap();
 
             // let the forkserver know the shmid
             shmem.write_to_env("__AFL_SHM_ID").unwrap();
+            // The in-process executor writes the coverage into the map through
+            // a second mapping.
+            let coverage_view = match &in_process {
+                Some(_) => {
+                    Some(shmem_provider_client.shmem_from_id_and_size(shmem.id(), map_size)?)
+                }
+                None => None,
+            };
             let shmem_buf = shmem.as_mut_slice();
 
-            // To let know the AFL++ binary that we have a big map
-            std::env::set_var("AFL_MAP_SIZE", format!("{}", MAP_SIZE));
+            // Let the AFL++ runtime know how big the map is
+            std::env::set_var("AFL_MAP_SIZE", format!("{}", map_size));
 
             // Create an observation channel using the hitcounts map of AFL++
             let edges_observer =
@@ -262,9 +514,72 @@ fn fuzz(
             // Create an observation channel to keep track of the execution time
             let time_observer = TimeObserver::new("time");
 
-            let map_feedback = MaxMapFeedback::tracking(&edges_observer, true, false);
+            // Tells the target which program prefixes are worth a checkpoint.
+            let mut hint_shmem = if checkpoints {
+                let mut hint_shmem = shmem_provider_client
+                    .new_shmem(hint_channel_size())
+                    .unwrap();
+                hint_shmem.write_to_env(CHECKPOINT_SHM_ENV).unwrap();
+                Some(hint_shmem)
+            } else {
+                None
+            };
+            let hint_observer = CheckpointHintObserver::new(
+                "checkpoint_hints",
+                hint_shmem.as_mut().map(|shmem| shmem.as_mut_slice()),
+            );
+
+            // Only compares the hit entries of the map with the history.
+            let map_feedback = SparseMaxMapFeedback::new(&edges_observer);
+
+            let calibration =
+                ProgramCalibration::new(&map_feedback, &time_observer, calibration_mode);
 
-            let calibration = DummyCalibration::new(&map_feedback);
+            let minimization = MinimizationStage::new(&map_feedback, minimized_dir.is_some());
+
+            // The cause minimizer has the target save the causes of its
+            // candidates in a scratch dir of this client.
+            let mut cause_redirect = match &minimized_dir {
+                Some(_) => {
+                    let mut scratch_dir = out_dir.join("cause_scratch");
+                    scratch_dir.push(format!("{}", core_id.0));
+                    let flag = shmem_provider_client.new_shmem(4)?;
+                    Some(CauseRedirect::new(flag, scratch_dir)?)
+                }
+                None => None,
+            };
+
+            let seed_culler = SeedCuller::new(&map_feedback);
+
+            // The per-program coverage of batched executions.
+            let mut batch_view = None;
+            let batch_channel = if batch_size > 1 {
+                let mut batch_shmem = shmem_provider_client
+                    .new_shmem(channel_size(batch_size))
+                    .unwrap();
+                batch_shmem.write_to_env(BATCH_SHM_ENV).unwrap();
+                // The in-process executor reports the programs of a batch
+                // in place of the harness.
+                if in_process.is_some() {
+                    batch_view = Some(
+                        shmem_provider_client
+                            .shmem_from_id_and_size(batch_shmem.id(), batch_shmem.len())?,
+                    );
+                }
+                Some(BatchChannel::new(batch_shmem).map_err(Error::illegal_argument)?)
+            } else {
+                None
+            };
+            let mutator = PrefilterMutator::new(
+                AdaptiveScheduledMutator::new(mutation_schedule, mutations, insts.clone()),
+                (prefilter_steps > 0).then(|| Prefilter::new(prefilter_steps)),
+            );
+            let power = BatchedMutationalStage::new(
+                StdPowerMutationalStage::new(mutator),
+                &map_feedback,
+                batch_channel,
+                batch_size,
+            );
 
             // Feedback to rate the interestingness of an input
             // This one is composed by two Feedbacks in OR
@@ -279,6 +594,7 @@ fn fuzz(
             // writing the corpus to disk.
             let mut corpus_dir = base_corpus_dir.clone();
             corpus_dir.push(format!("{}", core_id.0));
+            let sync_corpus_dir = corpus_dir.clone();
             let mut objective_dir = base_objective_dir.clone();
             objective_dir.push(format!("{}", core_id.0));
 
@@ -288,21 +604,13 @@ fn fuzz(
             // Create the fuzz state.
             let mut state = StdState::new(
                 StdRand::with_seed(current_nanos()),
-                OnDiskCorpus::<ProgramInput>::with_meta_format(
-                    corpus_dir,
-                    OnDiskMetadataFormat::Postcard,
-                )
-                .unwrap(),
+                HybridCorpus::new(corpus_dir, corpus_memory).unwrap(),
                 OnDiskCorpus::new(objective_dir).unwrap(),
                 &mut feedback,
                 &mut objective,
             )
             .unwrap();
 
-            let mutator = StdScheduledMutator::new(all_riscv_mutations());
-
-            let power = StdPowerMutationalStage::new(mutator);
-
             // A minimization+queue policy to get testcasess from the corpus
             let scheduler = IndexesLenTimeMinimizerScheduler::new(
                 StdWeightedScheduler::with_schedule(&mut state, &edges_observer, schedule),
@@ -311,47 +619,90 @@ fn fuzz(
             // A fuzzer with feedbacks and a corpus scheduler
             let mut fuzzer = StdFuzzer::new(scheduler, feedback, objective);
 
-            let forkserver = ForkserverExecutor::builder()
-                .program(executable.clone())
-                .debug_child(debug_child)
-                .parse_afl_cmdline(arguments)
-                .coverage_map_size(MAP_SIZE)
-                .is_persistent(false)
-                .is_deferred_frksrv(true)
-                .build_dynamic_map(edges_observer, tuple_list!(time_observer))
-                .unwrap();
-
-            let mut executor = TimeoutForkserverExecutor::with_signal(forkserver, timeout, signal)
-                .expect("Failed to create the executor.");
-
-            // Load the initial seeds from the user directory.
-            // state
-            //     .load_initial_inputs(&mut fuzzer, &mut executor, &mut mgr, &[seed_dir.clone()])
-            //     .unwrap_or_else(|_| {
-            //         println!("Failed to load initial corpus at {:?}", &seed_dir);
-            //         process::exit(0);
-            //     });
-
-            let nop = Instruction::new(
-                &ADDI,
-                vec![
-                    Argument::new(&args::RD, 0u32),
-                    Argument::new(&args::RS1, 0u32),
-                    Argument::new(&args::IMM12, 0u32),
-                ],
-            );
-
-            let init = ProgramInput::new([nop].to_vec());
-            fuzzer
-                .add_input(&mut state, &mut executor, &mut mgr, init)
-                .expect("Failed to load initial inputs");
+            let mut executor = match &in_process {
+                Some(library) => SimExecutor::InProcess(InProcessSimExecutor::new(
+                    library.clone(),
+                    workers,
+                    arguments,
+                    tuple_list!(edges_observer, time_observer, hint_observer),
+                    coverage_view.unwrap(),
+                    batch_view,
+                    timeout,
+                    Some(cause_dir.clone()),
+                    cause_redirect
+                        .as_ref()
+                        .map(|redirect| redirect.second_mapping(&mut shmem_provider_client))
+                        .transpose()?,
+                )?),
+                None => {
+                    let forkserver = ForkserverExecutor::builder()
+                        .program(executable.clone())
+                        .debug_child(debug_child)
+                        .parse_afl_cmdline(arguments)
+                        .coverage_map_size(map_size)
+                        // Deliver test cases via shared memory if the target
+                        // supports it (see FUZZER_API_INIT in FuzzerAPI.h).
+                        // Otherwise the forkserver falls back to writing the
+                        // '@@' file.
+                        .shmem_provider(&mut shmem_provider_client)
+                        .is_persistent(persistent)
+                        .is_deferred_frksrv(true)
+                        // Truncates the map to the size the forkserver reports.
+                        .build_dynamic_map(
+                            edges_observer,
+                            tuple_list!(time_observer, hint_observer),
+                        )
+                        .unwrap();
+
+                    SimExecutor::Forkserver(
+                        TimeoutForkserverExecutor::with_signal(forkserver, timeout, signal)
+                            .expect("Failed to create the executor."),
+                    )
+                }
+            };
+
+            // Load this client's share of the initial seeds from the user
+            // directory, keeping only the ones needed to cover the same map
+            // entries. They are added with the coverage of the culling run.
+            let client = cores.ids.iter().position(|id| *id == core_id).unwrap_or(0);
+            let shard = seed_shard(seeds, client, cores.ids.len());
+            let culled =
+                seed_culler.cull(&mut fuzzer, &mut executor, &mut state, &mut mgr, &shard)?;
+            let added =
+                seed_culler.add_culled(&mut fuzzer, &mut executor, &mut state, &mut mgr, culled)?;
+            log::info!("Keeping {} of {} seeds", added, shard.len());
+
+            // Without any seeds start from a single nop.
+            if added == 0 {
+                let nop = Instruction::new(
+                    &ADDI,
+                    vec![
+                        Argument::new(&args::RD, 0u32),
+                        Argument::new(&args::RS1, 0u32),
+                        Argument::new(&args::IMM12, 0u32),
+                    ],
+                );
+                fuzzer
+                    .add_input(&mut state, &mut executor, &mut mgr, ProgramInput::new(vec![nop]))
+                    .expect("Failed to load initial inputs");
+            }
 
-            // First calibrate the initial seed and then mutate.
-            let mut stages = tuple_list!(calibration, power);
+            // First minimize and calibrate new entries and then mutate.
+            let mut stages = tuple_list!(minimization, calibration, power);
 
             // Main fuzzing loop.
             let mut last = current_time();
             let monitor_timeout = Duration::from_secs(1);
+            let mut node_sync = match &sync {
+                Some((sync_dir, node)) if core_id == sync_core => {
+                    Some(NodeSync::new(sync_dir, node).map_err(Error::illegal_argument)?)
+                }
+                _ => None,
+            };
+            // The last solution that was handed to the cause minimizer.
+            let mut last_solution: Option<CorpusId> = None;
+            // The progress report time of the last sync with other machines.
+            let mut synced = last;
 
             loop {
                 let fuzz_err = fuzzer.fuzz_one(&mut stages, &mut executor, &mut state, &mut mgr);
@@ -362,13 +713,82 @@ fn fuzz(
                 if last_err.is_err() {
                     log::error!("last_err error: {}", last_err.err().unwrap());
                 } else {
-                    last = last_err.ok().unwrap()
+                    let reported = last_err.ok().unwrap();
+                    // Send the mutation stats along with the regular progress.
+                    if reported != last {
+                        let summary = state
+                            .metadata_map()
+                            .get::<MutationStatsMetadata>()
+                            .map(|stats| stats.summary());
+                        if let Some(summary) = summary {
+                            let stats_event = Event::UpdateUserStats {
+                                name: MUTATION_STATS_NAME.to_owned(),
+                                value: UserStats::String(summary),
+                                phantom: PhantomData,
+                            };
+                            if let Err(err) = mgr.fire(&mut state, stats_event) {
+                                log::error!("Failed to report mutation stats: {}", err);
+                            }
+                        }
+                    }
+                    last = reported
+                }
+
+                // Exchange corpus entries and causes with other machines at
+                // the same rate as the progress reports.
+                if let Some(node_sync) = node_sync.as_mut().filter(|_| synced != last) {
+                    synced = last;
+                    if let Err(err) = node_sync.export_corpus(&sync_corpus_dir) {
+                        log::error!("Failed to export corpus: {}", err);
+                    }
+                    for input in node_sync.import_corpus() {
+                        if let Err(err) =
+                            fuzzer.evaluate_input(&mut state, &mut executor, &mut mgr, input)
+                        {
+                            log::error!("Failed to evaluate synced input: {}", err);
+                        }
+                    }
+                    if let Err(err) = node_sync.export_causes(&cause_dir) {
+                        log::error!("Failed to export causes: {}", err);
+                    }
+                    if let Err(err) = node_sync.import_causes(&cause_dir) {
+                        log::error!("Failed to import causes: {}", err);
+                    }
                 }
 
-                // If we have a simple UI, we need to manually list all causes
-                // to check if we found all bugs.
-                if simple_ui {
-                    list_causes(start_time);
+                if let (Some(minimized_dir), Some(cause_redirect)) =
+                    (&minimized_dir, cause_redirect.as_mut())
+                {
+                    loop {
+                        let next = match last_solution {
+                            None => state.solutions().first(),
+                            Some(id) => state.solutions().next(id),
+                        };
+                        let id = match next {
+                            Some(id) => id,
+                            None => break,
+                        };
+                        last_solution = Some(id);
+                        let input = state
+                            .solutions()
+                            .get(id)?
+                            .borrow_mut()
+                            .load_input(state.solutions())?
+                            .clone();
+                        match minimize_cause(
+                            &mut fuzzer,
+                            &mut executor,
+                            &mut state,
+                            &mut mgr,
+                            &input,
+                            minimized_dir,
+                            cause_redirect,
+                        ) {
+                            Ok(Some(path)) => log::info!("Minimized cause into {:?}", path),
+                            Ok(None) => (),
+                            Err(err) => log::error!("Failed to minimize cause: {}", err),
+                        }
+                    }
                 }
             }
         };
@@ -389,6 +809,7 @@ fn fuzz(
         .monitor(monitor)
         .serialize_state(false)
         .broker_port(actual_port)
+        .remote_broker_addr(remote_broker)
         .run_client(&mut run_client);
 
     let mut launcher_log_file = out_dir.clone();
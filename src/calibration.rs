@@ -3,20 +3,25 @@ use alloc::string::{String, ToString};
 use core::{fmt::Debug, marker::PhantomData, time::Duration};
 
 use hashbrown::HashSet;
+use num_traits::Bounded;
 
 use serde::{Deserialize, Serialize};
 
+#[cfg(feature = "introspection")]
+use libafl::monitors::PerfFeature;
 use libafl::{
-    bolts::{tuples::Named, AsIter},
+    bolts::{current_time, tuples::Named, AsIter},
     corpus::{Corpus, CorpusId, SchedulerTestcaseMetadata},
     events::{EventFirer, LogSeverity},
     executors::{Executor, ExitKind, HasObservers},
-    feedbacks::HasObserverName,
+    feedbacks::{HasObserverName, MapFeedbackMetadata},
     fuzzer::Evaluator,
     inputs::UsesInput,
-    observers::{MapObserver, ObserversTuple, UsesObserver},
+    mark_feature_time,
+    observers::{MapObserver, ObserversTuple, TimeObserver, UsesObserver},
     schedulers::powersched::SchedulerMetadata,
     stages::Stage,
+    start_timer,
     state::{HasClientPerfMonitor, HasCorpus, HasMetadata, HasNamedMetadata, UsesState},
     Error,
 };
@@ -56,21 +61,36 @@ impl UnstableEntriesMetadata {
     }
 }
 
+/// How the calibration stage determines the cost of a corpus entry.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum CalibrationMode {
+    /// Run the entry once and estimate its execution time from the number of
+    /// instructions. Cheap, but knows nothing about the real simulation cost.
+    Estimate,
+    /// Run the entry the given number of times, use the average time
+    /// measured by the `TimeObserver` and record map entries that differ
+    /// between runs as unstable.
+    Measure { runs: usize },
+}
+
 /// The calibration stage will measure the average exec time and the target's stability for this input.
 #[derive(Clone, Debug)]
-pub struct DummyCalibration<O, OT, S> {
+pub struct ProgramCalibration<O, OT, S> {
     map_observer_name: String,
+    map_feedback_name: String,
+    time_observer_name: String,
+    mode: CalibrationMode,
     phantom: PhantomData<(O, OT, S)>,
 }
 
-impl<O, OT, S> UsesState for DummyCalibration<O, OT, S>
+impl<O, OT, S> UsesState for ProgramCalibration<O, OT, S>
 where
     S: UsesInput,
 {
     type State = S;
 }
 
-impl<E, EM, O, OT, Z> Stage<E, EM, Z> for DummyCalibration<O, OT, E::State>
+impl<E, EM, O, OT, Z> Stage<E, EM, Z> for ProgramCalibration<O, OT, E::State>
 where
     E: Executor<EM, Z> + HasObservers<Observers = OT>,
     EM: EventFirer<State = E::State>,
@@ -98,34 +118,90 @@ where
             }
         }
 
-        // We only ran our program once.
-        let iter = 1;
+        let iter = match self.mode {
+            CalibrationMode::Estimate => 1,
+            CalibrationMode::Measure { runs } => runs.max(1),
+        };
 
+        start_timer!(state);
         let input = state
             .corpus()
             .get(corpus_idx)?
             .borrow_mut()
             .load_input(state.corpus())?
             .clone();
+        mark_feature_time!(state, PerfFeature::GetInputFromCorpus);
 
-        executor.observers_mut().pre_exec_all(state, &input)?;
+        let mut measured_time = Duration::ZERO;
+        let mut first_map: Option<Vec<O::Entry>> = None;
+        let mut unstable_entries = HashSet::<usize>::new();
+        let mut map_len = 0;
+        for _ in 0..iter {
+            start_timer!(state);
+            executor.observers_mut().pre_exec_all(state, &input)?;
+            mark_feature_time!(state, PerfFeature::PreExecObservers);
 
-        let exit_kind = executor.run_target(fuzzer, state, mgr, &input)?;
-        if exit_kind != ExitKind::Ok {
-            mgr.log(
-                state,
-                LogSeverity::Warn,
-                "Corpus entry errored on execution!".into(),
-            )?;
-        };
+            start_timer!(state);
+            let start = current_time();
+            let exit_kind = executor.run_target(fuzzer, state, mgr, &input)?;
+            let wall_time = current_time() - start;
+            mark_feature_time!(state, PerfFeature::TargetExecution);
+            if exit_kind != ExitKind::Ok {
+                mgr.log(
+                    state,
+                    LogSeverity::Warn,
+                    "Corpus entry errored on execution!".into(),
+                )?;
+            };
+
+            start_timer!(state);
+            executor
+                .observers_mut()
+                .post_exec_all(state, &input, &exit_kind)?;
+            mark_feature_time!(state, PerfFeature::PostExecObservers);
+
+            if self.mode == CalibrationMode::Estimate {
+                break;
+            }
 
-        executor
-            .observers_mut()
-            .post_exec_all(state, &input, &exit_kind)?;
+            // Prefer the observer's time, which doesn't include our overhead.
+            let run_time = executor
+                .observers()
+                .match_name::<TimeObserver>(&self.time_observer_name)
+                .and_then(|observer| *observer.last_runtime())
+                .unwrap_or(wall_time);
+            measured_time += run_time;
 
-        // Estimate duration based on number of instructions.
-        let program: ProgramInput = input.into();
-        let total_time = Duration::from_secs((program.insts().len() + 1) as u64);
+            let map = executor
+                .observers()
+                .match_name::<O>(&self.map_observer_name)
+                .ok_or_else(|| Error::key_not_found("MapObserver not found".to_string()))?;
+            let current_map = map.to_vec();
+            map_len = current_map.len();
+            match &first_map {
+                None => first_map = Some(current_map),
+                Some(first) => {
+                    for (idx, (a, b)) in first.iter().zip(current_map.iter()).enumerate() {
+                        if a != b {
+                            unstable_entries.insert(idx);
+                        }
+                    }
+                }
+            }
+        }
+
+        let total_time = match self.mode {
+            // Estimate duration based on number of instructions.
+            CalibrationMode::Estimate => {
+                let program: ProgramInput = input.into();
+                Duration::from_secs((program.insts().len() + 1) as u64)
+            }
+            CalibrationMode::Measure { .. } => measured_time,
+        };
+
+        if !unstable_entries.is_empty() {
+            self.mark_unstable(state, &unstable_entries, map_len);
+        }
 
         // If weighted scheduler or powerscheduler is used, update it
         if state.has_metadata::<SchedulerMetadata>() {
@@ -186,21 +262,57 @@ where
     }
 }
 
-impl<O, OT, S> DummyCalibration<O, OT, S>
+impl<O, OT, S> ProgramCalibration<O, OT, S>
 where
     O: MapObserver,
     OT: ObserversTuple<S>,
     S: HasCorpus + HasMetadata + HasNamedMetadata,
 {
     #[must_use]
-    pub fn new<F>(map_feedback: &F) -> Self
+    pub fn new<F>(map_feedback: &F, time_observer: &TimeObserver, mode: CalibrationMode) -> Self
     where
         F: HasObserverName + Named + UsesObserver<S, Observer = O>,
         for<'it> O: AsIter<'it, Item = O::Entry>,
     {
         Self {
             map_observer_name: map_feedback.observer_name().to_string(),
+            map_feedback_name: map_feedback.name().to_string(),
+            time_observer_name: time_observer.name().to_string(),
+            mode,
             phantom: PhantomData,
         }
     }
+
+    /// Records the given map entries as unstable and makes the map feedback
+    /// ignore them from now on.
+    fn mark_unstable(&self, state: &mut S, unstable_entries: &HashSet<usize>, map_len: usize)
+    where
+        for<'de> O::Entry: Serialize + Deserialize<'de> + 'static,
+    {
+        // Setting the history to the maximum value means that no future value
+        // of these entries is ever considered novel.
+        if let Some(feedback_state) = state
+            .named_metadata_map_mut()
+            .get_mut::<MapFeedbackMetadata<O::Entry>>(&self.map_feedback_name)
+        {
+            for idx in unstable_entries {
+                if let Some(entry) = feedback_state.history_map.get_mut(*idx) {
+                    *entry = O::Entry::max_value();
+                }
+            }
+        }
+
+        if let Some(meta) = state
+            .metadata_map_mut()
+            .get_mut::<UnstableEntriesMetadata>()
+        {
+            meta.unstable_entries
+                .extend(unstable_entries.iter().copied());
+        } else {
+            state.add_metadata(UnstableEntriesMetadata::new(
+                unstable_entries.clone(),
+                map_len,
+            ));
+        }
+    }
 }
@@ -1,24 +1,33 @@
 use std::{
-    collections::HashSet,
+    collections::{BTreeSet, HashSet},
+    ffi::OsString,
     fs::File,
     io::{BufRead, BufReader, Write},
-    path::Path,
-    process::Command,
+    path::{Path, PathBuf},
     time::{Duration, UNIX_EPOCH},
 };
 
+use nix::{
+    sys::{
+        inotify::{AddWatchFlags, InitFlags, Inotify},
+        signal::{kill, Signal},
+    },
+    unistd::{getpgid, Pid},
+};
+
 pub const FUZZING_CAUSE_DIR_VAR: &'static str = "FUZZING_CAUSE_DIR";
 pub const FUZZING_EXPECTED_LIST_VAR: &'static str = "FUZZING_EXPECTED_LIST";
+/// The pid of the process that should be interrupted once all expected
+/// causes were found (i.e., the process running the launcher).
+pub const FUZZER_PID_VAR: &'static str = "SIM_FUZZER_PID";
 
 pub struct TestCaseData {
     pub cause: String,
     pub time_to_exposure: Duration,
 }
 
-fn get_found_all_path() -> String {
-    let cause_dir =
-        std::env::var(FUZZING_CAUSE_DIR_VAR).expect("Driver failed to set cause env var?");
-    cause_dir + "/../found_all"
+fn get_found_all_path(cause_dir: &Path) -> PathBuf {
+    cause_dir.join("..").join("found_all")
 }
 
 fn get_expected() -> HashSet<String> {
@@ -33,55 +42,171 @@ fn get_expected() -> HashSet<String> {
         .collect()
 }
 
-pub struct CausesList {
-    pub found: Vec<TestCaseData>,
-    pub still_missing: Vec<String>,
+/// Keeps track of the causes in the cause directory. The directory is only
+/// scanned once, afterwards new files are picked up through inotify (or by
+/// only looking at new file names if inotify is not available). Once all
+/// expected causes are found, the results are written to 'found_all' and
+/// the fuzzer is asked to stop.
+pub struct CauseTracker {
+    cause_dir: PathBuf,
+    start_time: Duration,
+    /// File names in the cause dir that were already processed.
+    seen: HashSet<OsString>,
+    /// All found causes sorted by their time to exposure.
+    found: Vec<TestCaseData>,
+    still_missing: BTreeSet<String>,
+    watch: Option<Inotify>,
+    stop_pid: Option<Pid>,
+    reported_all: bool,
 }
 
-pub fn list_causes(start_time: std::time::Duration) -> CausesList {
-    let cause_dir =
-        std::env::var(FUZZING_CAUSE_DIR_VAR).expect("Driver failed to set cause env var?");
+impl CauseTracker {
+    /// Creates a tracker for the cause dir and expected list set in the
+    /// environment by the fuzzer.
+    pub fn new(start_time: Duration) -> Self {
+        let cause_dir =
+            std::env::var(FUZZING_CAUSE_DIR_VAR).expect("Driver failed to set cause env var?");
+        let stop_pid = std::env::var(FUZZER_PID_VAR)
+            .ok()
+            .and_then(|pid| pid.parse::<i32>().ok())
+            .map(Pid::from_raw);
+        Self::with_paths(
+            PathBuf::from(cause_dir),
+            get_expected(),
+            start_time,
+            stop_pid,
+        )
+    }
 
-    let causes = std::fs::read_dir(Path::new(&cause_dir)).expect("Failed to read causes dir");
+    pub fn with_paths(
+        cause_dir: PathBuf,
+        expected: HashSet<String>,
+        start_time: Duration,
+        stop_pid: Option<Pid>,
+    ) -> Self {
+        // Start watching before the scan so no cause falls in between.
+        let watch = Inotify::init(InitFlags::IN_NONBLOCK | InitFlags::IN_CLOEXEC)
+            .ok()
+            .filter(|inotify| {
+                inotify
+                    .add_watch(
+                        &cause_dir,
+                        AddWatchFlags::IN_CLOSE_WRITE | AddWatchFlags::IN_MOVED_TO,
+                    )
+                    .is_ok()
+            });
+        let mut result = Self {
+            cause_dir,
+            start_time,
+            seen: HashSet::new(),
+            found: Vec::new(),
+            still_missing: expected.into_iter().collect(),
+            watch,
+            stop_pid,
+            reported_all: false,
+        };
+        result.rescan();
+        result
+    }
 
-    let mut expected = get_expected();
+    /// All found causes sorted by their time to exposure.
+    pub fn found(&self) -> &[TestCaseData] {
+        &self.found
+    }
 
-    let mut case_list = Vec::<TestCaseData>::new();
-    for cause_or_err in causes {
-        let cause = cause_or_err.unwrap();
-        let creation_time = cause.metadata().unwrap().created().unwrap();
-        let creation_unix_time = creation_time.duration_since(UNIX_EPOCH).unwrap();
-        let diff_time = creation_unix_time - start_time;
-
-        let filename = cause.file_name().into_string().unwrap();
-        let cause_str = filename
-            .split("%")
-            .nth(0)
-            .or(Some("Bad cause name"))
-            .unwrap();
-        let display_str = cause_str.replace("_", " ");
+    /// The expected causes that weren't found yet in alphabetical order.
+    pub fn still_missing(&self) -> impl Iterator<Item = &String> {
+        self.still_missing.iter()
+    }
 
-        expected.remove(&display_str);
+    /// Processes all causes added since the last call. Returns the number of
+    /// new causes.
+    pub fn update(&mut self) -> usize {
+        let before = self.found.len();
+        match self.watch.as_ref().map(|watch| watch.read_events()) {
+            None => self.rescan(),
+            Some(Ok(events)) => {
+                let overflow = events
+                    .iter()
+                    .any(|event| event.mask.contains(AddWatchFlags::IN_Q_OVERFLOW));
+                if overflow {
+                    self.rescan();
+                } else {
+                    for name in events.into_iter().filter_map(|event| event.name) {
+                        self.add(name);
+                    }
+                }
+            }
+            // EAGAIN just means there are no new events.
+            Some(Err(nix::errno::Errno::EAGAIN)) => (),
+            Some(Err(_)) => {
+                self.watch = None;
+                self.rescan();
+            }
+        }
+        if self.still_missing.is_empty() && !self.reported_all {
+            self.reported_all = true;
+            self.report_found_all();
+        }
+        self.found.len() - before
+    }
 
-        case_list.push(TestCaseData {
-            cause: display_str.to_string(),
-            time_to_exposure: diff_time,
-        })
+    /// Looks for files that we haven't seen yet.
+    fn rescan(&mut self) {
+        let causes = std::fs::read_dir(&self.cause_dir).expect("Failed to read causes dir");
+        for cause in causes.filter_map(|cause| cause.ok()) {
+            self.add(cause.file_name());
+        }
     }
 
-    case_list.sort_by_key(|t| t.time_to_exposure);
+    fn add(&mut self, filename: OsString) {
+        // Hidden files are temporary files of the corpus sync.
+        if filename.to_string_lossy().starts_with('.') {
+            return;
+        }
+        if !self.seen.insert(filename.clone()) {
+            return;
+        }
+        let path = self.cause_dir.join(&filename);
+        // Not every file system (e.g. tmpfs) records the creation time.
+        let creation_time = match path
+            .metadata()
+            .and_then(|m| m.created().or_else(|_| m.modified()))
+        {
+            Ok(time) => time,
+            // Removed again before we got to it.
+            Err(_) => {
+                self.seen.remove(&filename);
+                return;
+            }
+        };
+        let creation_unix_time = creation_time.duration_since(UNIX_EPOCH).unwrap();
+        let time_to_exposure = creation_unix_time.saturating_sub(self.start_time);
+
+        let filename = filename.to_string_lossy();
+        let cause_str = filename.split("%").nth(0).unwrap_or("Bad cause name");
+        let display_str = cause_str.replace("_", " ");
 
-    let mut missing = Vec::<String>::new();
-    for m in expected {
-        missing.push(m);
+        self.still_missing.remove(&display_str);
+
+        let pos = self
+            .found
+            .partition_point(|case| case.time_to_exposure <= time_to_exposure);
+        self.found.insert(
+            pos,
+            TestCaseData {
+                cause: display_str,
+                time_to_exposure,
+            },
+        );
     }
-    missing.sort();
 
-    if missing.is_empty() {
-        let mut results =
-            File::create(get_found_all_path()).expect("Failed to create found_all_path");
+    /// Writes all found causes to the 'found_all' file and stops the fuzzer.
+    fn report_found_all(&self) {
+        let mut results = File::create(get_found_all_path(&self.cause_dir))
+            .expect("Failed to create found_all_path");
 
-        for case in &case_list {
+        for case in &self.found {
             results
                 .write_all(
                     format!("{} $ {}\n", case.time_to_exposure.as_secs(), case.cause).as_bytes(),
@@ -90,17 +215,56 @@ pub fn list_causes(start_time: std::time::Duration) -> CausesList {
         }
         results.flush().expect("Failed to flush results file");
 
-        // Run killall to stop the fuzzer.
-        // FIXME: That cann't be the only way to stop the fuzzer, but it seems
-        // it is...
-        Command::new("killall")
-            .arg("sim-fuzzer")
-            .spawn()
-            .expect("Failed to stop sim-fuzzer:");
+        // Interrupt the process group of the launcher (with the broker and
+        // all clients) like Ctrl-C does. That's only its own group if it
+        // leads it (e.g. when started from an interactive shell), otherwise
+        // it could be a script or CI job. Then only interrupt the launcher
+        // and leave stopping the clients to its shutdown.
+        if let Some(pid) = self.stop_pid {
+            let target = match getpgid(Some(pid)) {
+                Ok(pgid) if pgid == pid => Pid::from_raw(-pid.as_raw()),
+                _ => pid,
+            };
+            if let Err(err) = kill(target, Signal::SIGINT) {
+                log::error!("Failed to stop the fuzzer: {}", err);
+            }
+        }
     }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{collections::HashSet, fs, time::Duration};
+
+    use super::CauseTracker;
+
+    #[test]
+    fn track_new_causes() {
+        let dir = std::env::temp_dir().join(format!("riscv-causes-{}", std::process::id()));
+        let causes = dir.join("causes");
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&causes).unwrap();
+        fs::write(causes.join("bug_a%0000000000000001"), b"").unwrap();
+
+        let expected: HashSet<String> = ["bug a", "bug b", "bug c"]
+            .iter()
+            .map(|s| s.to_string())
+            .collect();
+        let mut tracker = CauseTracker::with_paths(causes.clone(), expected, Duration::ZERO, None);
+        assert_eq!(tracker.found().len(), 1);
+
+        fs::write(causes.join("bug_b%0000000000000002"), b"").unwrap();
+        fs::write(causes.join("bug_b%0000000000000003"), b"").unwrap();
+        assert_eq!(tracker.update(), 2);
+        assert_eq!(tracker.update(), 0);
+        assert_eq!(tracker.found().len(), 3);
+        assert_eq!(tracker.still_missing().collect::<Vec<_>>(), vec!["bug c"]);
+        assert!(!dir.join("found_all").exists());
+
+        fs::write(causes.join("bug_c%0000000000000004"), b"").unwrap();
+        assert_eq!(tracker.update(), 1);
+        assert!(dir.join("found_all").exists());
 
-    CausesList {
-        found: case_list,
-        still_missing: missing,
+        fs::remove_dir_all(dir).unwrap();
     }
 }
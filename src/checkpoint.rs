@@ -0,0 +1,151 @@
+//! Hints for the prefix checkpoints of the harness (see FuzzerCheckpoint.h).
+//! Before every execution the harness is told how much of every program is
+//! shared with the corpus entry it was mutated from. Only checkpoints within
+//! that prefix are saved, as only they will be seen again by the next
+//! mutations of the same entry.
+extern crate alloc;
+use alloc::string::{String, ToString};
+
+use libafl::{
+    bolts::{ownedref::OwnedMutSlice, tuples::Named, AsMutSlice},
+    corpus::{Corpus, CorpusId},
+    inputs::UsesInput,
+    observers::Observer,
+    state::HasCorpus,
+    Error,
+};
+use serde::{Deserialize, Serialize};
+
+use crate::{batch::split_programs, program_input::ProgramInput};
+
+/// The env var with the id of the shared memory for the hints.
+pub const CHECKPOINT_SHM_ENV: &str = "SIM_CHECKPOINT_SHM_ID";
+/// The env var with the memory (in bytes) the harness may use for checkpoints.
+pub const CHECKPOINT_MEMORY_ENV: &str = "SIM_CHECKPOINT_MEMORY";
+/// Programs of a batch beyond this many get no checkpoints.
+const MAX_HINTS: usize = 4096;
+
+/// Returns the bytes of the shared memory for the hints.
+pub fn hint_channel_size() -> usize {
+    4 * (MAX_HINTS + 1)
+}
+
+/// Returns how many bytes (in whole instructions) both programs start with.
+/// This is measured on the encoding, so it covers every mutation without the
+/// mutators having to keep track of the position they changed.
+pub fn shared_prefix(a: &[u8], b: &[u8]) -> usize {
+    let same = a.iter().zip(b).take_while(|(x, y)| x == y).count();
+    same & !3
+}
+
+/// Writes the number of programs and the shared prefix of every program.
+fn write_hints(channel: &mut [u8], base: Option<&[u8]>, programs: &[&[u8]]) {
+    let count = programs.len().min(channel.len() / 4 - 1);
+    for (idx, program) in programs[..count].iter().enumerate() {
+        let hint = base.map_or(0, |base| shared_prefix(base, program)) as u32;
+        channel[4 * (idx + 1)..4 * (idx + 2)].copy_from_slice(&hint.to_le_bytes());
+    }
+    channel[..4].copy_from_slice(&(count as u32).to_le_bytes());
+}
+
+/// Writes the checkpoint hints into shared memory before every execution.
+/// Does nothing without shared memory, i.e. when checkpoints are disabled.
+#[derive(Serialize, Deserialize, Debug)]
+pub struct CheckpointHintObserver<'a> {
+    name: String,
+    hints: Option<OwnedMutSlice<'a, u8>>,
+    /// The corpus entry that is currently fuzzed and its encoding.
+    #[serde(skip)]
+    base: Option<(CorpusId, Vec<u8>)>,
+}
+
+impl<'a> CheckpointHintObserver<'a> {
+    /// Creates the observer on the shared memory that is passed to the
+    /// target via `CHECKPOINT_SHM_ENV`.
+    #[must_use]
+    pub fn new(name: &str, hints: Option<&'a mut [u8]>) -> Self {
+        Self {
+            name: name.to_string(),
+            hints: hints.map(OwnedMutSlice::from),
+            base: None,
+        }
+    }
+
+    /// Loads the encoding of the corpus entry that is fuzzed right now.
+    /// Entries that were minimized keep their id, but not their length.
+    fn update_base<S>(&mut self, state: &S)
+    where
+        S: HasCorpus + UsesInput<Input = ProgramInput>,
+    {
+        let current = *state.corpus().current();
+        self.base = self.base.take().filter(|(id, _)| Some(*id) == current);
+        let id = match current {
+            Some(id) => id,
+            None => return,
+        };
+        let mut testcase = match state.corpus().get(id).map(|cell| cell.try_borrow_mut()) {
+            Ok(Ok(testcase)) => testcase,
+            _ => return,
+        };
+        if let Some((_, bytes)) = &self.base {
+            let len = testcase
+                .input()
+                .as_ref()
+                .map(|input| input.insts().len() * 4);
+            if len.map_or(true, |len| len == bytes.len()) {
+                return;
+            }
+        }
+        self.base = testcase
+            .load_input(state.corpus())
+            .ok()
+            .map(|input| (id, input.encoded().to_vec()));
+    }
+}
+
+impl<'a> Named for CheckpointHintObserver<'a> {
+    fn name(&self) -> &str {
+        &self.name
+    }
+}
+
+impl<'a, S> Observer<S> for CheckpointHintObserver<'a>
+where
+    S: HasCorpus + UsesInput<Input = ProgramInput>,
+{
+    fn pre_exec(&mut self, state: &mut S, input: &ProgramInput) -> Result<(), Error> {
+        if self.hints.is_none() {
+            return Ok(());
+        }
+        self.update_base(state);
+        let base = self.base.as_ref().map(|(_, bytes)| bytes.as_slice());
+        let bytes = input.encoded();
+        let programs = split_programs(bytes).unwrap_or_else(|| vec![bytes]);
+        if let Some(hints) = self.hints.as_mut() {
+            write_hints(hints.as_mut_slice(), base, &programs);
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{shared_prefix, write_hints};
+
+    #[test]
+    fn hints_for_programs() {
+        let base = [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12];
+        assert_eq!(shared_prefix(&base, &base), 12);
+        assert_eq!(shared_prefix(&base, &base[..8]), 8);
+        // Only whole instructions count.
+        assert_eq!(shared_prefix(&base, &[1, 2, 3, 4, 5, 6, 0, 8]), 4);
+
+        let mut channel = vec![0u8; 12];
+        let programs: Vec<&[u8]> = vec![&base[..8], &[9, 9, 9, 9], &base];
+        write_hints(&mut channel, Some(&base), &programs);
+        // There is only space for two hints.
+        assert_eq!(channel, [2, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0]);
+        write_hints(&mut channel, None, &programs[2..]);
+        assert_eq!(channel[..8], [1, 0, 0, 0, 0, 0, 0, 0]);
+    }
+}
@@ -0,0 +1,203 @@
+//! Reader for the coverage map dumps written by `completedSimCallback` in
+//! FuzzerCoverage.h.
+use std::path::Path;
+
+const MAGIC: &[u8; 4] = b"RVCM";
+const VERSION: u8 = 1;
+const HEADER_SIZE: usize = 16;
+const SPARSE_ENTRY_SIZE: usize = 5;
+const KIND_DENSE: u8 = 0;
+const KIND_SPARSE: u8 = 1;
+const FLAG_ZSTD: u8 = 1;
+
+/// A coverage map that only stores the non-zero entries.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct CoverageMap {
+    /// The number of entries in the original map.
+    map_size: u32,
+    /// (index, hitcount) pairs of all non-zero entries, sorted by index.
+    entries: Vec<(u32, u8)>,
+}
+
+impl CoverageMap {
+    /// Creates a sparse map from the given raw coverage map.
+    pub fn from_dense(map: &[u8]) -> Self {
+        let entries = map
+            .iter()
+            .enumerate()
+            .filter(|(_, count)| **count != 0)
+            .map(|(idx, count)| (idx as u32, *count))
+            .collect();
+        Self {
+            map_size: map.len() as u32,
+            entries,
+        }
+    }
+
+    pub fn map_size(&self) -> u32 {
+        self.map_size
+    }
+
+    /// The (index, hitcount) pairs of all non-zero entries.
+    pub fn entries(&self) -> &[(u32, u8)] {
+        &self.entries
+    }
+
+    /// The number of covered (non-zero) entries.
+    pub fn coverage(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// Expands the map back into its raw representation.
+    pub fn to_dense(&self) -> Vec<u8> {
+        let mut result = vec![0u8; self.map_size as usize];
+        for (idx, count) in &self.entries {
+            result[*idx as usize] = *count;
+        }
+        result
+    }
+}
+
+fn read_u32(data: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(data[offset..offset + 4].try_into().unwrap())
+}
+
+#[cfg(feature = "zstd")]
+fn decompress(payload: &[u8]) -> Result<Vec<u8>, String> {
+    zstd::stream::decode_all(payload).map_err(|e| format!("Failed to decompress map: {}", e))
+}
+
+#[cfg(not(feature = "zstd"))]
+fn decompress(_payload: &[u8]) -> Result<Vec<u8>, String> {
+    Err("Coverage map is zstd compressed, but zstd support is not enabled".to_owned())
+}
+
+/// Parses the old text format which stores every entry as 8 '0'/'1' chars.
+fn parse_text(data: &[u8]) -> Result<CoverageMap, String> {
+    if data.len() % 8 != 0 {
+        return Err(format!("Text coverage map has invalid size {}", data.len()));
+    }
+    let mut dense = Vec::<u8>::with_capacity(data.len() / 8);
+    for bits in data.chunks(8) {
+        let str = std::str::from_utf8(bits).map_err(|_| "Invalid text coverage map")?;
+        dense.push(u8::from_str_radix(str, 2).map_err(|_| "Invalid text coverage map")?);
+    }
+    Ok(CoverageMap::from_dense(&dense))
+}
+
+/// Parses a coverage map dump in any of the formats written by the harness.
+pub fn parse_coverage_map(data: &[u8]) -> Result<CoverageMap, String> {
+    if !data.starts_with(MAGIC) {
+        return parse_text(data);
+    }
+    if data.len() < HEADER_SIZE {
+        return Err("Truncated coverage map header".to_owned());
+    }
+    let version = data[4];
+    let kind = data[5];
+    let flags = data[6];
+    if version != VERSION {
+        return Err(format!("Unsupported coverage map version {}", version));
+    }
+    let map_size = read_u32(data, 8);
+    let num_entries = read_u32(data, 12) as usize;
+
+    let raw_payload = &data[HEADER_SIZE..];
+    let decompressed;
+    let payload = if flags & FLAG_ZSTD != 0 {
+        decompressed = decompress(raw_payload)?;
+        decompressed.as_slice()
+    } else {
+        raw_payload
+    };
+
+    match kind {
+        KIND_DENSE => {
+            if payload.len() != map_size as usize {
+                return Err(format!(
+                    "Dense coverage map has {} bytes but expected {}",
+                    payload.len(),
+                    map_size
+                ));
+            }
+            Ok(CoverageMap::from_dense(payload))
+        }
+        KIND_SPARSE => {
+            if payload.len() != num_entries * SPARSE_ENTRY_SIZE {
+                return Err(format!(
+                    "Sparse coverage map has {} bytes but expected {} entries",
+                    payload.len(),
+                    num_entries
+                ));
+            }
+            let mut entries = Vec::<(u32, u8)>::with_capacity(num_entries);
+            for entry in payload.chunks(SPARSE_ENTRY_SIZE) {
+                let idx = read_u32(entry, 0);
+                if idx >= map_size {
+                    return Err(format!("Coverage map index {} out of bounds", idx));
+                }
+                entries.push((idx, entry[4]));
+            }
+            Ok(CoverageMap { map_size, entries })
+        }
+        _ => Err(format!("Unknown coverage map kind {}", kind)),
+    }
+}
+
+/// Reads the coverage map dump at the given path.
+pub fn read_coverage_map<P: AsRef<Path>>(path: P) -> Result<CoverageMap, String> {
+    let data = std::fs::read(path.as_ref())
+        .map_err(|e| format!("Failed to read {:?}: {}", path.as_ref(), e))?;
+    parse_coverage_map(&data)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{parse_coverage_map, CoverageMap};
+
+    fn header(kind: u8, map_size: u32, entries: u32) -> Vec<u8> {
+        let mut result = b"RVCM".to_vec();
+        result.extend_from_slice(&[1, kind, 0, 0]);
+        result.extend_from_slice(&map_size.to_le_bytes());
+        result.extend_from_slice(&entries.to_le_bytes());
+        result
+    }
+
+    #[test]
+    fn parse_sparse() {
+        let mut data = header(1, 21, 2);
+        data.extend_from_slice(&[2, 0, 0, 0, 3]);
+        data.extend_from_slice(&[20, 0, 0, 0, 255]);
+        let map = parse_coverage_map(&data).unwrap();
+        assert_eq!(map.map_size(), 21);
+        assert_eq!(map.entries(), &[(2, 3), (20, 255)]);
+    }
+
+    #[test]
+    fn parse_dense_matches_sparse() {
+        let raw = [0u8, 0, 3, 0, 0, 0, 7, 0];
+        let mut data = header(0, raw.len() as u32, raw.len() as u32);
+        data.extend_from_slice(&raw);
+        let map = parse_coverage_map(&data).unwrap();
+        assert_eq!(map, CoverageMap::from_dense(&raw));
+        assert_eq!(map.coverage(), 2);
+        assert_eq!(map.to_dense(), raw.to_vec());
+    }
+
+    #[test]
+    fn parse_text() {
+        let map = parse_coverage_map(b"000000000000001100000001").unwrap();
+        assert_eq!(map.map_size(), 3);
+        assert_eq!(map.entries(), &[(1, 3), (2, 1)]);
+    }
+
+    #[test]
+    fn parse_invalid() {
+        let mut data = header(1, 4, 1);
+        data.extend_from_slice(&[9, 0, 0, 0, 1]);
+        assert!(parse_coverage_map(&data).is_err());
+        assert!(parse_coverage_map(&header(1, 4, 1)).is_err());
+        assert!(parse_coverage_map(b"RVCM").is_err());
+        assert!(parse_coverage_map(b"0101").is_err());
+    }
+}
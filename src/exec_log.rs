@@ -0,0 +1,146 @@
+//! Reader for the execution logs written by the harness into COUNTER_FOLDER.
+//! See FuzzerExecLog.h for the writer and the file layout.
+use std::{
+    fs::File,
+    io::{BufReader, Read},
+    path::Path,
+};
+
+const MAGIC: &[u8; 4] = b"RVEL";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 32;
+const RECORD_SIZE: usize = 16;
+
+/// A single executed input.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct ExecRecord {
+    /// The stable (XXH64) hash of the input.
+    pub hash: u64,
+    /// The size of the input in bytes.
+    pub size: u32,
+    /// The time of the execution in seconds since the epoch of the log.
+    pub time: u32,
+}
+
+/// Streams the records of an execution log.
+pub struct ExecLogReader<R: Read> {
+    input: R,
+    epoch: u64,
+    remaining: u64,
+}
+
+impl<R: Read> ExecLogReader<R> {
+    /// Reads the header of the log from the given reader.
+    pub fn new(mut input: R) -> Result<Self, String> {
+        let mut header = [0u8; HEADER_SIZE];
+        input
+            .read_exact(&mut header)
+            .map_err(|_| "Truncated execution log header".to_owned())?;
+        if &header[0..4] != MAGIC {
+            return Err("Not an execution log".to_owned());
+        }
+        let version = u32::from_le_bytes(header[4..8].try_into().unwrap());
+        if version != VERSION {
+            return Err(format!("Unsupported execution log version {}", version));
+        }
+        Ok(Self {
+            input,
+            epoch: u64::from_le_bytes(header[8..16].try_into().unwrap()),
+            remaining: u64::from_le_bytes(header[24..32].try_into().unwrap()),
+        })
+    }
+
+    /// The unix time (in seconds) that record time stamps are relative to.
+    pub fn epoch(&self) -> u64 {
+        self.epoch
+    }
+}
+
+impl<R: Read> Iterator for ExecLogReader<R> {
+    type Item = ExecRecord;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.remaining == 0 {
+            return None;
+        }
+        let mut record = [0u8; RECORD_SIZE];
+        // A truncated file just ends the log early.
+        if self.input.read_exact(&mut record).is_err() {
+            self.remaining = 0;
+            return None;
+        }
+        self.remaining -= 1;
+        Some(ExecRecord {
+            hash: u64::from_le_bytes(record[0..8].try_into().unwrap()),
+            size: u32::from_le_bytes(record[8..12].try_into().unwrap()),
+            time: u32::from_le_bytes(record[12..16].try_into().unwrap()),
+        })
+    }
+}
+
+/// Opens the execution log at the given path.
+pub fn open_exec_log<P: AsRef<Path>>(path: P) -> Result<ExecLogReader<BufReader<File>>, String> {
+    let file = File::open(path.as_ref())
+        .map_err(|e| format!("Failed to open {:?}: {}", path.as_ref(), e))?;
+    ExecLogReader::new(BufReader::new(file))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{ExecLogReader, ExecRecord};
+
+    fn make_log(num_records: u64, records: &[(u64, u32, u32)], capacity: usize) -> Vec<u8> {
+        let mut result = b"RVEL".to_vec();
+        result.extend_from_slice(&1u32.to_le_bytes());
+        result.extend_from_slice(&1704063600u64.to_le_bytes());
+        result.extend_from_slice(&(capacity as u64).to_le_bytes());
+        result.extend_from_slice(&num_records.to_le_bytes());
+        for (hash, size, time) in records {
+            result.extend_from_slice(&hash.to_le_bytes());
+            result.extend_from_slice(&size.to_le_bytes());
+            result.extend_from_slice(&time.to_le_bytes());
+        }
+        // Unused capacity is zero filled.
+        result.resize(32 + capacity * 16, 0);
+        result
+    }
+
+    #[test]
+    fn read_records() {
+        let data = make_log(2, &[(0xdead, 4, 10), (0xbeef, 8, 11)], 16);
+        let reader = ExecLogReader::new(data.as_slice()).unwrap();
+        assert_eq!(reader.epoch(), 1704063600);
+        let records: Vec<ExecRecord> = reader.collect();
+        assert_eq!(
+            records,
+            vec![
+                ExecRecord {
+                    hash: 0xdead,
+                    size: 4,
+                    time: 10
+                },
+                ExecRecord {
+                    hash: 0xbeef,
+                    size: 8,
+                    time: 11
+                }
+            ]
+        );
+    }
+
+    #[test]
+    fn read_truncated() {
+        let mut data = make_log(3, &[(1, 4, 0), (2, 4, 0)], 2);
+        data.truncate(32 + 16 + 8);
+        let reader = ExecLogReader::new(data.as_slice()).unwrap();
+        assert_eq!(reader.count(), 1);
+    }
+
+    #[test]
+    fn read_invalid() {
+        assert!(ExecLogReader::new(&b"RVEL"[..]).is_err());
+        let mut data = make_log(0, &[], 0);
+        data[0] = b'X';
+        assert!(ExecLogReader::new(data.as_slice()).is_err());
+    }
+}
@@ -19,7 +19,7 @@ use tui::{
     Frame, Terminal,
 };
 
-use crate::causes::list_causes;
+use crate::causes::CauseTracker;
 
 // Every nth corpus increase that should be logged.
 const EVERY_N_CORPUS: u64 = 1000;
@@ -39,6 +39,9 @@ pub struct FuzzUIData {
     time_since_last_find_group: f64,
     start_time: std::time::Duration,
     messages: VecDeque<String>,
+    causes: Option<CauseTracker>,
+    /// Where the clients spend their time (with the introspection feature).
+    stage_timing: Option<String>,
 }
 
 impl FuzzUIData {
@@ -79,6 +82,26 @@ impl FuzzUIData {
         self.messages.push_front(value);
     }
 
+    pub fn set_stage_timing(&mut self, value: String) {
+        self.stage_timing = Some(value);
+    }
+
+    /// Picks up new causes. Should be called at monitor rate.
+    pub fn update_causes(&mut self) {
+        let start_time = self.start_time;
+        self.causes
+            .get_or_insert_with(|| CauseTracker::new(start_time))
+            .update();
+    }
+
+    /// Number of found causes (including duplicates) and of expected causes
+    /// that weren't found yet.
+    pub fn cause_counts(&self) -> (usize, usize) {
+        self.causes.as_ref().map_or((0, 0), |causes| {
+            (causes.found().len(), causes.still_missing().count())
+        })
+    }
+
     fn rel_time_secs(&self) -> f64 {
         (current_time() - self.start_time).as_secs_f64()
     }
@@ -98,6 +121,8 @@ impl FuzzUI {
             time_since_last_find_group: 0.0,
             start_time: current_time(),
             messages: VecDeque::<String>::new(),
+            causes: None,
+            stage_timing: None,
         };
         data.time_since_last_find.push(TimeData {
             time: 0.0,
@@ -168,10 +193,13 @@ impl Drop for FuzzUI {
 }
 
 fn summarize_findings(data: &FuzzUIData) -> Vec<String> {
-    let case_list = list_causes(data.start_time);
+    let case_list = match &data.causes {
+        Some(causes) => causes,
+        None => return Vec::new(),
+    };
 
     let mut dupes = HashMap::<String, u64>::new();
-    for case in &case_list.found {
+    for case in case_list.found() {
         dupes.insert(
             case.cause.clone(),
             dupes.get(&case.cause).or(Some(&0)).unwrap() + 1,
@@ -181,7 +209,7 @@ fn summarize_findings(data: &FuzzUIData) -> Vec<String> {
     let mut emitted_causes = HashSet::<String>::new();
 
     let mut result = Vec::<String>::new();
-    for case in &case_list.found {
+    for case in case_list.found() {
         if !emitted_causes.insert(case.cause.clone()) {
             continue;
         }
@@ -193,7 +221,7 @@ fn summarize_findings(data: &FuzzUIData) -> Vec<String> {
         );
         result.push(res);
     }
-    for case in &case_list.still_missing {
+    for case in case_list.still_missing() {
         let res = format!("{} (Missing)", case);
         result.push(res);
     }
@@ -375,7 +403,21 @@ fn ui<B: Backend>(f: &mut Frame<B>, data: &FuzzUIData) {
     let items = List::new(items).block(Block::default().borders(Borders::ALL).title("Messages"));
 
     // We can now render the item list
-    f.render_widget(items, top_chunks[0]);
+    match &data.stage_timing {
+        Some(stage_timing) => {
+            let left_chunks = Layout::default()
+                .direction(Direction::Vertical)
+                .constraints([Constraint::Percentage(50), Constraint::Percentage(50)])
+                .split(top_chunks[0]);
+            f.render_widget(items, left_chunks[0]);
+
+            let timing: Vec<ListItem> = stage_timing.lines().map(ListItem::new).collect();
+            let timing =
+                List::new(timing).block(Block::default().borders(Borders::ALL).title("Time spent"));
+            f.render_widget(timing, left_chunks[1]);
+        }
+        None => f.render_widget(items, top_chunks[0]),
+    }
 
     render_coverage(f, data, bottom_chunks[0]);
     render_time_between_findings(f, data, bottom_chunks[1]);
@@ -1,27 +1,189 @@
-use crate::instructions::{Argument, ArgumentSpec, Instruction, InstructionTemplate};
+use std::{
+    borrow::Cow,
+    sync::{Arc, OnceLock},
+};
+
+use crate::instructions::{self, Argument, ArgumentSpec, Instruction, InstructionTemplate};
+
+/// The instruction templates that the generator picks from, optionally with
+/// a weight for each template.
+///
+/// Weighted sets are turned into an alias table (Vose's method), so picking
+/// a template is one random index and one comparison regardless of the
+/// number of templates.
+#[derive(Clone, Debug)]
+pub struct InstructionSet {
+    templates: Vec<&'static InstructionTemplate>,
+    /// Probability (scaled to 2^32) of keeping the picked index instead of
+    /// switching to its alias. Empty if all templates are equally likely.
+    keep_chance: Vec<u64>,
+    alias: Vec<u32>,
+}
+
+impl InstructionSet {
+    const ALIAS_SCALE: u64 = 1 << 32;
+
+    /// A set in which every template is equally likely.
+    pub fn new(templates: &[&'static InstructionTemplate]) -> Self {
+        assert!(!templates.is_empty());
+        Self {
+            templates: templates.to_vec(),
+            keep_chance: Vec::new(),
+            alias: Vec::new(),
+        }
+    }
+
+    /// A set in which templates are picked proportionally to their weight.
+    /// Templates with a zero weight are left out.
+    pub fn weighted(templates: &[(&'static InstructionTemplate, u32)]) -> Result<Self, String> {
+        let used: Vec<(&'static InstructionTemplate, u32)> = templates
+            .iter()
+            .filter(|(_, weight)| *weight != 0)
+            .copied()
+            .collect();
+        if used.is_empty() {
+            return Err("Instruction set has no instructions with a non-zero weight".to_owned());
+        }
+
+        let n = used.len() as u64;
+        let total: u64 = used.iter().map(|(_, weight)| *weight as u64).sum();
+        // Scale the weights so that the average weight is ALIAS_SCALE. The
+        // product doesn't fit into 64 bits for large weights, the result
+        // (at most n * ALIAS_SCALE) does.
+        let mut scaled: Vec<u64> = used
+            .iter()
+            .map(|(_, weight)| {
+                (*weight as u128 * n as u128 * Self::ALIAS_SCALE as u128 / total as u128) as u64
+            })
+            .collect();
+        let mut keep_chance = vec![Self::ALIAS_SCALE; used.len()];
+        let mut alias: Vec<u32> = (0..used.len() as u32).collect();
+
+        let (mut small, mut large): (Vec<usize>, Vec<usize>) =
+            (0..used.len()).partition(|&i| scaled[i] < Self::ALIAS_SCALE);
+        while let (Some(s), Some(&l)) = (small.pop(), large.last()) {
+            // Fill up the remaining chance of 's' with 'l'.
+            keep_chance[s] = scaled[s];
+            alias[s] = l as u32;
+            scaled[l] -= Self::ALIAS_SCALE - scaled[s];
+            if scaled[l] < Self::ALIAS_SCALE {
+                large.pop();
+                small.push(l);
+            }
+        }
+        // Everything left over is (up to rounding) exactly average.
+
+        Ok(Self {
+            templates: used.iter().map(|(template, _)| *template).collect(),
+            keep_chance,
+            alias,
+        })
+    }
+
+    /// The RV64I set that the mutators use by default.
+    pub fn riscv_base() -> Arc<InstructionSet> {
+        static SET: OnceLock<Arc<InstructionSet>> = OnceLock::new();
+        SET.get_or_init(|| Arc::new(Self::new(instructions::sets::riscv_base())))
+            .clone()
+    }
+
+    pub fn templates(&self) -> &[&'static InstructionTemplate] {
+        &self.templates
+    }
+
+    /// Picks a random template from the set.
+    pub fn choose<R: libafl::prelude::Rand>(&self, rand: &mut R) -> &'static InstructionTemplate {
+        let idx = rand.below(self.templates.len() as u64) as usize;
+        if self.keep_chance.is_empty() || rand.below(Self::ALIAS_SCALE) < self.keep_chance[idx] {
+            return self.templates[idx];
+        }
+        self.templates[self.alias[idx] as usize]
+    }
+}
+
+/// Argument values that the generator can reuse, indexed by their length.
+///
+/// This is kept around with each input (see `ProgramInput::insts_and_pool_mut`)
+/// so the mutators don't have to collect the arguments of the whole program
+/// for every generated instruction. The values of removed instructions are
+/// not dropped from the pool, reusing them is just a heuristic anyway.
+#[derive(Clone, Debug, Default)]
+pub struct ArgumentPool {
+    /// All values of arguments with length `i` are in `values[i]`.
+    values: Vec<Vec<u32>>,
+}
+
+impl ArgumentPool {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Creates a pool with all arguments of the given program.
+    pub fn from_program(program: &[Instruction]) -> Self {
+        let mut result = Self::new();
+        for inst in program {
+            result.add_args(&inst.arguments());
+        }
+        result
+    }
+
+    pub fn add(&mut self, arg: &Argument) {
+        let length = arg.spec().length() as usize;
+        if self.values.len() <= length {
+            self.values.resize(length + 1, Vec::new());
+        }
+        self.values[length].push(arg.value());
+    }
+
+    pub fn add_args(&mut self, args: &[Argument]) {
+        for arg in args {
+            self.add(arg);
+        }
+    }
+
+    /// Returns a random value of an argument with the given length.
+    pub fn choose<R: libafl::prelude::Rand>(&self, rand: &mut R, length: u32) -> Option<u32> {
+        let values = self.values.get(length as usize)?;
+        if values.is_empty() {
+            return None;
+        }
+        Some(values[rand.below(values.len() as u64) as usize])
+    }
+}
 
 /// Generates random RISC-V instructions.
 #[derive(Default)]
-pub struct InstGenerator {
-    /// List of known arguments the generator should try to reuse.
-    known_args: Vec<Argument>,
+pub struct InstGenerator<'a> {
+    /// Known arguments the generator should try to reuse.
+    known_args: Cow<'a, ArgumentPool>,
     // Chance (0-100) of reusing a known arg value in the program.
     reuse_chance: u64,
     // Chance (0-100) of choosing a power of two as arg value.
     power_of_two_chance: u64,
 }
 
-impl InstGenerator {
+impl InstGenerator<'static> {
     pub fn new() -> Self {
+        Self::with_known_args(Cow::Owned(ArgumentPool::new()))
+    }
+}
+
+impl<'a> InstGenerator<'a> {
+    /// Creates a generator that reuses the arguments in the given pool.
+    pub fn with_pool(known_args: &'a ArgumentPool) -> Self {
+        Self::with_known_args(Cow::Borrowed(known_args))
+    }
+
+    fn with_known_args(known_args: Cow<'a, ArgumentPool>) -> Self {
         Self {
-            known_args: Vec::<Argument>::new(),
+            known_args,
             reuse_chance: 50,
             power_of_two_chance: 50,
         }
     }
 
     pub fn forward_args(&mut self, args: &[Argument]) {
-        self.known_args.append(&mut args.to_vec())
+        self.known_args.to_mut().add_args(args)
     }
 
     pub fn generate_argument<R: libafl::prelude::Rand>(
@@ -30,14 +192,8 @@ impl InstGenerator {
         arg: &'static ArgumentSpec,
     ) -> Argument {
         if rand.below(100) < self.reuse_chance {
-            let filtered = self
-                .known_args
-                .iter()
-                .filter(|x| x.spec().length() == arg.length());
-            let options = filtered.collect::<Vec<&Argument>>();
-            if !options.is_empty() {
-                let chosen = rand.choose(options).clone();
-                return Argument::new(arg, chosen.value());
+            if let Some(value) = self.known_args.choose(rand, arg.length()) {
+                return Argument::new(arg, value);
             }
         }
 
@@ -51,22 +207,38 @@ impl InstGenerator {
     pub fn generate_instruction<R: libafl::prelude::Rand>(
         &self,
         rand: &mut R,
-        insts: &Vec<&'static InstructionTemplate>,
+        insts: &[&'static InstructionTemplate],
     ) -> Instruction {
         assert!(!insts.is_empty());
         let template = rand.choose(insts.iter());
+        self.generate_with_template(rand, template)
+    }
 
-        let mut arguments = Vec::<Argument>::new();
-        for arg in template.operands() {
-            arguments.push(self.generate_argument(rand, arg));
-        }
+    /// Generates an instruction from the given (weighted) set.
+    pub fn generate_instruction_from<R: libafl::prelude::Rand>(
+        &self,
+        rand: &mut R,
+        set: &InstructionSet,
+    ) -> Instruction {
+        let template = set.choose(rand);
+        self.generate_with_template(rand, template)
+    }
+
+    fn generate_with_template<R: libafl::prelude::Rand>(
+        &self,
+        rand: &mut R,
+        template: &'static InstructionTemplate,
+    ) -> Instruction {
+        let arguments = template
+            .operands()
+            .map(|arg| self.generate_argument(rand, arg));
         Instruction::new(template, arguments)
     }
 
     pub fn generate_instructions<R: libafl::prelude::Rand>(
         &self,
         rand: &mut R,
-        insts: &Vec<&'static InstructionTemplate>,
+        insts: &[&'static InstructionTemplate],
         number: u32,
     ) -> Vec<Instruction> {
         let mut result = Vec::<Instruction>::new();
@@ -83,7 +255,7 @@ mod tests {
 
     use crate::instructions::{self, Argument};
 
-    use super::InstGenerator;
+    use super::{ArgumentPool, InstGenerator, InstructionSet};
 
     #[test]
     fn generate_random_instructions() {
@@ -108,8 +280,8 @@ mod tests {
             let mut generator = InstGenerator::new();
 
             // Tell the generator that there it should try emit instructions
-            // that use x35 as RD.
-            let magic_value: u32 = 35;
+            // that use x27 as RD.
+            let magic_value: u32 = 27;
             generator.forward_args(&vec![Argument::new(
                 &instructions::riscv::args::RD,
                 magic_value,
@@ -117,7 +289,7 @@ mod tests {
 
             let mut found = false;
             // Generate 100 instructions and check that one of them actually
-            // use x35 as RD.
+            // use x27 as RD.
             for _ in 0..100 {
                 let inst = generator.generate_instruction::<Xoshiro256StarRand>(
                     &mut rng,
@@ -133,4 +305,61 @@ mod tests {
             assert!(found);
         }
     }
+
+    #[test]
+    fn argument_pool_by_length() {
+        let mut rng = Xoshiro256StarRand::default();
+        rng.set_seed(0);
+
+        let mut pool = ArgumentPool::new();
+        assert_eq!(pool.choose(&mut rng, 5), None);
+
+        pool.add(&Argument::new(&instructions::riscv::args::RD, 3));
+        pool.add(&Argument::new(&instructions::riscv::args::RS1, 7));
+        pool.add(&Argument::new(&instructions::riscv::args::IMM12, 0x123));
+        for _ in 0..100 {
+            let reg = pool.choose(&mut rng, 5).unwrap();
+            assert!(reg == 3 || reg == 7);
+            assert_eq!(pool.choose(&mut rng, 12), Some(0x123));
+            assert_eq!(pool.choose(&mut rng, 20), None);
+        }
+    }
+
+    #[test]
+    fn weighted_instruction_set() {
+        use instructions::riscv::rv_i::{ADD, ADDI, AND, SUB, XOR};
+
+        let mut rng = Xoshiro256StarRand::default();
+        rng.set_seed(0);
+
+        let weights = [(&ADD, 3), (&SUB, 0), (&ADDI, 1), (&XOR, 4), (&AND, 12)];
+        let set = InstructionSet::weighted(&weights).unwrap();
+        assert_eq!(set.templates().len(), 4);
+
+        const PICKS: u32 = 20000;
+        let mut counts = [0u32; 5];
+        for _ in 0..PICKS {
+            let template = set.choose(&mut rng);
+            let idx = weights.iter().position(|(t, _)| *t == template).unwrap();
+            counts[idx] += 1;
+        }
+        for (i, (_, weight)) in weights.iter().enumerate() {
+            let expected = PICKS * weight / 20;
+            assert!(
+                counts[i].abs_diff(expected) <= PICKS / 50,
+                "{}: {} vs {}",
+                i,
+                counts[i],
+                expected
+            );
+        }
+
+        assert!(InstructionSet::weighted(&[(&ADD, 0)]).is_err());
+
+        // Weights close to u32::MAX keep their ratio.
+        let weights = [(&ADD, u32::MAX), (&SUB, u32::MAX / 3)];
+        let set = InstructionSet::weighted(&weights).unwrap();
+        let adds = (0..PICKS).filter(|_| set.choose(&mut rng) == &ADD).count() as u32;
+        assert!(adds.abs_diff(PICKS * 3 / 4) <= PICKS / 50, "{}", adds);
+    }
 }
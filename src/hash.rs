@@ -0,0 +1,106 @@
+//! The stable input hash (XXH64) that the harness uses to name cause files
+//! and in its logs. See FuzzerHash.h for the C++ version.
+
+const PRIME1: u64 = 0x9E3779B185EBCA87;
+const PRIME2: u64 = 0xC2B2AE3D27D4EB4F;
+const PRIME3: u64 = 0x165667B19E3779F9;
+const PRIME4: u64 = 0x85EBCA77C2B2AE63;
+const PRIME5: u64 = 0x27D4EB2F165667C5;
+
+fn read64(data: &[u8]) -> u64 {
+    u64::from_le_bytes(data[0..8].try_into().unwrap())
+}
+
+fn read32(data: &[u8]) -> u32 {
+    u32::from_le_bytes(data[0..4].try_into().unwrap())
+}
+
+fn round(acc: u64, input: u64) -> u64 {
+    acc.wrapping_add(input.wrapping_mul(PRIME2))
+        .rotate_left(31)
+        .wrapping_mul(PRIME1)
+}
+
+fn merge_round(acc: u64, val: u64) -> u64 {
+    (acc ^ round(0, val))
+        .wrapping_mul(PRIME1)
+        .wrapping_add(PRIME4)
+}
+
+/// Returns the stable 64-bit hash of the given bytes. Same as
+/// `hashFuzzingBytes` with the default seed.
+pub fn hash_fuzzing_bytes(data: &[u8]) -> u64 {
+    let mut rest = data;
+    let mut h: u64;
+
+    if data.len() >= 32 {
+        let mut v1 = PRIME1.wrapping_add(PRIME2);
+        let mut v2 = PRIME2;
+        let mut v3 = 0u64;
+        let mut v4 = 0u64.wrapping_sub(PRIME1);
+        while rest.len() >= 32 {
+            v1 = round(v1, read64(&rest[0..]));
+            v2 = round(v2, read64(&rest[8..]));
+            v3 = round(v3, read64(&rest[16..]));
+            v4 = round(v4, read64(&rest[24..]));
+            rest = &rest[32..];
+        }
+
+        h = v1
+            .rotate_left(1)
+            .wrapping_add(v2.rotate_left(7))
+            .wrapping_add(v3.rotate_left(12))
+            .wrapping_add(v4.rotate_left(18));
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    } else {
+        h = PRIME5;
+    }
+
+    h = h.wrapping_add(data.len() as u64);
+
+    while rest.len() >= 8 {
+        h ^= round(0, read64(rest));
+        h = h.rotate_left(27).wrapping_mul(PRIME1).wrapping_add(PRIME4);
+        rest = &rest[8..];
+    }
+    if rest.len() >= 4 {
+        h ^= (read32(rest) as u64).wrapping_mul(PRIME1);
+        h = h.rotate_left(23).wrapping_mul(PRIME2).wrapping_add(PRIME3);
+        rest = &rest[4..];
+    }
+    for byte in rest {
+        h ^= (*byte as u64).wrapping_mul(PRIME5);
+        h = h.rotate_left(11).wrapping_mul(PRIME1);
+    }
+
+    h ^= h >> 33;
+    h = h.wrapping_mul(PRIME2);
+    h ^= h >> 29;
+    h = h.wrapping_mul(PRIME3);
+    h ^= h >> 32;
+    h
+}
+
+/// Formats the hash the same way as the harness does in cause file names.
+pub fn hash_string(hash: u64) -> String {
+    format!("{:016x}", hash)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::hash_fuzzing_bytes;
+
+    #[test]
+    fn reference_values() {
+        assert_eq!(hash_fuzzing_bytes(b""), 0xef46db3751d8e999);
+        assert_eq!(hash_fuzzing_bytes(b"a"), 0xd24ec4f1a98c6e5b);
+        assert_eq!(hash_fuzzing_bytes(b"abc"), 0x44bc2cf5ad770999);
+        assert_eq!(
+            hash_fuzzing_bytes(b"0123456789abcdef0123456789abcdefXYZ12345678q"),
+            0xc1e8887d7e3cd015
+        );
+    }
+}
@@ -0,0 +1,541 @@
+//! A corpus that keeps its decoded programs in memory and writes them to
+//! disk in the background. The files on disk have the same names and format
+//! as the ones of `OnDiskCorpus` with postcard metadata, so restarting from
+//! the queue of a run (see `seeds.rs`) keeps working.
+//! Programs are evicted in least-recently-loaded order once they use more
+//! than the memory budget and are loaded from disk again when needed.
+//! Adding entries waits for the writer when it falls behind, and queued
+//! writes are finished when the process exits (see `flush_corpus_writes`).
+use core::{cell::RefCell, time::Duration};
+use std::{
+    collections::{HashMap, HashSet, VecDeque},
+    fs,
+    path::{Path, PathBuf},
+    sync::{
+        mpsc::{sync_channel, Receiver, SyncSender},
+        Arc, Condvar, Mutex, Once, Weak,
+    },
+    thread::{self, JoinHandle},
+};
+
+use libafl::{
+    bolts::serdeany::SerdeAnyMap,
+    corpus::{Corpus, CorpusId, InMemoryCorpus, Testcase},
+    inputs::{Input, UsesInput},
+    state::HasMetadata,
+    Error,
+};
+use serde::{Deserialize, Serialize};
+
+use crate::{instructions::Instruction, program_input::ProgramInput};
+
+/// How many writes can be queued before adding entries blocks.
+const WRITE_QUEUE_LEN: usize = 1024;
+/// How many queued writes the writer handles at once.
+const WRITE_BATCH: usize = 64;
+/// Adding entries waits for the writer once this many writes are queued, so
+/// a killed fuzzer loses at most the last few entries.
+const FLUSH_THRESHOLD: usize = 2 * WRITE_BATCH;
+/// How long the process waits for queued writes when it exits.
+const EXIT_FLUSH_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// The same layout as the metadata files of `OnDiskCorpus`.
+#[derive(Serialize)]
+struct EntryMetadata<'a> {
+    metadata: &'a SerdeAnyMap,
+    exec_time: &'a Option<Duration>,
+    executions: &'a usize,
+}
+
+/// The path of the metadata file of the entry at the given path.
+fn metadata_path(path: &Path) -> PathBuf {
+    let name = path.file_name().unwrap_or_default().to_string_lossy();
+    path.with_file_name(format!(".{}.metadata", name))
+}
+
+enum WriteOp {
+    Write(PathBuf, Vec<u8>),
+    Remove(PathBuf),
+}
+
+/// Counts the queued operations the writer didn't finish yet.
+#[derive(Default)]
+struct Unwritten {
+    count: Mutex<usize>,
+    done: Condvar,
+}
+
+impl Unwritten {
+    fn add(&self) {
+        *self.count.lock().unwrap() += 1;
+    }
+
+    fn finish(&self, ops: usize) {
+        let mut count = self.count.lock().unwrap();
+        *count -= ops;
+        if *count == 0 {
+            self.done.notify_all();
+        }
+    }
+
+    fn count(&self) -> usize {
+        *self.count.lock().unwrap()
+    }
+
+    /// Waits until the writer finished all queued operations.
+    fn wait(&self, timeout: Option<Duration>) {
+        let count = self.count.lock().unwrap();
+        match timeout {
+            Some(timeout) => drop(self.done.wait_timeout_while(count, timeout, |c| *c > 0)),
+            None => drop(self.done.wait_while(count, |c| *c > 0)),
+        }
+    }
+}
+
+/// The writers of all corpora in this process, for `flush_corpus_writes`.
+static WRITERS: Mutex<Vec<Weak<Unwritten>>> = Mutex::new(Vec::new());
+static REGISTER_EXIT_FLUSH: Once = Once::new();
+
+/// Waits (for a few seconds at most) until the queued writes of all corpora
+/// are on disk. Runs on exit, but can be called before the process stops in
+/// other ways (e.g. in a panic hook).
+pub fn flush_corpus_writes() {
+    let writers: Vec<Arc<Unwritten>> = match WRITERS.lock() {
+        Ok(writers) => writers.iter().filter_map(Weak::upgrade).collect(),
+        Err(_) => return,
+    };
+    for unwritten in writers {
+        unwritten.wait(Some(EXIT_FLUSH_TIMEOUT));
+    }
+}
+
+extern "C" fn flush_at_exit() {
+    flush_corpus_writes();
+}
+
+/// Writes files on a background thread.
+struct WriteBehind {
+    sender: Option<SyncSender<WriteOp>>,
+    thread: Option<JoinHandle<()>>,
+    /// Inputs that were queued but not written yet. These can't be evicted.
+    pending: Arc<Mutex<HashSet<PathBuf>>>,
+    unwritten: Arc<Unwritten>,
+}
+
+/// Writes the file under a hidden name first, so readers of the directory
+/// never see partially written files.
+fn write_atomic(path: &Path, bytes: &[u8]) -> std::io::Result<()> {
+    let mut tmp_name = std::ffi::OsString::from(".");
+    tmp_name.push(path.file_name().unwrap_or_default());
+    tmp_name.push(".tmp");
+    let tmp = path.with_file_name(tmp_name);
+    fs::write(&tmp, bytes)?;
+    fs::rename(&tmp, path)
+}
+
+fn run_writer(
+    receiver: Receiver<WriteOp>,
+    pending: Arc<Mutex<HashSet<PathBuf>>>,
+    unwritten: Arc<Unwritten>,
+) {
+    while let Ok(first) = receiver.recv() {
+        let mut batch = vec![first];
+        batch.extend(receiver.try_iter().take(WRITE_BATCH - 1));
+        let ops = batch.len();
+        let mut written = Vec::<PathBuf>::with_capacity(batch.len());
+        for op in batch {
+            match op {
+                WriteOp::Write(path, bytes) => {
+                    if let Err(err) = write_atomic(&path, &bytes) {
+                        log::error!("Failed to write corpus entry {:?}: {}", path, err);
+                    }
+                    written.push(path);
+                }
+                WriteOp::Remove(path) => {
+                    let _ = fs::remove_file(&path);
+                }
+            }
+        }
+        let mut pending = pending.lock().unwrap();
+        for path in written {
+            pending.remove(&path);
+        }
+        drop(pending);
+        unwritten.finish(ops);
+    }
+}
+
+impl WriteBehind {
+    fn new() -> Self {
+        let (sender, receiver) = sync_channel(WRITE_QUEUE_LEN);
+        let pending = Arc::new(Mutex::new(HashSet::new()));
+        let unwritten = Arc::new(Unwritten::default());
+        let writer_pending = pending.clone();
+        let writer_unwritten = unwritten.clone();
+        let thread = thread::spawn(move || run_writer(receiver, writer_pending, writer_unwritten));
+
+        // Neither process::exit nor returning from main drop the corpus.
+        REGISTER_EXIT_FLUSH.call_once(|| unsafe {
+            libc::atexit(flush_at_exit);
+        });
+        let mut writers = WRITERS.lock().unwrap();
+        writers.retain(|writer| writer.strong_count() > 0);
+        writers.push(Arc::downgrade(&unwritten));
+        Self {
+            sender: Some(sender),
+            thread: Some(thread),
+            pending,
+            unwritten,
+        }
+    }
+
+    fn write(&self, path: PathBuf, bytes: Vec<u8>, track: bool) -> Result<(), Error> {
+        if track {
+            self.pending.lock().unwrap().insert(path.clone());
+        }
+        self.send(WriteOp::Write(path, bytes))
+    }
+
+    fn remove(&self, path: PathBuf) -> Result<(), Error> {
+        self.send(WriteOp::Remove(path))
+    }
+
+    fn send(&self, op: WriteOp) -> Result<(), Error> {
+        self.unwritten.add();
+        self.sender.as_ref().unwrap().send(op).map_err(|_| {
+            self.unwritten.finish(1);
+            Error::illegal_state("Corpus writer stopped")
+        })
+    }
+
+    /// Waits for the writer if too many writes are queued.
+    fn limit_backlog(&self) {
+        if self.unwritten.count() > FLUSH_THRESHOLD {
+            self.unwritten.wait(None);
+        }
+    }
+
+    fn is_pending(&self, path: &Path) -> bool {
+        self.pending.lock().unwrap().contains(path)
+    }
+}
+
+impl Drop for WriteBehind {
+    /// Writes out everything that is still queued.
+    fn drop(&mut self) {
+        self.sender.take();
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+    }
+}
+
+/// Which programs are in memory and in which order they were loaded.
+#[derive(Default)]
+struct CacheState {
+    ids_by_path: HashMap<PathBuf, CorpusId>,
+    sizes: HashMap<CorpusId, usize>,
+    /// Least recently loaded entries first.
+    order: VecDeque<CorpusId>,
+    used: usize,
+}
+
+/// Approximate memory used by a decoded program.
+fn program_size(input: &ProgramInput) -> usize {
+    // The instructions, their cached encoding and a few pooled arguments
+    // each.
+    input.insts().len() * (std::mem::size_of::<Instruction>() + 4 + 3 * 4)
+        + std::mem::size_of::<ProgramInput>()
+}
+
+/// Prepares the input of an entry in memory for the mutators.
+fn prepare_input(testcase: &Testcase<ProgramInput>) -> usize {
+    match testcase.input() {
+        Some(input) => {
+            input.cache_arg_pool();
+            program_size(input)
+        }
+        None => 0,
+    }
+}
+
+#[derive(Serialize, Deserialize)]
+pub struct HybridCorpus {
+    inner: InMemoryCorpus<ProgramInput>,
+    dir: PathBuf,
+    memory_budget: usize,
+    #[serde(skip)]
+    cache: RefCell<CacheState>,
+    #[serde(skip)]
+    writer: Option<WriteBehind>,
+}
+
+impl UsesInput for HybridCorpus {
+    type Input = ProgramInput;
+}
+
+impl HybridCorpus {
+    /// Creates the corpus in the given directory. Decoded programs use at
+    /// most about `memory_budget` bytes.
+    pub fn new<P: AsRef<Path>>(dir: P, memory_budget: usize) -> Result<Self, Error> {
+        let dir = dir.as_ref().to_owned();
+        fs::create_dir_all(&dir)?;
+        Ok(Self {
+            inner: InMemoryCorpus::new(),
+            dir,
+            memory_budget,
+            cache: RefCell::new(CacheState::default()),
+            writer: Some(WriteBehind::new()),
+        })
+    }
+
+    fn writer(&self) -> &WriteBehind {
+        // The writer is only missing after deserialization, which the fuzzer
+        // doesn't do for its corpus.
+        self.writer.as_ref().expect("Corpus writer not running")
+    }
+
+    /// Queues removing the files of an entry that left the corpus.
+    fn remove_files(&self, path: &Path) -> Result<(), Error> {
+        self.writer().remove(path.to_path_buf())?;
+        self.writer().remove(metadata_path(path))
+    }
+
+    /// Queues writing the testcase and its metadata to disk.
+    fn persist(&self, idx: usize, testcase: &mut Testcase<ProgramInput>) -> Result<PathBuf, Error> {
+        let input = testcase
+            .input()
+            .as_ref()
+            .ok_or_else(|| Error::illegal_argument("Testcase without input"))?;
+        // Like `OnDiskCorpus`, entries with the same program get a counter
+        // appended, so removing one of them leaves the file of the other.
+        let name = input.generate_name(idx);
+        let mut filename = name.clone();
+        let cache = self.cache.borrow();
+        for ctr in 2.. {
+            let path = self.dir.join(&filename);
+            if !cache.ids_by_path.contains_key(&path) && !path.exists() {
+                break;
+            }
+            filename = format!("{}-{}", name, ctr);
+        }
+        drop(cache);
+        let path = self.dir.join(&filename);
+        let bytes = postcard::to_allocvec(input)?;
+
+        let metadata = EntryMetadata {
+            metadata: testcase.metadata_map(),
+            exec_time: testcase.exec_time(),
+            executions: testcase.executions(),
+        };
+        let metadata_bytes = postcard::to_allocvec(&metadata)?;
+        self.writer().write(path.clone(), bytes, true)?;
+        self.writer()
+            .write(metadata_path(&path), metadata_bytes, false)?;
+        self.writer().limit_backlog();
+        *testcase.file_path_mut() = Some(path.clone());
+        Ok(path)
+    }
+
+    /// Records that the program of the entry is in memory and evicts the
+    /// least recently loaded programs if we are over budget.
+    fn track(&self, id: CorpusId, path: PathBuf, size: usize) {
+        let mut cache = self.cache.borrow_mut();
+        cache.ids_by_path.insert(path, id);
+        if let Some(old) = cache.sizes.insert(id, size) {
+            cache.used -= old;
+            cache.order.retain(|other| *other != id);
+        }
+        cache.used += size;
+        cache.order.push_back(id);
+
+        let mut attempts = cache.order.len();
+        while cache.used > self.memory_budget && attempts > 0 {
+            attempts -= 1;
+            let victim = cache.order.pop_front().unwrap();
+            if victim == id || !self.evict(victim) {
+                cache.order.push_back(victim);
+                continue;
+            }
+            let size = cache.sizes.remove(&victim).unwrap_or(0);
+            cache.used -= size;
+        }
+    }
+
+    /// Drops the program of the entry from memory if it is on disk and not
+    /// in use right now.
+    fn evict(&self, id: CorpusId) -> bool {
+        let mut testcase = match self.inner.get(id).map(|t| t.try_borrow_mut()) {
+            Ok(Ok(testcase)) => testcase,
+            _ => return false,
+        };
+        match testcase.file_path() {
+            Some(path) if !self.writer().is_pending(path) => (),
+            _ => return false,
+        }
+        testcase.input_mut().take();
+        true
+    }
+
+    fn untrack(&self, id: CorpusId) {
+        let mut cache = self.cache.borrow_mut();
+        if let Some(size) = cache.sizes.remove(&id) {
+            cache.used -= size;
+        }
+        cache.order.retain(|other| *other != id);
+        cache.ids_by_path.retain(|_, other| *other != id);
+    }
+}
+
+impl Corpus for HybridCorpus {
+    fn count(&self) -> usize {
+        self.inner.count()
+    }
+
+    fn add(&mut self, mut testcase: Testcase<ProgramInput>) -> Result<CorpusId, Error> {
+        let path = self.persist(self.inner.count(), &mut testcase)?;
+        let size = prepare_input(&testcase);
+        let id = self.inner.add(testcase)?;
+        self.track(id, path, size);
+        Ok(id)
+    }
+
+    fn replace(
+        &mut self,
+        idx: CorpusId,
+        mut testcase: Testcase<ProgramInput>,
+    ) -> Result<Testcase<ProgramInput>, Error> {
+        let path = self.persist(self.inner.count(), &mut testcase)?;
+        let size = prepare_input(&testcase);
+        let old = self.inner.replace(idx, testcase)?;
+        self.untrack(idx);
+        if let Some(old_path) = old.file_path() {
+            if *old_path != path {
+                self.remove_files(old_path)?;
+            }
+        }
+        self.track(idx, path, size);
+        Ok(old)
+    }
+
+    fn remove(&mut self, idx: CorpusId) -> Result<Testcase<ProgramInput>, Error> {
+        let testcase = self.inner.remove(idx)?;
+        self.untrack(idx);
+        if let Some(path) = testcase.file_path() {
+            self.remove_files(path)?;
+        }
+        Ok(testcase)
+    }
+
+    fn get(&self, idx: CorpusId) -> Result<&RefCell<Testcase<ProgramInput>>, Error> {
+        self.inner.get(idx)
+    }
+
+    fn current(&self) -> &Option<CorpusId> {
+        self.inner.current()
+    }
+
+    fn current_mut(&mut self) -> &mut Option<CorpusId> {
+        self.inner.current_mut()
+    }
+
+    fn next(&self, idx: CorpusId) -> Option<CorpusId> {
+        self.inner.next(idx)
+    }
+
+    fn prev(&self, idx: CorpusId) -> Option<CorpusId> {
+        self.inner.prev(idx)
+    }
+
+    fn first(&self) -> Option<CorpusId> {
+        self.inner.first()
+    }
+
+    fn last(&self) -> Option<CorpusId> {
+        self.inner.last()
+    }
+
+    /// Loads an evicted program from disk again.
+    fn load_input_into(&self, testcase: &mut Testcase<ProgramInput>) -> Result<(), Error> {
+        if testcase.input().is_some() {
+            return Ok(());
+        }
+        let path = testcase
+            .file_path()
+            .clone()
+            .ok_or_else(|| Error::illegal_argument("Evicted testcase without a file"))?;
+        *testcase.input_mut() = Some(ProgramInput::from_file(&path)?);
+        let size = prepare_input(testcase);
+
+        let id = self.cache.borrow().ids_by_path.get(&path).copied();
+        if let Some(id) = id {
+            self.track(id, path, size);
+        }
+        Ok(())
+    }
+
+    fn store_input_from(&self, testcase: &Testcase<ProgramInput>) -> Result<(), Error> {
+        let (path, input) = match (testcase.file_path(), testcase.input()) {
+            (Some(path), Some(input)) => (path, input),
+            _ => return Ok(()),
+        };
+        self.writer()
+            .write(path.clone(), postcard::to_allocvec(input)?, true)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+
+    use super::{flush_corpus_writes, WriteBehind};
+
+    #[test]
+    fn backlog_is_written() {
+        let dir = std::env::temp_dir().join(format!("riscv-backlog-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+
+        let writer = WriteBehind::new();
+        for i in 0..10u8 {
+            writer
+                .write(dir.join(format!("{}", i)), vec![i], true)
+                .unwrap();
+        }
+        // Everything is on disk without dropping the writer.
+        flush_corpus_writes();
+        assert_eq!(writer.unwritten.count(), 0);
+        assert_eq!(fs::read_dir(&dir).unwrap().count(), 10);
+
+        drop(writer);
+        fs::remove_dir_all(dir).unwrap();
+    }
+
+    #[test]
+    fn write_behind_flushes_on_drop() {
+        let dir = std::env::temp_dir().join(format!("riscv-corpus-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+
+        let writer = WriteBehind::new();
+        for i in 0..200u8 {
+            writer
+                .write(dir.join(format!("{}", i)), vec![i], true)
+                .unwrap();
+        }
+        writer.remove(dir.join("7")).unwrap();
+        drop(writer);
+
+        let mut names: Vec<String> = fs::read_dir(&dir)
+            .unwrap()
+            .map(|entry| entry.unwrap().file_name().into_string().unwrap())
+            .collect();
+        names.sort();
+        // No temporary files are left behind.
+        assert_eq!(names.len(), 199);
+        assert!(names.iter().all(|name| !name.starts_with('.')));
+        assert_eq!(fs::read(dir.join("42")).unwrap(), vec![42]);
+
+        fs::remove_dir_all(dir).unwrap();
+    }
+}
@@ -0,0 +1,755 @@
+//! Runs simulators that are built as a shared library inside the fuzzer
+//! process (see the in-process section of FuzzerAPI.h). Every worker thread
+//! owns a `SimContext` with its own simulator instance and coverage map, so
+//! one client can keep several simulator instances busy and no input goes
+//! through fork, exec or a file.
+//!
+//! A single input runs on one of the workers. The programs of a batch (see
+//! `batch.rs`) are spread over all workers, and the results are written into
+//! the batch channel as if the harness had run them one after another.
+extern crate alloc;
+use alloc::string::String;
+use core::{fmt::Debug, marker::PhantomData};
+use std::{
+    ffi::{c_char, c_int, c_void, CStr, CString},
+    fs,
+    os::unix::ffi::OsStrExt,
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering},
+        mpsc::{channel, Receiver, RecvTimeoutError, Sender},
+        Arc, Mutex,
+    },
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+use libafl::{
+    bolts::{shmem::ShMem, AsSlice},
+    executors::{Executor, ExitKind, HasObservers},
+    inputs::{HasTargetBytes, UsesInput},
+    observers::{ObserversTuple, UsesObservers},
+    state::{HasExecutions, UsesState},
+    Error,
+};
+
+use crate::{
+    batch::{channel_slots, split_programs, write_slot, write_started},
+    hash::{hash_fuzzing_bytes, hash_string},
+    minimizer::CauseRedirect,
+    sparse_feedback::nonzero_entries,
+};
+
+/// Has to match SIM_FUZZER_ABI_VERSION in FuzzerAPI.h.
+const SIM_FUZZER_ABI_VERSION: u32 = 1;
+const SIM_FUZZER_OK: c_int = 0;
+const SIM_FUZZER_ISSUE: c_int = 1;
+const SIM_FUZZER_TIMEOUT: c_int = 2;
+
+/// The values of the stop flag of a worker. Any non-zero value makes
+/// `simFuzzerShouldStop` return true.
+const WORKER_RUN: u32 = 0;
+const WORKER_STOP: u32 = 1;
+/// The worker was replaced and exits once its current program returns.
+const WORKER_RETIRED: u32 = 2;
+
+/// How long the workers get to stop after a timeout before they are
+/// replaced.
+const STOP_GRACE: Duration = Duration::from_secs(1);
+
+/// The `SimContext` of FuzzerAPI.h.
+#[repr(C)]
+struct SimContext {
+    abi_version: u32,
+    worker: u32,
+    coverage: *mut u8,
+    coverage_size: u32,
+    stop: *const u32,
+    record_issue: Option<unsafe extern "C" fn(*mut SimContext, *const c_char)>,
+    fuzzer: *mut c_void,
+    target: *mut c_void,
+}
+
+type TestOneInputFn = unsafe extern "C" fn(*const u8, usize, *mut SimContext) -> c_int;
+type InitContextFn = unsafe extern "C" fn(*mut SimContext, c_int, *mut *mut c_char) -> c_int;
+type DestroyContextFn = unsafe extern "C" fn(*mut SimContext);
+type MapSizeFn = unsafe extern "C" fn() -> u32;
+
+/// A loaded in-process target. The library stays loaded until the process
+/// exits, as simulators rarely expect their static destructors to run early.
+pub struct SimLibrary {
+    path: PathBuf,
+    test_one_input: TestOneInputFn,
+    init_context: Option<InitContextFn>,
+    destroy_context: Option<DestroyContextFn>,
+    map_size: Option<MapSizeFn>,
+}
+
+// The functions are only called with contexts owned by the calling thread.
+unsafe impl Send for SimLibrary {}
+unsafe impl Sync for SimLibrary {}
+
+impl Debug for SimLibrary {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("SimLibrary")
+            .field("path", &self.path)
+            .finish()
+    }
+}
+
+fn dl_error() -> String {
+    let err = unsafe { libc::dlerror() };
+    if err.is_null() {
+        "unknown error".to_owned()
+    } else {
+        unsafe { CStr::from_ptr(err) }
+            .to_string_lossy()
+            .into_owned()
+    }
+}
+
+impl SimLibrary {
+    /// Loads the target library at the given path.
+    pub fn open(path: &Path) -> Result<Self, String> {
+        let c_path = CString::new(path.as_os_str().as_bytes())
+            .map_err(|_| format!("Invalid library path {:?}", path))?;
+        let handle = unsafe { libc::dlopen(c_path.as_ptr(), libc::RTLD_NOW | libc::RTLD_LOCAL) };
+        if handle.is_null() {
+            return Err(format!("Failed to load {:?}: {}", path, dl_error()));
+        }
+        let symbol = |name: &[u8]| {
+            let ptr = unsafe { libc::dlsym(handle, name.as_ptr() as *const c_char) };
+            (!ptr.is_null()).then_some(ptr)
+        };
+
+        let test_one_input = symbol(b"SimFuzzerTestOneInput\0")
+            .ok_or_else(|| format!("{:?} doesn't define SimFuzzerTestOneInput", path))?;
+        unsafe {
+            Ok(Self {
+                path: path.to_owned(),
+                test_one_input: core::mem::transmute::<*mut c_void, TestOneInputFn>(test_one_input),
+                init_context: symbol(b"SimFuzzerInitContext\0")
+                    .map(|ptr| core::mem::transmute::<*mut c_void, InitContextFn>(ptr)),
+                destroy_context: symbol(b"SimFuzzerDestroyContext\0")
+                    .map(|ptr| core::mem::transmute::<*mut c_void, DestroyContextFn>(ptr)),
+                map_size: symbol(b"SimFuzzerMapSize\0")
+                    .map(|ptr| core::mem::transmute::<*mut c_void, MapSizeFn>(ptr)),
+            })
+        }
+    }
+
+    /// The map size the target asks for, if it tells.
+    pub fn map_size(&self) -> Option<usize> {
+        let size = unsafe { (self.map_size?)() } as usize;
+        (size > 0).then_some(size)
+    }
+}
+
+/// Stores the reasons the target records for the current input.
+unsafe extern "C" fn record_issue(ctx: *mut SimContext, reason: *const c_char) {
+    if ctx.is_null() || reason.is_null() || (*ctx).fuzzer.is_null() {
+        return;
+    }
+    let issues = &mut *((*ctx).fuzzer as *mut Vec<String>);
+    issues.push(CStr::from_ptr(reason).to_string_lossy().into_owned());
+}
+
+/// Returns the name the harness gives the cause file of a program, see
+/// `getFuzzingSavePath`.
+fn cause_file_name(reason: &str, program: &[u8]) -> String {
+    format!(
+        "{}%{}",
+        reason.replace(' ', "_"),
+        hash_string(hash_fuzzing_bytes(program))
+    )
+}
+
+/// A program for the workers. `slot` is its index in the input of the given
+/// round, see `run_programs`.
+struct Job {
+    round: u64,
+    slot: usize,
+    program: Vec<u8>,
+}
+
+enum WorkerMessage {
+    /// The worker created its context (or failed to).
+    Ready(Result<(), String>),
+    Done(JobResult),
+}
+
+struct JobResult {
+    round: u64,
+    slot: usize,
+    result: c_int,
+    /// The (map index, hitcount) pairs the program covered.
+    coverage: Vec<(usize, u8)>,
+    issues: Vec<String>,
+}
+
+/// The flags the executor and one worker share.
+#[derive(Default)]
+struct WorkerControl {
+    /// Read by the target through `simFuzzerShouldStop`.
+    stop: AtomicU32,
+    /// Set while the worker runs a program.
+    busy: AtomicBool,
+}
+
+/// The queues all workers share.
+#[derive(Clone)]
+struct WorkerQueue {
+    jobs: Arc<Mutex<Receiver<Job>>>,
+    /// The round the executor waits for. Jobs of older rounds are dropped.
+    round: Arc<AtomicU64>,
+    results: Sender<WorkerMessage>,
+}
+
+/// The body of a worker thread. Creates the context, runs jobs until the
+/// executor goes away or replaces the worker and then destroys the context on
+/// the same thread.
+fn run_worker(
+    library: Arc<SimLibrary>,
+    worker: usize,
+    map_size: usize,
+    argv: Vec<CString>,
+    control: Arc<WorkerControl>,
+    queue: WorkerQueue,
+) {
+    // Both are only accessed through the context while it exists.
+    let coverage = Box::into_raw(vec![0u8; map_size].into_boxed_slice()) as *mut u8;
+    let issues = Box::into_raw(Box::new(Vec::<String>::new()));
+    let mut ctx = SimContext {
+        abi_version: SIM_FUZZER_ABI_VERSION,
+        worker: worker as u32,
+        coverage,
+        coverage_size: map_size as u32,
+        stop: &control.stop as *const AtomicU32 as *const u32,
+        record_issue: Some(record_issue),
+        fuzzer: issues as *mut c_void,
+        target: core::ptr::null_mut(),
+    };
+
+    let ready = match library.init_context {
+        Some(init) => {
+            // Like the argv of main, the list ends with a null pointer.
+            let mut args: Vec<*mut c_char> = argv
+                .iter()
+                .map(|arg| arg.as_ptr() as *mut c_char)
+                .chain(core::iter::once(core::ptr::null_mut()))
+                .collect();
+            let argc = argv.len() as c_int;
+            match unsafe { init(&mut ctx, argc, args.as_mut_ptr()) } {
+                0 => Ok(()),
+                err => Err(format!(
+                    "SimFuzzerInitContext of {:?} failed with {}",
+                    library.path, err
+                )),
+            }
+        }
+        None => Ok(()),
+    };
+    let initialized = ready.is_ok();
+    let _ = queue.results.send(WorkerMessage::Ready(ready));
+
+    let mut covered = Vec::new();
+    while initialized && control.stop.load(Ordering::SeqCst) != WORKER_RETIRED {
+        // Only one worker waits for a job at a time, the others wait for
+        // the lock.
+        let job = match queue.jobs.lock().unwrap().recv() {
+            Ok(job) => job,
+            Err(_) => break,
+        };
+        // Left in the queue when all workers were stuck.
+        if job.round != queue.round.load(Ordering::SeqCst) {
+            continue;
+        }
+        control.busy.store(true, Ordering::SeqCst);
+        let result =
+            unsafe { (library.test_one_input)(job.program.as_ptr(), job.program.len(), &mut ctx) };
+
+        // Clearing only the hit entries keeps the map zeroed for the next
+        // input without a memset of the whole map.
+        let map = unsafe { core::slice::from_raw_parts_mut(ctx.coverage, map_size) };
+        nonzero_entries(map, &mut covered);
+        let entries = covered
+            .iter()
+            .map(|idx| (*idx, core::mem::take(&mut map[*idx])))
+            .collect();
+        let issues = core::mem::take(unsafe { &mut *(ctx.fuzzer as *mut Vec<String>) });
+        let done = JobResult {
+            round: job.round,
+            slot: job.slot,
+            result,
+            coverage: entries,
+            issues,
+        };
+        control.busy.store(false, Ordering::SeqCst);
+        if queue.results.send(WorkerMessage::Done(done)).is_err() {
+            break;
+        }
+    }
+
+    if initialized {
+        if let Some(destroy) = library.destroy_context {
+            unsafe { destroy(&mut ctx) };
+        }
+    }
+    unsafe {
+        drop(Box::from_raw(core::ptr::slice_from_raw_parts_mut(
+            coverage, map_size,
+        )));
+        drop(Box::from_raw(issues));
+    }
+}
+
+struct Worker {
+    control: Arc<WorkerControl>,
+    thread: Option<JoinHandle<()>>,
+}
+
+/// Runs inputs with the worker threads of an in-process target. The
+/// coverage of the executed program is written into `coverage`, which has to
+/// be a second mapping of the shared memory of the map observer.
+pub struct InProcessSimExecutor<OT, S, SHM> {
+    observers: OT,
+    library: Arc<SimLibrary>,
+    workers: Vec<Worker>,
+    /// The arguments of the contexts, kept to replace stuck workers.
+    argv: Vec<CString>,
+    jobs: Option<Sender<Job>>,
+    queue: WorkerQueue,
+    results: Receiver<WorkerMessage>,
+    /// Counts the calls of `run_programs`, so the results of a worker that
+    /// stopped too late can't be mistaken for those of a later input.
+    round: u64,
+    coverage: SHM,
+    /// A second mapping of the channel of `BatchedMutationalStage`.
+    batch_channel: Option<SHM>,
+    timeout: Duration,
+    cause_dir: Option<PathBuf>,
+    /// A second mapping of the redirect of the cause minimizer.
+    cause_redirect: Option<CauseRedirect<SHM>>,
+    phantom: PhantomData<S>,
+}
+
+impl<OT, S, SHM> InProcessSimExecutor<OT, S, SHM>
+where
+    SHM: ShMem,
+{
+    /// Starts `workers` threads that each create a context with the given
+    /// arguments. Fails if one of them couldn't create its context.
+    pub fn new(
+        library: Arc<SimLibrary>,
+        workers: usize,
+        arguments: &[String],
+        observers: OT,
+        coverage: SHM,
+        batch_channel: Option<SHM>,
+        timeout: Duration,
+        cause_dir: Option<PathBuf>,
+        cause_redirect: Option<CauseRedirect<SHM>>,
+    ) -> Result<Self, Error> {
+        let argv: Vec<CString> = core::iter::once(library.path.to_string_lossy().into_owned())
+            .chain(arguments.iter().cloned())
+            .map(|arg| CString::new(arg).map_err(|_| Error::illegal_argument("Invalid argument")))
+            .collect::<Result<_, _>>()?;
+
+        let (jobs, job_receiver) = channel();
+        let (result_sender, results) = channel();
+        let queue = WorkerQueue {
+            jobs: Arc::new(Mutex::new(job_receiver)),
+            round: Arc::new(AtomicU64::new(0)),
+            results: result_sender,
+        };
+        let mut executor = Self {
+            observers,
+            library: library.clone(),
+            workers: Vec::with_capacity(workers),
+            argv,
+            jobs: Some(jobs),
+            queue,
+            results,
+            round: 0,
+            coverage,
+            batch_channel,
+            timeout,
+            cause_dir,
+            cause_redirect,
+            phantom: PhantomData,
+        };
+        for worker in 0..workers.max(1) {
+            let worker = executor.start_worker(worker)?;
+            executor.workers.push(worker);
+        }
+        executor.wait_ready(executor.workers.len())?;
+        log::info!(
+            "Running {:?} in-process with {} workers",
+            library.path,
+            executor.workers.len()
+        );
+        Ok(executor)
+    }
+
+    /// Starts the thread of the worker with the given index.
+    fn start_worker(&self, worker: usize) -> Result<Worker, Error> {
+        let control = Arc::new(WorkerControl::default());
+        let library = self.library.clone();
+        let map_size = self.coverage.len();
+        let argv = self.argv.clone();
+        let thread_control = control.clone();
+        let queue = self.queue.clone();
+        let thread = thread::Builder::new()
+            .name(format!("sim-worker-{}", worker))
+            .spawn(move || run_worker(library, worker, map_size, argv, thread_control, queue))
+            .map_err(|err| Error::unknown(format!("Failed to start worker: {}", err)))?;
+        Ok(Worker {
+            control,
+            thread: Some(thread),
+        })
+    }
+
+    /// Waits until the given number of new workers created their context.
+    fn wait_ready(&self, count: usize) -> Result<(), Error> {
+        let mut ready = 0;
+        while ready < count {
+            match self.results.recv() {
+                Ok(WorkerMessage::Ready(Ok(()))) => ready += 1,
+                Ok(WorkerMessage::Ready(Err(err))) => return Err(Error::illegal_state(err)),
+                // A stuck worker finished a program of an old round.
+                Ok(WorkerMessage::Done(_)) => (),
+                Err(_) => return Err(Error::illegal_state("Worker exited during start-up")),
+            }
+        }
+        Ok(())
+    }
+
+    /// Gives up on the workers that are still running a program and starts
+    /// new ones in their place.
+    fn replace_stuck_workers(&mut self) -> Result<(), Error> {
+        let mut started = 0;
+        for idx in 0..self.workers.len() {
+            if !self.workers[idx].control.busy.load(Ordering::SeqCst) {
+                continue;
+            }
+            log::warn!(
+                "Worker {} didn't stop {:?} after the timeout, starting a new one",
+                idx,
+                STOP_GRACE
+            );
+            // The old thread can't be joined before its program returns, so
+            // it is left to exit on its own.
+            self.workers[idx]
+                .control
+                .stop
+                .store(WORKER_RETIRED, Ordering::SeqCst);
+            self.workers[idx] = self.start_worker(idx)?;
+            started += 1;
+        }
+        self.wait_ready(started)
+    }
+
+    /// Runs the given programs on the workers and returns their results by
+    /// slot and whether each one finished in time. A program that didn't
+    /// return within `STOP_GRACE` after the timeout counts as a timeout
+    /// without coverage, and its worker is replaced.
+    fn run_programs(&mut self, programs: &[&[u8]]) -> Result<Vec<(JobResult, bool)>, Error> {
+        self.round += 1;
+        let round = self.round;
+        self.queue.round.store(round, Ordering::SeqCst);
+        for worker in &self.workers {
+            worker.control.stop.store(WORKER_RUN, Ordering::SeqCst);
+        }
+        let jobs = self.jobs.as_ref().unwrap();
+        for (slot, program) in programs.iter().enumerate() {
+            let program = program.to_vec();
+            jobs.send(Job {
+                round,
+                slot,
+                program,
+            })
+            .map_err(|_| Error::illegal_state("All workers exited"))?;
+        }
+
+        let mut deadline = Instant::now() + self.timeout;
+        let mut timed_out = false;
+        let mut results: Vec<Option<(JobResult, bool)>> =
+            (0..programs.len()).map(|_| None).collect();
+        let mut remaining = programs.len();
+        while remaining > 0 {
+            match self
+                .results
+                .recv_timeout(deadline.saturating_duration_since(Instant::now()))
+            {
+                Ok(WorkerMessage::Done(done)) if done.round == round => {
+                    let slot = done.slot;
+                    results[slot] = Some((done, !timed_out));
+                    remaining -= 1;
+                }
+                // A replaced worker finished a program of an old round.
+                Ok(WorkerMessage::Done(_)) => (),
+                Err(RecvTimeoutError::Timeout) if !timed_out => {
+                    // The programs still running have to notice this
+                    // themselves, a thread can't be killed.
+                    timed_out = true;
+                    deadline = Instant::now() + STOP_GRACE;
+                    for worker in &self.workers {
+                        worker.control.stop.store(WORKER_STOP, Ordering::SeqCst);
+                    }
+                }
+                Err(RecvTimeoutError::Timeout) => {
+                    self.replace_stuck_workers()?;
+                    break;
+                }
+                Ok(WorkerMessage::Ready(_)) | Err(RecvTimeoutError::Disconnected) => {
+                    return Err(Error::illegal_state(
+                        "A worker exited while running an input",
+                    ))
+                }
+            }
+        }
+        Ok(results
+            .into_iter()
+            .enumerate()
+            .map(|(slot, result)| {
+                result.unwrap_or_else(|| {
+                    let done = JobResult {
+                        round,
+                        slot,
+                        result: SIM_FUZZER_TIMEOUT,
+                        coverage: Vec::new(),
+                        issues: Vec::new(),
+                    };
+                    (done, false)
+                })
+            })
+            .collect())
+    }
+
+    /// Saves the program in the cause dir for every recorded issue.
+    fn save_causes(&self, program: &[u8], issues: &[String]) {
+        let cause_dir: &Path = match (&self.cause_dir, &self.cause_redirect) {
+            (Some(cause_dir), Some(redirect)) => redirect.cause_dir(cause_dir),
+            (Some(cause_dir), None) => cause_dir,
+            (None, _) => return,
+        };
+        for reason in issues {
+            log::info!("Found issue: {}", reason);
+            let path = cause_dir.join(cause_file_name(reason, program));
+            // Duplicates have the same name, so just keep the first one.
+            if !path.exists() {
+                if let Err(err) = fs::write(&path, program) {
+                    log::error!("Failed to save cause {:?}: {}", path, err);
+                }
+            }
+        }
+    }
+
+    /// Writes the coverage of a program into the map of the observer.
+    fn restore_map(&mut self, entries: &[(usize, u8)]) {
+        let map = self.coverage.as_mut_slice();
+        let len = map.len();
+        for (idx, hits) in entries.iter().filter(|(idx, _)| *idx < len) {
+            map[*idx] = *hits;
+        }
+    }
+}
+
+impl<OT, S, SHM> Drop for InProcessSimExecutor<OT, S, SHM> {
+    fn drop(&mut self) {
+        // Closing the job queue lets the workers destroy their contexts.
+        self.jobs = None;
+        for worker in &mut self.workers {
+            worker.control.stop.store(WORKER_STOP, Ordering::SeqCst);
+            if let Some(thread) = worker.thread.take() {
+                let _ = thread.join();
+            }
+        }
+    }
+}
+
+impl<OT, S, SHM> Debug for InProcessSimExecutor<OT, S, SHM>
+where
+    OT: Debug,
+{
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("InProcessSimExecutor")
+            .field("library", &self.library)
+            .field("workers", &self.workers.len())
+            .field("timeout", &self.timeout)
+            .field("observers", &self.observers)
+            .finish_non_exhaustive()
+    }
+}
+
+impl<OT, S, SHM> UsesState for InProcessSimExecutor<OT, S, SHM>
+where
+    S: UsesInput,
+{
+    type State = S;
+}
+
+impl<OT, S, SHM> UsesObservers for InProcessSimExecutor<OT, S, SHM>
+where
+    OT: ObserversTuple<S>,
+    S: UsesInput,
+{
+    type Observers = OT;
+}
+
+impl<OT, S, SHM> HasObservers for InProcessSimExecutor<OT, S, SHM>
+where
+    OT: ObserversTuple<S>,
+    S: UsesInput,
+{
+    fn observers(&self) -> &OT {
+        &self.observers
+    }
+
+    fn observers_mut(&mut self) -> &mut OT {
+        &mut self.observers
+    }
+}
+
+impl<EM, OT, S, SHM, Z> Executor<EM, Z> for InProcessSimExecutor<OT, S, SHM>
+where
+    EM: UsesState<State = S>,
+    OT: ObserversTuple<S> + Debug,
+    S: UsesInput + HasExecutions + Debug,
+    S::Input: HasTargetBytes,
+    SHM: ShMem,
+    Z: UsesState<State = S>,
+{
+    fn run_target(
+        &mut self,
+        _fuzzer: &mut Z,
+        state: &mut S,
+        _mgr: &mut EM,
+        input: &S::Input,
+    ) -> Result<ExitKind, Error> {
+        *state.executions_mut() += 1;
+
+        let bytes = input.target_bytes();
+        let bytes = bytes.as_slice();
+        let batch = split_programs(bytes).filter(|_| self.batch_channel.is_some());
+        let programs = batch.clone().unwrap_or_else(|| vec![bytes]);
+        let results = self.run_programs(&programs)?;
+
+        let mut failed = None;
+        for (slot, (done, in_time)) in results.iter().enumerate() {
+            self.save_causes(programs[slot], &done.issues);
+            let exit_kind = match done.result {
+                SIM_FUZZER_OK if *in_time => ExitKind::Ok,
+                SIM_FUZZER_OK | SIM_FUZZER_TIMEOUT => ExitKind::Timeout,
+                SIM_FUZZER_ISSUE => ExitKind::Crash,
+                err => {
+                    return Err(Error::illegal_state(format!(
+                        "{:?} failed to run an input ({})",
+                        self.library.path, err
+                    )))
+                }
+            };
+            if failed.is_none() && exit_kind != ExitKind::Ok {
+                failed = Some((slot, exit_kind));
+            }
+        }
+
+        // For a batch, the programs up to the first failed one count as
+        // started. The map holds the coverage of the failed one, just like
+        // it would after a forkserver target stopped in that program.
+        let started = failed.map_or(programs.len(), |(slot, _)| slot + 1);
+        if let (Some(_), Some(channel)) = (&batch, self.batch_channel.as_mut()) {
+            let channel = channel.as_mut_slice();
+            let slots = channel_slots(channel);
+            for (slot, (done, _)) in results.iter().enumerate().take(started.min(slots)) {
+                write_slot(channel, slot, &done.coverage);
+            }
+            write_started(channel, started);
+        }
+        match failed {
+            Some((slot, _)) => self.restore_map(&results[slot].0.coverage),
+            None if batch.is_none() => self.restore_map(&results[0].0.coverage),
+            None => (),
+        }
+        Ok(failed.map_or(ExitKind::Ok, |(_, exit_kind)| exit_kind))
+    }
+}
+
+/// Either the forkserver or the in-process executor. Both have the same
+/// observers, so the rest of the fuzzer doesn't depend on which one runs.
+#[derive(Debug)]
+pub enum SimExecutor<F, I> {
+    Forkserver(F),
+    InProcess(I),
+}
+
+impl<F, I> UsesState for SimExecutor<F, I>
+where
+    F: UsesState,
+    I: UsesState<State = F::State>,
+{
+    type State = F::State;
+}
+
+impl<F, I> UsesObservers for SimExecutor<F, I>
+where
+    F: UsesObservers,
+    I: UsesObservers<State = F::State, Observers = F::Observers>,
+{
+    type Observers = F::Observers;
+}
+
+impl<F, I> HasObservers for SimExecutor<F, I>
+where
+    F: HasObservers,
+    I: HasObservers<State = F::State, Observers = F::Observers>,
+{
+    fn observers(&self) -> &Self::Observers {
+        match self {
+            Self::Forkserver(executor) => executor.observers(),
+            Self::InProcess(executor) => executor.observers(),
+        }
+    }
+
+    fn observers_mut(&mut self) -> &mut Self::Observers {
+        match self {
+            Self::Forkserver(executor) => executor.observers_mut(),
+            Self::InProcess(executor) => executor.observers_mut(),
+        }
+    }
+}
+
+impl<EM, F, I, Z> Executor<EM, Z> for SimExecutor<F, I>
+where
+    EM: UsesState<State = F::State>,
+    F: Executor<EM, Z>,
+    I: Executor<EM, Z> + UsesState<State = F::State>,
+    Z: UsesState<State = F::State>,
+{
+    fn run_target(
+        &mut self,
+        fuzzer: &mut Z,
+        state: &mut Self::State,
+        mgr: &mut EM,
+        input: &<Self::State as UsesInput>::Input,
+    ) -> Result<ExitKind, Error> {
+        match self {
+            Self::Forkserver(executor) => executor.run_target(fuzzer, state, mgr, input),
+            Self::InProcess(executor) => executor.run_target(fuzzer, state, mgr, input),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::cause_file_name;
+
+    #[test]
+    fn cause_names_match_harness() {
+        // Same name as getFuzzingSavePath gives the empty program.
+        assert_eq!(
+            cause_file_name("illegal trap at pc", &[]),
+            "illegal_trap_at_pc%ef46db3751d8e999"
+        );
+    }
+}
@@ -0,0 +1,192 @@
+//! Reader for the packed input storage that the harness writes into
+//! INPUT_STORAGE when INPUT_STORAGE_FORMAT=pack is set.
+//! See FuzzerInputStore.h for the writer and the file layout.
+use std::{
+    fs::File,
+    io::{BufReader, Read},
+    os::unix::fs::FileExt,
+    path::{Path, PathBuf},
+};
+
+const MAGIC: &[u8; 4] = b"RVIS";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 64;
+const SLOT_SIZE: usize = 32;
+
+/// Value of the INPUT_STORAGE_FORMAT env var that enables packed storage.
+pub const INPUT_STORAGE_FORMAT_PACK: &'static str = "pack";
+
+/// A single unique input in the store.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct StoredInput {
+    /// The stable (XXH64) hash of the input.
+    pub hash: u64,
+    /// Offset of the input bytes in the data file.
+    pub offset: u64,
+    /// Size of the input in bytes.
+    pub size: u32,
+    /// Time of the first execution in seconds since the epoch of the store.
+    pub first_seen: u32,
+    /// How often this input was executed.
+    pub count: u32,
+}
+
+/// Returns true if the given bytes start with an input store index header.
+pub fn is_input_store_index(data: &[u8]) -> bool {
+    data.starts_with(MAGIC)
+}
+
+/// Parses an index file and returns its epoch and all complete entries
+/// sorted by their position in the data file.
+pub fn parse_index<R: Read>(mut input: R) -> Result<(u64, Vec<StoredInput>), String> {
+    let mut header = [0u8; HEADER_SIZE];
+    input
+        .read_exact(&mut header)
+        .map_err(|_| "Truncated input store header".to_owned())?;
+    if !is_input_store_index(&header) {
+        return Err("Not an input store index".to_owned());
+    }
+    let version = u32::from_le_bytes(header[4..8].try_into().unwrap());
+    if version != VERSION {
+        return Err(format!("Unsupported input store version {}", version));
+    }
+    let epoch = u64::from_le_bytes(header[8..16].try_into().unwrap());
+    let num_slots = u64::from_le_bytes(header[16..24].try_into().unwrap());
+
+    let mut entries = Vec::<StoredInput>::new();
+    let mut slot = [0u8; SLOT_SIZE];
+    for _ in 0..num_slots {
+        if input.read_exact(&mut slot).is_err() {
+            break;
+        }
+        let hash = u64::from_le_bytes(slot[0..8].try_into().unwrap());
+        let ready = u32::from_le_bytes(slot[28..32].try_into().unwrap());
+        // Skip unused slots and inputs that were never completely written.
+        if hash == 0 || ready == 0 {
+            continue;
+        }
+        entries.push(StoredInput {
+            hash,
+            offset: u64::from_le_bytes(slot[8..16].try_into().unwrap()),
+            size: u32::from_le_bytes(slot[16..20].try_into().unwrap()),
+            first_seen: u32::from_le_bytes(slot[20..24].try_into().unwrap()),
+            count: u32::from_le_bytes(slot[24..28].try_into().unwrap()),
+        });
+    }
+    entries.sort_by_key(|e| e.offset);
+    Ok((epoch, entries))
+}
+
+/// A packed input store consisting of an index and a data file.
+pub struct InputStore {
+    epoch: u64,
+    entries: Vec<StoredInput>,
+    data: File,
+}
+
+impl InputStore {
+    /// Opens the store with the given index file ('inputs_<pid>.idx').
+    /// The data file is expected next to it with the '.dat' extension.
+    pub fn open<P: AsRef<Path>>(index_path: P) -> Result<Self, String> {
+        let index_path = index_path.as_ref();
+        let index = File::open(index_path)
+            .map_err(|e| format!("Failed to open {:?}: {}", index_path, e))?;
+        let (epoch, entries) = parse_index(BufReader::new(index))?;
+
+        let data_path: PathBuf = index_path.with_extension("dat");
+        let data = File::open(&data_path)
+            .map_err(|e| format!("Failed to open {:?}: {}", data_path, e))?;
+        Ok(Self {
+            epoch,
+            entries,
+            data,
+        })
+    }
+
+    /// The unix time (in seconds) that first-seen time stamps are relative to.
+    pub fn epoch(&self) -> u64 {
+        self.epoch
+    }
+
+    /// All inputs in the store.
+    pub fn entries(&self) -> &[StoredInput] {
+        &self.entries
+    }
+
+    /// Reads the bytes of the given input.
+    pub fn read(&self, entry: &StoredInput) -> Result<Vec<u8>, String> {
+        let mut result = vec![0u8; entry.size as usize];
+        self.data
+            .read_exact_at(&mut result, entry.offset)
+            .map_err(|e| format!("Failed to read input {:016x}: {}", entry.hash, e))?;
+        Ok(result)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{parse_index, StoredInput};
+
+    fn slot(hash: u64, offset: u64, size: u32, count: u32, ready: u32) -> Vec<u8> {
+        let mut result = Vec::<u8>::new();
+        result.extend_from_slice(&hash.to_le_bytes());
+        result.extend_from_slice(&offset.to_le_bytes());
+        result.extend_from_slice(&size.to_le_bytes());
+        result.extend_from_slice(&7u32.to_le_bytes());
+        result.extend_from_slice(&count.to_le_bytes());
+        result.extend_from_slice(&ready.to_le_bytes());
+        result
+    }
+
+    fn index(slots: &[Vec<u8>]) -> Vec<u8> {
+        let mut result = b"RVIS".to_vec();
+        result.extend_from_slice(&1u32.to_le_bytes());
+        result.extend_from_slice(&1704063600u64.to_le_bytes());
+        result.extend_from_slice(&(slots.len() as u64).to_le_bytes());
+        result.resize(64, 0);
+        for s in slots {
+            result.extend_from_slice(s);
+        }
+        result
+    }
+
+    #[test]
+    fn parse_entries() {
+        let data = index(&[
+            slot(0, 0, 0, 0, 0),
+            slot(0xaa, 8, 4, 3, 1),
+            slot(0xbb, 0, 8, 1, 1),
+            // Claimed but never finished.
+            slot(0xcc, 12, 4, 1, 0),
+        ]);
+        let (epoch, entries) = parse_index(data.as_slice()).unwrap();
+        assert_eq!(epoch, 1704063600);
+        assert_eq!(
+            entries,
+            vec![
+                StoredInput {
+                    hash: 0xbb,
+                    offset: 0,
+                    size: 8,
+                    first_seen: 7,
+                    count: 1
+                },
+                StoredInput {
+                    hash: 0xaa,
+                    offset: 8,
+                    size: 4,
+                    first_seen: 7,
+                    count: 3
+                }
+            ]
+        );
+    }
+
+    #[test]
+    fn parse_invalid() {
+        assert!(parse_index(&b"RVIS"[..]).is_err());
+        let mut data = index(&[]);
+        data[4] = 2;
+        assert!(parse_index(data.as_slice()).is_err());
+    }
+}
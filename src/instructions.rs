@@ -1,7 +1,14 @@
-use std::iter::{zip, Flatten};
+use std::{
+    fmt,
+    iter::{Flatten, Take},
+    ops::Deref,
+};
 
 pub type EncodedInstruction = u32;
 
+/// The maximum number of operands of a single instruction.
+pub const MAX_OPERANDS: usize = 5;
+
 #[derive(Clone, Debug, PartialEq, Eq, Hash)]
 pub struct ArgumentSpec {
     name: &'static str,
@@ -20,11 +27,20 @@ impl ArgumentSpec {
     }
 
     pub fn extract(&'static self, inst: EncodedInstruction) -> Argument {
-        let mask: u32 = 2u32.pow(self.length) - 1u32;
-        let value: u32 = (inst >> self.offset) & mask;
+        let value: u32 = (inst >> self.offset) & self.mask();
         Argument { spec: self, value }
     }
 
+    /// The mask for values of this argument (before shifting it into place).
+    pub fn mask(&self) -> u32 {
+        2u32.pow(self.length) - 1u32
+    }
+
+    /// The bits of an encoded instruction that belong to this argument.
+    pub fn field_mask(&self) -> EncodedInstruction {
+        self.mask() << self.offset
+    }
+
     pub fn length(&self) -> u32 {
         self.length
     }
@@ -74,7 +90,9 @@ impl InstructionTemplate {
         }
     }
 
-    pub fn operands(&self) -> Flatten<std::array::IntoIter<&Option<&'static ArgumentSpec>, 5>> {
+    pub fn operands(
+        &self,
+    ) -> Flatten<std::array::IntoIter<&Option<&'static ArgumentSpec>, MAX_OPERANDS>> {
         [
             &self.operand1,
             &self.operand2,
@@ -90,6 +108,11 @@ impl InstructionTemplate {
         self.match_pattern
     }
 
+    /// The bits of an instruction that are fixed by this template.
+    pub fn mask_pattern(&self) -> EncodedInstruction {
+        self.mask_pattern
+    }
+
     pub fn name(&self) -> &str {
         self.name
     }
@@ -112,47 +135,74 @@ impl InstructionTemplate {
             return None;
         }
 
-        let mut args = Vec::<Argument>::new();
+        // Only keep the bits that belong to the opcode or an operand, so that
+        // the result doesn't depend on any unused bits in the input.
+        let mut encoded = self.match_pattern;
         for arg in self.operands() {
-            args.push(arg.extract(data))
+            encoded |= data & arg.field_mask();
         }
         Some(Instruction {
             template: self,
-            arguments: args,
+            encoded,
         })
     }
 }
 
 include!(concat!(env!("OUT_DIR"), "/raw_instructions.rs"));
 
+/// Commonly used sets of instructions. Each set is only built once.
 pub mod sets {
+    use std::sync::OnceLock;
+
     use super::riscv::*;
     use super::InstructionTemplate;
 
-    pub fn riscv_g() -> Vec<&'static InstructionTemplate> {
-        let mut result = Vec::<&'static InstructionTemplate>::new();
-        result.append(&mut rv64_i::INSTS.to_vec());
-        result.append(&mut rv64_a::INSTS.to_vec());
-        result.append(&mut rv64_d::INSTS.to_vec());
-        result.append(&mut rv64_f::INSTS.to_vec());
-        result.append(&mut rv64_m::INSTS.to_vec());
-        result.append(&mut rv_i::INSTS.to_vec());
-        result.append(&mut rv_a::INSTS.to_vec());
-        result.append(&mut rv_d::INSTS.to_vec());
-        result.append(&mut rv_f::INSTS.to_vec());
-        result.append(&mut rv_m::INSTS.to_vec());
-        result
+    pub fn riscv_g() -> &'static [&'static InstructionTemplate] {
+        static SET: OnceLock<Vec<&'static InstructionTemplate>> = OnceLock::new();
+        SET.get_or_init(|| {
+            let mut result = Vec::<&'static InstructionTemplate>::new();
+            result.extend_from_slice(&rv64_i::INSTS);
+            result.extend_from_slice(&rv64_a::INSTS);
+            result.extend_from_slice(&rv64_d::INSTS);
+            result.extend_from_slice(&rv64_f::INSTS);
+            result.extend_from_slice(&rv64_m::INSTS);
+            result.extend_from_slice(&rv_i::INSTS);
+            result.extend_from_slice(&rv_a::INSTS);
+            result.extend_from_slice(&rv_d::INSTS);
+            result.extend_from_slice(&rv_f::INSTS);
+            result.extend_from_slice(&rv_m::INSTS);
+            result
+        })
     }
 
-    pub fn riscv_base() -> Vec<&'static InstructionTemplate> {
-        let mut result = Vec::<&'static InstructionTemplate>::new();
-        result.append(&mut rv64_i::INSTS.to_vec());
-        result.append(&mut rv_i::INSTS.to_vec());
-        result
+    pub fn riscv_base() -> &'static [&'static InstructionTemplate] {
+        static SET: OnceLock<Vec<&'static InstructionTemplate>> = OnceLock::new();
+        SET.get_or_init(|| {
+            let mut result = Vec::<&'static InstructionTemplate>::new();
+            result.extend_from_slice(&rv64_i::INSTS);
+            result.extend_from_slice(&rv_i::INSTS);
+            result
+        })
+    }
+
+    /// All generated extension modules and their instructions.
+    pub fn extensions() -> [(&'static str, &'static [&'static InstructionTemplate]); 10] {
+        [
+            ("rv_i", &rv_i::INSTS),
+            ("rv_m", &rv_m::INSTS),
+            ("rv_a", &rv_a::INSTS),
+            ("rv_f", &rv_f::INSTS),
+            ("rv_d", &rv_d::INSTS),
+            ("rv64_i", &rv64_i::INSTS),
+            ("rv64_m", &rv64_m::INSTS),
+            ("rv64_a", &rv64_a::INSTS),
+            ("rv64_f", &rv64_f::INSTS),
+            ("rv64_d", &rv64_d::INSTS),
+        ]
     }
 }
 
-#[derive(Clone, Debug, PartialEq, Eq, Hash)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
 pub struct Argument {
     spec: &'static ArgumentSpec,
     value: u32,
@@ -160,7 +210,7 @@ pub struct Argument {
 
 impl Argument {
     pub fn encode(&self) -> EncodedInstruction {
-        self.value << self.spec.offset
+        (self.value & self.spec.mask()) << self.spec.offset
     }
     pub fn new(spec: &'static ArgumentSpec, value: u32) -> Argument {
         Argument { spec, value }
@@ -174,39 +224,103 @@ impl Argument {
     }
 }
 
-#[derive(Clone, Debug, PartialEq, Eq, Hash)]
+/// Placeholder spec for the unused entries in `Arguments`.
+static NO_ARGUMENT: ArgumentSpec = ArgumentSpec {
+    name: "",
+    length: 0,
+    offset: 0,
+};
+
+/// The decoded arguments of an instruction. Stored inline so that extracting
+/// the arguments of an instruction doesn't need a heap allocation.
+#[derive(Clone, Copy)]
+pub struct Arguments {
+    len: usize,
+    args: [Argument; MAX_OPERANDS],
+}
+
+impl Deref for Arguments {
+    type Target = [Argument];
+
+    fn deref(&self) -> &[Argument] {
+        &self.args[..self.len]
+    }
+}
+
+impl IntoIterator for Arguments {
+    type Item = Argument;
+    type IntoIter = Take<std::array::IntoIter<Argument, MAX_OPERANDS>>;
+
+    fn into_iter(self) -> Self::IntoIter {
+        self.args.into_iter().take(self.len)
+    }
+}
+
+impl<'a> IntoIterator for &'a Arguments {
+    type Item = &'a Argument;
+    type IntoIter = std::slice::Iter<'a, Argument>;
+
+    fn into_iter(self) -> Self::IntoIter {
+        self.iter()
+    }
+}
+
+impl PartialEq for Arguments {
+    fn eq(&self, other: &Self) -> bool {
+        self[..] == other[..]
+    }
+}
+
+impl Eq for Arguments {}
+
+impl fmt::Debug for Arguments {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_list().entries(self.iter()).finish()
+    }
+}
+
+/// A single instruction. Stored in its encoded form next to its template,
+/// so instructions are small, can be copied around freely and never need a
+/// heap allocation.
+#[derive(Clone, Copy, PartialEq, Eq, Hash)]
 pub struct Instruction {
     template: &'static InstructionTemplate,
-    arguments: Vec<Argument>,
+    encoded: EncodedInstruction,
 }
 
 impl Instruction {
     pub fn encode(&self) -> EncodedInstruction {
-        let mut result: EncodedInstruction = self.template.base_pattern();
-        for arg in &self.arguments {
-            result |= arg.encode()
-        }
-        result
+        self.encoded
     }
 
-    pub fn new(template: &'static InstructionTemplate, arguments: Vec<Argument>) -> Instruction {
-        // Check that the arguments match the template's arguments.
-        debug_assert_eq!(template.operands().count(), arguments.len());
-        for i in zip(
-            arguments.clone().into_iter(),
-            template.operands().into_iter(),
-        ) {
-            debug_assert_eq!(i.0.spec.name, i.1.name);
-        }
-
-        Instruction {
+    pub fn new<A: IntoIterator<Item = Argument>>(
+        template: &'static InstructionTemplate,
+        arguments: A,
+    ) -> Instruction {
+        let mut result = Instruction {
             template,
-            arguments,
+            encoded: template.base_pattern(),
+        };
+        let mut num_args = 0usize;
+        for arg in arguments {
+            result.set_arg(arg);
+            num_args += 1;
         }
+        // Check that the arguments match the template's arguments.
+        debug_assert_eq!(template.operands().count(), num_args);
+        result
     }
 
-    pub fn arguments(&self) -> &[Argument] {
-        self.arguments.as_ref()
+    pub fn arguments(&self) -> Arguments {
+        let mut result = Arguments {
+            len: 0,
+            args: [Argument::new(&NO_ARGUMENT, 0); MAX_OPERANDS],
+        };
+        for op in self.template.operands() {
+            result.args[result.len] = op.extract(self.encoded);
+            result.len += 1;
+        }
+        result
     }
 
     pub fn template(&self) -> &'static InstructionTemplate {
@@ -214,11 +328,23 @@ impl Instruction {
     }
 
     pub fn set_arg(&mut self, new_arg: Argument) {
-        // Delete the old argument if it exists.
-        self.arguments
-            .retain(|arg: &Argument| arg.spec != new_arg.spec);
-        // Add the new argument at the end.
-        self.arguments.push(new_arg);
+        debug_assert!(
+            self.template.operands().any(|op| *op == new_arg.spec),
+            "Operand {} is not part of {}",
+            new_arg.spec.name,
+            self.template.name
+        );
+        // Clear the old value of the argument and put in the new one.
+        self.encoded = (self.encoded & !new_arg.spec.field_mask()) | new_arg.encode();
+    }
+}
+
+impl fmt::Debug for Instruction {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Instruction")
+            .field("template", &self.template)
+            .field("arguments", &self.arguments())
+            .finish()
     }
 }
 
@@ -277,4 +403,34 @@ mod tests {
         // Do a whole decode-encode roundabout with this instruction.
         assert_eq!(ADD.decode(inst.encode()).unwrap(), inst);
     }
+
+    #[test]
+    fn set_arg_keeps_other_args() {
+        let mut inst = Instruction::new(
+            &ADD,
+            [
+                Argument::new(&args::RD, 1),
+                Argument::new(&args::RS1, 2),
+                Argument::new(&args::RS2, 4),
+            ],
+        );
+        inst.set_arg(Argument::new(&args::RS1, 31));
+        inst.set_arg(Argument::new(&args::RS1, 3));
+        assert_eq!(
+            inst.arguments()[..],
+            [
+                Argument::new(&args::RD, 1),
+                Argument::new(&args::RS1, 3),
+                Argument::new(&args::RS2, 4),
+            ]
+        );
+        assert_eq!(inst.encode(), 0x004180b3);
+    }
+
+    #[test]
+    fn instruction_is_compact() {
+        // Just the template pointer and the encoded instruction.
+        assert_eq!(std::mem::size_of::<Instruction>(), 16);
+        assert_eq!(ECALL.decode(0x00000073).unwrap().arguments().len(), 0);
+    }
 }
@@ -0,0 +1,306 @@
+//! Selects which instructions the mutators generate and how often.
+//! See the --isa and --isa-weights options of sim-fuzzer.
+use std::{fs, path::Path};
+
+use crate::{
+    generator::InstructionSet,
+    instructions::{sets, InstructionTemplate},
+};
+
+/// Coarse classes of instructions, derived from their major opcode.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum InstructionClass {
+    Alu,
+    Loads,
+    Stores,
+    Branches,
+    Jumps,
+    Fp,
+    Amo,
+    Fence,
+    System,
+}
+
+impl InstructionClass {
+    pub const ALL: [InstructionClass; 9] = [
+        InstructionClass::Alu,
+        InstructionClass::Loads,
+        InstructionClass::Stores,
+        InstructionClass::Branches,
+        InstructionClass::Jumps,
+        InstructionClass::Fp,
+        InstructionClass::Amo,
+        InstructionClass::Fence,
+        InstructionClass::System,
+    ];
+
+    pub fn of(template: &InstructionTemplate) -> Self {
+        match template.base_pattern() & 0x7f {
+            // LOAD, LOAD-FP
+            0x03 | 0x07 => InstructionClass::Loads,
+            // STORE, STORE-FP
+            0x23 | 0x27 => InstructionClass::Stores,
+            0x63 => InstructionClass::Branches,
+            // JALR, JAL
+            0x67 | 0x6f => InstructionClass::Jumps,
+            // MADD, MSUB, NMSUB, NMADD, OP-FP
+            0x43 | 0x47 | 0x4b | 0x4f | 0x53 => InstructionClass::Fp,
+            0x2f => InstructionClass::Amo,
+            0x0f => InstructionClass::Fence,
+            0x73 => InstructionClass::System,
+            _ => InstructionClass::Alu,
+        }
+    }
+
+    pub fn name(&self) -> &'static str {
+        match self {
+            InstructionClass::Alu => "alu",
+            InstructionClass::Loads => "loads",
+            InstructionClass::Stores => "stores",
+            InstructionClass::Branches => "branches",
+            InstructionClass::Jumps => "jumps",
+            InstructionClass::Fp => "fp",
+            InstructionClass::Amo => "amo",
+            InstructionClass::Fence => "fence",
+            InstructionClass::System => "system",
+        }
+    }
+
+    pub fn from_name(name: &str) -> Option<Self> {
+        Self::ALL.into_iter().find(|class| class.name() == name)
+    }
+}
+
+/// An instruction together with the extension module it comes from.
+#[derive(Clone, Copy, Debug)]
+pub struct IsaInstruction {
+    pub extension: &'static str,
+    pub template: &'static InstructionTemplate,
+}
+
+/// Parses an ISA description into the instructions it contains.
+///
+/// The description is a comma separated list of extension modules (e.g.,
+/// 'rv_i,rv64_m') and/or extension letters with an optional 'rv'/'rv64'
+/// prefix (e.g., 'rv64imafd' or 'g'). A letter selects both the 32 and the 64
+/// bit module of the extension.
+pub fn parse_isa(spec: &str) -> Result<Vec<IsaInstruction>, String> {
+    let extensions = sets::extensions();
+    let mut selected = Vec::<&'static str>::new();
+    let mut select = |name: &'static str| {
+        if !selected.contains(&name) {
+            selected.push(name);
+        }
+    };
+
+    for item in spec.split(',').map(|item| item.trim().to_lowercase()) {
+        if item.is_empty() {
+            continue;
+        }
+        if let Some((name, _)) = extensions.iter().find(|(name, _)| *name == item) {
+            select(name);
+            continue;
+        }
+
+        let letters = item
+            .strip_prefix("rv64")
+            .or_else(|| item.strip_prefix("rv"))
+            .unwrap_or(&item);
+        for letter in letters.chars() {
+            let expanded = match letter {
+                'g' => "imafd".to_owned(),
+                'i' | 'm' | 'a' | 'f' | 'd' => letter.to_string(),
+                _ => {
+                    let names: Vec<&str> = extensions.iter().map(|(name, _)| *name).collect();
+                    return Err(format!(
+                        "Unknown extension '{}' in ISA '{}'. Supported: letters imafdg or {:?}",
+                        letter, spec, names
+                    ));
+                }
+            };
+            for letter in expanded.chars() {
+                for (name, _) in &extensions {
+                    if name.ends_with(&format!("_{}", letter)) {
+                        select(name);
+                    }
+                }
+            }
+        }
+    }
+
+    let mut result = Vec::<IsaInstruction>::new();
+    for (name, insts) in extensions
+        .iter()
+        .filter(|(name, _)| selected.contains(name))
+    {
+        for template in insts.iter() {
+            result.push(IsaInstruction {
+                extension: name,
+                template,
+            });
+        }
+    }
+    if result.is_empty() {
+        return Err(format!("ISA '{}' contains no instructions", spec));
+    }
+    Ok(result)
+}
+
+/// Assigns a weight to every instruction based on the given weights file.
+///
+/// Every line of the file is '<selector> <weight>' where the selector is an
+/// instruction name ('fadd.s'), a class ('class:loads') or an extension module
+/// ('ext:rv_m'). Instructions start with a weight of 1 and later lines
+/// override earlier ones. A weight of 0 disables an instruction. '#' starts a
+/// comment.
+pub fn parse_weights(
+    insts: &[IsaInstruction],
+    text: &str,
+) -> Result<Vec<(&'static InstructionTemplate, u32)>, String> {
+    let mut weights = vec![1u32; insts.len()];
+    for (line_no, line) in text.lines().enumerate() {
+        let line = line.split('#').next().unwrap().trim();
+        if line.is_empty() {
+            continue;
+        }
+        let err = |msg: String| format!("Line {}: {}", line_no + 1, msg);
+
+        let parts: Vec<&str> = line.split_whitespace().collect();
+        if parts.len() != 2 {
+            return Err(err(format!(
+                "Expected '<selector> <weight>' but got '{}'",
+                line
+            )));
+        }
+        let weight = parts[1]
+            .parse::<u32>()
+            .map_err(|_| err(format!("Invalid weight '{}'", parts[1])))?;
+
+        let selector = parts[0];
+        let matches: Box<dyn Fn(&IsaInstruction) -> bool> =
+            if let Some(class_name) = selector.strip_prefix("class:") {
+                let class = InstructionClass::from_name(class_name).ok_or_else(|| {
+                    let names: Vec<&str> = InstructionClass::ALL.iter().map(|c| c.name()).collect();
+                    err(format!(
+                        "Unknown class '{}'. Supported: {:?}",
+                        class_name, names
+                    ))
+                })?;
+                Box::new(move |inst| InstructionClass::of(inst.template) == class)
+            } else if let Some(extension) = selector.strip_prefix("ext:") {
+                if !sets::extensions()
+                    .iter()
+                    .any(|(name, _)| *name == extension)
+                {
+                    return Err(err(format!("Unknown extension '{}'", extension)));
+                }
+                Box::new(move |inst| inst.extension == extension)
+            } else {
+                if !sets::extensions()
+                    .iter()
+                    .any(|(_, insts)| insts.iter().any(|inst| inst.name() == selector))
+                {
+                    return Err(err(format!("Unknown instruction '{}'", selector)));
+                }
+                Box::new(move |inst| inst.template.name() == selector)
+            };
+
+        // Selectors for instructions outside of the ISA are fine, that way
+        // one weights file can be used with several ISAs.
+        for (i, inst) in insts.iter().enumerate() {
+            if matches(inst) {
+                weights[i] = weight;
+            }
+        }
+    }
+
+    Ok(insts
+        .iter()
+        .zip(weights)
+        .map(|(inst, weight)| (inst.template, weight))
+        .collect())
+}
+
+/// Builds the instruction set for the mutators from the --isa and
+/// --isa-weights options.
+pub fn resolve_instruction_set(
+    isa: &str,
+    weights_file: Option<&Path>,
+) -> Result<InstructionSet, String> {
+    let insts = parse_isa(isa)?;
+    match weights_file {
+        None => {
+            let templates: Vec<&'static InstructionTemplate> =
+                insts.iter().map(|inst| inst.template).collect();
+            Ok(InstructionSet::new(&templates))
+        }
+        Some(path) => {
+            let text = fs::read_to_string(path)
+                .map_err(|e| format!("Failed to read {:?}: {}", path, e))?;
+            let weights = parse_weights(&insts, &text)
+                .map_err(|e| format!("Invalid weights file {:?}: {}", path, e))?;
+            InstructionSet::weighted(&weights)
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::instructions::riscv::{rv64_i, rv_i, rv_m};
+
+    use super::{parse_isa, parse_weights, InstructionClass};
+
+    #[test]
+    fn parse_isa_specs() {
+        let base = parse_isa("i").unwrap();
+        assert_eq!(base.len(), rv_i::INSTS.len() + rv64_i::INSTS.len());
+        assert!(base
+            .iter()
+            .all(|inst| inst.extension == "rv_i" || inst.extension == "rv64_i"));
+
+        // Same extensions in different notations.
+        assert_eq!(
+            parse_isa("rv64im").unwrap().len(),
+            parse_isa("rv_i, rv64_i,rv_m,rv64_m").unwrap().len()
+        );
+        assert_eq!(
+            parse_isa("g").unwrap().len(),
+            parse_isa("imafd").unwrap().len()
+        );
+        // Duplicates are ignored.
+        assert_eq!(parse_isa("i,i,rv_i").unwrap().len(), base.len());
+
+        assert!(parse_isa("rv64x").is_err());
+        assert!(parse_isa("").is_err());
+    }
+
+    #[test]
+    fn parse_weight_files() {
+        let insts = parse_isa("imf").unwrap();
+        let weights = parse_weights(
+            &insts,
+            "# Focus on FP.\nclass:alu 0\next:rv_m 2\nclass:fp 5\nfadd.s 9 # Especially this.\nfld 3\n",
+        )
+        .unwrap();
+        for (template, weight) in weights {
+            let expected = if template.name() == "fadd.s" {
+                9
+            } else if InstructionClass::of(template) == InstructionClass::Fp {
+                5
+            } else if rv_m::INSTS.contains(&template) {
+                2
+            } else if InstructionClass::of(template) == InstructionClass::Alu {
+                0
+            } else {
+                1
+            };
+            assert_eq!(weight, expected, "{}", template.name());
+        }
+
+        assert!(parse_weights(&insts, "add").is_err());
+        assert!(parse_weights(&insts, "add x").is_err());
+        assert!(parse_weights(&insts, "class:vector 1").is_err());
+        assert!(parse_weights(&insts, "ext:rv_v 1").is_err());
+        assert!(parse_weights(&insts, "notaninst 1").is_err());
+    }
+}
@@ -1,10 +1,28 @@
 pub mod assembler;
+pub mod batch;
 pub mod calibration;
 pub mod causes;
+pub mod checkpoint;
+pub mod coverage_map;
+pub mod exec_log;
 pub mod fuzz_ui;
 pub mod generator;
+pub mod hash;
+pub mod hybrid_corpus;
+pub mod in_process;
+pub mod input_store;
 pub mod instructions;
+pub mod isa;
+pub mod logger;
+pub mod map_size;
+pub mod minimizer;
 pub mod monitor;
+pub mod mutation_scheduler;
 pub mod mutator;
 pub mod parser;
+pub mod prefilter;
 pub mod program_input;
+pub mod seeds;
+pub mod sparse_feedback;
+pub mod stats;
+pub mod sync;
@@ -0,0 +1,374 @@
+//! The logger of the fuzzer processes. Records are formatted by the caller
+//! and handed to a background thread through a bounded channel, which writes
+//! them buffered into one file per process and flushes it periodically. The
+//! fuzzing loop therefore never waits for the disk. If the thread falls
+//! behind, records are dropped and the number of dropped records is logged.
+//!
+//! Besides the text format, records can be written in a compact binary
+//! format (see `fuzz-log` for a reader). Its layout (little endian):
+//!   file header: magic "RVLG", u32 version
+//!   records: u32 size of the rest, u64 unix time in microseconds,
+//!            u8 level, u16 size of the target, target, message
+use std::{
+    fs::{File, OpenOptions},
+    io::{BufReader, BufWriter, Read, Write},
+    path::{Path, PathBuf},
+    process,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        mpsc::{sync_channel, Receiver, RecvTimeoutError, SyncSender, TrySendError},
+        Mutex, Once,
+    },
+    thread,
+    time::{Duration, Instant, SystemTime, UNIX_EPOCH},
+};
+
+use log::{Level, Metadata, Record};
+
+pub const FUZZING_LOG_DIR_VAR: &str = "FUZZING_LOG_DIR";
+
+const MAGIC: &[u8; 4] = b"RVLG";
+const VERSION: u32 = 1;
+/// How many records can be queued for the writer thread.
+const QUEUE_LEN: usize = 4096;
+/// How often buffered records are written to the file.
+const FLUSH_INTERVAL: Duration = Duration::from_secs(1);
+const BUFFER_SIZE: usize = 64 * 1024;
+
+enum LogMessage {
+    Record(Vec<u8>),
+    /// Writes out everything queued so far and then acknowledges.
+    Flush(SyncSender<()>),
+}
+
+/// The writer thread of the current process.
+struct LogSink {
+    /// The process that started the thread. Forked clients don't inherit the
+    /// thread, so they have to start their own.
+    pid: u32,
+    sender: SyncSender<LogMessage>,
+    dropped: u64,
+}
+
+/// Set as the global logger, writes into `FUZZING_LOG_DIR`.
+pub struct FuzzLogger {
+    binary: AtomicBool,
+    sink: Mutex<Option<LogSink>>,
+}
+
+impl FuzzLogger {
+    pub const fn new() -> Self {
+        Self {
+            binary: AtomicBool::new(false),
+            sink: Mutex::new(None),
+        }
+    }
+
+    /// Switches to the binary record format. Has to be called before the
+    /// first record is logged.
+    pub fn set_binary(&self, binary: bool) {
+        self.binary.store(binary, Ordering::Relaxed);
+    }
+
+    fn log_path(&self) -> PathBuf {
+        let log_dir = std::env::var(FUZZING_LOG_DIR_VAR).unwrap_or(".".to_owned());
+        let extension = if self.binary.load(Ordering::Relaxed) {
+            "bin"
+        } else {
+            "log"
+        };
+        PathBuf::from(format!(
+            "{}/fuzzer-pid_{}.{}",
+            log_dir,
+            process::id(),
+            extension
+        ))
+    }
+
+    fn encode(&self, level: Level, target: &str, message: &str) -> Vec<u8> {
+        if self.binary.load(Ordering::Relaxed) {
+            encode_binary(SystemTime::now(), level, target, message)
+        } else {
+            format!("{}\n", message).into_bytes()
+        }
+    }
+
+    /// Sends a message to the writer thread of this process, starting it if
+    /// needed. Returns false if the queue is full.
+    fn send(&self, sink: &mut Option<LogSink>, message: LogMessage) -> bool {
+        let pid = process::id();
+        if sink.as_ref().map_or(true, |sink| sink.pid != pid) {
+            let (sender, receiver) = sync_channel(QUEUE_LEN);
+            let path = self.log_path();
+            let binary = self.binary.load(Ordering::Relaxed);
+            let started = thread::Builder::new()
+                .name("fuzz-log".to_owned())
+                .spawn(move || write_records(&path, binary, receiver));
+            if started.is_err() {
+                return false;
+            }
+            *sink = Some(LogSink {
+                pid,
+                sender,
+                dropped: 0,
+            });
+        }
+        let sink = sink.as_mut().unwrap();
+        match sink.sender.try_send(message) {
+            Ok(()) => true,
+            Err(TrySendError::Full(_)) | Err(TrySendError::Disconnected(_)) => false,
+        }
+    }
+}
+
+impl Default for FuzzLogger {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl log::Log for FuzzLogger {
+    fn enabled(&self, _metadata: &Metadata) -> bool {
+        true
+    }
+
+    fn log(&self, record: &Record) {
+        // Format outside of the lock and on the calling thread, as the
+        // arguments can't be sent to the writer.
+        let bytes = if self.binary.load(Ordering::Relaxed) {
+            self.encode(record.level(), record.target(), &record.args().to_string())
+        } else {
+            format!("{:?}\n", record).into_bytes()
+        };
+        let mut sink = self.sink.lock().unwrap();
+        let dropped = sink
+            .as_ref()
+            .filter(|sink| sink.pid == process::id())
+            .map_or(0, |sink| sink.dropped);
+        if dropped > 0 {
+            let note = self.encode(
+                Level::Warn,
+                "fuzz_logger",
+                &format!("Dropped {} log records", dropped),
+            );
+            if self.send(&mut sink, LogMessage::Record(note)) {
+                sink.as_mut().unwrap().dropped = 0;
+            }
+        }
+        if !self.send(&mut sink, LogMessage::Record(bytes)) {
+            if let Some(sink) = sink.as_mut() {
+                sink.dropped += 1;
+            }
+        }
+    }
+
+    /// Waits until everything logged so far is written to the file.
+    fn flush(&self) {
+        let sender = {
+            let sink = self.sink.lock().unwrap();
+            match sink.as_ref().filter(|sink| sink.pid == process::id()) {
+                Some(sink) => sink.sender.clone(),
+                None => return,
+            }
+        };
+        let (ack_sender, ack) = sync_channel(1);
+        // Unlike records, flushes wait for space in the queue.
+        if sender.send(LogMessage::Flush(ack_sender)).is_ok() {
+            let _ = ack.recv();
+        }
+    }
+}
+
+/// The writer thread.
+fn write_records(path: &Path, binary: bool, receiver: Receiver<LogMessage>) {
+    let file = match OpenOptions::new().append(true).create(true).open(path) {
+        Ok(file) => file,
+        Err(err) => {
+            eprintln!("Failed to open log {:?}: {}", path, err);
+            return;
+        }
+    };
+    let is_new = file.metadata().map_or(true, |meta| meta.len() == 0);
+    let mut out = BufWriter::with_capacity(BUFFER_SIZE, file);
+    if binary && is_new {
+        let _ = out.write_all(MAGIC);
+        let _ = out.write_all(&VERSION.to_le_bytes());
+    }
+
+    let mut dirty = false;
+    let mut last_flush = Instant::now();
+    loop {
+        match receiver.recv_timeout(FLUSH_INTERVAL) {
+            Ok(LogMessage::Record(bytes)) => {
+                let _ = out.write_all(&bytes);
+                dirty = true;
+            }
+            Ok(LogMessage::Flush(ack)) => {
+                let _ = out.flush();
+                dirty = false;
+                last_flush = Instant::now();
+                let _ = ack.send(());
+            }
+            Err(RecvTimeoutError::Timeout) => (),
+            Err(RecvTimeoutError::Disconnected) => break,
+        }
+        if dirty && last_flush.elapsed() >= FLUSH_INTERVAL {
+            let _ = out.flush();
+            dirty = false;
+            last_flush = Instant::now();
+        }
+    }
+    let _ = out.flush();
+}
+
+fn encode_binary(time: SystemTime, level: Level, target: &str, message: &str) -> Vec<u8> {
+    let micros = time
+        .duration_since(UNIX_EPOCH)
+        .map_or(0, |since| since.as_micros() as u64);
+    let target = &target.as_bytes()[..target.len().min(u16::MAX as usize)];
+    let size = 8 + 1 + 2 + target.len() + message.len();
+    let mut out = Vec::with_capacity(4 + size);
+    out.extend_from_slice(&(size as u32).to_le_bytes());
+    out.extend_from_slice(&micros.to_le_bytes());
+    out.push(level as u8);
+    out.extend_from_slice(&(target.len() as u16).to_le_bytes());
+    out.extend_from_slice(target);
+    out.extend_from_slice(message.as_bytes());
+    out
+}
+
+/// A single record of a binary log.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct LogRecord {
+    /// Unix time in microseconds.
+    pub time: u64,
+    pub level: Level,
+    pub target: String,
+    pub message: String,
+}
+
+/// Streams the records of a binary log.
+pub struct LogReader<R: Read> {
+    input: R,
+}
+
+impl<R: Read> LogReader<R> {
+    /// Reads the header of the log from the given reader.
+    pub fn new(mut input: R) -> Result<Self, String> {
+        let mut header = [0u8; 8];
+        input
+            .read_exact(&mut header)
+            .map_err(|_| "Truncated log header".to_owned())?;
+        if &header[0..4] != MAGIC {
+            return Err("Not a binary fuzzer log".to_owned());
+        }
+        let version = u32::from_le_bytes(header[4..8].try_into().unwrap());
+        if version != VERSION {
+            return Err(format!("Unsupported log version {}", version));
+        }
+        Ok(Self { input })
+    }
+}
+
+impl<R: Read> Iterator for LogReader<R> {
+    type Item = LogRecord;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let mut size = [0u8; 4];
+        self.input.read_exact(&mut size).ok()?;
+        let mut record = vec![0u8; u32::from_le_bytes(size) as usize];
+        // A truncated file just ends the log early.
+        self.input.read_exact(&mut record).ok()?;
+        if record.len() < 11 {
+            return None;
+        }
+        let target_len = u16::from_le_bytes(record[9..11].try_into().unwrap()) as usize;
+        if record.len() < 11 + target_len {
+            return None;
+        }
+        let level = match record[8] {
+            1 => Level::Error,
+            2 => Level::Warn,
+            3 => Level::Info,
+            4 => Level::Debug,
+            _ => Level::Trace,
+        };
+        Some(LogRecord {
+            time: u64::from_le_bytes(record[0..8].try_into().unwrap()),
+            level,
+            target: String::from_utf8_lossy(&record[11..11 + target_len]).into_owned(),
+            message: String::from_utf8_lossy(&record[11 + target_len..]).into_owned(),
+        })
+    }
+}
+
+/// Opens the binary log at the given path.
+pub fn open_fuzz_log<P: AsRef<Path>>(path: P) -> Result<LogReader<BufReader<File>>, String> {
+    let file = File::open(path.as_ref())
+        .map_err(|err| format!("Failed to open {:?}: {}", path.as_ref(), err))?;
+    LogReader::new(BufReader::new(file))
+}
+
+/// Flushes the logger, e.g. before the process exits.
+pub fn flush_log() {
+    log::logger().flush();
+}
+
+extern "C" fn flush_log_at_exit() {
+    flush_log();
+}
+
+/// Flushes the logger when the process exits, also through `process::exit`
+/// (which LibAFL uses to stop the clients). Panics don't exit, so the panic
+/// hook has to call `flush_log` itself.
+pub fn flush_log_on_exit() {
+    static REGISTER: Once = Once::new();
+    REGISTER.call_once(|| unsafe {
+        libc::atexit(flush_log_at_exit);
+    });
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::{Duration, UNIX_EPOCH};
+
+    use log::Level;
+
+    use super::{encode_binary, LogReader, LogRecord, MAGIC, VERSION};
+
+    #[test]
+    fn binary_round_trip() {
+        let mut log = MAGIC.to_vec();
+        log.extend_from_slice(&VERSION.to_le_bytes());
+        let time = UNIX_EPOCH + Duration::from_micros(1_700_000_000_123_456);
+        log.extend(encode_binary(
+            time,
+            Level::Info,
+            "sim_fuzzer",
+            "MUTATIONS: add 3",
+        ));
+        log.extend(encode_binary(time, Level::Error, "", ""));
+        // A record cut off by a crash.
+        log.extend(&encode_binary(time, Level::Warn, "x", "lost")[..10]);
+
+        let records: Vec<LogRecord> = LogReader::new(log.as_slice()).unwrap().collect();
+        assert_eq!(
+            records,
+            vec![
+                LogRecord {
+                    time: 1_700_000_000_123_456,
+                    level: Level::Info,
+                    target: "sim_fuzzer".to_owned(),
+                    message: "MUTATIONS: add 3".to_owned(),
+                },
+                LogRecord {
+                    time: 1_700_000_000_123_456,
+                    level: Level::Error,
+                    target: String::new(),
+                    message: String::new(),
+                },
+            ]
+        );
+        assert!(LogReader::new(&b"RVEL\x01\x00\x00\x00"[..]).is_err());
+    }
+}
@@ -0,0 +1,141 @@
+//! Sizing of the coverage map. AFL++ instrumented targets know how many map
+//! entries their instrumentation uses (`__afl_map_size`) and print it when
+//! started with `AFL_DUMP_MAP_SIZE` set. If the binary contains that name,
+//! the fuzzer asks the target once at startup and sizes the shared memory
+//! and the map observer to match, so that the map passes after every
+//! execution don't touch unused entries. If the forkserver reports an even
+//! smaller map in its handshake, the observer is truncated to that (see
+//! `build_dynamic_map`).
+use std::{
+    fs::File,
+    io::{BufReader, Read},
+    path::Path,
+    process::{Command, Stdio},
+    thread,
+    time::{Duration, Instant},
+};
+
+/// The map size used when the target can't tell its map size.
+pub const DEFAULT_MAP_SIZE: usize = 2_621_440;
+/// AFL++ only works with maps in multiples of this size.
+const MAP_SIZE_ALIGN: usize = 64;
+/// How long the target may take to print its map size.
+const PROBE_TIMEOUT: Duration = Duration::from_secs(10);
+/// The variable the AFL++ runtime checks, so every binary that can print
+/// its map size contains it.
+const DUMP_MAP_SIZE_VAR: &str = "AFL_DUMP_MAP_SIZE";
+
+/// Rounds the map size up to the next size the AFL++ runtime accepts.
+pub fn align_map_size(size: usize) -> usize {
+    (size.max(1) + MAP_SIZE_ALIGN - 1) / MAP_SIZE_ALIGN * MAP_SIZE_ALIGN
+}
+
+/// Parses the output of a target started with `AFL_DUMP_MAP_SIZE`.
+fn parse_map_size(output: &str) -> Option<usize> {
+    output
+        .lines()
+        .next()?
+        .trim()
+        .parse::<usize>()
+        .ok()
+        .filter(|size| *size > 0)
+}
+
+/// Returns whether the marker occurs anywhere in the input.
+fn contains_marker<R: Read>(mut input: R, marker: &[u8]) -> bool {
+    let mut window = Vec::with_capacity(64 * 1024 + marker.len());
+    let mut chunk = vec![0u8; 64 * 1024];
+    loop {
+        let read = match input.read(&mut chunk) {
+            Ok(0) | Err(_) => return false,
+            Ok(read) => read,
+        };
+        window.extend_from_slice(&chunk[..read]);
+        if window.windows(marker.len()).any(|bytes| bytes == marker) {
+            return true;
+        }
+        // Keep the tail in case the marker spans two chunks.
+        let keep = window.len().min(marker.len() - 1);
+        window.drain(..window.len() - keep);
+    }
+}
+
+/// Starts the target with `AFL_DUMP_MAP_SIZE` and returns the (aligned) map
+/// size it reports. Other targets would just run on an empty input (until
+/// the timeout), so they aren't started at all.
+pub fn probe_map_size(executable: &Path, arguments: &[String]) -> Result<usize, String> {
+    let binary = File::open(executable)
+        .map_err(|err| format!("Failed to open {:?}: {}", executable, err))?;
+    if !contains_marker(BufReader::new(binary), DUMP_MAP_SIZE_VAR.as_bytes()) {
+        return Err(format!("{:?} can't report its map size", executable));
+    }
+
+    // The size is printed before main, so the input file doesn't matter.
+    let arguments = arguments.iter().map(|arg| {
+        if arg == "@@" {
+            "/dev/null"
+        } else {
+            arg.as_str()
+        }
+    });
+    let mut child = Command::new(executable)
+        .args(arguments)
+        .env(DUMP_MAP_SIZE_VAR, "1")
+        .stdin(Stdio::null())
+        .stdout(Stdio::piped())
+        .stderr(Stdio::null())
+        .spawn()
+        .map_err(|err| format!("Failed to start {:?}: {}", executable, err))?;
+
+    let started = Instant::now();
+    loop {
+        match child.try_wait() {
+            Ok(Some(_)) => break,
+            Ok(None) if started.elapsed() < PROBE_TIMEOUT => {
+                thread::sleep(Duration::from_millis(10));
+            }
+            // A target that doesn't know the variable just runs normally.
+            _ => {
+                let _ = child.kill();
+                let _ = child.wait();
+                return Err(format!("{:?} didn't report its map size", executable));
+            }
+        }
+    }
+
+    let mut output = String::new();
+    child
+        .stdout
+        .take()
+        .map(|mut stdout| stdout.read_to_string(&mut output));
+    parse_map_size(&output)
+        .map(align_map_size)
+        .ok_or_else(|| format!("{:?} didn't report its map size", executable))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{align_map_size, contains_marker, parse_map_size};
+
+    #[test]
+    fn map_size_from_output() {
+        assert_eq!(parse_map_size("65536\n"), Some(65536));
+        assert_eq!(parse_map_size("1234\nsome other output\n"), Some(1234));
+        assert_eq!(parse_map_size(""), None);
+        assert_eq!(parse_map_size("0\n"), None);
+        assert_eq!(parse_map_size("usage: sim <program>\n"), None);
+
+        assert_eq!(align_map_size(1234), 1280);
+        assert_eq!(align_map_size(65536), 65536);
+        assert_eq!(align_map_size(0), 64);
+    }
+
+    #[test]
+    fn find_marker() {
+        let mut binary = vec![0u8; 200_000];
+        assert!(!contains_marker(binary.as_slice(), b"AFL_DUMP_MAP_SIZE"));
+        // Across the boundary of two reads.
+        binary[64 * 1024 - 4..64 * 1024 + 13].copy_from_slice(b"AFL_DUMP_MAP_SIZE");
+        assert!(contains_marker(binary.as_slice(), b"AFL_DUMP_MAP_SIZE"));
+    }
+}
@@ -0,0 +1,453 @@
+//! Shrinks corpus entries and found causes while they keep their coverage
+//! or keep triggering the same cause. Shorter programs simulate faster, so
+//! every later execution of a minimized corpus entry is cheaper.
+extern crate alloc;
+use alloc::string::{String, ToString};
+use core::marker::PhantomData;
+use std::{
+    fs,
+    path::{Path, PathBuf},
+};
+
+#[cfg(feature = "introspection")]
+use libafl::monitors::PerfFeature;
+use libafl::{
+    bolts::{
+        shmem::{ShMem, ShMemProvider},
+        tuples::{HasConstLen, Named},
+        AsIter, AsMutSlice, AsSlice,
+    },
+    corpus::{Corpus, CorpusId},
+    executors::{Executor, ExitKind, HasObservers},
+    feedbacks::HasObserverName,
+    inputs::{HasTargetBytes, UsesInput},
+    mark_feature_time,
+    mutators::{MutationResult, MutatorsTuple},
+    observers::{MapObserver, ObserversTuple, UsesObserver},
+    stages::Stage,
+    start_timer,
+    state::{HasClientPerfMonitor, HasCorpus, HasRand, UsesState},
+    Error,
+};
+
+use crate::{
+    causes::FUZZING_CAUSE_DIR_VAR,
+    hash::{hash_fuzzing_bytes, hash_string},
+    instructions::Instruction,
+    mutator::{reducing_mutations, RiscVReducingMutationList},
+    program_input::ProgramInput,
+};
+
+/// The env var with the id of the shared memory of `CauseRedirect`.
+pub const CAUSE_REDIRECT_SHM_ENV: &str = "SIM_CAUSE_REDIRECT_SHM_ID";
+/// The env var with the directory the target saves redirected causes in.
+pub const FUZZING_SCRATCH_DIR_VAR: &str = "FUZZING_SCRATCH_DIR";
+
+/// How many executions minimizing a single program may take at most.
+const MAX_MINIMIZE_EXECS: usize = 512;
+/// How often the reducing mutations are tried after removing chunks.
+const REDUCE_ATTEMPTS: usize = 32;
+
+/// Removes chunks of instructions from the program for as long as `keep`
+/// accepts the result. Starts with removing halves of the program and then
+/// halves the chunk size until single instructions are removed (delta
+/// debugging). Never produces an empty program.
+pub fn remove_chunks<F>(program: Vec<Instruction>, mut keep: F) -> Result<Vec<Instruction>, Error>
+where
+    F: FnMut(&[Instruction]) -> Result<bool, Error>,
+{
+    let mut program = program;
+    let mut chunk = (program.len() / 2).max(1);
+    loop {
+        let mut start = 0;
+        while start < program.len() {
+            let end = (start + chunk).min(program.len());
+            if end - start == program.len() {
+                break;
+            }
+            let mut candidate = Vec::with_capacity(program.len() - (end - start));
+            candidate.extend_from_slice(&program[..start]);
+            candidate.extend_from_slice(&program[end..]);
+            // On success the next chunk moved to `start`, so only advance
+            // if the chunk has to stay.
+            if keep(&candidate)? {
+                program = candidate;
+            } else {
+                start = end;
+            }
+        }
+        if chunk == 1 {
+            break;
+        }
+        chunk /= 2;
+    }
+    Ok(program)
+}
+
+/// Runs a single program on the executor.
+pub(crate) fn run_program<E, EM, Z>(
+    fuzzer: &mut Z,
+    executor: &mut E,
+    state: &mut E::State,
+    mgr: &mut EM,
+    input: &ProgramInput,
+) -> Result<ExitKind, Error>
+where
+    E: Executor<EM, Z> + HasObservers,
+    EM: UsesState<State = E::State>,
+    Z: UsesState<State = E::State>,
+    E::State: HasClientPerfMonitor + UsesInput<Input = ProgramInput>,
+{
+    start_timer!(state);
+    executor.observers_mut().pre_exec_all(state, input)?;
+    mark_feature_time!(state, PerfFeature::PreExecObservers);
+
+    start_timer!(state);
+    let exit_kind = executor.run_target(fuzzer, state, mgr, input)?;
+    mark_feature_time!(state, PerfFeature::TargetExecution);
+
+    start_timer!(state);
+    executor
+        .observers_mut()
+        .post_exec_all(state, input, &exit_kind)?;
+    mark_feature_time!(state, PerfFeature::PostExecObservers);
+    Ok(exit_kind)
+}
+
+/// Shrinks the program with `remove_chunks` and the reducing mutations.
+/// `keep` decides if a candidate still has the property we care about.
+fn minimize_program<S, F>(
+    state: &mut S,
+    input: &ProgramInput,
+    reducers: &mut RiscVReducingMutationList,
+    mut keep: F,
+) -> Result<ProgramInput, Error>
+where
+    S: HasRand,
+    F: FnMut(&mut S, &ProgramInput) -> Result<bool, Error>,
+{
+    let mut execs = 0;
+    let insts = remove_chunks(input.insts().to_vec(), |candidate| {
+        execs += 1;
+        if execs > MAX_MINIMIZE_EXECS {
+            return Ok(false);
+        }
+        keep(state, &ProgramInput::new(candidate.to_vec()))
+    })?;
+
+    let mut current = ProgramInput::new(insts);
+    for _ in 0..REDUCE_ATTEMPTS {
+        if execs > MAX_MINIMIZE_EXECS {
+            break;
+        }
+        let mut candidate = current.clone();
+        let idx = state.rand_mut().below(reducers.len() as u64) as usize;
+        let result = reducers.get_and_mutate(idx.into(), state, &mut candidate, 0)?;
+        if result == MutationResult::Skipped
+            || candidate.insts().is_empty()
+            || candidate.insts() == current.insts()
+        {
+            continue;
+        }
+        execs += 1;
+        if keep(state, &candidate)? {
+            current = candidate;
+        }
+    }
+    Ok(current)
+}
+
+/// Returns the indices of all map entries that were hit in the last run.
+pub(crate) fn covered_entries<O: MapObserver>(map: &O) -> Vec<usize> {
+    let initial = map.initial();
+    (0..map.usable_count())
+        .filter(|idx| *map.get(*idx) != initial)
+        .collect()
+}
+
+/// Minimizes new corpus entries before they are calibrated. A smaller
+/// program replaces the original entry if it still hits every map entry
+/// that the original hit.
+pub struct MinimizationStage<O, OT, S> {
+    enabled: bool,
+    map_observer_name: String,
+    reducers: RiscVReducingMutationList,
+    phantom: PhantomData<(O, OT, S)>,
+}
+
+impl<O, OT, S> UsesState for MinimizationStage<O, OT, S>
+where
+    S: UsesInput,
+{
+    type State = S;
+}
+
+impl<E, EM, O, OT, Z> Stage<E, EM, Z> for MinimizationStage<O, OT, E::State>
+where
+    E: Executor<EM, Z> + HasObservers<Observers = OT>,
+    EM: UsesState<State = E::State>,
+    O: MapObserver,
+    OT: ObserversTuple<E::State>,
+    E::State: HasClientPerfMonitor + HasCorpus + HasRand + UsesInput<Input = ProgramInput>,
+    Z: UsesState<State = E::State>,
+{
+    fn perform(
+        &mut self,
+        fuzzer: &mut Z,
+        executor: &mut E,
+        state: &mut E::State,
+        mgr: &mut EM,
+        corpus_idx: CorpusId,
+    ) -> Result<(), Error> {
+        if !self.enabled {
+            return Ok(());
+        }
+
+        // Like the calibration, only look at each corpus entry once.
+        {
+            let corpus = state.corpus().get(corpus_idx)?.borrow();
+            if corpus.scheduled_count() > 0 {
+                return Ok(());
+            }
+        }
+
+        let input = state
+            .corpus()
+            .get(corpus_idx)?
+            .borrow_mut()
+            .load_input(state.corpus())?
+            .clone();
+        if input.insts().len() <= 1 {
+            return Ok(());
+        }
+
+        if run_program(fuzzer, executor, state, mgr, &input)? != ExitKind::Ok {
+            return Ok(());
+        }
+        let map_observer_name = &self.map_observer_name;
+        let coverage = covered_entries(
+            executor
+                .observers()
+                .match_name::<O>(map_observer_name)
+                .ok_or_else(|| Error::key_not_found("MapObserver not found".to_string()))?,
+        );
+
+        let minimized = minimize_program(state, &input, &mut self.reducers, |state, candidate| {
+            if run_program(fuzzer, executor, state, mgr, candidate)? != ExitKind::Ok {
+                return Ok(false);
+            }
+            let map = executor
+                .observers()
+                .match_name::<O>(map_observer_name)
+                .ok_or_else(|| Error::key_not_found("MapObserver not found".to_string()))?;
+            let initial = map.initial();
+            Ok(coverage.iter().all(|idx| *map.get(*idx) != initial))
+        })?;
+
+        if minimized.insts().len() < input.insts().len() {
+            log::info!(
+                "Minimized corpus entry from {} to {} instructions",
+                input.insts().len(),
+                minimized.insts().len()
+            );
+            let mut testcase = state.corpus().get(corpus_idx)?.borrow().clone();
+            testcase.set_input(minimized);
+            state.corpus_mut().replace(corpus_idx, testcase)?;
+        }
+
+        Ok(())
+    }
+}
+
+impl<O, OT, S> MinimizationStage<O, OT, S>
+where
+    O: MapObserver,
+    OT: ObserversTuple<S>,
+    S: HasCorpus,
+{
+    /// Creates the stage. A disabled stage does nothing, which keeps the
+    /// type of the stages tuple the same for both cases.
+    #[must_use]
+    pub fn new<F>(map_feedback: &F, enabled: bool) -> Self
+    where
+        F: HasObserverName + Named + UsesObserver<S, Observer = O>,
+        for<'it> O: AsIter<'it, Item = O::Entry>,
+    {
+        Self {
+            enabled,
+            map_observer_name: map_feedback.observer_name().to_string(),
+            reducers: reducing_mutations(),
+            phantom: PhantomData,
+        }
+    }
+}
+
+/// Returns the path of the cause file that the harness writes for the
+/// given input and reason.
+fn cause_path(cause_dir: &Path, reason: &str, input: &ProgramInput) -> PathBuf {
+    let hash = hash_fuzzing_bytes(input.target_bytes().as_slice());
+    cause_dir.join(format!("{}%{}", reason, hash_string(hash)))
+}
+
+/// Returns the reason of the cause that the given input triggered.
+fn find_reason(cause_dir: &Path, input: &ProgramInput) -> Option<String> {
+    let suffix = format!(
+        "%{}",
+        hash_string(hash_fuzzing_bytes(input.target_bytes().as_slice()))
+    );
+    fs::read_dir(cause_dir).ok()?.find_map(|entry| {
+        let name = entry.ok()?.file_name().into_string().ok()?;
+        name.strip_suffix(&suffix).map(|reason| reason.to_owned())
+    })
+}
+
+/// Switches the target between saving causes in the cause dir and in a
+/// scratch dir (see `getFuzzingCauseDir` in FuzzerAPI.h). Only the cause dir
+/// is watched for new causes, so the candidates tried by `minimize_cause`
+/// don't count as found causes.
+#[derive(Debug)]
+pub struct CauseRedirect<SHM> {
+    /// A u32 that is non-zero while causes go to the scratch dir.
+    flag: SHM,
+    scratch_dir: PathBuf,
+}
+
+impl<SHM> CauseRedirect<SHM>
+where
+    SHM: ShMem,
+{
+    /// Creates the scratch dir and passes it and the flag to the target via
+    /// the environment, so this has to happen before the target starts.
+    pub fn new(flag: SHM, scratch_dir: PathBuf) -> Result<Self, Error> {
+        fs::create_dir_all(&scratch_dir)?;
+        flag.write_to_env(CAUSE_REDIRECT_SHM_ENV)?;
+        std::env::set_var(FUZZING_SCRATCH_DIR_VAR, &scratch_dir);
+        let mut result = Self { flag, scratch_dir };
+        result.set(false);
+        Ok(result)
+    }
+
+    /// Maps the same flag a second time, for executors that save the causes
+    /// in place of the target.
+    pub fn second_mapping<P>(&self, provider: &mut P) -> Result<CauseRedirect<P::ShMem>, Error>
+    where
+        P: ShMemProvider,
+    {
+        Ok(CauseRedirect {
+            flag: provider.shmem_from_id_and_size(self.flag.id(), self.flag.len())?,
+            scratch_dir: self.scratch_dir.clone(),
+        })
+    }
+
+    fn set(&mut self, redirected: bool) {
+        self.flag.as_mut_slice()[..4].copy_from_slice(&u32::from(redirected).to_le_bytes());
+    }
+
+    /// Returns the dir causes are saved in right now.
+    pub fn cause_dir<'a>(&'a self, cause_dir: &'a Path) -> &'a Path {
+        if self.flag.as_slice()[..4] == [0; 4] {
+            cause_dir
+        } else {
+            &self.scratch_dir
+        }
+    }
+}
+
+/// Minimizes an input that triggered a cause and stores the result in
+/// `out_dir` under the same name scheme as the cause directory. The smaller
+/// program has to trigger the same cause (i.e., the same reason string).
+/// Returns the path of the minimized reproducer or None if the input didn't
+/// report a cause.
+pub fn minimize_cause<E, EM, SHM, Z>(
+    fuzzer: &mut Z,
+    executor: &mut E,
+    state: &mut E::State,
+    mgr: &mut EM,
+    input: &ProgramInput,
+    out_dir: &Path,
+    redirect: &mut CauseRedirect<SHM>,
+) -> Result<Option<PathBuf>, Error>
+where
+    E: Executor<EM, Z> + HasObservers,
+    EM: UsesState<State = E::State>,
+    SHM: ShMem,
+    Z: UsesState<State = E::State>,
+    E::State: HasClientPerfMonitor + HasRand + UsesInput<Input = ProgramInput>,
+{
+    let cause_dir = match std::env::var(FUZZING_CAUSE_DIR_VAR) {
+        Ok(dir) => PathBuf::from(dir),
+        Err(_) => return Ok(None),
+    };
+    let reason = match find_reason(&cause_dir, input) {
+        Some(reason) => reason,
+        None => return Ok(None),
+    };
+
+    let scratch_dir = redirect.scratch_dir.clone();
+    let mut reducers = reducing_mutations();
+    redirect.set(true);
+    let minimized = minimize_program(state, input, &mut reducers, |state, candidate| {
+        // The harness keeps the first file for every input, so an existing
+        // file means the candidate already triggered the cause.
+        if cause_path(&cause_dir, &reason, candidate).exists() {
+            return Ok(true);
+        }
+        run_program(fuzzer, executor, state, mgr, candidate)?;
+        let path = cause_path(&scratch_dir, &reason, candidate);
+        if !path.exists() {
+            return Ok(false);
+        }
+        // Don't flood the scratch dir with intermediate reproducers.
+        let _ = fs::remove_file(&path);
+        Ok(true)
+    });
+    redirect.set(false);
+    let minimized = minimized?;
+
+    let result = cause_path(out_dir, &reason, &minimized);
+    fs::write(&result, minimized.target_bytes().as_slice())
+        .map_err(|e| Error::illegal_state(format!("Failed to write {:?}: {}", result, e)))?;
+    Ok(Some(result))
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::instructions::{
+        riscv::{args, rv_i::ADDI},
+        Argument, Instruction,
+    };
+
+    use super::remove_chunks;
+
+    fn addi(imm: u32) -> Instruction {
+        Instruction::new(
+            &ADDI,
+            vec![
+                Argument::new(&args::RD, 1u32),
+                Argument::new(&args::RS1, 1u32),
+                Argument::new(&args::IMM12, imm),
+            ],
+        )
+    }
+
+    #[test]
+    fn remove_chunks_keeps_required() {
+        let program: Vec<Instruction> = (0..20).map(addi).collect();
+        let required = [addi(3), addi(17)];
+        let mut runs = 0;
+        let result = remove_chunks(program, |candidate| {
+            runs += 1;
+            Ok(required.iter().all(|inst| candidate.contains(inst)))
+        })
+        .unwrap();
+        assert_eq!(result, required.to_vec());
+        assert!(runs < 60);
+    }
+
+    #[test]
+    fn remove_chunks_never_empty() {
+        let program: Vec<Instruction> = (0..5).map(addi).collect();
+        let result = remove_chunks(program, |_| Ok(true)).unwrap();
+        assert_eq!(result.len(), 1);
+    }
+}
@@ -1,21 +1,212 @@
 use core::time::Duration;
-use std::fs::OpenOptions;
+#[cfg(feature = "introspection")]
+use std::collections::BTreeMap;
+use std::collections::HashMap;
+use std::fs::{File, OpenOptions};
 use std::io::Write;
+use std::path::PathBuf;
+use std::sync::mpsc::{sync_channel, Receiver, RecvTimeoutError, SyncSender, TrySendError};
 use std::sync::{Arc, Mutex};
+use std::thread::{self, JoinHandle};
+use std::time::Instant;
 
+#[cfg(feature = "introspection")]
+use libafl::monitors::ClientPerfMonitor;
+use libafl::monitors::UserStats;
 use libafl::prelude::current_time;
 use libafl::prelude::{format_duration_hms, ClientId, ClientStats, Monitor};
 
 use crate::fuzz_ui::FuzzUI;
+use crate::mutation_scheduler::MUTATION_STATS_NAME;
+use crate::stats::{write_metrics, FuzzStats};
 
-/// Tracking monitor during fuzzing.
+/// How many updates can be queued for the UI thread. If the UI falls behind
+/// further, updates are dropped as the next one supersedes them anyway.
+const STATS_QUEUE_LEN: usize = 256;
+/// How often the UI is redrawn and the metrics file is written.
+const TICK_RATE: Duration = Duration::from_millis(250);
+/// Only log every few hundred iterations the time to avoid creating a too
+/// large log file.
+const LOG_EVERY_N_ITERATIONS: u64 = 500;
+
+/// An update from the broker for the UI thread.
+struct StatsEvent {
+    stats: FuzzStats,
+    user_stats: HashMap<String, UserStats>,
+    #[cfg(feature = "introspection")]
+    sender: ClientId,
+    #[cfg(feature = "introspection")]
+    perf: ClientPerfMonitor,
+}
+
+/// Everything the UI thread owns.
+struct StatsSink {
+    ui: FuzzUI,
+    iterations_log: File,
+    last_iterations_logged: u64,
+    metrics_path: PathBuf,
+    latest: Option<FuzzStats>,
+    /// The latest timing breakdown of every client.
+    #[cfg(feature = "introspection")]
+    stage_timing: BTreeMap<u32, ClientPerfMonitor>,
+    #[cfg(feature = "introspection")]
+    stage_timing_path: PathBuf,
+    #[cfg(feature = "introspection")]
+    stage_timing_changed: bool,
+}
+
+impl StatsSink {
+    fn handle(&mut self, event: StatsEvent) {
+        let StatsEvent {
+            mut stats,
+            user_stats,
+            ..
+        } = event;
+        #[cfg(feature = "introspection")]
+        {
+            self.stage_timing.insert(event.sender.0, event.perf);
+            self.stage_timing_changed = true;
+        }
+        let data = self.ui.data();
+        data.add_corpus_size(stats.corpus_size);
+        data.add_max_coverage(stats.coverage as f64);
+        data.update_causes();
+        (stats.causes_found, stats.causes_missing) = data.cause_counts();
+
+        if stats.execs > self.last_iterations_logged + LOG_EVERY_N_ITERATIONS {
+            self.last_iterations_logged = stats.execs;
+
+            // Write the current time and iterations to a log file. This can
+            // be used to find infer iterations-to-exposure from the
+            // time-to-exposure data we log.
+            writeln!(
+                self.iterations_log,
+                "{} {} {} {} {}",
+                stats.run_time.as_secs(),
+                stats.execs,
+                stats.corpus_size,
+                data.get_max_coverage() as u64,
+                stats.coverage_max
+            )
+            .expect("Failed to update iterations log file");
+
+            // Stats arrive for every client all the time, so the mutation
+            // stats are logged along with the iterations.
+            if let Some(mutations) = user_stats.get(MUTATION_STATS_NAME) {
+                log::info!("MUTATIONS: {}", mutations);
+            }
+        }
+
+        let mut msg = format!(
+            "time: {}, corpus: {}, found: {}, execs: {}, exec/sec: {:.1}",
+            format_duration_hms(&stats.run_time),
+            stats.corpus_size,
+            stats.objective_size,
+            stats.execs,
+            stats.execs_per_sec,
+        );
+        for (key, val) in &user_stats {
+            msg += format!(", {key}: {val}").as_str();
+        }
+        data.add_message(msg);
+        self.latest = Some(stats);
+    }
+
+    #[cfg(feature = "introspection")]
+    fn update_stage_timing(&mut self) {
+        if !self.stage_timing_changed {
+            return;
+        }
+        self.stage_timing_changed = false;
+        let mut text = String::new();
+        for (client, perf) in &self.stage_timing {
+            text += &format!("Client {}: {}\n", client, perf);
+        }
+        if let Err(err) = std::fs::write(&self.stage_timing_path, &text) {
+            log::error!("Failed to write stage timing: {}", err);
+        }
+        self.ui.data().set_stage_timing(text);
+    }
+
+    fn tick(&mut self) {
+        #[cfg(feature = "introspection")]
+        self.update_stage_timing();
+        self.ui.try_tick();
+        if let Some(stats) = self.latest.take() {
+            if let Err(err) = write_metrics(&self.metrics_path, &stats) {
+                log::error!("Failed to write metrics: {}", err);
+            }
+        }
+    }
+
+    fn run(mut self, receiver: Receiver<StatsEvent>) {
+        let mut last_tick = Instant::now();
+        loop {
+            let timeout = TICK_RATE.saturating_sub(last_tick.elapsed());
+            match receiver.recv_timeout(timeout) {
+                Ok(event) => self.handle(event),
+                Err(RecvTimeoutError::Timeout) => (),
+                Err(RecvTimeoutError::Disconnected) => break,
+            }
+            if last_tick.elapsed() >= TICK_RATE {
+                self.tick();
+                last_tick = Instant::now();
+            }
+        }
+        self.tick();
+    }
+}
+
+/// The UI thread. It is only started on the first event, so it only exists
+/// in the broker process and not in the forked clients.
+struct StatsPipeline {
+    pending: Mutex<Option<StatsSink>>,
+    sender: Mutex<Option<SyncSender<StatsEvent>>>,
+    thread: Mutex<Option<JoinHandle<()>>>,
+}
+
+impl StatsPipeline {
+    fn send(&self, event: StatsEvent) {
+        let mut sender = self.sender.lock().unwrap();
+        if sender.is_none() {
+            let sink = match self.pending.lock().unwrap().take() {
+                Some(sink) => sink,
+                None => return,
+            };
+            let (new_sender, receiver) = sync_channel(STATS_QUEUE_LEN);
+            let thread = thread::Builder::new()
+                .name("fuzz-ui".to_owned())
+                .spawn(move || sink.run(receiver))
+                .expect("Failed to start UI thread");
+            *self.thread.lock().unwrap() = Some(thread);
+            *sender = Some(new_sender);
+        }
+        match sender.as_ref().unwrap().try_send(event) {
+            Ok(()) | Err(TrySendError::Full(_)) => (),
+            Err(TrySendError::Disconnected(_)) => {
+                log::error!("UI thread stopped");
+            }
+        }
+    }
+}
+
+impl Drop for StatsPipeline {
+    /// Lets the UI thread finish, which restores the terminal.
+    fn drop(&mut self) {
+        self.sender.lock().unwrap().take();
+        if let Some(thread) = self.thread.lock().unwrap().take() {
+            let _ = thread.join();
+        }
+    }
+}
+
+/// Tracking monitor during fuzzing. The broker only collects the numbers
+/// here, the UI, logs and metrics are updated on a separate thread.
 #[derive(Clone)]
 pub struct HWFuzzMonitor {
     start_time: Duration,
     client_stats: Vec<ClientStats>,
-    ui: Arc<Mutex<FuzzUI>>,
-    iterations_log_path: String,
-    last_iterations_logged: u64,
+    pipeline: Arc<StatsPipeline>,
 }
 
 impl Monitor for HWFuzzMonitor {
@@ -36,122 +227,85 @@ impl Monitor for HWFuzzMonitor {
 
     fn display(&mut self, _event_msg: String, sender_id: ClientId) {
         let execs = self.total_execs();
-        let execs_per_sec = self.execs_per_sec_pretty();
-        {
-            let client = self.client_stats_mut_for(sender_id).clone();
-
-            let mut ui = self.ui.lock().unwrap();
-            let data = ui.data();
-
-            data.add_corpus_size(self.corpus_size());
-
-            let mut max_coverage : u64 = 0;
-            for (key, val) in &client.user_monitor {
-                if key == "shared_mem" {
-                    // shared_mem has the form:
-                    //  BITS/MAX_BITS (PERCENTAGE%)
-                    // For example:
-                    //  0/2201728 (0%)
-                    //  ^ ^^^^^^^
-                    // We store these two parts.
-                    let str = val.to_string();
-                    let bit_str = str.split("/").nth(0).unwrap();
-                    let bits = u64::from_str_radix(bit_str, 10).unwrap();
-                    data.add_max_coverage(bits as f64);
-
-                    // The second half is the maximum coverage.
-                    // This should be constant during the execution.
-                    // Changes depending on used coverage, so we log it.
-                    let right_side = str.split("/").nth(1).unwrap();
-                    let max_str = right_side.split(" (").nth(0).unwrap();
-                    max_coverage = u64::from_str_radix(max_str, 10).unwrap();
-                }
-            }
-
-            let time_since_start = current_time() - self.start_time;
-
-            // Only log every few hundred iterations the time to avoid creating
-            // a too large log file.
-            let log_every_n_iterations = 500;
-            if execs > self.last_iterations_logged + log_every_n_iterations {
-                self.last_iterations_logged = execs;
-
-                // Write the current time and iterations to a log file. This can
-                // be used to find infer iterations-to-exposure from the
-                // time-to-exposure data we log.
-                let mut iterations_log = OpenOptions::new()
-                    .write(true)
-                    .create(true)
-                    .append(true)
-                    .open(&self.iterations_log_path)
-                    .expect("Failed to open iterations log file");
-
-                iterations_log
-                    .write_all(
-                        format!(
-                            "{} {} {} {} {}\n",
-                            time_since_start.as_secs(),
-                            execs,
-                            self.corpus_size(),
-                            data.get_max_coverage() as u64,
-                            max_coverage
-                        )
-                        .as_bytes(),
-                    )
-                    .expect("Failed to update iterations log file");
-            }
+        let execs_per_sec = self.execs_per_sec();
+        let client = self.client_stats_mut_for(sender_id);
+        let user_stats = client.user_monitor.clone();
+        #[cfg(feature = "introspection")]
+        let perf = client.introspection_monitor.clone();
 
-            let mut msg = format!(
-                "time: {}, corpus: {}, found: {}, execs: {}, exec/sec: {}",
-                format_duration_hms(&(current_time() - self.start_time)),
-                self.corpus_size(),
-                self.objective_size(),
-                execs,
-                execs_per_sec,
-            );
-            for (key, val) in &client.user_monitor {
-                msg += format!(", {key}: {val}").as_str();
-            }
-            data.add_message(msg.to_string());
-
-            if msg.contains("shared_mem") {
-                let mut log_msg = format!(
-                    "STATUS: {} {} {} {} {} ",
-                    (current_time() - self.start_time).as_secs(),
-                    self.corpus_size(),
-                    self.objective_size(),
-                    execs,
-                    execs_per_sec,
-                );
-                for (_key, val) in &client.user_monitor {
-                    // Remove bunch of undesired stuff from the key to make it
-                    // fully space separated.
-                    let mut val_str = format!(" {val}").as_str().to_owned();
-                    val_str = val_str.replace("/", " ");
-                    val_str = val_str.replace("(", " ");
-                    val_str = val_str.replace(")", " ");
-                    val_str = val_str.replace("%", " ");
-                    log_msg += &val_str;
-                }
-                log::info!("{}", log_msg);
-            }
-        }
+        // Every client reports the coverage of its own corpus, so the
+        // fuzzer as a whole has (at least) the best of them.
+        let client_coverage: Vec<(usize, u64, u64)> = self
+            .client_stats
+            .iter()
+            .enumerate()
+            .filter_map(|(id, client)| match client.user_monitor.get("shared_mem") {
+                Some(UserStats::Ratio(bits, max)) => Some((id, *bits, *max)),
+                _ => None,
+            })
+            .collect();
+        let coverage = client_coverage.iter().map(|(_, bits, _)| *bits).max();
+        let coverage_max = client_coverage.iter().map(|(_, _, max)| *max).max();
 
-        let mut ui = self.ui.lock().unwrap();
-        ui.try_tick();
+        let stats = FuzzStats {
+            run_time: current_time() - self.start_time,
+            clients: self.client_stats.len(),
+            corpus_size: self.corpus_size(),
+            objective_size: self.objective_size(),
+            execs,
+            execs_per_sec,
+            coverage: coverage.unwrap_or(0),
+            client_coverage: client_coverage
+                .iter()
+                .map(|(id, bits, _)| (*id, *bits))
+                .collect(),
+            coverage_max: coverage_max.unwrap_or(0),
+            ..Default::default()
+        };
+        self.pipeline.send(StatsEvent {
+            stats,
+            user_stats,
+            #[cfg(feature = "introspection")]
+            sender: sender_id,
+            #[cfg(feature = "introspection")]
+            perf,
+        });
     }
 }
 
 impl HWFuzzMonitor {
-    /// Creates the monitor, using the `current_time` as `start_time`.
-    pub fn new(ui: Arc<Mutex<FuzzUI>>, out_dir: String) -> Self {
-        let log_path = out_dir + "/iterations_time";
+    /// Creates the monitor, using the `current_time` as `start_time`. Writes
+    /// 'iterations_time' and 'metrics.prom' into the out dir and, with the
+    /// introspection feature, 'logs/stage_timing'.
+    pub fn new(ui: FuzzUI, out_dir: String) -> Self {
+        let log_path = out_dir.clone() + "/iterations_time";
+        let iterations_log = OpenOptions::new()
+            .write(true)
+            .create(true)
+            .append(true)
+            .open(&log_path)
+            .expect("Failed to open iterations log file");
+        let sink = StatsSink {
+            ui,
+            iterations_log,
+            last_iterations_logged: 0,
+            metrics_path: PathBuf::from(out_dir.clone() + "/metrics.prom"),
+            latest: None,
+            #[cfg(feature = "introspection")]
+            stage_timing: BTreeMap::new(),
+            #[cfg(feature = "introspection")]
+            stage_timing_path: PathBuf::from(out_dir.clone() + "/logs/stage_timing"),
+            #[cfg(feature = "introspection")]
+            stage_timing_changed: false,
+        };
         Self {
             start_time: current_time(),
             client_stats: vec![],
-            ui,
-            iterations_log_path: log_path,
-            last_iterations_logged: 0,
+            pipeline: Arc::new(StatsPipeline {
+                pending: Mutex::new(Some(sink)),
+                sender: Mutex::new(None),
+                thread: Mutex::new(None),
+            }),
         }
     }
 }
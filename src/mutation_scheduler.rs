@@ -0,0 +1,352 @@
+//! Adaptive scheduling of the RISC-V mutations.
+//!
+//! `StdScheduledMutator` picks every mutation in the list with the same
+//! probability. Simulator executions are expensive, so this scheduler instead
+//! tracks how often each mutation took part in an execution that produced a
+//! new corpus entry and shifts the probabilities towards the productive ones
+//! (a discounted bandit, similar in spirit to MOpt).
+use std::{collections::VecDeque, fmt::Write, sync::Arc};
+
+use libafl::{
+    bolts::tuples::Named,
+    corpus::CorpusId,
+    mutators::{MutationResult, Mutator},
+    prelude::Rand,
+    state::{HasMetadata, HasRand},
+    Error,
+};
+use serde::{Deserialize, Serialize};
+
+use crate::{
+    generator::InstructionSet,
+    mutator::{Mutation, RiscVInstructionMutator},
+    program_input::HasProgramInput,
+};
+
+/// Name of the user stat that carries the mutation stats to the monitor.
+pub const MUTATION_STATS_NAME: &str = "mutations";
+
+/// How the mutation probabilities are chosen.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum MutationSchedule {
+    /// Like `StdScheduledMutator`: probabilities are fixed by the list.
+    Uniform,
+    /// Probabilities follow the yield of each mutation.
+    Adaptive,
+}
+
+impl MutationSchedule {
+    pub fn from_name(name: &str) -> Option<Self> {
+        match name {
+            "uniform" => Some(MutationSchedule::Uniform),
+            "adaptive" => Some(MutationSchedule::Adaptive),
+            _ => None,
+        }
+    }
+}
+
+/// Usage statistics of a single mutation.
+#[derive(Serialize, Deserialize, Clone, Debug)]
+pub struct MutationStats {
+    pub name: String,
+    /// Number of executed inputs that this mutation took part in.
+    pub execs: u64,
+    /// Number of those inputs that were added to the corpus.
+    pub finds: u64,
+    /// The current probability of picking this mutation.
+    pub probability: f64,
+}
+
+libafl::impl_serdeany!(MutationStatsMetadata);
+/// The stats of all mutations, updated in the state by the scheduler.
+#[derive(Serialize, Deserialize, Clone, Debug, Default)]
+pub struct MutationStatsMetadata {
+    pub mutations: Vec<MutationStats>,
+}
+
+impl MutationStatsMetadata {
+    /// One line summary for the monitor, e.g. 'add 31% 5/1200, ...'.
+    pub fn summary(&self) -> String {
+        let mut result = String::new();
+        for (i, stats) in self.mutations.iter().enumerate() {
+            if i != 0 {
+                result += ", ";
+            }
+            write!(
+                result,
+                "{} {:.0}% {}/{}",
+                stats.name,
+                stats.probability * 100.0,
+                stats.finds,
+                stats.execs
+            )
+            .unwrap();
+        }
+        result
+    }
+}
+
+/// Applies a stack of RISC-V mutations, picking each mutation according to
+/// the chosen `MutationSchedule`.
+pub struct AdaptiveScheduledMutator {
+    schedule: MutationSchedule,
+    /// One mutator per distinct mutation.
+    mutators: Vec<RiscVInstructionMutator>,
+    stats: MutationStatsMetadata,
+    /// How often the mutation appeared in the mutation list.
+    prior: Vec<f64>,
+    /// Discounted execs/finds that the probabilities are computed from.
+    recent_execs: Vec<f64>,
+    recent_finds: Vec<f64>,
+    /// Running sum of the mutation probabilities.
+    cumulative: Vec<f64>,
+    /// Bit set of the mutations that changed the current input.
+    used: u64,
+    /// The `used` sets of mutated inputs that didn't run yet, by stage
+    /// index. Batches mutate several inputs before the first one runs.
+    pending: VecDeque<(i32, u64)>,
+    /// Up to 2^max_stack_pow mutations are stacked on one input.
+    max_stack_pow: u64,
+    execs_since_update: u64,
+}
+
+impl AdaptiveScheduledMutator {
+    /// Probabilities are recomputed after this many executions.
+    const UPDATE_INTERVAL: u64 = 1000;
+    /// Share of the probability that is always spread by the prior, so that
+    /// unproductive mutations still get tried now and then.
+    const EXPLORATION: f64 = 0.2;
+    /// Weight of the old observations after each update. Keeps the
+    /// probabilities following the current phase of the fuzzing campaign.
+    const DECAY: f64 = 0.9;
+    /// Inputs that never run (e.g., after an error) are forgotten after this
+    /// many newer ones.
+    const MAX_PENDING: usize = 4096;
+
+    /// Creates a scheduler for the given mutation list (see
+    /// `mutator::parse_mutations`). Mutations that appear several times in
+    /// the list start out with a higher probability.
+    pub fn new(
+        schedule: MutationSchedule,
+        mutations: &[Mutation],
+        insts: Arc<InstructionSet>,
+    ) -> Self {
+        assert!(!mutations.is_empty());
+        let mut distinct = Vec::<Mutation>::new();
+        let mut prior = Vec::<f64>::new();
+        for mutation in mutations {
+            match distinct.iter().position(|m| m == mutation) {
+                Some(idx) => prior[idx] += 1.0,
+                None => {
+                    distinct.push(*mutation);
+                    prior.push(1.0);
+                }
+            }
+        }
+        let total: f64 = prior.iter().sum();
+        prior.iter_mut().for_each(|p| *p /= total);
+
+        let mut result = Self {
+            schedule,
+            mutators: distinct
+                .iter()
+                .map(|mutation| RiscVInstructionMutator::with_set(*mutation, insts.clone()))
+                .collect(),
+            stats: MutationStatsMetadata {
+                mutations: distinct
+                    .iter()
+                    .map(|mutation| MutationStats {
+                        name: mutation.name().to_owned(),
+                        execs: 0,
+                        finds: 0,
+                        probability: 0.0,
+                    })
+                    .collect(),
+            },
+            recent_execs: vec![0.0; distinct.len()],
+            recent_finds: vec![0.0; distinct.len()],
+            cumulative: vec![0.0; distinct.len()],
+            prior,
+            used: 0,
+            pending: VecDeque::new(),
+            max_stack_pow: 7,
+            execs_since_update: 0,
+        };
+        result.update_probabilities();
+        result
+    }
+
+    pub fn stats(&self) -> &MutationStatsMetadata {
+        &self.stats
+    }
+
+    fn update_probabilities(&mut self) {
+        let mut probabilities = self.prior.clone();
+        if self.schedule == MutationSchedule::Adaptive {
+            // Estimated yield per execution, with a bit of smoothing so that
+            // mutations without any finds yet don't drop to zero.
+            let yields: Vec<f64> = (0..self.prior.len())
+                .map(|i| {
+                    self.prior[i] * (self.recent_finds[i] + 1.0) / (self.recent_execs[i] + 2.0)
+                })
+                .collect();
+            let total_yield: f64 = yields.iter().sum();
+            for (p, y) in probabilities.iter_mut().zip(yields) {
+                *p = Self::EXPLORATION * *p + (1.0 - Self::EXPLORATION) * y / total_yield;
+            }
+        }
+
+        let mut sum = 0.0;
+        for (i, p) in probabilities.iter().enumerate() {
+            sum += p;
+            self.cumulative[i] = sum;
+            self.stats.mutations[i].probability = *p;
+        }
+    }
+
+    /// Credits the given mutations of an input with an execution (and a
+    /// find if the input was added to the corpus). Returns true if the
+    /// probabilities were updated.
+    fn record_execution(&mut self, used: u64, found: bool) -> bool {
+        for idx in 0..self.mutators.len() {
+            if used & (1 << idx) == 0 {
+                continue;
+            }
+            self.stats.mutations[idx].execs += 1;
+            self.recent_execs[idx] += 1.0;
+            if found {
+                self.stats.mutations[idx].finds += 1;
+                self.recent_finds[idx] += 1.0;
+            }
+        }
+
+        self.execs_since_update += 1;
+        if self.execs_since_update < Self::UPDATE_INTERVAL {
+            return false;
+        }
+        self.execs_since_update = 0;
+        self.update_probabilities();
+        self.recent_execs.iter_mut().for_each(|e| *e *= Self::DECAY);
+        self.recent_finds.iter_mut().for_each(|f| *f *= Self::DECAY);
+        true
+    }
+
+    fn choose<R: Rand>(&self, rand: &mut R) -> usize {
+        // 53 random bits are all that fit into the mantissa.
+        let pick =
+            (rand.next() >> 11) as f64 / (1u64 << 53) as f64 * self.cumulative.last().unwrap();
+        self.cumulative
+            .partition_point(|&sum| sum <= pick)
+            .min(self.mutators.len() - 1)
+    }
+}
+
+impl Named for AdaptiveScheduledMutator {
+    fn name(&self) -> &str {
+        "AdaptiveScheduledMutator"
+    }
+}
+
+impl<I, S> Mutator<I, S> for AdaptiveScheduledMutator
+where
+    S: HasRand + HasMetadata,
+    I: HasProgramInput,
+{
+    fn mutate(
+        &mut self,
+        state: &mut S,
+        input: &mut I,
+        stage_idx: i32,
+    ) -> Result<MutationResult, Error> {
+        let mut result = MutationResult::Skipped;
+        self.used = 0;
+        let num_mutations = 1 << (1 + state.rand_mut().below(self.max_stack_pow));
+        for _ in 0..num_mutations {
+            let idx = self.choose(state.rand_mut());
+            if self.mutators[idx].mutate(state, input, stage_idx)? == MutationResult::Mutated {
+                result = MutationResult::Mutated;
+                self.used |= 1 << idx;
+            }
+        }
+        if result == MutationResult::Mutated {
+            if self.pending.len() == Self::MAX_PENDING {
+                self.pending.pop_front();
+            }
+            self.pending.push_back((stage_idx, self.used));
+        }
+        Ok(result)
+    }
+
+    fn post_exec(
+        &mut self,
+        state: &mut S,
+        stage_idx: i32,
+        corpus_idx: Option<CorpusId>,
+    ) -> Result<(), Error> {
+        // Stage indices repeat between stages, the newest entry is the one
+        // of the current stage.
+        let used = match self.pending.iter().rposition(|(idx, _)| *idx == stage_idx) {
+            Some(pos) => self.pending.remove(pos).unwrap().1,
+            None => 0,
+        };
+        if self.record_execution(used, corpus_idx.is_some()) {
+            state.add_metadata(self.stats.clone());
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use libafl::prelude::{Rand, Xoshiro256StarRand};
+
+    use crate::{generator::InstructionSet, mutator::Mutation};
+
+    use super::{AdaptiveScheduledMutator, MutationSchedule};
+
+    fn simulate(schedule: MutationSchedule) -> AdaptiveScheduledMutator {
+        let mut rng = Xoshiro256StarRand::default();
+        rng.set_seed(0);
+        let mut mutator = AdaptiveScheduledMutator::new(
+            schedule,
+            &[
+                Mutation::Add,
+                Mutation::Add,
+                Mutation::Remove,
+                Mutation::Snippet,
+            ],
+            InstructionSet::riscv_base(),
+        );
+        // Only 'remove' ever finds something.
+        for _ in 0..20000 {
+            let idx = mutator.choose(&mut rng);
+            let found = idx == 1 && rng.below(10) == 0;
+            mutator.record_execution(1 << idx, found);
+        }
+        mutator
+    }
+
+    #[test]
+    fn uniform_uses_prior() {
+        let mutator = simulate(MutationSchedule::Uniform);
+        let probabilities: Vec<f64> = mutator
+            .stats()
+            .mutations
+            .iter()
+            .map(|stats| stats.probability)
+            .collect();
+        assert_eq!(probabilities, vec![0.5, 0.25, 0.25]);
+    }
+
+    #[test]
+    fn adaptive_prefers_productive_mutations() {
+        let mutator = simulate(MutationSchedule::Adaptive);
+        let stats = &mutator.stats().mutations;
+        assert_eq!(stats[1].name, "remove");
+        assert!(stats[1].probability > 0.8, "{:?}", stats);
+        // Unproductive mutations are still explored.
+        assert!(stats[0].probability > 0.05, "{:?}", stats);
+        assert!(stats[2].probability > 0.02, "{:?}", stats);
+        assert!(mutator.stats().summary().starts_with("add "));
+    }
+}
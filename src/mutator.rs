@@ -1,11 +1,10 @@
-use std::cmp::max;
+use std::{cmp::max, sync::Arc};
 
 use libafl::prelude::*;
 
 use crate::{
-    generator::InstGenerator,
+    generator::{ArgumentPool, InstGenerator, InstructionSet},
     instructions::{
-        self,
         riscv::{
             args,
             rv_i::{ADDI, AUIPC, JALR},
@@ -16,10 +15,10 @@ use crate::{
 };
 
 #[cfg(test)]
-use crate::{assembler::assemble_instructions, parser::parse_instructions};
+use crate::{assembler::assemble_instructions, instructions, parser::parse_instructions};
 
 /// Supported mutation strategies.
-#[derive(Clone, Copy)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
 pub enum Mutation {
     // Adds a new instruction.
     Add,
@@ -38,12 +37,45 @@ pub enum Mutation {
     Snippet,
 }
 
+impl Mutation {
+    pub const ALL: [Mutation; 8] = [
+        Mutation::Add,
+        Mutation::Replace,
+        Mutation::ReplaceArg,
+        Mutation::RepeatSeveral,
+        Mutation::SwapTwo,
+        Mutation::Remove,
+        Mutation::ReplaceWithNop,
+        Mutation::Snippet,
+    ];
+
+    /// The name of the mutation as used by the --mutations option.
+    pub fn name(&self) -> &'static str {
+        match self {
+            Mutation::Add => "add",
+            Mutation::Replace => "replace",
+            Mutation::ReplaceArg => "replace-arg",
+            Mutation::RepeatSeveral => "repeat",
+            Mutation::SwapTwo => "swap",
+            Mutation::Remove => "remove",
+            Mutation::ReplaceWithNop => "nop",
+            Mutation::Snippet => "snippet",
+        }
+    }
+
+    pub fn from_name(name: &str) -> Option<Self> {
+        Self::ALL.into_iter().find(|mutation| mutation.name() == name)
+    }
+}
+
 /// Mutator for RISC-V instructions.
 /// Operates on byte vectors that are parsed as RISC-V vectors.
 /// Invalid instructions are just filtered from the input.
 pub struct RiscVInstructionMutator {
     /// This should be a const generic argument but Rust doesn't support that.
     mutation: Mutation,
+    /// The instructions that new instructions are picked from.
+    insts: Arc<InstructionSet>,
 }
 
 impl<I, S> Mutator<I, S> for RiscVInstructionMutator
@@ -57,7 +89,8 @@ where
         input: &mut I,
         _stage_idx: i32,
     ) -> Result<MutationResult, Error> {
-        self.mutate_impl(state.rand_mut(), input.insts_mut())
+        let (program, pool) = input.insts_and_pool_mut();
+        self.mutate_impl(state.rand_mut(), program, pool)
     }
 }
 
@@ -71,18 +104,17 @@ pub struct EmptyProgramNotSupported;
 
 impl RiscVInstructionMutator {
     pub fn new(mutation: Mutation) -> Self {
-        Self { mutation }
+        Self::with_set(mutation, InstructionSet::riscv_base())
     }
 
-    /// Generates a random instruction.
-    fn gen_inst<Rng: Rand>(&self, program: &Vec<Instruction>, rng: &mut Rng) -> Instruction {
-        let mut generator = InstGenerator::new();
-
-        for inst in program {
-            generator.forward_args(inst.arguments())
-        }
+    /// Creates a mutator that generates instructions from the given set.
+    pub fn with_set(mutation: Mutation, insts: Arc<InstructionSet>) -> Self {
+        Self { mutation, insts }
+    }
 
-        generator.generate_instruction::<Rng>(rng, &instructions::sets::riscv_base())
+    /// Generates a random instruction that reuses arguments from the pool.
+    fn gen_inst<Rng: Rand>(&self, pool: &ArgumentPool, rng: &mut Rng) -> Instruction {
+        InstGenerator::with_pool(pool).generate_instruction_from::<Rng>(rng, &self.insts)
     }
 
     /// Interprets the input bytes as RISC-V opcodes and mutates them.
@@ -90,8 +122,9 @@ impl RiscVInstructionMutator {
         &self,
         rng: &mut Rng,
         program: &mut Vec<Instruction>,
+        pool: &mut ArgumentPool,
     ) -> Result<MutationResult, Error> {
-        if self.mutate_with(program, rng, self.mutation).is_none() {
+        if self.mutate_with(program, pool, rng, self.mutation).is_none() {
             return Ok(MutationResult::Skipped);
         }
 
@@ -110,8 +143,9 @@ impl RiscVInstructionMutator {
             return Err(Error::illegal_argument(program_or_err.err().unwrap()));
         }
         let mut program = program_or_err.unwrap();
+        let mut pool = ArgumentPool::from_program(&program);
 
-        if self.mutate_with(&mut program, rng, self.mutation).is_none() {
+        if self.mutate_with(&mut program, &mut pool, rng, self.mutation).is_none() {
             return Ok(MutationResult::Skipped);
         }
 
@@ -133,11 +167,11 @@ impl RiscVInstructionMutator {
             vec![
                 Instruction::new(
                     &AUIPC,
-                    vec![Argument::new(&args::RD, 2), Argument::new(&args::IMM20, 0)],
+                    [Argument::new(&args::RD, 2), Argument::new(&args::IMM20, 0)],
                 ),
                 Instruction::new(
                     &JALR,
-                    vec![
+                    [
                         Argument::new(&args::RD, 1),
                         Argument::new(&args::RS1, 2),
                         Argument::new(&args::IMM12, raw_offset*4),
@@ -150,7 +184,7 @@ impl RiscVInstructionMutator {
         let make_ret = |_rng: &mut Rng| -> Vec<Instruction> {
             vec![Instruction::new(
                 &JALR,
-                vec![
+                [
                     Argument::new(&args::RD, 0),
                     Argument::new(&args::RS1, 1),
                     Argument::new(&args::IMM12, 0),
@@ -167,6 +201,7 @@ impl RiscVInstructionMutator {
     fn mutate_with<Rng: Rand>(
         &self,
         program: &mut Vec<Instruction>,
+        pool: &mut ArgumentPool,
         rng: &mut Rng,
         mutation: Mutation,
     ) -> Option<()> {
@@ -188,15 +223,18 @@ impl RiscVInstructionMutator {
 
         match mutation {
             Mutation::Add => {
-                program.insert(add_pos(rng), self.gen_inst(program, rng));
+                let new_inst = self.gen_inst(pool, rng);
+                pool.add_args(&new_inst.arguments());
+                program.insert(add_pos(rng), new_inst);
             }
             Mutation::Replace => {
                 // Keep replacing until we actually changed something.
                 loop {
                     let pos = valid_pos(rng)?;
-                    let old_inst = program[pos].clone();
-                    let new_inst = self.gen_inst(program, rng);
+                    let old_inst = program[pos];
+                    let new_inst = self.gen_inst(pool, rng);
                     if new_inst != old_inst {
+                        pool.add_args(&new_inst.arguments());
                         program[pos] = new_inst;
                         break;
                     }
@@ -204,7 +242,7 @@ impl RiscVInstructionMutator {
             }
             Mutation::ReplaceArg => {
                 let pos = valid_pos(rng)?;
-                let mut inst = program[pos].clone();
+                let mut inst = program[pos];
                 if inst.arguments().is_empty() {
                     return None;
                 }
@@ -213,9 +251,10 @@ impl RiscVInstructionMutator {
                 // Keep generating arguments until we find a new one.
                 loop {
                     let new_arg = InstGenerator::new().generate_argument(rng, arg_spec);
-                    if &new_arg == old_arg {
+                    if new_arg == old_arg {
                         continue;
                     }
+                    pool.add(&new_arg);
                     inst.set_arg(new_arg);
                     break;
                 }
@@ -224,14 +263,12 @@ impl RiscVInstructionMutator {
             Mutation::SwapTwo => {
                 let pos = valid_pos(rng)?;
                 let pos2 = valid_pos(rng)?;
-                let backup = program[pos].clone();
-                program[pos] = program[pos2].clone();
-                program[pos2] = backup;
+                program.swap(pos, pos2);
             }
             Mutation::RepeatSeveral => {
                 let pos = valid_pos(rng)?;
                 for _ in 0..(rng.below(4) + 1) {
-                    program.insert(pos, program[pos].clone());
+                    program.insert(pos, program[pos]);
                 }
             }
             Mutation::Remove => {
@@ -241,19 +278,22 @@ impl RiscVInstructionMutator {
                 let pos = valid_pos(rng)?;
                 let nop = Instruction::new(
                     &ADDI,
-                    vec![
+                    [
                         Argument::new(&args::RD, 0),
                         Argument::new(&args::RS1, 0),
                         Argument::new(&args::IMM12, 0),
                     ],
                 );
+                pool.add_args(&nop.arguments());
                 program[pos] = nop;
             }
             Mutation::Snippet => {
                 let pos = add_pos(rng);
                 let mut snippet = self.make_snippet(rng);
                 while !snippet.is_empty() {
-                    program.insert(pos, snippet.pop().unwrap());
+                    let inst = snippet.pop().unwrap();
+                    pool.add_args(&inst.arguments());
+                    program.insert(pos, inst);
                 }
             }
         }
@@ -279,25 +319,68 @@ pub type RiscVMutationList = tuple_list_type!(
     RiscVInstructionMutator,
 );
 
+/// The default mix of mutations in `all_riscv_mutations`.
+pub const DEFAULT_MUTATIONS: [Mutation; 13] = [
+    Mutation::Add,
+    Mutation::Add,
+    Mutation::Remove,
+    Mutation::Remove,
+    Mutation::ReplaceArg,
+    Mutation::ReplaceArg,
+    Mutation::Replace,
+    Mutation::Replace,
+    Mutation::RepeatSeveral,
+    Mutation::RepeatSeveral,
+    Mutation::SwapTwo,
+    Mutation::SwapTwo,
+    Mutation::Snippet,
+];
+
 /// Provides a list of all supported RISC-V instruction mutators.
 pub fn all_riscv_mutations() -> RiscVMutationList {
+    let m = |i: usize| RiscVInstructionMutator::new(DEFAULT_MUTATIONS[i]);
     tuple_list!(
-        RiscVInstructionMutator::new(Mutation::Add),
-        RiscVInstructionMutator::new(Mutation::Add),
-        RiscVInstructionMutator::new(Mutation::Remove),
-        RiscVInstructionMutator::new(Mutation::Remove),
-        RiscVInstructionMutator::new(Mutation::ReplaceArg),
-        RiscVInstructionMutator::new(Mutation::ReplaceArg),
-        RiscVInstructionMutator::new(Mutation::Replace),
-        RiscVInstructionMutator::new(Mutation::Replace),
-        RiscVInstructionMutator::new(Mutation::RepeatSeveral),
-        RiscVInstructionMutator::new(Mutation::RepeatSeveral),
-        RiscVInstructionMutator::new(Mutation::SwapTwo),
-        RiscVInstructionMutator::new(Mutation::SwapTwo),
-        RiscVInstructionMutator::new(Mutation::Snippet),
+        m(0),
+        m(1),
+        m(2),
+        m(3),
+        m(4),
+        m(5),
+        m(6),
+        m(7),
+        m(8),
+        m(9),
+        m(10),
+        m(11),
+        m(12),
     )
 }
 
+/// Parses the --mutations option: either 'default' or a comma separated list
+/// of mutation names (see `Mutation::name`).
+pub fn parse_mutations(spec: &str) -> Result<Vec<Mutation>, String> {
+    if spec == "default" {
+        return Ok(DEFAULT_MUTATIONS.to_vec());
+    }
+    let mut result = Vec::<Mutation>::new();
+    for name in spec.split(',').map(str::trim).filter(|name| !name.is_empty()) {
+        match Mutation::from_name(name) {
+            Some(mutation) => result.push(mutation),
+            None => {
+                let names: Vec<&str> = Mutation::ALL.iter().map(|m| m.name()).collect();
+                return Err(format!(
+                    "Unknown mutation '{}'. Supported mutations: {:?}",
+                    name, names
+                ));
+            }
+        }
+    }
+    if result.is_empty() {
+        return Err("No mutations given".to_owned());
+    }
+    Ok(result)
+}
+
 /// All reducing mutations
 pub type RiscVReducingMutationList = tuple_list_type!(
     RiscVInstructionMutator,
@@ -331,8 +414,8 @@ mod tests {
     use crate::instructions::InstructionTemplate;
     use crate::parser::parse_instructions;
 
-    use super::Mutation;
     use super::RiscVInstructionMutator;
+    use super::{parse_mutations, Mutation, DEFAULT_MUTATIONS};
 
     /// The test harness.
     /// Contains all the data for the tests below and some utility code.
@@ -485,12 +568,12 @@ mod tests {
 
         for _ in 0..TRIES {
             setup.fill_one_inst(&instructions::riscv::rv_i::ADD);
-            let original_inst = setup.parsed_insts()[0].clone();
+            let original_inst = setup.parsed_insts()[0];
             if setup.mutate() {
                 // This mutation does not add new instructions.
                 assert_eq!(setup.data.len(), setup.old_data.len());
                 // Parse the new instruction we generated.
-                let new_inst = setup.parsed_insts()[0].clone();
+                let new_inst = setup.parsed_insts()[0];
 
                 // The instruction should still be the ADD we created.
                 assert_eq!(
@@ -552,15 +635,29 @@ mod tests {
             assert!(setup.mutate());
 
             let insts = setup.parsed_insts();
-            let first_inst = insts[0].clone();
+            let first_inst = insts[0];
             if first_inst.template() == &AUIPC {
                 eprintln!("{:?}", insts);
                 assert_eq!(insts.len(), 2);
-                let jump = insts[1].clone();
+                let jump = insts[1];
                 assert_eq!(jump.template(), &JALR);
             } else {
                 assert_eq!(insts.len(), 1);
             }
         }
     }
+
+    #[test]
+    fn parse_mutation_lists() {
+        assert_eq!(parse_mutations("default").unwrap(), DEFAULT_MUTATIONS.to_vec());
+        assert_eq!(
+            parse_mutations("add, replace-arg,add").unwrap(),
+            vec![Mutation::Add, Mutation::ReplaceArg, Mutation::Add]
+        );
+        for mutation in Mutation::ALL {
+            assert_eq!(Mutation::from_name(mutation.name()), Some(mutation));
+        }
+        assert!(parse_mutations("add,flip").is_err());
+        assert!(parse_mutations("").is_err());
+    }
 }
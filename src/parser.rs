@@ -1,35 +1,113 @@
-use crate::instructions::{Instruction, InstructionTemplate};
+use std::sync::OnceLock;
 
+use crate::instructions::{self, EncodedInstruction, Instruction, InstructionTemplate};
+
+/// The bits of an instruction that are used to look up candidate templates:
+/// the major opcode (bits 0-6) and funct3 (bits 12-14).
+const KEY_MASK: EncodedInstruction = 0x707f;
+const NUM_KEYS: usize = 1 << 10;
+
+fn key_of(data: EncodedInstruction) -> usize {
+    ((data & 0x7f) | ((data >> 5) & 0x380)) as usize
+}
+
+fn encoding_of_key(key: usize) -> EncodedInstruction {
+    let key = key as EncodedInstruction;
+    (key & 0x7f) | ((key & 0x380) << 5)
+}
+
+/// Decodes instructions from a fixed set of templates.
+///
+/// The templates are bucketed by opcode and funct3, so decoding only has to
+/// check the few templates that share those bits (e.g., add/sub/mul) instead
+/// of the whole set. Templates are tried in the order of the set, so the
+/// result is the same as trying every template in turn.
+pub struct Decoder {
+    /// Start of the templates for each key in `templates`. The templates for
+    /// key `k` are `templates[starts[k]..starts[k + 1]]`.
+    starts: Vec<u32>,
+    templates: Vec<&'static InstructionTemplate>,
+}
+
+impl Decoder {
+    pub fn new(insts: &[&'static InstructionTemplate]) -> Self {
+        let mut starts = Vec::<u32>::with_capacity(NUM_KEYS + 1);
+        let mut templates = Vec::<&'static InstructionTemplate>::new();
+        for key in 0..NUM_KEYS {
+            starts.push(templates.len() as u32);
+            let data = encoding_of_key(key);
+            for inst in insts {
+                // Templates that don't care about some key bits end up in
+                // several buckets.
+                let mask = inst.mask_pattern() & KEY_MASK;
+                if data & mask == inst.base_pattern() & mask {
+                    templates.push(inst);
+                }
+            }
+        }
+        starts.push(templates.len() as u32);
+        Self { starts, templates }
+    }
+
+    /// Decoder for all known RISC-V instructions.
+    pub fn all() -> &'static Decoder {
+        static DECODER: OnceLock<Decoder> = OnceLock::new();
+        DECODER.get_or_init(|| Decoder::new(&instructions::riscv::all()))
+    }
+
+    /// Decoder for the RV64G instructions (see `sets::riscv_g`).
+    pub fn riscv_g() -> &'static Decoder {
+        static DECODER: OnceLock<Decoder> = OnceLock::new();
+        DECODER.get_or_init(|| Decoder::new(instructions::sets::riscv_g()))
+    }
+
+    pub fn decode(&self, data: EncodedInstruction) -> Option<Instruction> {
+        let key = key_of(data);
+        let candidates = &self.templates[self.starts[key] as usize..self.starts[key + 1] as usize];
+        candidates.iter().find_map(|inst| inst.decode(data))
+    }
+}
+
+/// Parses the given bytes as instructions from the given set of templates.
+/// This tries every template for every instruction, so prefer
+/// `parse_instructions_with` with a cached `Decoder` for repeated parsing.
 pub fn parse_instructions(
     input: &Vec<u8>,
-    insts: &Vec<&'static InstructionTemplate>,
+    insts: &[&'static InstructionTemplate],
 ) -> Result<Vec<Instruction>, String> {
-    let mut result = Vec::<Instruction>::new();
-
     if input.len() % 4 != 0 {
         return Err(format!("Tailing garbage in instructions: {:?}", input));
     }
 
-    for i in (0..input.len()).step_by(4) {
-        if i + 4 > input.len() {
-            continue;
-        }
-        let data = u32::from_ne_bytes(input[i..i + 4].try_into().unwrap());
-
-        let mut found = false;
-        for inst in insts {
-            let maybe_parsed = inst.decode(data);
-            if let Some(..) = maybe_parsed {
-                found = true;
-                result.push(maybe_parsed.unwrap());
-                break;
-            }
-        }
-        if found {
-            continue;
+    let mut result = Vec::<Instruction>::with_capacity(input.len() / 4);
+    for chunk in input.chunks_exact(4) {
+        let data = u32::from_ne_bytes(chunk.try_into().unwrap());
+        match insts.iter().find_map(|inst| inst.decode(data)) {
+            Some(inst) => result.push(inst),
+            None => return Err(format!("Failed to parse bytes as instruction: {:x}", data)),
         }
+    }
+
+    Ok(result)
+}
 
-        return Err(format!("Failed to parse bytes as instruction: {:x}", data));
+/// Same as `parse_instructions` but only does one table lookup to find the
+/// template of each instruction.
+pub fn parse_instructions_with(
+    input: &[u8],
+    decoder: &Decoder,
+) -> Result<Vec<Instruction>, String> {
+    if input.len() % 4 != 0 {
+        return Err(format!("Tailing garbage in instructions: {:?}", input));
+    }
+
+    let mut result = Vec::<Instruction>::with_capacity(input.len() / 4);
+    for chunk in input.chunks_exact(4) {
+        let data = u32::from_ne_bytes(chunk.try_into().unwrap());
+        match decoder.decode(data) {
+            Some(inst) => result.push(inst),
+            None => return Err(format!("Failed to parse bytes as instruction: {:x}", data)),
+        }
     }
 
     Ok(result)
@@ -41,7 +119,7 @@ mod tests {
 
     use crate::instructions;
 
-    use super::parse_instructions;
+    use super::{parse_instructions, parse_instructions_with, Decoder};
 
     #[test]
     fn parse_random_bytes() {
@@ -61,4 +139,44 @@ mod tests {
             assert_eq!(parsed.unwrap().len() * 4, input.len());
         }
     }
+
+    #[test]
+    fn decoder_matches_linear_scan() {
+        let insts = instructions::riscv::all();
+        let decoder = Decoder::all();
+        let mut rng = Xoshiro256StarRand::default();
+        rng.set_seed(0);
+
+        let mut words: Vec<u32> = (0..100000).map(|_| rng.next() as u32).collect();
+        // Random words are mostly invalid, so also check every template.
+        words.extend(insts.iter().map(|inst| inst.base_pattern()));
+        for data in words {
+            let expected = insts.iter().find_map(|inst| inst.decode(data));
+            assert_eq!(decoder.decode(data), expected);
+        }
+    }
+
+    #[test]
+    fn decoder_matches_parse_instructions() {
+        let insts = instructions::sets::riscv_g();
+        let mut rng = Xoshiro256StarRand::default();
+        rng.set_seed(1);
+
+        let mut inputs: Vec<Vec<u8>> = (0..10000)
+            .map(|_| (0..rng.below(5) * 4).map(|_| rng.next() as u8).collect())
+            .collect();
+        // Random bytes rarely decode, so also parse a program of every template.
+        inputs.push(
+            insts
+                .iter()
+                .flat_map(|inst| inst.base_pattern().to_ne_bytes())
+                .collect(),
+        );
+        for input in inputs {
+            assert_eq!(
+                parse_instructions_with(&input, Decoder::riscv_g()),
+                parse_instructions(&input, &insts)
+            );
+        }
+    }
 }
@@ -0,0 +1,724 @@
+//! A fast RISC-V (RV64G) interpreter that runs every mutated program before
+//! it is sent to the simulator. Programs that are doomed anyway are dropped
+//! or repaired, which costs microseconds instead of a whole execution of the
+//! simulator:
+//!
+//! - programs that jump out of the program, which traps right away. Direct
+//!   jumps and `jalr`s with a known base are repaired to jump to the end of
+//!   the program instead.
+//! - programs that loop forever (they reach the same state again without
+//!   storing anything in between) or run longer than the step limit.
+//! - programs with the same architectural trace as a recently run program.
+//!
+//! The interpreter only knows what the program computes itself: registers
+//! start out unknown, loads return unknown values and memory isn't modeled.
+//! Addresses in the program are tracked relative to the (unknown) start of
+//! the program. Execution starts at the first instruction and ends once it
+//! reaches the end of the program. When the next step depends on something
+//! unknown (a branch on an unknown register, a jump to an unknown address, a
+//! system instruction), interpretation stops and the program is run, so the
+//! filter never drops a program that the simulator could run differently.
+use core::hash::{BuildHasher, Hash, Hasher};
+use std::collections::{HashSet, VecDeque};
+
+use ahash::RandomState;
+use libafl::{
+    bolts::tuples::Named,
+    corpus::CorpusId,
+    mutators::{MutationResult, Mutator},
+    Error,
+};
+
+use crate::program_input::HasProgramInput;
+
+/// How many traces of recently run programs are remembered.
+const RECENT_TRACES: usize = 1 << 16;
+/// How many out-of-bounds jumps of one program are repaired.
+const MAX_REPAIRS: usize = 4;
+/// Stats are logged after this many checked programs.
+const LOG_INTERVAL: u64 = 1 << 20;
+
+/// What the interpreter knows about a register.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+enum Value {
+    Unknown,
+    Const(u64),
+    /// The start address of the program plus the offset.
+    Code(u64),
+}
+
+use Value::{Code, Const, Unknown};
+
+/// How the interpretation of a program ended.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum Outcome {
+    /// Reached the end of the program. The trace identifies everything the
+    /// program did.
+    End { trace: u64 },
+    /// Stopped at something the interpreter can't follow.
+    Stopped,
+    /// The instruction at the index jumps outside of the program. `base` is
+    /// the offset its target is relative to (`pc` for direct jumps).
+    OutOfBounds { inst: usize, base: u64 },
+    /// Runs forever or longer than the step limit.
+    Loops,
+}
+
+/// What the filter decided for a program.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Verdict {
+    Run,
+    /// Jumps out of the program were redirected to its end.
+    Repaired,
+    OutOfBounds,
+    Loops,
+    Duplicate,
+}
+
+/// Sign extends the lowest `bits` bits of the value.
+fn sext(value: u64, bits: u32) -> u64 {
+    ((value << (64 - bits)) as i64 >> (64 - bits)) as u64
+}
+
+fn rd(enc: u32) -> usize {
+    (enc >> 7 & 0x1f) as usize
+}
+
+fn rs1(enc: u32) -> usize {
+    (enc >> 15 & 0x1f) as usize
+}
+
+fn rs2(enc: u32) -> usize {
+    (enc >> 20 & 0x1f) as usize
+}
+
+fn funct3(enc: u32) -> u32 {
+    enc >> 12 & 0x7
+}
+
+fn i_imm(enc: u32) -> u64 {
+    (enc as i32 >> 20) as u64
+}
+
+fn u_imm(enc: u32) -> u64 {
+    (enc & 0xffff_f000) as i32 as u64
+}
+
+fn b_imm(enc: u32) -> u64 {
+    let imm = (enc >> 31 & 1) << 12
+        | (enc >> 7 & 1) << 11
+        | (enc >> 25 & 0x3f) << 5
+        | (enc >> 8 & 0xf) << 1;
+    sext(imm as u64, 13)
+}
+
+fn j_imm(enc: u32) -> u64 {
+    let imm = (enc >> 31 & 1) << 20
+        | (enc >> 12 & 0xff) << 12
+        | (enc >> 20 & 1) << 11
+        | (enc >> 21 & 0x3ff) << 1;
+    sext(imm as u64, 21)
+}
+
+fn with_i_imm(enc: u32, imm: i64) -> Option<u32> {
+    if !(-2048..2048).contains(&imm) {
+        return None;
+    }
+    Some(enc & 0x000f_ffff | (imm as u32 & 0xfff) << 20)
+}
+
+fn with_b_imm(enc: u32, imm: i64) -> Option<u32> {
+    if !(-4096..4096).contains(&imm) || imm & 1 != 0 {
+        return None;
+    }
+    let imm = imm as u32;
+    Some(
+        enc & 0x01ff_f07f
+            | (imm >> 12 & 1) << 31
+            | (imm >> 5 & 0x3f) << 25
+            | (imm >> 1 & 0xf) << 8
+            | (imm >> 11 & 1) << 7,
+    )
+}
+
+fn with_j_imm(enc: u32, imm: i64) -> Option<u32> {
+    if !(-(1 << 20)..1 << 20).contains(&imm) || imm & 1 != 0 {
+        return None;
+    }
+    let imm = imm as u32;
+    Some(
+        enc & 0x0000_0fff
+            | (imm >> 20 & 1) << 31
+            | (imm >> 1 & 0x3ff) << 21
+            | (imm >> 11 & 1) << 20
+            | (imm >> 12 & 0xff) << 12,
+    )
+}
+
+/// Computes an integer operation on known values. `op` is the funct3 of
+/// OP/OP-IMM, `alt` selects sub/sra, `m` the M extension and `word` the 32
+/// bit variants.
+fn alu(op: u32, alt: bool, m: bool, word: bool, a: u64, b: u64) -> u64 {
+    if word {
+        let (a32, b32) = (a as u32, b as u32);
+        let result = match (m, op) {
+            (false, 0) if alt => a32.wrapping_sub(b32),
+            (false, 0) => a32.wrapping_add(b32),
+            (false, 1) => a32 << (b & 0x1f),
+            (false, 5) if alt => (a32 as i32 >> (b & 0x1f)) as u32,
+            (false, 5) => a32 >> (b & 0x1f),
+            (true, 0) => a32.wrapping_mul(b32),
+            (true, 4) if b32 == 0 => u32::MAX,
+            (true, 4) => (a32 as i32).wrapping_div(b32 as i32) as u32,
+            (true, 5) if b32 == 0 => u32::MAX,
+            (true, 5) => a32 / b32,
+            (true, 6) if b32 == 0 => a32,
+            (true, 6) => (a32 as i32).wrapping_rem(b32 as i32) as u32,
+            (true, 7) if b32 == 0 => a32,
+            (true, 7) => a32 % b32,
+            _ => 0,
+        };
+        return result as i32 as u64;
+    }
+    match (m, op) {
+        (false, 0) if alt => a.wrapping_sub(b),
+        (false, 0) => a.wrapping_add(b),
+        (false, 1) => a << (b & 0x3f),
+        (false, 2) => ((a as i64) < (b as i64)) as u64,
+        (false, 3) => (a < b) as u64,
+        (false, 4) => a ^ b,
+        (false, 5) if alt => (a as i64 >> (b & 0x3f)) as u64,
+        (false, 5) => a >> (b & 0x3f),
+        (false, 6) => a | b,
+        (false, 7) => a & b,
+        (true, 0) => a.wrapping_mul(b),
+        (true, 1) => ((a as i64 as i128 * b as i64 as i128) >> 64) as u64,
+        (true, 2) => ((a as i64 as i128 * b as i128) >> 64) as u64,
+        (true, 3) => ((a as u128 * b as u128) >> 64) as u64,
+        (true, 4) if b == 0 => u64::MAX,
+        (true, 4) => (a as i64).wrapping_div(b as i64) as u64,
+        (true, 5) if b == 0 => u64::MAX,
+        (true, 5) => a / b,
+        (true, 6) if b == 0 => a,
+        (true, 6) => (a as i64).wrapping_rem(b as i64) as u64,
+        (true, 7) if b == 0 => a,
+        (true, 7) => a % b,
+        _ => unreachable!(),
+    }
+}
+
+/// Like `alu`, but for values that may be unknown or relative to the start
+/// of the program. `same_reg` is set if both operands are one register.
+fn alu_value(op: u32, alt: bool, m: bool, word: bool, a: Value, b: Value, same_reg: bool) -> Value {
+    match (a, b) {
+        (Const(a), Const(b)) => Const(alu(op, alt, m, word, a, b)),
+        // Offsets into the program stay offsets into the program.
+        (Code(a), Const(b)) if !m && !word && op == 0 => Code(alu(op, alt, m, word, a, b)),
+        (Const(a), Code(b)) if !m && !word && op == 0 && !alt => Code(a.wrapping_add(b)),
+        (Code(a), Code(b)) if !m && !word && op == 0 && alt => Const(a.wrapping_sub(b)),
+        // Common ways to clear a register.
+        _ if same_reg && !m && (op == 0 && alt || op == 4) => Const(alu(op, alt, m, word, 0, 0)),
+        (_, Const(0)) | (Const(0), _) if !m && op == 7 => Const(0),
+        _ => Unknown,
+    }
+}
+
+/// Decides a branch, or returns None if it depends on something unknown.
+fn branch_taken(op: u32, a: Value, b: Value, same_reg: bool) -> Option<bool> {
+    let (a, b) = match (a, b) {
+        _ if same_reg => (0, 0),
+        (Const(a), Const(b)) => (a, b),
+        // Only equality is known for two offsets, the order may wrap.
+        (Code(a), Code(b)) if op < 2 => (a, b),
+        _ => return None,
+    };
+    match op {
+        0 => Some(a == b),
+        1 => Some(a != b),
+        4 => Some((a as i64) < (b as i64)),
+        5 => Some((a as i64) >= (b as i64)),
+        6 => Some(a < b),
+        7 => Some(a >= b),
+        _ => None,
+    }
+}
+
+/// Returns true if the OP-FP instruction writes an integer register:
+/// comparisons, conversions to integers, fmv.x and fclass.
+fn fp_writes_int(enc: u32) -> bool {
+    matches!(enc >> 27, 0x14 | 0x18 | 0x1c)
+}
+
+/// Interprets the program for up to `max_steps` instructions. `visited`
+/// holds the state hashes of the current run and is only passed in so that
+/// it doesn't have to be allocated for every program.
+fn interpret(program: &[u32], max_steps: usize, visited: &mut HashSet<u64>) -> Outcome {
+    let hasher = RandomState::with_seeds(0, 0, 0, 0);
+    let end = program.len() as u64 * 4;
+    let mut regs = [Unknown; 32];
+    regs[0] = Const(0);
+    let mut pc = 0u64;
+    let mut trace = hasher.hash_one(end);
+    visited.clear();
+
+    for _ in 0..max_steps {
+        if pc == end {
+            return Outcome::End { trace };
+        }
+        let inst = (pc / 4) as usize;
+        let enc = program[inst];
+        trace = trace.rotate_left(5) ^ enc as u64;
+        trace = trace.wrapping_mul(0x9e37_79b9_7f4a_7c15);
+
+        let mut next = pc + 4;
+        // The target of a jump and the offset it is relative to.
+        let mut jump: Option<(Value, u64)> = None;
+        let mut result: Option<Value> = None;
+        let (a, b) = (regs[rs1(enc)], regs[rs2(enc)]);
+        let same_reg = rs1(enc) == rs2(enc);
+        match enc & 0x7f {
+            // LUI, AUIPC
+            0x37 => result = Some(Const(u_imm(enc))),
+            0x17 => result = Some(Code(pc.wrapping_add(u_imm(enc)))),
+            // JAL, JALR
+            0x6f => {
+                jump = Some((Code(pc.wrapping_add(j_imm(enc))), pc));
+                result = Some(Code(pc + 4));
+            }
+            0x67 => {
+                jump = match a {
+                    Code(base) => Some((Code(base.wrapping_add(i_imm(enc)) & !1), base)),
+                    _ => return Outcome::Stopped,
+                };
+                result = Some(Code(pc + 4));
+            }
+            0x63 => match branch_taken(funct3(enc), a, b, same_reg) {
+                Some(true) => jump = Some((Code(pc.wrapping_add(b_imm(enc))), pc)),
+                Some(false) => (),
+                None => return Outcome::Stopped,
+            },
+            // LOAD, AMO
+            0x03 | 0x2f => {
+                result = Some(Unknown);
+                if enc & 0x7f == 0x2f {
+                    visited.clear();
+                }
+            }
+            // STORE, STORE-FP: Memory isn't modeled, so a loop that stores
+            // something may still make progress.
+            0x23 | 0x27 => visited.clear(),
+            // LOAD-FP, MISC-MEM, fused multiply-add
+            0x07 | 0x0f | 0x43 | 0x47 | 0x4b | 0x4f => (),
+            0x53 => {
+                if fp_writes_int(enc) {
+                    result = Some(Unknown);
+                }
+            }
+            // OP-IMM, OP-IMM-32
+            0x13 | 0x1b => {
+                let op = funct3(enc);
+                let word = enc & 0x7f == 0x1b;
+                let imm = if op == 1 || op == 5 {
+                    (enc >> 20 & 0x3f) as u64
+                } else {
+                    i_imm(enc)
+                };
+                let alt = op == 5 && enc >> 30 & 1 == 1;
+                result = Some(alu_value(op, alt, false, word, a, Const(imm), false));
+            }
+            // OP, OP-32
+            0x33 | 0x3b => {
+                let word = enc & 0x7f == 0x3b;
+                let m = enc >> 25 == 1;
+                let alt = !m && enc >> 30 & 1 == 1;
+                result = Some(alu_value(funct3(enc), alt, m, word, a, b, same_reg));
+            }
+            // SYSTEM and everything that isn't RV64G.
+            _ => return Outcome::Stopped,
+        }
+
+        if let Some(value) = result {
+            if rd(enc) != 0 {
+                regs[rd(enc)] = value;
+            }
+        }
+        if let Some((target, base)) = jump {
+            next = match target {
+                Code(target) if target % 4 == 0 && target <= end => target,
+                Code(_) => return Outcome::OutOfBounds { inst, base },
+                _ => return Outcome::Stopped,
+            };
+            // Every loop jumps backwards, so it is enough to only remember
+            // the state there. The same state without a store in between
+            // means that the program never gets out.
+            if next <= pc {
+                let mut state = hasher.build_hasher();
+                next.hash(&mut state);
+                regs.hash(&mut state);
+                if !visited.insert(state.finish()) {
+                    return Outcome::Loops;
+                }
+            }
+        }
+        pc = next;
+    }
+    if pc == end {
+        return Outcome::End { trace };
+    }
+    Outcome::Loops
+}
+
+/// Redirects the out-of-bounds jump to the end of the program. Returns the
+/// new encoding or None if the end is too far away for the jump.
+fn repair_jump(program: &[u32], inst: usize, base: u64) -> Option<u32> {
+    let enc = program[inst];
+    let offset = (program.len() as u64 * 4).wrapping_sub(base) as i64;
+    match enc & 0x7f {
+        0x6f => with_j_imm(enc, offset),
+        0x67 => with_i_imm(enc, offset),
+        0x63 => with_b_imm(enc, offset),
+        _ => None,
+    }
+}
+
+/// Counts what the filter did.
+#[derive(Clone, Debug, Default)]
+pub struct PrefilterStats {
+    pub checked: u64,
+    pub repaired: u64,
+    pub out_of_bounds: u64,
+    pub loops: u64,
+    pub duplicates: u64,
+}
+
+/// Checks programs before they are run (see the module documentation).
+pub struct Prefilter {
+    max_steps: usize,
+    /// Traces of the recently run programs, oldest first.
+    recent: VecDeque<u64>,
+    recent_set: HashSet<u64>,
+    visited: HashSet<u64>,
+    encoded: Vec<u32>,
+    stats: PrefilterStats,
+}
+
+impl Prefilter {
+    /// Creates a filter that considers programs that run for more than
+    /// `max_steps` instructions as looping.
+    pub fn new(max_steps: usize) -> Self {
+        Self {
+            max_steps,
+            recent: VecDeque::with_capacity(RECENT_TRACES),
+            recent_set: HashSet::with_capacity(RECENT_TRACES),
+            visited: HashSet::new(),
+            encoded: Vec::new(),
+            stats: PrefilterStats::default(),
+        }
+    }
+
+    pub fn stats(&self) -> &PrefilterStats {
+        &self.stats
+    }
+
+    /// Checks the program and repairs it if possible. Only programs with the
+    /// verdict `Run` or `Repaired` should be executed.
+    pub fn check<I: HasProgramInput>(&mut self, input: &mut I) -> Verdict {
+        self.stats.checked += 1;
+        self.encoded.clear();
+        self.encoded
+            .extend(input.insts().iter().map(|inst| inst.encode()));
+
+        let mut repairs = 0;
+        let verdict = loop {
+            match interpret(&self.encoded, self.max_steps, &mut self.visited) {
+                Outcome::End { trace } => {
+                    if !self.remember(trace) {
+                        self.stats.duplicates += 1;
+                        break Verdict::Duplicate;
+                    }
+                    break Verdict::Run;
+                }
+                Outcome::Stopped => break Verdict::Run,
+                Outcome::Loops => {
+                    self.stats.loops += 1;
+                    break Verdict::Loops;
+                }
+                Outcome::OutOfBounds { inst, base } => {
+                    let repaired = repair_jump(&self.encoded, inst, base);
+                    let decoded =
+                        repaired.and_then(|enc| input.insts()[inst].template().decode(enc));
+                    match decoded {
+                        Some(fixed) if repairs < MAX_REPAIRS => {
+                            self.encoded[inst] = fixed.encode();
+                            input.insts_mut()[inst] = fixed;
+                            repairs += 1;
+                        }
+                        _ => {
+                            self.stats.out_of_bounds += 1;
+                            break Verdict::OutOfBounds;
+                        }
+                    }
+                }
+            }
+        };
+
+        if repairs > 0 {
+            self.stats.repaired += 1;
+        }
+        if self.stats.checked % LOG_INTERVAL == 0 {
+            log::info!("Prefilter: {:?}", self.stats);
+        }
+        match verdict {
+            Verdict::Run if repairs > 0 => Verdict::Repaired,
+            verdict => verdict,
+        }
+    }
+
+    /// Adds the trace to the recent traces. Returns false if it was already
+    /// there.
+    fn remember(&mut self, trace: u64) -> bool {
+        if !self.recent_set.insert(trace) {
+            return false;
+        }
+        if self.recent.len() == RECENT_TRACES {
+            let oldest = self.recent.pop_front().unwrap();
+            self.recent_set.remove(&oldest);
+        }
+        self.recent.push_back(trace);
+        true
+    }
+}
+
+/// Runs the prefilter on every input the wrapped mutator produced. Dropped
+/// inputs are reported as skipped, so the stages don't execute them, and
+/// the wrapped mutator is told that they found nothing. Without a filter the
+/// inputs are passed through, which keeps the type of the stages the same.
+pub struct PrefilterMutator<M> {
+    inner: M,
+    filter: Option<Prefilter>,
+}
+
+impl<M> PrefilterMutator<M> {
+    pub fn new(inner: M, filter: Option<Prefilter>) -> Self {
+        Self { inner, filter }
+    }
+}
+
+impl<M> Named for PrefilterMutator<M> {
+    fn name(&self) -> &str {
+        "PrefilterMutator"
+    }
+}
+
+impl<I, M, S> Mutator<I, S> for PrefilterMutator<M>
+where
+    I: HasProgramInput,
+    M: Mutator<I, S>,
+{
+    fn mutate(
+        &mut self,
+        state: &mut S,
+        input: &mut I,
+        stage_idx: i32,
+    ) -> Result<MutationResult, Error> {
+        if self.inner.mutate(state, input, stage_idx)? == MutationResult::Skipped {
+            return Ok(MutationResult::Skipped);
+        }
+        let filter = match self.filter.as_mut() {
+            Some(filter) => filter,
+            None => return Ok(MutationResult::Mutated),
+        };
+        match filter.check(input) {
+            Verdict::Run | Verdict::Repaired => Ok(MutationResult::Mutated),
+            _ => {
+                self.inner.post_exec(state, stage_idx, None)?;
+                Ok(MutationResult::Skipped)
+            }
+        }
+    }
+
+    fn post_exec(
+        &mut self,
+        state: &mut S,
+        stage_idx: i32,
+        corpus_idx: Option<CorpusId>,
+    ) -> Result<(), Error> {
+        self.inner.post_exec(state, stage_idx, corpus_idx)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashSet;
+
+    use libafl::{
+        bolts::serdeany::SerdeAnyMap,
+        corpus::CorpusId,
+        mutators::{MutationResult, Mutator},
+        prelude::StdRand,
+        state::{HasMetadata, HasRand},
+    };
+
+    use crate::{
+        generator::InstructionSet,
+        instructions::{
+            riscv::{args, rv_i::ADDI},
+            Argument, Instruction,
+        },
+        mutation_scheduler::{AdaptiveScheduledMutator, MutationSchedule},
+        mutator::Mutation,
+        program_input::ProgramInput,
+    };
+
+    use super::{interpret, repair_jump, Outcome, Prefilter, PrefilterMutator};
+
+    const NOP: u32 = 0x0000_0013;
+    /// addi x5, x0, 3
+    const LI_X5_3: u32 = 0x0030_0293;
+    /// addi x5, x5, -1
+    const DEC_X5: u32 = 0xfff2_8293;
+    /// bne x5, x0, -4
+    const BNEZ_X5_BACK: u32 = 0xfe02_9ee3;
+    /// jal x0, 0
+    const JAL_SELF: u32 = 0x0000_006f;
+    /// jal x0, 64
+    const JAL_FAR: u32 = 0x0400_006f;
+    /// auipc x2, 0
+    const AUIPC_X2: u32 = 0x0000_0117;
+    /// jalr x1, 8(x2)
+    const CALL_8: u32 = 0x0081_00e7;
+    /// jalr x1, 16(x2)
+    const CALL_16: u32 = 0x0101_00e7;
+    /// jalr x0, 0(x1)
+    const RET: u32 = 0x0000_8067;
+    /// ld x6, 0(x7)
+    const LOAD_X6: u32 = 0x0003_b303;
+    /// beq x6, x0, 8
+    const BEQZ_X6: u32 = 0x0003_0463;
+
+    fn run(program: &[u32]) -> Outcome {
+        interpret(program, 10_000, &mut HashSet::new())
+    }
+
+    #[test]
+    fn counted_loop_ends() {
+        let program = [LI_X5_3, DEC_X5, BNEZ_X5_BACK, NOP];
+        assert!(matches!(run(&program), Outcome::End { .. }));
+        // The trace follows what was executed, not just the encoding.
+        let Outcome::End { trace: a } = run(&program) else {
+            panic!()
+        };
+        let Outcome::End { trace: b } = run(&[LI_X5_3, NOP, NOP, NOP]) else {
+            panic!()
+        };
+        assert_ne!(a, b);
+    }
+
+    #[test]
+    fn infinite_loops() {
+        assert_eq!(run(&[NOP, JAL_SELF]), Outcome::Loops);
+        // A call that lands on its own return.
+        assert_eq!(run(&[AUIPC_X2, CALL_8, RET]), Outcome::Loops);
+        // A count that never reaches zero within the step limit.
+        assert_eq!(
+            interpret(&[LI_X5_3, DEC_X5, BNEZ_X5_BACK], 5, &mut HashSet::new()),
+            Outcome::Loops
+        );
+    }
+
+    #[test]
+    fn out_of_bounds_jumps() {
+        let program = [NOP, JAL_FAR, NOP];
+        assert_eq!(run(&program), Outcome::OutOfBounds { inst: 1, base: 4 });
+        let fixed = repair_jump(&program, 1, 4).unwrap();
+        assert!(matches!(run(&[NOP, fixed, NOP]), Outcome::End { .. }));
+
+        // The snippet call jumps relative to the auipc.
+        let program = [AUIPC_X2, CALL_16];
+        assert_eq!(run(&program), Outcome::OutOfBounds { inst: 1, base: 0 });
+        let fixed = repair_jump(&program, 1, 0).unwrap();
+        assert!(matches!(run(&[AUIPC_X2, fixed]), Outcome::End { .. }));
+    }
+
+    #[test]
+    fn unknown_values_stop() {
+        assert_eq!(run(&[LOAD_X6, BEQZ_X6, JAL_FAR]), Outcome::Stopped);
+        assert_eq!(run(&[RET]), Outcome::Stopped);
+    }
+
+    struct TestState {
+        rand: StdRand,
+        metadata: SerdeAnyMap,
+    }
+
+    impl HasRand for TestState {
+        type Rand = StdRand;
+
+        fn rand(&self) -> &StdRand {
+            &self.rand
+        }
+
+        fn rand_mut(&mut self) -> &mut StdRand {
+            &mut self.rand
+        }
+    }
+
+    impl HasMetadata for TestState {
+        fn metadata_map(&self) -> &SerdeAnyMap {
+            &self.metadata
+        }
+
+        fn metadata_map_mut(&mut self) -> &mut SerdeAnyMap {
+            &mut self.metadata
+        }
+    }
+
+    #[test]
+    fn rejected_programs_in_a_batch() {
+        let mut state = TestState {
+            rand: StdRand::with_seed(0),
+            metadata: SerdeAnyMap::new(),
+        };
+        let mut mutator = PrefilterMutator::new(
+            AdaptiveScheduledMutator::new(
+                MutationSchedule::Uniform,
+                &[Mutation::Add],
+                InstructionSet::riscv_base(),
+            ),
+            Some(Prefilter::new(64)),
+        );
+        let nop = Instruction::new(
+            &ADDI,
+            vec![
+                Argument::new(&args::RD, 0u32),
+                Argument::new(&args::RS1, 0u32),
+                Argument::new(&args::IMM12, 0u32),
+            ],
+        );
+        // Programs that grow past 64 instructions count as looping.
+        let base = ProgramInput::new(vec![nop; 60]);
+
+        // Like BatchedMutationalStage, mutate the whole batch before the
+        // first program runs. Rejected programs are finished right away.
+        let mut batch = Vec::new();
+        let mut rejected = 0;
+        for stage_idx in 0..32 {
+            let mut input = base.clone();
+            match mutator.mutate(&mut state, &mut input, stage_idx).unwrap() {
+                MutationResult::Mutated => batch.push(stage_idx),
+                MutationResult::Skipped => rejected += 1,
+            }
+        }
+        assert!(rejected > 0 && !batch.is_empty(), "{}", rejected);
+        for (slot, stage_idx) in batch.iter().enumerate() {
+            let corpus_idx = (slot == 1).then(|| CorpusId::from(0usize));
+            Mutator::<ProgramInput, _>::post_exec(&mut mutator, &mut state, *stage_idx, corpus_idx)
+                .unwrap();
+        }
+
+        // Every program is credited once and only the find of its own slot.
+        let stats = &mutator.inner.stats().mutations[0];
+        assert_eq!(stats.execs, 32);
+        assert_eq!(stats.finds, 1);
+    }
+}
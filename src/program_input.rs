@@ -1,28 +1,54 @@
 //! The gramatron grammar fuzzer
-use core::hash::{BuildHasher, Hasher};
+use core::hash::{BuildHasher, Hash, Hasher};
 use libafl::{
     prelude::{HasLen, HasTargetBytes, Input, OwnedSlice},
     Error,
 };
-use std::fmt;
+use std::{cell::OnceCell, fmt};
 
 use ahash::RandomState;
 use serde::{de::Visitor, Deserialize, Deserializer, Serialize, Serializer};
 
 use crate::{
-    assembler::assemble_instructions,
-    instructions::{self, Instruction},
-    parser::parse_instructions,
+    assembler::assemble_instructions_into,
+    generator::ArgumentPool,
+    instructions::Instruction,
+    parser::{parse_instructions_with, Decoder},
 };
 
 pub trait HasProgramInput {
     fn insts(&self) -> &[Instruction];
     fn insts_mut(&mut self) -> &mut Vec<Instruction>;
+    /// Returns the instructions for modification together with the pool of
+    /// their arguments. Callers have to add the arguments of any instruction
+    /// they add to the program to the pool.
+    fn insts_and_pool_mut(&mut self) -> (&mut Vec<Instruction>, &mut ArgumentPool);
 }
 
-#[derive(Clone, Debug, Default, PartialEq, Eq, Hash)]
+#[derive(Clone, Debug, Default)]
 pub struct ProgramInput {
     insts: Vec<Instruction>,
+    /// The encoded program. Computed on first use and dropped whenever the
+    /// instructions are handed out for modification.
+    encoded: OnceCell<Vec<u8>>,
+    /// The arguments used in the program. Computed when the mutators first
+    /// need it (or when the corpus stores the input, see `cache_arg_pool`)
+    /// and then kept up to date by them.
+    arg_pool: OnceCell<ArgumentPool>,
+}
+
+impl PartialEq for ProgramInput {
+    fn eq(&self, other: &Self) -> bool {
+        self.insts == other.insts
+    }
+}
+
+impl Eq for ProgramInput {}
+
+impl Hash for ProgramInput {
+    fn hash<H: Hasher>(&self, state: &mut H) {
+        self.insts.hash(state)
+    }
 }
 
 impl Serialize for ProgramInput {
@@ -30,7 +56,7 @@ impl Serialize for ProgramInput {
     where
         S: Serializer,
     {
-        serializer.serialize_bytes(assemble_instructions(&self.insts).as_slice())
+        serializer.serialize_bytes(self.encoded())
     }
 }
 
@@ -45,9 +71,7 @@ impl<'de> Deserialize<'de> for ProgramInput {
 
 impl HasTargetBytes for ProgramInput {
     fn target_bytes(&self) -> OwnedSlice<u8> {
-        let bytes = assemble_instructions(&self.insts);
-        debug_assert!(parse_instructions(&bytes.to_vec(), &instructions::riscv::all()).is_ok());
-        OwnedSlice::<u8>::from(bytes.to_vec())
+        OwnedSlice::<u8>::from(self.encoded())
     }
 }
 
@@ -63,8 +87,13 @@ impl<'de> Visitor<'de> for ProgramInputVisitor {
     where
         E: serde::de::Error,
     {
+        // The serialized bytes are the encoding, so keep them around.
+        let bytes = v.to_vec();
+        let insts = parse_instructions_with(&bytes, Decoder::all()).map_err(E::custom)?;
         Ok(ProgramInput {
-            insts: parse_instructions(&v.to_vec(), &instructions::riscv::all()).unwrap(),
+            insts,
+            encoded: OnceCell::from(bytes),
+            arg_pool: OnceCell::new(),
         })
     }
 }
@@ -74,7 +103,7 @@ impl Input for ProgramInput {
     #[must_use]
     fn generate_name(&self, _idx: usize) -> String {
         let mut hasher = RandomState::with_seeds(0, 0, 0, 0).build_hasher();
-        hasher.write(assemble_instructions(&self.insts).as_slice());
+        hasher.write(self.encoded());
         format!("size:{}-hash:{:016x}", self.insts().len(), hasher.finish())
     }
 }
@@ -91,7 +120,11 @@ impl HasProgramInput for ProgramInput {
     }
 
     fn insts_mut(&mut self) -> &mut Vec<Instruction> {
-        &mut self.insts
+        ProgramInput::insts_mut(self)
+    }
+
+    fn insts_and_pool_mut(&mut self) -> (&mut Vec<Instruction>, &mut ArgumentPool) {
+        ProgramInput::insts_and_pool_mut(self)
     }
 }
 
@@ -99,31 +132,146 @@ impl ProgramInput {
     /// Creates a new codes input using the given terminals
     #[must_use]
     pub fn new(insts: Vec<Instruction>) -> Self {
-        Self { insts }
+        Self {
+            insts,
+            encoded: OnceCell::new(),
+            arg_pool: OnceCell::new(),
+        }
+    }
+
+    /// Creates an input that is sent to the target as exactly the given
+    /// bytes, e.g. a batch of programs (see `batch.rs`). It has no
+    /// instructions, so it must not be mutated or stored in a corpus.
+    pub(crate) fn from_target_bytes(bytes: Vec<u8>) -> Self {
+        Self {
+            insts: Vec::new(),
+            encoded: OnceCell::from(bytes),
+            arg_pool: OnceCell::new(),
+        }
     }
 
     pub fn insts(&self) -> &[Instruction] {
         &self.insts
     }
 
+    /// Returns the instructions for modification. Invalidates the cached
+    /// encoding of the program.
     pub fn insts_mut(&mut self) -> &mut Vec<Instruction> {
+        self.encoded.take();
+        self.arg_pool.take();
         &mut self.insts
     }
 
+    /// Returns the instructions for modification and the pool of their
+    /// arguments. Only builds the pool if the program was modified through
+    /// `insts_mut` since the last call.
+    pub fn insts_and_pool_mut(&mut self) -> (&mut Vec<Instruction>, &mut ArgumentPool) {
+        self.encoded.take();
+        let insts = &self.insts;
+        self.arg_pool
+            .get_or_init(|| ArgumentPool::from_program(insts));
+        (&mut self.insts, self.arg_pool.get_mut().unwrap())
+    }
+
+    /// Builds the pool of the arguments now. The mutational stages mutate a
+    /// clone of the corpus entry, so calling this on the entry means its
+    /// clones come with the pool instead of building it every time.
+    pub fn cache_arg_pool(&self) {
+        self.arg_pool
+            .get_or_init(|| ArgumentPool::from_program(&self.insts));
+    }
+
+    /// Returns the encoded program, only encoding it if it changed since the
+    /// last call.
+    pub fn encoded(&self) -> &[u8] {
+        self.encoded.get_or_init(|| {
+            let mut bytes = Vec::<u8>::with_capacity(self.insts.len() * 4);
+            assemble_instructions_into(&self.insts, &mut bytes);
+            debug_assert!(parse_instructions_with(&bytes, Decoder::all()).is_ok());
+            bytes
+        })
+    }
+
     /// Create a bytes representation of this input
     pub fn unparse(&self, bytes: &mut Vec<u8>) {
         bytes.clear();
-        bytes.extend_from_slice(assemble_instructions(&self.insts).as_slice());
+        bytes.extend_from_slice(self.encoded());
     }
 
     /// Crop the value to the given length
     pub fn crop(&self, from: usize, to: usize) -> Result<Self, Error> {
         if from < to && to <= self.insts.len() {
-            let mut insts = vec![];
-            insts.clone_from_slice(&self.insts[from..to]);
-            Ok(Self { insts })
+            Ok(Self::new(self.insts[from..to].to_vec()))
         } else {
             Err(Error::illegal_argument("Invalid from or to argument"))
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use libafl::bolts::AsSlice;
+    use libafl::prelude::{HasTargetBytes, Rand, Xoshiro256StarRand};
+
+    use crate::assembler::assemble_instructions;
+    use crate::generator::InstGenerator;
+    use crate::instructions;
+
+    use super::ProgramInput;
+
+    #[test]
+    fn cached_encoding_follows_mutations() {
+        let mut rng = Xoshiro256StarRand::default();
+        rng.set_seed(0);
+        let generator = InstGenerator::new();
+        let insts = generator.generate_instructions(&mut rng, &instructions::sets::riscv_g(), 10);
+
+        let mut input = ProgramInput::new(insts.clone());
+        assert_eq!(
+            input.target_bytes().as_slice(),
+            assemble_instructions(&insts)
+        );
+
+        // Modifying the program has to drop the cached encoding.
+        input.insts_mut().pop();
+        assert_eq!(
+            input.target_bytes().as_slice(),
+            assemble_instructions(&insts[..9].to_vec())
+        );
+    }
+
+    #[test]
+    fn clones_keep_arg_pool() {
+        let mut rng = Xoshiro256StarRand::default();
+        rng.set_seed(2);
+        let generator = InstGenerator::new();
+        let insts = generator.generate_instructions(&mut rng, &instructions::sets::riscv_g(), 10);
+
+        let input = ProgramInput::new(insts);
+        assert!(input.clone().arg_pool.get().is_none());
+        input.cache_arg_pool();
+        assert!(input.clone().arg_pool.get().is_some());
+        // Modifying the program has to drop the pool.
+        let mut clone = input.clone();
+        clone.insts_mut().pop();
+        assert!(clone.arg_pool.get().is_none());
+    }
+
+    #[test]
+    fn postcard_roundtrip() {
+        let mut rng = Xoshiro256StarRand::default();
+        rng.set_seed(1);
+        let generator = InstGenerator::new();
+        let insts = generator.generate_instructions(&mut rng, &instructions::sets::riscv_g(), 10);
+
+        let input = ProgramInput::new(insts);
+        let mut buffer = [0u8; 128];
+        let bytes = postcard::to_slice(&input, &mut buffer).unwrap();
+        let parsed = postcard::from_bytes::<ProgramInput>(bytes).unwrap();
+        assert_eq!(parsed, input);
+        assert_eq!(
+            parsed.target_bytes().as_slice(),
+            input.target_bytes().as_slice()
+        );
+    }
+}
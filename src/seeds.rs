@@ -0,0 +1,346 @@
+//! Loading of the initial corpus. Seeds are either raw encoded programs
+//! ('.insts' files) or programs in the serialized format of the corpus
+//! (e.g. the 'queue' directory of an earlier run). Before fuzzing starts
+//! the seeds are culled to a small set that covers the same map entries.
+//! Each client culls its own share of the seeds, the other clients get the
+//! kept ones through the usual new testcase events.
+use std::{
+    collections::{HashMap, HashSet},
+    fs,
+    marker::PhantomData,
+    path::{Path, PathBuf},
+    thread,
+};
+
+use libafl::{
+    events::EventFirer,
+    executors::{Executor, ExitKind, HasObservers},
+    feedbacks::HasObserverName,
+    fuzzer::ExecutionProcessor,
+    inputs::UsesInput,
+    observers::{MapObserver, ObserversTuple, UsesObserver},
+    state::{HasClientPerfMonitor, UsesState},
+    Error,
+};
+
+use crate::{
+    minimizer::run_program,
+    parser::{parse_instructions_with, Decoder},
+    program_input::ProgramInput,
+};
+
+/// Extension of files with raw encoded instructions.
+pub const RAW_SEED_EXTENSION: &'static str = "insts";
+
+/// Parses a single seed file. Files with the '.insts' extension are raw
+/// instructions, everything else is first tried in the corpus format.
+pub fn parse_seed(path: &Path, bytes: &[u8]) -> Result<ProgramInput, String> {
+    let is_raw = path
+        .extension()
+        .map_or(false, |ext| ext == RAW_SEED_EXTENSION);
+    if !is_raw {
+        if let Ok(input) = postcard::from_bytes::<ProgramInput>(bytes) {
+            return Ok(input);
+        }
+    }
+    let insts = parse_instructions_with(bytes, Decoder::all())?;
+    Ok(ProgramInput::new(insts))
+}
+
+/// Collects all seed files in the directory and its subdirectories.
+/// Hidden files (such as the '.<name>.metadata' files of the corpus) are
+/// skipped.
+fn collect_seed_files(dir: &Path, result: &mut Vec<PathBuf>) -> Result<(), String> {
+    let entries = fs::read_dir(dir).map_err(|e| format!("Failed to read {:?}: {}", dir, e))?;
+    for entry in entries {
+        let entry = entry.map_err(|e| format!("Failed to read {:?}: {}", dir, e))?;
+        let path = entry.path();
+        if entry.file_name().to_string_lossy().starts_with('.') {
+            continue;
+        }
+        if path.is_dir() {
+            collect_seed_files(&path, result)?;
+        } else {
+            result.push(path);
+        }
+    }
+    Ok(())
+}
+
+/// Loads all seeds in the given directory. Files are read and parsed on all
+/// available cores. Files that aren't programs, empty programs and
+/// duplicates are skipped. The result is in the order of the file names.
+pub fn load_seeds(dir: &Path) -> Result<Vec<ProgramInput>, String> {
+    let mut files = Vec::<PathBuf>::new();
+    collect_seed_files(dir, &mut files)?;
+    files.sort();
+
+    let threads = thread::available_parallelism().map_or(1, |n| n.get());
+    let chunk_size = ((files.len() + threads - 1) / threads).max(1);
+    let parsed: Vec<Option<ProgramInput>> = thread::scope(|scope| {
+        let workers: Vec<_> = files
+            .chunks(chunk_size)
+            .map(|chunk| {
+                scope.spawn(move || {
+                    chunk
+                        .iter()
+                        .map(|path| {
+                            let bytes = fs::read(path).ok()?;
+                            parse_seed(path, &bytes).ok()
+                        })
+                        .collect::<Vec<_>>()
+                })
+            })
+            .collect();
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().expect("Seed parser panicked"))
+            .collect()
+    });
+
+    let mut seen = HashSet::<ProgramInput>::new();
+    let mut result = Vec::<ProgramInput>::new();
+    for input in parsed.into_iter().flatten() {
+        if input.insts().is_empty() || seen.contains(&input) {
+            continue;
+        }
+        seen.insert(input.clone());
+        result.push(input);
+    }
+    Ok(result)
+}
+
+/// Returns the seeds the given client of `clients` culls, every
+/// `clients`-th seed starting at its index. Every client culls just its own
+/// shard, so seeds in different shards that cover the same entries are all
+/// kept. The union of the culled shards still covers everything.
+pub fn seed_shard(seeds: &[ProgramInput], client: usize, clients: usize) -> Vec<ProgramInput> {
+    seeds
+        .iter()
+        .skip(client)
+        .step_by(clients.max(1))
+        .cloned()
+        .collect()
+}
+
+/// Picks the seeds to keep given the length and covered map entries of each
+/// seed. Every map entry is kept covered by the shortest seed hitting it
+/// (ties go to the earlier seed), so the result covers the same entries as
+/// all seeds together. Returns the sorted indices of the kept seeds.
+pub fn select_covering_seeds(seeds: &[(usize, Vec<usize>)]) -> Vec<usize> {
+    // Map entry -> index of the best seed covering it.
+    let mut best = HashMap::<usize, usize>::new();
+    for (idx, (len, entries)) in seeds.iter().enumerate() {
+        for entry in entries {
+            best.entry(*entry)
+                .and_modify(|current| {
+                    if *len < seeds[*current].0 {
+                        *current = idx;
+                    }
+                })
+                .or_insert(idx);
+        }
+    }
+    let mut result: Vec<usize> = best
+        .into_values()
+        .collect::<HashSet<_>>()
+        .into_iter()
+        .collect();
+    result.sort();
+    result
+}
+
+/// Runs seeds on the executor to find out which of them can be dropped.
+pub struct SeedCuller<O> {
+    map_observer_name: String,
+    phantom: PhantomData<O>,
+}
+
+/// A kept seed with the map entries (and their hitcounts) of its run.
+pub type CulledSeed = (ProgramInput, Vec<(usize, u8)>);
+
+impl<O> SeedCuller<O>
+where
+    O: MapObserver<Entry = u8>,
+{
+    #[must_use]
+    pub fn new<F, S>(map_feedback: &F) -> Self
+    where
+        F: HasObserverName + UsesObserver<S, Observer = O>,
+        S: UsesInput,
+    {
+        Self {
+            map_observer_name: map_feedback.observer_name().to_string(),
+            phantom: PhantomData,
+        }
+    }
+
+    /// Executes every seed once and returns a subset of them (shortest first)
+    /// that covers the same map entries as all of them. This is a greedy
+    /// pick, not necessarily the smallest such subset, and it only removes
+    /// overlap within the given seeds (e.g. a single `seed_shard`). Seeds
+    /// that don't run successfully are dropped.
+    pub fn cull<E, EM, Z>(
+        &self,
+        fuzzer: &mut Z,
+        executor: &mut E,
+        state: &mut E::State,
+        mgr: &mut EM,
+        seeds: &[ProgramInput],
+    ) -> Result<Vec<CulledSeed>, Error>
+    where
+        E: Executor<EM, Z> + HasObservers,
+        E::Observers: ObserversTuple<E::State>,
+        EM: UsesState<State = E::State>,
+        Z: UsesState<State = E::State>,
+        E::State: HasClientPerfMonitor + UsesInput<Input = ProgramInput>,
+    {
+        let mut coverage = Vec::<(usize, Vec<usize>)>::with_capacity(seeds.len());
+        let mut hits = Vec::<Vec<u8>>::with_capacity(seeds.len());
+        for seed in seeds {
+            if run_program(fuzzer, executor, state, mgr, seed)? != ExitKind::Ok {
+                coverage.push((seed.insts().len(), Vec::new()));
+                hits.push(Vec::new());
+                continue;
+            }
+            let map = executor
+                .observers()
+                .match_name::<O>(&self.map_observer_name)
+                .ok_or_else(|| Error::key_not_found("MapObserver not found".to_string()))?;
+            let initial = map.initial();
+            let entries: Vec<usize> = (0..map.usable_count())
+                .filter(|idx| *map.get(*idx) != initial)
+                .collect();
+            hits.push(entries.iter().map(|idx| *map.get(*idx)).collect());
+            coverage.push((seed.insts().len(), entries));
+        }
+
+        let mut kept = select_covering_seeds(&coverage);
+        kept.sort_by_key(|idx| coverage[*idx].0);
+        Ok(kept
+            .into_iter()
+            .map(|idx| {
+                let entries = core::mem::take(&mut coverage[idx].1);
+                let entries = entries.into_iter().zip(hits[idx].iter().copied());
+                (seeds[idx].clone(), entries.collect())
+            })
+            .collect())
+    }
+
+    /// Adds culled seeds to the corpus with the coverage they had in `cull`
+    /// instead of running them again. Going from the shortest seed, each one
+    /// hits an entry no seed before it hit, so on a fresh state the feedback
+    /// keeps all of them. Returns how many seeds were added.
+    pub fn add_culled<E, EM, OT, Z>(
+        &self,
+        fuzzer: &mut Z,
+        executor: &mut E,
+        state: &mut E::State,
+        mgr: &mut EM,
+        culled: Vec<CulledSeed>,
+    ) -> Result<usize, Error>
+    where
+        E: HasObservers<Observers = OT> + UsesState,
+        EM: EventFirer<State = E::State>,
+        OT: ObserversTuple<E::State>,
+        Z: ExecutionProcessor<OT, State = E::State>,
+        E::State: UsesInput<Input = ProgramInput>,
+    {
+        let mut added = 0;
+        for (seed, entries) in culled {
+            // The hitcounts were classified by the observer in the culling
+            // run, so only the map is restored.
+            let map = executor
+                .observers_mut()
+                .match_name_mut::<O>(&self.map_observer_name)
+                .ok_or_else(|| Error::key_not_found("MapObserver not found".to_string()))?;
+            map.reset_map()?;
+            let len = map.usable_count();
+            for &(idx, hits) in entries.iter().filter(|(idx, _)| *idx < len) {
+                *map.get_mut(idx) = hits;
+            }
+            let (_, corpus_id) = fuzzer.process_execution(
+                state,
+                mgr,
+                seed,
+                executor.observers(),
+                &ExitKind::Ok,
+                true,
+            )?;
+            if corpus_id.is_some() {
+                added += 1;
+            }
+        }
+        Ok(added)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::path::Path;
+
+    use crate::{
+        assembler::assemble_instructions,
+        instructions::{
+            riscv::{args, rv_i::ADDI},
+            Argument, Instruction,
+        },
+        program_input::ProgramInput,
+    };
+
+    use super::{parse_seed, seed_shard, select_covering_seeds};
+
+    #[test]
+    fn select_shortest_covering() {
+        let seeds = vec![
+            (10, vec![1, 2, 3]),
+            (2, vec![1, 2]),
+            (3, vec![3]),
+            // Only covers entries that shorter seeds cover.
+            (5, vec![2]),
+            // Crashed or didn't cover anything.
+            (1, vec![]),
+        ];
+        assert_eq!(select_covering_seeds(&seeds), vec![1, 2]);
+    }
+
+    #[test]
+    fn shards_cover_all_seeds() {
+        let seeds: Vec<ProgramInput> = (0..7u32)
+            .map(|imm| {
+                let inst = Instruction::new(
+                    &ADDI,
+                    vec![
+                        Argument::new(&args::RD, 1u32),
+                        Argument::new(&args::RS1, 2u32),
+                        Argument::new(&args::IMM12, imm),
+                    ],
+                );
+                ProgramInput::new(vec![inst])
+            })
+            .collect();
+        let shards: Vec<_> = (0..3).map(|client| seed_shard(&seeds, client, 3)).collect();
+        assert_eq!(
+            shards.iter().map(Vec::len).collect::<Vec<_>>(),
+            vec![3, 2, 2]
+        );
+        assert_eq!(shards[1], vec![seeds[1].clone(), seeds[4].clone()]);
+        assert_eq!(seed_shard(&seeds, 0, 1), seeds);
+    }
+
+    #[test]
+    fn parse_raw_seed() {
+        let inst = Instruction::new(
+            &ADDI,
+            vec![
+                Argument::new(&args::RD, 1u32),
+                Argument::new(&args::RS1, 2u32),
+                Argument::new(&args::IMM12, 3u32),
+            ],
+        );
+        let bytes = assemble_instructions(&vec![inst]);
+        let input = parse_seed(Path::new("seed.insts"), &bytes).unwrap();
+        assert_eq!(input.insts(), &[inst]);
+        assert!(parse_seed(Path::new("seed.insts"), &[1, 2, 3]).is_err());
+    }
+}
@@ -0,0 +1,225 @@
+//! A max map feedback for coverage maps where only a small part of the
+//! entries is hit per execution, which is the common case for the big maps
+//! of simulators. Instead of comparing every entry with the history, the map
+//! is scanned a word at a time for hit entries and only those are compared.
+//!
+//! It keeps the same state as `MaxMapFeedback` (`MapFeedbackMetadata` under
+//! its name, `MapIndexesMetadata` for new corpus entries and the coverage
+//! ratio under the name of the observer), so the stages and schedulers
+//! that work with that feedback work with this one.
+extern crate alloc;
+use alloc::string::{String, ToString};
+use core::{fmt::Debug, marker::PhantomData};
+
+use libafl::{
+    bolts::{tuples::Named, AsSlice},
+    corpus::Testcase,
+    events::{Event, EventFirer},
+    executors::ExitKind,
+    feedbacks::{Feedback, HasObserverName, MapFeedbackMetadata, MapIndexesMetadata},
+    inputs::UsesInput,
+    monitors::UserStats,
+    observers::{MapObserver, Observer, ObserversTuple, UsesObserver},
+    state::{HasClientPerfMonitor, HasMetadata, HasNamedMetadata},
+    Error,
+};
+
+/// Prefix of the name of the feedback, the same as for `MaxMapFeedback`.
+const FEEDBACK_PREFIX: &str = "mapfeedback_metadata_";
+
+/// Writes the indices of the non-zero entries of the map into `covered`.
+pub fn nonzero_entries(map: &[u8], covered: &mut Vec<usize>) {
+    covered.clear();
+    let mut words = map.chunks_exact(8);
+    for (word_idx, word) in words.by_ref().enumerate() {
+        let mut bits = u64::from_le_bytes(word.try_into().unwrap());
+        while bits != 0 {
+            let byte = bits.trailing_zeros() as usize / 8;
+            covered.push(word_idx * 8 + byte);
+            bits &= !(0xffu64 << (byte * 8));
+        }
+    }
+    let tail = map.len() - words.remainder().len();
+    covered.extend(
+        words
+            .remainder()
+            .iter()
+            .enumerate()
+            .filter(|(_, hits)| **hits != 0)
+            .map(|(idx, _)| tail + idx),
+    );
+}
+
+/// Returns how many entries of the history are set.
+fn count_filled(history: &[u8]) -> usize {
+    let mut words = history.chunks_exact(8);
+    let mut filled = 0;
+    for word in words.by_ref() {
+        let bits = u64::from_le_bytes(word.try_into().unwrap());
+        if bits != 0 {
+            filled += word.iter().filter(|hits| **hits != 0).count();
+        }
+    }
+    filled + words.remainder().iter().filter(|hits| **hits != 0).count()
+}
+
+/// Keeps inputs that hit an entry of the map more often than any input
+/// before, for maps of `u8` entries that start at 0.
+#[derive(Debug)]
+pub struct SparseMaxMapFeedback<O, S> {
+    name: String,
+    observer_name: String,
+    /// The entries hit in the last execution.
+    covered: Vec<usize>,
+    phantom: PhantomData<(O, S)>,
+}
+
+impl<O, S> SparseMaxMapFeedback<O, S>
+where
+    O: MapObserver<Entry = u8> + AsSlice<Entry = u8>,
+{
+    #[must_use]
+    pub fn new(map_observer: &O) -> Self {
+        Self {
+            name: FEEDBACK_PREFIX.to_string() + map_observer.name(),
+            observer_name: map_observer.name().to_string(),
+            covered: Vec::new(),
+            phantom: PhantomData,
+        }
+    }
+
+    /// Collects the hit entries of the map in the observers.
+    fn scan<'a, OT>(&mut self, observers: &'a OT) -> Result<&'a [u8], Error>
+    where
+        OT: ObserversTuple<S>,
+        S: UsesInput,
+    {
+        let observer = observers
+            .match_name::<O>(&self.observer_name)
+            .ok_or_else(|| Error::key_not_found("MapObserver not found".to_string()))?;
+        let map = observer.as_slice();
+        let map = &map[..observer.usable_count().min(map.len())];
+        nonzero_entries(map, &mut self.covered);
+        Ok(map)
+    }
+}
+
+impl<O, S> Named for SparseMaxMapFeedback<O, S> {
+    fn name(&self) -> &str {
+        &self.name
+    }
+}
+
+impl<O, S> HasObserverName for SparseMaxMapFeedback<O, S> {
+    fn observer_name(&self) -> &str {
+        &self.observer_name
+    }
+}
+
+impl<O, S> UsesObserver<S> for SparseMaxMapFeedback<O, S>
+where
+    O: Observer<S>,
+    S: UsesInput,
+{
+    type Observer = O;
+}
+
+impl<O, S> Feedback<S> for SparseMaxMapFeedback<O, S>
+where
+    O: MapObserver<Entry = u8> + AsSlice<Entry = u8> + Observer<S>,
+    S: UsesInput + HasClientPerfMonitor + HasNamedMetadata + Debug,
+{
+    fn init_state(&mut self, state: &mut S) -> Result<(), Error> {
+        state.add_named_metadata(MapFeedbackMetadata::<u8>::default(), &self.name);
+        Ok(())
+    }
+
+    fn is_interesting<EM, OT>(
+        &mut self,
+        state: &mut S,
+        manager: &mut EM,
+        _input: &S::Input,
+        observers: &OT,
+        _exit_kind: &ExitKind,
+    ) -> Result<bool, Error>
+    where
+        EM: EventFirer<State = S>,
+        OT: ObserversTuple<S>,
+    {
+        let map = self.scan(observers)?;
+        let len = map.len();
+        let history = &mut state
+            .named_metadata_map_mut()
+            .get_mut::<MapFeedbackMetadata<u8>>(&self.name)
+            .ok_or_else(|| Error::key_not_found("Map history not found".to_string()))?
+            .history_map;
+        if history.len() < len {
+            history.resize(len, 0);
+        }
+        let interesting = self.covered.iter().any(|idx| map[*idx] > history[*idx]);
+        if !interesting {
+            return Ok(false);
+        }
+
+        // New inputs are rare, so the full count of the history is cheap.
+        let new_entries = self.covered.iter().filter(|idx| history[**idx] == 0);
+        let filled = count_filled(history) + new_entries.count();
+        manager.fire(
+            state,
+            Event::UpdateUserStats {
+                name: self.observer_name.clone(),
+                value: UserStats::Ratio(filled as u64, len as u64),
+                phantom: PhantomData,
+            },
+        )?;
+        Ok(true)
+    }
+
+    /// Adds the map of the execution to the history. Only called for inputs
+    /// that are added to the corpus.
+    fn append_metadata<OT>(
+        &mut self,
+        state: &mut S,
+        observers: &OT,
+        testcase: &mut Testcase<S::Input>,
+    ) -> Result<(), Error>
+    where
+        OT: ObserversTuple<S>,
+    {
+        let map = self.scan(observers)?;
+        let len = map.len();
+        let history = &mut state
+            .named_metadata_map_mut()
+            .get_mut::<MapFeedbackMetadata<u8>>(&self.name)
+            .ok_or_else(|| Error::key_not_found("Map history not found".to_string()))?
+            .history_map;
+        if history.len() < len {
+            history.resize(len, 0);
+        }
+        for idx in &self.covered {
+            history[*idx] = history[*idx].max(map[*idx]);
+        }
+        testcase.add_metadata(MapIndexesMetadata::new(self.covered.clone()));
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{count_filled, nonzero_entries};
+
+    #[test]
+    fn sparse_scan_finds_all_entries() {
+        let mut map = vec![0u8; 67];
+        for idx in [0, 7, 8, 15, 40, 63, 64, 66] {
+            map[idx] = 1 + idx as u8;
+        }
+        let mut covered = vec![1234];
+        nonzero_entries(&map, &mut covered);
+        assert_eq!(covered, vec![0, 7, 8, 15, 40, 63, 64, 66]);
+        assert_eq!(count_filled(&map), 8);
+
+        nonzero_entries(&vec![0u8; 16], &mut covered);
+        assert!(covered.is_empty());
+    }
+}
@@ -0,0 +1,97 @@
+//! Typed fuzzing statistics and their export in the Prometheus text format.
+//! The metrics file can be picked up by the textfile collector of the
+//! Prometheus node exporter on every machine of a campaign.
+use std::{fmt::Write as _, fs, io, path::Path, time::Duration};
+
+/// Snapshot of the overall fuzzing progress as seen by the broker.
+#[derive(Clone, Debug, Default, PartialEq)]
+pub struct FuzzStats {
+    pub run_time: Duration,
+    pub clients: usize,
+    pub corpus_size: u64,
+    pub objective_size: u64,
+    pub execs: u64,
+    pub execs_per_sec: f64,
+    /// Covered map entries of the client that covers the most.
+    pub coverage: u64,
+    /// Covered map entries by client id, for the clients that reported any.
+    pub client_coverage: Vec<(usize, u64)>,
+    /// Number of usable map entries.
+    pub coverage_max: u64,
+    pub causes_found: usize,
+    pub causes_missing: usize,
+}
+
+fn push_metric(out: &mut String, name: &str, kind: &str, help: &str, value: f64) {
+    let _ = writeln!(out, "# HELP sim_fuzzer_{} {}", name, help);
+    let _ = writeln!(out, "# TYPE sim_fuzzer_{} {}", name, kind);
+    let _ = writeln!(out, "sim_fuzzer_{} {}", name, value);
+}
+
+/// Formats the stats in the Prometheus text exposition format.
+pub fn prometheus_text(stats: &FuzzStats) -> String {
+    let mut out = String::with_capacity(1024);
+    #[rustfmt::skip]
+    let metrics = [
+        ("run_time_seconds", "gauge", "Time since the fuzzer started.", stats.run_time.as_secs_f64()),
+        ("clients", "gauge", "Number of fuzzing clients.", stats.clients as f64),
+        ("corpus_size", "gauge", "Entries in the corpus of all clients.", stats.corpus_size as f64),
+        ("objective_size", "gauge", "Crashes found by all clients.", stats.objective_size as f64),
+        ("execs_total", "counter", "Executions of all clients.", stats.execs as f64),
+        ("execs_per_second", "gauge", "Executions per second of all clients.", stats.execs_per_sec),
+        ("coverage", "gauge", "Covered map entries.", stats.coverage as f64),
+        ("coverage_max", "gauge", "Usable map entries.", stats.coverage_max as f64),
+        ("causes_found", "gauge", "Found causes including duplicates.", stats.causes_found as f64),
+        ("causes_missing", "gauge", "Expected causes that weren't found yet.", stats.causes_missing as f64),
+    ];
+    for (name, kind, help, value) in metrics {
+        push_metric(&mut out, name, kind, help, value);
+    }
+    if !stats.client_coverage.is_empty() {
+        let name = "sim_fuzzer_client_coverage";
+        let _ = writeln!(out, "# HELP {} Covered map entries of every client.", name);
+        let _ = writeln!(out, "# TYPE {} gauge", name);
+        for (client, coverage) in &stats.client_coverage {
+            let _ = writeln!(out, "{}{{client=\"{}\"}} {}", name, client, coverage);
+        }
+    }
+    out
+}
+
+/// Replaces the metrics file, so scrapers never read a partial file.
+pub fn write_metrics(path: &Path, stats: &FuzzStats) -> io::Result<()> {
+    let tmp = path.with_extension("prom.tmp");
+    fs::write(&tmp, prometheus_text(stats))?;
+    fs::rename(&tmp, path)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::{prometheus_text, FuzzStats};
+
+    #[test]
+    fn format_prometheus() {
+        let stats = FuzzStats {
+            run_time: Duration::from_secs(90),
+            clients: 4,
+            execs: 12345,
+            execs_per_sec: 137.5,
+            coverage: 10,
+            client_coverage: vec![(1, 10), (2, 7)],
+            ..Default::default()
+        };
+        let text = prometheus_text(&stats);
+        assert!(
+            text.contains("# TYPE sim_fuzzer_execs_total counter\nsim_fuzzer_execs_total 12345\n")
+        );
+        assert!(text.contains("\nsim_fuzzer_run_time_seconds 90\n"));
+        assert!(text.contains("\nsim_fuzzer_execs_per_second 137.5\n"));
+        assert!(text.contains("\nsim_fuzzer_causes_missing 0\n"));
+        assert!(text.contains("\nsim_fuzzer_client_coverage{client=\"2\"} 7\n"));
+        // Every metric has a HELP, TYPE and value line, the per-client one
+        // has a value line per client.
+        assert_eq!(text.lines().count(), 34);
+    }
+}
@@ -0,0 +1,199 @@
+//! Synchronization between several machines fuzzing the same target through
+//! a shared directory. Every node exports its corpus and its causes into
+//! '<sync dir>/<node>/{queue,causes}' and imports what the other nodes
+//! exported. Only files that a node hasn't seen yet are transferred, and as
+//! corpus file names are derived from the content and cause file names from
+//! the input hash, the same input is never transferred twice.
+//! Coverage is not transferred explicitly: imported inputs are executed
+//! again, which updates the local coverage map.
+use std::{
+    collections::HashSet,
+    ffi::OsString,
+    fs,
+    path::{Path, PathBuf},
+};
+
+use crate::{program_input::ProgramInput, seeds::parse_seed};
+
+const QUEUE_DIR: &'static str = "queue";
+const CAUSES_DIR: &'static str = "causes";
+
+/// Returns the name of this machine or 'node' if it can't be determined.
+pub fn default_node_name() -> String {
+    fs::read_to_string("/proc/sys/kernel/hostname")
+        .map(|name| name.trim().to_owned())
+        .ok()
+        .filter(|name| !name.is_empty())
+        .unwrap_or("node".to_owned())
+}
+
+/// Lists the files in the directory. Hidden files are skipped, which
+/// includes corpus metadata and files that are still being copied.
+fn list_files(dir: &Path) -> Vec<(OsString, PathBuf)> {
+    let entries = match fs::read_dir(dir) {
+        Ok(entries) => entries,
+        Err(_) => return Vec::new(),
+    };
+    entries
+        .filter_map(|entry| entry.ok())
+        .filter(|entry| !entry.file_name().to_string_lossy().starts_with('.'))
+        .filter(|entry| entry.file_type().map_or(false, |t| t.is_file()))
+        .map(|entry| (entry.file_name(), entry.path()))
+        .collect()
+}
+
+/// Copies the file so that readers of the destination directory never see
+/// a partially written file.
+fn copy_atomic(from: &Path, to_dir: &Path, name: &OsString) -> Result<(), String> {
+    let mut tmp_name = OsString::from(".tmp-");
+    tmp_name.push(name);
+    let tmp = to_dir.join(tmp_name);
+    fs::copy(from, &tmp).map_err(|e| format!("Failed to copy {:?}: {}", from, e))?;
+    fs::rename(&tmp, to_dir.join(name)).map_err(|e| format!("Failed to rename {:?}: {}", tmp, e))
+}
+
+/// The state of one node in the shared sync directory.
+pub struct NodeSync {
+    sync_dir: PathBuf,
+    node: String,
+    /// Names of corpus files that were exported or imported.
+    known_inputs: HashSet<OsString>,
+    /// Names of cause files that were exported or imported.
+    known_causes: HashSet<OsString>,
+}
+
+impl NodeSync {
+    pub fn new(sync_dir: &Path, node: &str) -> Result<Self, String> {
+        for kind in [QUEUE_DIR, CAUSES_DIR] {
+            let dir = sync_dir.join(node).join(kind);
+            fs::create_dir_all(&dir).map_err(|e| format!("Failed to create {:?}: {}", dir, e))?;
+        }
+        Ok(Self {
+            sync_dir: sync_dir.to_owned(),
+            node: node.to_owned(),
+            known_inputs: HashSet::new(),
+            known_causes: HashSet::new(),
+        })
+    }
+
+    /// The export directories of all other nodes for the given kind.
+    fn other_nodes(&self, kind: &str) -> Vec<PathBuf> {
+        let entries = match fs::read_dir(&self.sync_dir) {
+            Ok(entries) => entries,
+            Err(_) => return Vec::new(),
+        };
+        entries
+            .filter_map(|entry| entry.ok())
+            .filter(|entry| entry.file_name() != self.node.as_str())
+            .map(|entry| entry.path().join(kind))
+            .filter(|dir| dir.is_dir())
+            .collect()
+    }
+
+    /// Copies unknown files from `from` into our export directory.
+    fn export(known: &mut HashSet<OsString>, from: &Path, to: &Path) -> Result<usize, String> {
+        let mut exported = 0;
+        for (name, path) in list_files(from) {
+            if known.contains(&name) {
+                continue;
+            }
+            if !to.join(&name).exists() {
+                copy_atomic(&path, to, &name)?;
+                exported += 1;
+            }
+            known.insert(name);
+        }
+        Ok(exported)
+    }
+
+    /// Exports new entries of the given corpus directory.
+    pub fn export_corpus(&mut self, corpus_dir: &Path) -> Result<usize, String> {
+        let to = self.sync_dir.join(&self.node).join(QUEUE_DIR);
+        Self::export(&mut self.known_inputs, corpus_dir, &to)
+    }
+
+    /// Exports new causes from the given cause directory.
+    pub fn export_causes(&mut self, cause_dir: &Path) -> Result<usize, String> {
+        let to = self.sync_dir.join(&self.node).join(CAUSES_DIR);
+        Self::export(&mut self.known_causes, cause_dir, &to)
+    }
+
+    /// Returns the inputs that other nodes exported since the last call.
+    /// Files that fail to parse are ignored.
+    pub fn import_corpus(&mut self) -> Vec<ProgramInput> {
+        let mut result = Vec::<ProgramInput>::new();
+        for dir in self.other_nodes(QUEUE_DIR) {
+            for (name, path) in list_files(&dir) {
+                if !self.known_inputs.insert(name) {
+                    continue;
+                }
+                if let Some(input) = fs::read(&path)
+                    .ok()
+                    .and_then(|bytes| parse_seed(&path, &bytes).ok())
+                {
+                    result.push(input);
+                }
+            }
+        }
+        result
+    }
+
+    /// Copies causes that other nodes found into the local cause directory,
+    /// so that the `CauseTracker` sees the causes of the whole cluster.
+    pub fn import_causes(&mut self, cause_dir: &Path) -> Result<usize, String> {
+        let mut imported = 0;
+        for dir in self.other_nodes(CAUSES_DIR) {
+            for (name, path) in list_files(&dir) {
+                if self.known_causes.contains(&name) {
+                    continue;
+                }
+                if !cause_dir.join(&name).exists() {
+                    copy_atomic(&path, cause_dir, &name)?;
+                    imported += 1;
+                }
+                self.known_causes.insert(name);
+            }
+        }
+        Ok(imported)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{fs, path::PathBuf};
+
+    use super::NodeSync;
+
+    fn temp_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("riscv-sync-{}-{}", name, std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    #[test]
+    fn exchange_causes() {
+        let sync = temp_dir("shared");
+        let causes_a = temp_dir("a");
+        let causes_b = temp_dir("b");
+        let mut node_a = NodeSync::new(&sync, "a").unwrap();
+        let mut node_b = NodeSync::new(&sync, "b").unwrap();
+
+        fs::write(causes_a.join("bug_1%0000000000000001"), b"1234").unwrap();
+        fs::write(causes_a.join(".hidden"), b"").unwrap();
+        assert_eq!(node_a.export_causes(&causes_a).unwrap(), 1);
+        // Nothing new to export.
+        assert_eq!(node_a.export_causes(&causes_a).unwrap(), 0);
+
+        assert_eq!(node_b.import_causes(&causes_b).unwrap(), 1);
+        assert!(causes_b.join("bug_1%0000000000000001").exists());
+        // Imported causes are not exported again.
+        assert_eq!(node_b.export_causes(&causes_b).unwrap(), 0);
+        // And a node never imports its own causes.
+        assert_eq!(node_a.import_causes(&causes_a).unwrap(), 0);
+
+        for dir in [sync, causes_a, causes_b] {
+            fs::remove_dir_all(dir).unwrap();
+        }
+    }
+}